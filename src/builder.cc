@@ -9,8 +9,12 @@
 
 #include <fcntl.h>
 #include <unistd.h>
+#include <zlib.h>
 
-#include <map>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <thread>  // NOLINT(build/c++11)
 #include <unordered_map>
 #include <unordered_set>
 #include <utility>
@@ -27,26 +31,101 @@ using google::protobuf::RepeatedField;
 namespace perftools {
 namespace profiles {
 
-Builder::Builder() : profile_(new Profile()) {
+Builder::Builder() : Builder(nullptr) {}
+
+Builder::Builder(google::protobuf::Arena *arena)
+    : profile_(google::protobuf::Arena::CreateMessage<Profile>(arena)) {
+  if (arena == nullptr) {
+    owned_profile_.reset(profile_);
+  }
   // string_table[0] must be ""
   profile_->add_string_table("");
 }
 
+std::unique_ptr<Profile> Builder::Consume() {
+  CHECK(profile_ == nullptr || profile_->GetArena() == nullptr)
+      << "Cannot consume a profile allocated on an arena";
+  profile_ = nullptr;
+  return std::move(owned_profile_);
+}
+
 int64 Builder::StringId(const char *str) {
-  if (str == nullptr || !str[0]) {
+  if (str == nullptr) {
+    return 0;
+  }
+  return StringId(std::string_view(str));
+}
+
+int64 Builder::StringId(std::string_view str) {
+  if (str.empty()) {
     return 0;
   }
 
   const int64 index = profile_->string_table_size();
-  const auto inserted = strings_.emplace(str, index);
-  if (!inserted.second) {
+  const int64 id = strings_.FindOrInsert(str, index);
+  if (id != index) {
     // Failed to insert -- use existing id.
-    return inserted.first->second;
+    return id;
   }
-  profile_->add_string_table(inserted.first->first);
+  profile_->add_string_table(str.data(), str.size());
   return index;
 }
 
+int64 Builder::StringIndex::FindOrInsert(std::string_view str, int64 id) {
+  // Keeps the table at most 3/4 full.
+  if (4 * (size_ + 1) > 3 * slots_.size()) {
+    Grow();
+  }
+  Slot *slot = Find(str);
+  if (slot->id == 0) {
+    slot->key = Copy(str);
+    slot->id = id;
+    ++size_;
+  }
+  return slot->id;
+}
+
+Builder::StringIndex::Slot *Builder::StringIndex::Find(std::string_view str) {
+  const size_t mask = slots_.size() - 1;
+  size_t i = std::hash<std::string_view>()(str) & mask;
+  // Linear probing.
+  while (slots_[i].id != 0 && slots_[i].key != str) {
+    i = (i + 1) & mask;
+  }
+  return &slots_[i];
+}
+
+void Builder::StringIndex::Grow() {
+  std::vector<Slot> old_slots(slots_.empty() ? 64 : 2 * slots_.size());
+  old_slots.swap(slots_);
+  for (const Slot &slot : old_slots) {
+    if (slot.id != 0) {
+      *Find(slot.key) = slot;
+    }
+  }
+}
+
+std::string_view Builder::StringIndex::Copy(std::string_view str) {
+  static const size_t kBlockSize = 64 * 1024;
+  char *copy;
+  if (str.size() > kBlockSize / 4) {
+    // Gets a block of its own, so as not to waste the current one.
+    blocks_.emplace_back(new char[str.size()]);
+    copy = blocks_.back().get();
+  } else {
+    if (str.size() > block_remaining_) {
+      blocks_.emplace_back(new char[kBlockSize]);
+      block_next_ = blocks_.back().get();
+      block_remaining_ = kBlockSize;
+    }
+    copy = block_next_;
+    block_next_ += str.size();
+    block_remaining_ -= str.size();
+  }
+  std::copy(str.begin(), str.end(), copy);
+  return std::string_view(copy, str.size());
+}
+
 uint64 Builder::FunctionId(const char *name, const char *system_name,
                            const char *file, int64 start_line) {
   int64 name_index = StringId(name);
@@ -91,6 +170,194 @@ bool Builder::Marshal(const Profile &profile, string *output) {
   return gzip_stream.Close();
 }
 
+namespace {
+
+// The amount of input deflated as one block by ParallelGzip().
+const size_t kParallelGzipBlockSize = 1 << 20;
+// The size of the deflate window, which each block is primed with.
+const size_t kDeflateWindowSize = 1 << 15;
+
+// Deflates |input| into |output| as raw deflate data, using |dictionary| as
+// the preceding input. Unless |last|, the output ends with a sync flush
+// instead of a final block, so that more deflate data can follow it.
+bool DeflateBlock(const char *input, size_t input_size, const char *dictionary,
+                  size_t dictionary_size, bool last, string *output) {
+  z_stream zs = {};
+  if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    return false;
+  }
+  if (dictionary_size > 0 &&
+      deflateSetDictionary(&zs, reinterpret_cast<const Bytef *>(dictionary),
+                           dictionary_size) != Z_OK) {
+    deflateEnd(&zs);
+    return false;
+  }
+  // deflateBound() covers the final block; a sync flush adds at most an empty
+  // stored block instead. Should the output still not fit, deflate() is
+  // called again with more room: a flush that fills the output buffer
+  // exactly may have more output pending.
+  output->resize(deflateBound(&zs, input_size) + 16);
+  zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(input));
+  zs.avail_in = input_size;
+  size_t output_size = 0;
+  bool ok;
+  for (;;) {
+    zs.next_out = reinterpret_cast<Bytef *>(&(*output)[output_size]);
+    zs.avail_out = output->size() - output_size;
+    const int ret = deflate(&zs, last ? Z_FINISH : Z_SYNC_FLUSH);
+    output_size = output->size() - zs.avail_out;
+    if (ret == Z_STREAM_END) {
+      ok = zs.avail_in == 0;
+      break;
+    }
+    // Z_BUF_ERROR only means that an earlier call had flushed everything.
+    if (ret != Z_OK && ret != Z_BUF_ERROR) {
+      ok = false;
+      break;
+    }
+    if (zs.avail_out != 0) {
+      ok = !last && zs.avail_in == 0;
+      break;
+    }
+    output->resize(2 * output->size());
+  }
+  output->resize(output_size);
+  deflateEnd(&zs);
+  return ok;
+}
+
+void AppendLittleEndian32(uint32_t value, string *output) {
+  for (int i = 0; i < 4; ++i) {
+    output->push_back(static_cast<char>(value >> (8 * i)));
+  }
+}
+
+// Compresses |input| into |output| as a single gzip member. The input is cut
+// into blocks that are deflated by up to |num_threads| threads at once and
+// then concatenated, as pigz does. Each block is primed with the window that
+// precedes it, so the output is about as small as with one thread.
+bool ParallelGzip(const string &input, int num_threads, string *output) {
+  const size_t num_blocks = std::max<size_t>(
+      1, (input.size() + kParallelGzipBlockSize - 1) / kParallelGzipBlockSize);
+  std::vector<string> blocks(num_blocks);
+  std::vector<uLong> crcs(num_blocks);
+  std::atomic<size_t> next_block(0);
+  std::atomic<bool> failed(false);
+  auto deflate_blocks = [&]() {
+    for (size_t i = next_block++; i < num_blocks && !failed;
+         i = next_block++) {
+      const size_t begin = i * kParallelGzipBlockSize;
+      const size_t size =
+          std::min(kParallelGzipBlockSize, input.size() - begin);
+      const size_t dictionary_size = std::min(begin, kDeflateWindowSize);
+      const char *data = input.data() + begin;
+      if (!DeflateBlock(data, size, data - dictionary_size, dictionary_size,
+                        i + 1 == num_blocks, &blocks[i])) {
+        failed = true;
+      }
+      crcs[i] = crc32(0, reinterpret_cast<const Bytef *>(data), size);
+    }
+  };
+  std::vector<std::thread> threads;
+  const size_t num_workers =
+      std::min(num_blocks, static_cast<size_t>(num_threads));
+  for (size_t i = 1; i < num_workers; ++i) {
+    threads.emplace_back(deflate_blocks);
+  }
+  deflate_blocks();
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  if (failed) {
+    LOG(ERROR) << "Failed to deflate the profile";
+    return false;
+  }
+
+  size_t output_size = 0;
+  for (const auto &block : blocks) {
+    output_size += block.size();
+  }
+  output->clear();
+  output->reserve(output_size + 18);
+  // A gzip header without a file name or time, written by a Unix system.
+  static const char kGzipHeader[] = {'\x1f', '\x8b', 8, 0, 0, 0, 0, 0, 0, 3};
+  output->append(kGzipHeader, sizeof(kGzipHeader));
+  uLong crc = crc32(0, nullptr, 0);
+  for (size_t i = 0; i < num_blocks; ++i) {
+    output->append(blocks[i]);
+    const size_t begin = i * kParallelGzipBlockSize;
+    crc = crc32_combine(
+        crc, crcs[i], std::min(kParallelGzipBlockSize, input.size() - begin));
+  }
+  AppendLittleEndian32(crc, output);
+  AppendLittleEndian32(static_cast<uint32_t>(input.size()), output);
+  return true;
+}
+
+// A set of the ids of the messages in a profile table. The ids are
+// usually assigned densely from 1, in which case the set is a bitmap
+// indexed by id, and otherwise a hash set.
+class IdSet {
+ public:
+  template <typename Message>
+  explicit IdSet(const google::protobuf::RepeatedPtrField<Message> &table) {
+    uint64 max_id = 0;
+    for (const auto &message : table) {
+      max_id = std::max(max_id, message.id());
+    }
+    if (max_id <= 4 * static_cast<uint64>(table.size()) + 64) {
+      dense_.resize(max_id + 1);
+      is_dense_ = true;
+    }
+  }
+
+  // Returns false if |id| was already in the set.
+  bool Insert(uint64 id) {
+    if (is_dense_) {
+      const bool present = dense_[id];
+      dense_[id] = true;
+      return !present;
+    }
+    return sparse_.insert(id).second;
+  }
+
+  bool Contains(uint64 id) const {
+    if (is_dense_) {
+      return id < dense_.size() && dense_[id];
+    }
+    return sparse_.count(id) != 0;
+  }
+
+ private:
+  bool is_dense_ = false;
+  std::vector<bool> dense_;
+  std::unordered_set<uint64> sparse_;
+};
+
+// The address range of a mapping, for associating locations with it.
+struct MappingRange {
+  uint64 start;
+  uint64 limit;
+  uint64 id;
+};
+
+}  // namespace
+
+bool Builder::Marshal(const Profile &profile, string *output,
+                      int num_threads) {
+  if (num_threads <= 1) {
+    return Marshal(profile, output);
+  }
+  *output = "";
+  string serialized;
+  if (!profile.SerializeToString(&serialized)) {
+    LOG(ERROR) << "Failed to serialize the profile";
+    return false;
+  }
+  return ParallelGzip(serialized, num_threads, output);
+}
+
 bool Builder::MarshalToFile(const Profile &profile, int fd) {
   FileOutputStream stream(fd);
   GzipOutputStream gzip_stream(&stream);
@@ -101,13 +368,39 @@ bool Builder::MarshalToFile(const Profile &profile, int fd) {
   return gzip_stream.Close();
 }
 
+bool Builder::MarshalToFile(const Profile &profile, int fd,
+                            int num_threads) {
+  if (num_threads <= 1) {
+    return MarshalToFile(profile, fd);
+  }
+  string output;
+  if (!Marshal(profile, &output, num_threads)) {
+    return false;
+  }
+  for (size_t written = 0; written < output.size();) {
+    const ssize_t ret = TEMP_FAILURE_RETRY(
+        write(fd, output.data() + written, output.size() - written));
+    if (ret <= 0) {
+      LOG(ERROR) << "Failed to write the profile";
+      return false;
+    }
+    written += ret;
+  }
+  return true;
+}
+
 bool Builder::MarshalToFile(const Profile &profile, const char *filename) {
+  return MarshalToFile(profile, filename, 1);
+}
+
+bool Builder::MarshalToFile(const Profile &profile, const char *filename,
+                            int num_threads) {
   int fd =
       TEMP_FAILURE_RETRY(open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0444));
   if (fd == -1) {
     return false;
   }
-  int ret = MarshalToFile(profile, fd);
+  int ret = MarshalToFile(profile, fd, num_threads);
   close(fd);
   return ret;
 }
@@ -115,11 +408,11 @@ bool Builder::MarshalToFile(const Profile &profile, const char *filename) {
 // Returns a bool indicating if the profile is valid. It logs any
 // errors it encounters.
 bool Builder::CheckValid(const Profile &profile) {
-  std::unordered_set<uint64> mapping_ids;
+  IdSet mapping_ids(profile.mapping());
   for (const auto &mapping : profile.mapping()) {
     const int64 id = mapping.id();
     if (id != 0) {
-      const bool insert_successful = mapping_ids.insert(id).second;
+      const bool insert_successful = mapping_ids.Insert(id);
       if (!insert_successful) {
         LOG(ERROR) << "Duplicate mapping id: " << id;
         return false;
@@ -127,11 +420,11 @@ bool Builder::CheckValid(const Profile &profile) {
     }
   }
 
-  std::unordered_set<uint64> function_ids;
+  IdSet function_ids(profile.function());
   for (const auto &function : profile.function()) {
     const int64 id = function.id();
     if (id != 0) {
-      const bool insert_successful = function_ids.insert(id).second;
+      const bool insert_successful = function_ids.Insert(id);
       if (!insert_successful) {
         LOG(ERROR) << "Duplicate function id: " << id;
         return false;
@@ -139,24 +432,24 @@ bool Builder::CheckValid(const Profile &profile) {
     }
   }
 
-  std::unordered_set<uint64> location_ids;
+  IdSet location_ids(profile.location());
   for (const auto &location : profile.location()) {
     const int64 id = location.id();
     if (id != 0) {
-      const bool insert_successful = location_ids.insert(id).second;
+      const bool insert_successful = location_ids.Insert(id);
       if (!insert_successful) {
         LOG(ERROR) << "Duplicate location id: " << id;
         return false;
       }
     }
     const int64 mapping_id = location.mapping_id();
-    if (mapping_id != 0 && mapping_ids.count(mapping_id) == 0) {
+    if (mapping_id != 0 && !mapping_ids.Contains(mapping_id)) {
       LOG(ERROR) << "Missing mapping " << mapping_id << " from location " << id;
       return false;
     }
     for (const auto &line : location.line()) {
       int64 function_id = line.function_id();
-      if (function_id != 0 && function_ids.count(function_id) == 0) {
+      if (function_id != 0 && !function_ids.Contains(function_id)) {
         LOG(ERROR) << "Missing function " << function_id;
         return false;
       }
@@ -181,7 +474,7 @@ bool Builder::CheckValid(const Profile &profile) {
         return false;
       }
 
-      if (location_ids.count(location_id) == 0) {
+      if (!location_ids.Contains(location_id)) {
         LOG(ERROR) << "Missing location " << location_id;
         return false;
       }
@@ -225,29 +518,55 @@ bool Builder::Finalize() {
 
   // Look up location address on mapping ranges.
   if (profile_->mapping_size() > 0) {
-    std::map<uint64, std::pair<uint64, uint64> > mapping_map;
+    // Sorted by start, keeping only the last of the mappings with the same
+    // start.
+    std::vector<MappingRange> ranges;
+    ranges.reserve(profile_->mapping_size());
     for (const auto &mapping : profile_->mapping()) {
-      mapping_map[mapping.memory_start()] =
-          std::make_pair(mapping.memory_limit(), mapping.id());
+      ranges.push_back({mapping.memory_start(), mapping.memory_limit(),
+                        mapping.id()});
     }
+    std::stable_sort(ranges.begin(), ranges.end(),
+                     [](const MappingRange &a, const MappingRange &b) {
+                       return a.start < b.start;
+                     });
+    auto last_of_start = [](const MappingRange &a, const MappingRange &b) {
+      return a.start == b.start;
+    };
+    std::reverse(ranges.begin(), ranges.end());
+    ranges.erase(std::unique(ranges.begin(), ranges.end(), last_of_start),
+                 ranges.end());
+    std::reverse(ranges.begin(), ranges.end());
 
+    // Locations mostly come in runs within one mapping, so the last range
+    // found is tried before searching.
+    const MappingRange *range = nullptr;
     for (auto &loc : *profile_->mutable_location()) {
-      if (loc.address() != 0 && loc.mapping_id() == 0) {
-        auto mapping = mapping_map.upper_bound(loc.address());
-        if (mapping == mapping_map.begin()) {
+      const uint64 address = loc.address();
+      if (address == 0 || loc.mapping_id() != 0) {
+        continue;
+      }
+      if (range == nullptr || address < range->start ||
+          (range + 1 != ranges.data() + ranges.size() &&
+           address >= (range + 1)->start)) {
+        auto next = std::upper_bound(
+            ranges.begin(), ranges.end(), address,
+            [](uint64 a, const MappingRange &r) { return a < r.start; });
+        if (next == ranges.begin()) {
           // Address landed before the first mapping
+          range = nullptr;
           continue;
         }
-        mapping--;
-        uint64 limit = mapping->second.first;
-        uint64 id = mapping->second.second;
-
-        if (loc.address() <= limit) {
-          loc.set_mapping_id(id);
-        }
+        range = &*(next - 1);
+      }
+      if (address <= range->limit) {
+        loc.set_mapping_id(range->id);
       }
     }
   }
+  if (!check_valid_) {
+    return true;
+  }
   return CheckValid(*profile_);
 }
 
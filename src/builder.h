@@ -14,8 +14,10 @@
 #include <algorithm>
 #include <memory>
 #include <string>
+#include <string_view>
 #include <tuple>
 #include <unordered_map>
+#include <vector>
 namespace perftools {
 namespace profiles {
 
@@ -40,10 +42,16 @@ namespace profiles {
 class Builder {
  public:
   Builder();
+  // Allocates the profile on |arena|, if not null, so that its samples,
+  // locations and other messages are not individually allocated and freed.
+  // The profile then lives as long as the arena, and cannot be Consume()d.
+  explicit Builder(google::protobuf::Arena *arena);
 
   // Adds a string to the profile string table if not already present.
-  // Returns a unique integer id for this string.
+  // Returns a unique integer id for this string. Looking up a string
+  // that is already present does not allocate.
   int64 StringId(const char *str);
+  int64 StringId(std::string_view str);
 
   // Adds a function with these attributes to the profile function
   // table, if not already present. Returns a unique integer id for
@@ -61,6 +69,11 @@ class Builder {
   // address into the mapping address range.
   bool Finalize();
 
+  // Sets whether Finalize() checks the profile with CheckValid(), which
+  // it does by default. Producers that only ever refer to ids they were
+  // given can turn this off to save a pass over the whole profile.
+  void SetCheckValid(bool check_valid) { check_valid_ = check_valid; }
+
   // Serializes and compresses the profile into a string, replacing
   // its contents. It calls Finalize() and returns whether the
   // encoding was successful.
@@ -80,19 +93,30 @@ class Builder {
   // file or replacing its contents if it already exists.
   static bool MarshalToFile(const Profile &profile, const char *filename);
 
+  // Like the above, but compresses the profile with up to |num_threads|
+  // threads. The output is still a single gzip stream, though not the same
+  // bytes as with one thread. A |num_threads| of 1 or less behaves like the
+  // variants without it.
+  static bool Marshal(const Profile &profile, string *output,
+                      int num_threads);
+  static bool MarshalToFile(const Profile &profile, int fd, int num_threads);
+  static bool MarshalToFile(const Profile &profile, const char *filename,
+                            int num_threads);
+
   // Determines if the profile is internally consistent (suitable for
   // serialization). Returns true if no errors were encountered.
   static bool CheckValid(const Profile &profile);
 
   // Extract the profile from the builder object. No further calls
-  // should be made to the builder after this.
-  std::unique_ptr<Profile> Consume() { return std::move(profile_); }
+  // should be made to the builder after this. Must not be called when
+  // the profile is allocated on an arena.
+  std::unique_ptr<Profile> Consume();
 
   // Returns the underlying profile, to populate any fields not
   // managed by the builder. The fields function and string_table
   // should be populated through Builder::StringId and
   // Builder::FunctionId.
-  Profile *mutable_profile() { return profile_.get(); }
+  Profile *mutable_profile() { return profile_; }
 
  private:
   // Holds the information about a function to facilitate deduplication.
@@ -108,12 +132,45 @@ class Builder {
     }
   };
 
+  // Open-addressing hash table from the strings in the string table to
+  // their ids. The keys are views of copies of the strings in blocks
+  // owned by the table, so they stay valid however the profile changes.
+  class StringIndex {
+   public:
+    // Returns the id of |str|, first inserting it with |id| if it is not
+    // present yet. |id| must not be 0.
+    int64 FindOrInsert(std::string_view str, int64 id);
+
+   private:
+    struct Slot {
+      std::string_view key;
+      int64 id = 0;  // 0 if the slot is empty.
+    };
+
+    // Returns the slot holding |str| or the empty slot where it belongs.
+    Slot *Find(std::string_view str);
+    // Doubles the number of slots.
+    void Grow();
+    // Returns a view of a copy of |str| in blocks_.
+    std::string_view Copy(std::string_view str);
+
+    std::vector<Slot> slots_;  // Size is zero or a power of 2.
+    size_t size_ = 0;
+    std::vector<std::unique_ptr<char[]>> blocks_;
+    char *block_next_ = nullptr;
+    size_t block_remaining_ = 0;
+  };
+
   // Hashes to deduplicate strings and functions.
-  std::unordered_map<string, int64> strings_;
+  StringIndex strings_;
   std::unordered_map<Function, int64, FunctionHasher> functions_;
 
-  // Actual profile being updated.
-  std::unique_ptr<Profile> profile_;
+  bool check_valid_ = true;
+
+  // Actual profile being updated, owned by |owned_profile_| unless it is
+  // allocated on an arena.
+  Profile *profile_;
+  std::unique_ptr<Profile> owned_profile_;
 };
 
 }  // namespace profiles
@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2026, Google Inc.
+ * All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+// Times Builder::Marshal() on a profile, such as one written by
+// perf_to_profile, with one thread and with more:
+//   builder_benchmark <profile.pb[.gz]> [<max threads>] [<iterations>]
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <chrono>  // NOLINT(build/c++11)
+#include <string>
+#include <vector>
+
+#include "google/protobuf/io/gzip_stream.h"
+#include "google/protobuf/io/zero_copy_stream_impl_lite.h"
+#include "src/builder.h"
+#include "src/quipper/base/logging.h"
+#include "src/quipper/file_utils.h"
+
+namespace perftools {
+namespace {
+
+// Marshals |profile| |iterations| times with |num_threads| threads and prints
+// the throughput and the compressed size.
+bool Time(const profiles::Profile& profile, size_t serialized_size,
+          int num_threads, int iterations) {
+  std::string output;
+  const auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; ++i) {
+    if (!profiles::Builder::Marshal(profile, &output, num_threads)) {
+      LOG(ERROR) << "Marshal failed with " << num_threads << " threads";
+      return false;
+    }
+  }
+  const double ms = std::chrono::duration<double, std::milli>(
+                        std::chrono::steady_clock::now() - start)
+                        .count() /
+                    iterations;
+  printf("%2d threads %8.1f ms %8.1f MB/s %10zu bytes (%.1f%%)\n", num_threads,
+         ms, serialized_size / 1e3 / ms, output.size(),
+         100.0 * output.size() / serialized_size);
+  return true;
+}
+
+}  // namespace
+}  // namespace perftools
+
+int main(int argc, char* argv[]) {
+  if (argc < 2 || argc > 4) {
+    LOG(ERROR) << "Usage: " << argv[0]
+               << " <profile.pb[.gz]> [<max threads>] [<iterations>]";
+    return EXIT_FAILURE;
+  }
+  const int max_threads = argc > 2 ? atoi(argv[2]) : 8;
+  const int iterations = argc > 3 ? atoi(argv[3]) : 5;
+  if (max_threads <= 0 || iterations <= 0) {
+    LOG(ERROR) << "The numbers of threads and iterations must be positive";
+    return EXIT_FAILURE;
+  }
+  std::vector<char> contents;
+  if (!quipper::FileToBuffer(argv[1], &contents)) {
+    LOG(ERROR) << "Could not read " << argv[1];
+    return EXIT_FAILURE;
+  }
+  google::protobuf::io::ArrayInputStream input(contents.data(),
+                                               contents.size());
+  perftools::profiles::Profile profile;
+  bool parsed;
+  if (contents.size() >= 2 && contents[0] == '\x1f' && contents[1] == '\x8b') {
+    google::protobuf::io::GzipInputStream gzip_input(
+        &input, google::protobuf::io::GzipInputStream::GZIP);
+    parsed = profile.ParseFromZeroCopyStream(&gzip_input);
+  } else {
+    parsed = profile.ParseFromZeroCopyStream(&input);
+  }
+  if (!parsed) {
+    LOG(ERROR) << argv[1] << " is not a profile";
+    return EXIT_FAILURE;
+  }
+
+  const size_t serialized_size = profile.ByteSizeLong();
+  printf("%zu bytes serialized\n", serialized_size);
+  for (int num_threads = 1; num_threads <= max_threads; num_threads *= 2) {
+    if (!perftools::Time(profile, serialized_size, num_threads, iterations)) {
+      return EXIT_FAILURE;
+    }
+  }
+  return EXIT_SUCCESS;
+}
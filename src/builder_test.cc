@@ -0,0 +1,275 @@
+/*
+ * Copyright (c) 2016, Google Inc.
+ * All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include "src/builder.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include <string>
+#include <string_view>
+
+#include <gtest/gtest.h>
+#include "google/protobuf/io/gzip_stream.h"
+#include "google/protobuf/io/zero_copy_stream_impl_lite.h"
+
+namespace perftools {
+namespace profiles {
+namespace {
+
+// Returns a profile that serializes to several MiB, so that it is compressed
+// in more than one block.
+Profile MakeLargeProfile() {
+  Builder builder;
+  Profile* profile = builder.mutable_profile();
+  auto* sample_type = profile->add_sample_type();
+  sample_type->set_type(builder.StringId("samples"));
+  sample_type->set_unit(builder.StringId("count"));
+  for (int i = 0; i < 100000; ++i) {
+    const std::string name = "function_" + std::to_string(i);
+    const uint64 function_id = builder.FunctionId(
+        name.c_str(), name.c_str(), "/src/file.cc", i % 1000);
+    auto* location = profile->add_location();
+    location->set_id(i + 1);
+    location->set_address(0x1000 + 16 * i);
+    location->add_line()->set_function_id(function_id);
+    auto* sample = profile->add_sample();
+    sample->add_location_id(i + 1);
+    sample->add_location_id((i * 7919) % 100000 + 1);
+    sample->add_value(i % 13);
+  }
+  EXPECT_TRUE(builder.Finalize());
+  return *builder.Consume();
+}
+
+std::string Gunzip(const std::string& compressed) {
+  google::protobuf::io::ArrayInputStream input(compressed.data(),
+                                               compressed.size());
+  google::protobuf::io::GzipInputStream gzip_input(
+      &input, google::protobuf::io::GzipInputStream::GZIP);
+  std::string output;
+  const void* data;
+  int size;
+  while (gzip_input.Next(&data, &size)) {
+    output.append(static_cast<const char*>(data), size);
+  }
+  return output;
+}
+
+TEST(BuilderTest, StringIdDeduplicatesStrings) {
+  Builder builder;
+  EXPECT_EQ(0, builder.StringId(""));
+  EXPECT_EQ(0, builder.StringId(static_cast<const char*>(nullptr)));
+  EXPECT_EQ(0, builder.StringId(std::string_view()));
+
+  const std::string text = "foo bar foo";
+  const int64 foo = builder.StringId(std::string_view(text).substr(0, 3));
+  const int64 bar = builder.StringId(std::string_view(text).substr(4, 3));
+  EXPECT_EQ(1, foo);
+  EXPECT_EQ(2, bar);
+  EXPECT_EQ(foo, builder.StringId("foo"));
+  EXPECT_EQ(foo, builder.StringId(std::string_view(text).substr(8)));
+  EXPECT_EQ(bar, builder.StringId(std::string("bar")));
+
+  // Enough strings, and long enough ones, to grow the table and fill
+  // several blocks.
+  const std::string long_string(100000, 'x');
+  EXPECT_EQ(3, builder.StringId(long_string));
+  for (int i = 0; i < 10000; ++i) {
+    EXPECT_EQ(4 + i, builder.StringId(std::string(20, 'a') +
+                                      std::to_string(i)));
+  }
+  EXPECT_EQ(3, builder.StringId(long_string));
+  for (int i = 0; i < 10000; ++i) {
+    EXPECT_EQ(4 + i, builder.StringId(std::string(20, 'a') +
+                                      std::to_string(i)));
+  }
+  const Profile& profile = *builder.mutable_profile();
+  ASSERT_EQ(4 + 10000, profile.string_table_size());
+  EXPECT_EQ("", profile.string_table(0));
+  EXPECT_EQ("foo", profile.string_table(foo));
+  EXPECT_EQ("bar", profile.string_table(bar));
+  EXPECT_EQ(long_string, profile.string_table(3));
+}
+
+TEST(BuilderTest, FinalizeAssociatesLocationsWithMappings) {
+  Builder builder;
+  Profile* profile = builder.mutable_profile();
+  profile->add_sample_type();
+  const struct {
+    uint64 start, limit, id;
+  } mappings[] = {
+      {0x5000, 0x5fff, 1}, {0x1000, 0x1fff, 2}, {0x3000, 0x3fff, 3},
+      // Replaces the mapping with the same start above.
+      {0x3000, 0x37ff, 4},
+  };
+  for (const auto& m : mappings) {
+    auto* mapping = profile->add_mapping();
+    mapping->set_memory_start(m.start);
+    mapping->set_memory_limit(m.limit);
+    mapping->set_id(m.id);
+  }
+  const struct {
+    uint64 address, mapping_id, want_mapping_id;
+  } locations[] = {
+      {0x1000, 0, 2}, {0x1800, 0, 2}, {0x5800, 0, 1}, {0x1fff, 0, 2},
+      {0x3100, 0, 4}, {0x3900, 0, 0}, {0x0800, 0, 0}, {0x2000, 0, 0},
+      {0x9000, 0, 0}, {0x1100, 3, 3}, {0, 0, 0},
+  };
+  uint64 id = 0;
+  for (const auto& l : locations) {
+    auto* location = profile->add_location();
+    location->set_id(++id);
+    location->set_address(l.address);
+    location->set_mapping_id(l.mapping_id);
+  }
+  ASSERT_TRUE(builder.Finalize());
+  for (int i = 0; i < profile->location_size(); ++i) {
+    EXPECT_EQ(locations[i].want_mapping_id, profile->location(i).mapping_id())
+        << "location " << i;
+  }
+}
+
+TEST(BuilderTest, CheckValidFindsInconsistentIds) {
+  for (const uint64 first_id : {uint64{1}, uint64{1} << 40}) {
+    Profile profile;
+    profile.add_sample_type();
+    for (int i = 0; i < 3; ++i) {
+      profile.add_mapping()->set_id(first_id + i);
+      profile.add_function()->set_id(first_id + i);
+      auto* location = profile.add_location();
+      location->set_id(first_id + i);
+      location->set_mapping_id(first_id + i);
+      location->add_line()->set_function_id(first_id + i);
+      auto* sample = profile.add_sample();
+      sample->add_location_id(first_id + i);
+      sample->add_value(1);
+    }
+    EXPECT_TRUE(Builder::CheckValid(profile)) << first_id;
+
+    Profile bad = profile;
+    bad.mutable_mapping(2)->set_id(first_id);
+    EXPECT_FALSE(Builder::CheckValid(bad)) << first_id;
+    bad = profile;
+    bad.mutable_function(1)->set_id(first_id + 2);
+    EXPECT_FALSE(Builder::CheckValid(bad)) << first_id;
+    bad = profile;
+    bad.mutable_location(0)->set_mapping_id(first_id + 3);
+    EXPECT_FALSE(Builder::CheckValid(bad)) << first_id;
+    bad = profile;
+    bad.mutable_location(0)->mutable_line(0)->set_function_id(first_id + 100);
+    EXPECT_FALSE(Builder::CheckValid(bad)) << first_id;
+    bad = profile;
+    bad.mutable_sample(0)->add_location_id(first_id + 1000);
+    EXPECT_FALSE(Builder::CheckValid(bad)) << first_id;
+  }
+}
+
+TEST(BuilderTest, FinalizeCanSkipCheckValid) {
+  Builder builder;
+  // No sample type, so the profile is not valid.
+  builder.mutable_profile()->add_sample()->add_location_id(0x1000);
+  EXPECT_FALSE(builder.Finalize());
+  builder.SetCheckValid(false);
+  EXPECT_TRUE(builder.Finalize());
+}
+
+TEST(BuilderTest, ParallelMarshalIsOneGzipStream) {
+  const Profile profile = MakeLargeProfile();
+  const std::string serialized = profile.SerializeAsString();
+  ASSERT_GT(serialized.size(), 2u << 20);
+
+  std::string single;
+  ASSERT_TRUE(Builder::Marshal(profile, &single));
+  std::string parallel;
+  ASSERT_TRUE(Builder::Marshal(profile, &parallel, 4));
+  EXPECT_EQ(serialized, Gunzip(single));
+  EXPECT_EQ(serialized, Gunzip(parallel));
+  // Priming each block with the preceding window keeps the ratio close.
+  EXPECT_LT(parallel.size(), single.size() * 11 / 10);
+}
+
+TEST(BuilderTest, ParallelMarshalOfSmallProfile) {
+  Profile small;
+  small.add_string_table("");
+  small.add_sample()->add_value(1);
+  for (const Profile& profile : {Profile(), small}) {
+    std::string parallel;
+    ASSERT_TRUE(Builder::Marshal(profile, &parallel, 2));
+    EXPECT_EQ(profile.SerializeAsString(), Gunzip(parallel));
+  }
+}
+
+TEST(BuilderTest, ParallelMarshalOfIncompressibleProfile) {
+  // Random strings do not compress, so each block's deflate output is as
+  // large as it can get and fills the output buffer.
+  Profile profile;
+  uint64 state = 1;
+  for (int i = 0; i < 3000; ++i) {
+    std::string random(1000, 0);
+    for (char& c : random) {
+      state = state * 6364136223846793005u + 1442695040888963407u;
+      c = static_cast<char>(state >> 56);
+    }
+    profile.add_string_table(random);
+  }
+  std::string parallel;
+  ASSERT_TRUE(Builder::Marshal(profile, &parallel, 3));
+  EXPECT_EQ(profile.SerializeAsString(), Gunzip(parallel));
+}
+
+TEST(BuilderTest, ParallelMarshalToFile) {
+  const Profile profile = MakeLargeProfile();
+  FILE* file = tmpfile();
+  ASSERT_NE(nullptr, file);
+  ASSERT_TRUE(Builder::MarshalToFile(profile, fileno(file), 3));
+
+  std::string compressed;
+  rewind(file);
+  char buffer[4096];
+  size_t size;
+  while ((size = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    compressed.append(buffer, size);
+  }
+  fclose(file);
+  EXPECT_EQ(profile.SerializeAsString(), Gunzip(compressed));
+}
+
+TEST(BuilderTest, BuildsProfileOnArena) {
+  const Profile want = MakeLargeProfile();
+  google::protobuf::Arena arena;
+  Builder builder(&arena);
+  Profile* profile = builder.mutable_profile();
+  EXPECT_EQ(&arena, profile->GetArena());
+  auto* sample_type = profile->add_sample_type();
+  sample_type->set_type(builder.StringId("samples"));
+  sample_type->set_unit(builder.StringId("count"));
+  for (int i = 0; i < 100000; ++i) {
+    const std::string name = "function_" + std::to_string(i);
+    const uint64 function_id = builder.FunctionId(
+        name.c_str(), name.c_str(), "/src/file.cc", i % 1000);
+    auto* location = profile->add_location();
+    location->set_id(i + 1);
+    location->set_address(0x1000 + 16 * i);
+    location->add_line()->set_function_id(function_id);
+    auto* sample = profile->add_sample();
+    sample->add_location_id(i + 1);
+    sample->add_location_id((i * 7919) % 100000 + 1);
+    sample->add_value(i % 13);
+  }
+  ASSERT_TRUE(builder.Finalize());
+  EXPECT_EQ(want.SerializeAsString(), profile->SerializeAsString());
+}
+
+}  // namespace
+}  // namespace profiles
+}  // namespace perftools
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -8,10 +8,14 @@
 #include "src/perf_data_converter.h"
 
 #include <algorithm>
+#include <cmath>
 #include <cstdint>
 #include <deque>
+#include <iterator>
 #include <map>
+#include <memory>
 #include <sstream>
+#include <string_view>
 #include <unordered_map>
 #include <utility>
 #include <vector>
@@ -19,9 +23,12 @@
 #include "src/quipper/base/logging.h"
 #include "src/builder.h"
 #include "src/perf_data_handler.h"
+#include "src/quipper/columnar_sample_store.h"
 #include "src/quipper/perf_data.pb.h"
 #include "src/quipper/perf_parser.h"
+#include "src/quipper/perf_proto_stream.h"
 #include "src/quipper/perf_reader.h"
+#include "src/symbolizer.h"
 
 namespace perftools {
 namespace {
@@ -60,8 +67,8 @@ const char* ExecModeString(ExecutionMode mode) {
 }
 
 ExecutionMode PerfExecMode(const PerfDataHandler::SampleContext& sample) {
-  if (sample.header.has_misc()) {
-    switch (sample.header.misc() & quipper::PERF_RECORD_MISC_CPUMODE_MASK) {
+  if (sample.sample.has_misc()) {
+    switch (sample.sample.misc() & quipper::PERF_RECORD_MISC_CPUMODE_MASK) {
       case quipper::PERF_RECORD_MISC_KERNEL:
         return HostKernel;
       case quipper::PERF_RECORD_MISC_USER:
@@ -81,10 +88,147 @@ ExecutionMode PerfExecMode(const PerfDataHandler::SampleContext& sample) {
 // this also ensures the string contains structurally valid UTF-8.
 // In order to successfully unmarshal the proto in Go, all strings inserted into
 // the profile string table must be valid UTF-8.
-int64_t UTF8StringId(const std::string& s, ProfileBuilder* builder) {
-  return builder->StringId(s.c_str());
+int64_t UTF8StringId(std::string_view s, ProfileBuilder* builder) {
+  return builder->StringId(s);
 }
 
+// Returns |x| with its bits mixed so that each depends on all of those of
+// |x|. This is the finalizer of SplitMix64.
+uint64_t MixBits(uint64_t x) {
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+// Returns a hash of |sample| and |seed|, which is uniformly distributed over
+// the samples and the same for the same sample and seed in every conversion.
+uint64_t SampleHash(const PerfDataHandler::SampleFields& sample,
+                    uint64_t seed) {
+  uint64_t hash = MixBits(seed);
+  for (uint64_t field :
+       {sample.sample_time_ns(), sample.ip(), sample.id(),
+        (static_cast<uint64_t>(sample.pid()) << 32) | sample.tid(),
+        static_cast<uint64_t>(sample.cpu()), sample.period()}) {
+    hash = MixBits(hash ^ field);
+  }
+  return hash;
+}
+
+// Returns the number of samples in |perf_data|.
+uint64_t CountSamples(const quipper::PerfDataProto& perf_data) {
+  uint64_t num_samples = 0;
+  for (const auto& event : perf_data.events()) {
+    num_samples += event.has_sample_event();
+  }
+  return num_samples;
+}
+
+// Returns |params| with sample_rate set from target_samples, if given, for
+// |num_samples| samples, or for an unknown number of them if 0.
+ConversionParams ResolveSampleRate(ConversionParams params,
+                                   uint64_t num_samples) {
+  if (params.target_samples != 0) {
+    params.sample_rate = 1.0;
+    if (num_samples > params.target_samples) {
+      params.sample_rate =
+          static_cast<double>(params.target_samples) / num_samples;
+    }
+    params.target_samples = 0;
+  }
+  return params;
+}
+
+// Returns whether at least |threshold| percent of the samples counted by
+// |stats| had all their addresses mapped, logging why not. This is the check
+// quipper::PerfParser does when it maps the samples itself.
+bool EnoughSamplesMapped(const PerfDataHandler::SampleStats& stats,
+                         float threshold) {
+  if (stats.samples == 0) return true;
+  float sample_mapping_percentage =
+      static_cast<float>(stats.mapped_samples) / stats.samples * 100.;
+  if (sample_mapping_percentage < threshold) {
+    LOG(ERROR) << "Only " << static_cast<int>(sample_mapping_percentage)
+               << "% of samples had all locations mapped to a module, expected "
+               << "at least " << static_cast<int>(threshold) << "%";
+    return false;
+  }
+  return true;
+}
+
+// Returns whether |params| can be used with |sample_labels| and |options|,
+// logging why not.
+bool ValidParams(uint32_t sample_labels, uint32_t options,
+                 const ConversionParams& params) {
+  if (((sample_labels & kTimeBucketLabel) || (options & kGroupByTimeWindows)) &&
+      params.time_bucket_ns == 0) {
+    LOG(ERROR) << "Time buckets must not be empty";
+    return false;
+  }
+  if (params.target_samples == 0 && !(params.sample_rate > 0)) {
+    LOG(ERROR) << "Sample rate must be positive: " << params.sample_rate;
+    return false;
+  }
+  return true;
+}
+
+// The labels a sample can have, in the order they are added to it.
+enum LabelKind {
+  kPidLabelKind,
+  kTidLabelKind,
+  kCommLabelKind,
+  kTimestampNsLabelKind,
+  kTimeBucketLabelKind,
+  kExecutionModeLabelKind,
+  kThreadTypeLabelKind,
+  kThreadCommLabelKind,
+  kCgroupLabelKind,
+  kCodePageSizeLabelKind,
+  kDataPageSizeLabelKind,
+  kCpuLabelKind,
+  kCacheLatencyLabelKind,
+  kDataSrcLabelKind,
+  kSnoopStatusLabelKind,
+  kNumLabelKinds
+};
+
+// The key of each kind of label.
+const char* const kLabelKeys[kNumLabelKinds] = {
+    PidLabelKey,          TidLabelKey,           CommLabelKey,
+    TimestampNsLabelKey,  TimeBucketNsLabelKey,  ExecutionModeLabelKey,
+    ThreadTypeLabelKey,   ThreadCommLabelKey,    CgroupLabelKey,
+    CodePageSizeLabelKey, DataPageSizeLabelKey,  CpuLabelKey,
+    CacheLatencyLabelKey, DataSrcLabelKey,       SnoopStatusLabelKey,
+};
+
+// The string IDs of the constant strings of the labels in a profile. Each is
+// -1 until first used, so that the string table is in the same order as if
+// they were looked up every time.
+struct LabelStringIds {
+  LabelStringIds() {
+    std::fill(std::begin(keys), std::end(keys), -1);
+    std::fill(std::begin(exec_modes), std::end(exec_modes), -1);
+  }
+
+  // Returns the string ID of |str|, memoized in |*id|.
+  static int64_t Get(int64_t* id, const char* str, ProfileBuilder* builder) {
+    if (*id < 0) {
+      *id = builder->StringId(str);
+    }
+    return *id;
+  }
+
+  int64_t keys[kNumLabelKinds];
+  int64_t exec_modes[Hypervisor + 1];
+  int64_t cpu_unit = -1;
+  int64_t cycles_unit = -1;
+};
+
+// The string ID of a string in a profile, and the builder of the profile.
+struct CachedStringId {
+  const ProfileBuilder* builder = nullptr;
+  int64_t id = 0;
+};
+
 // List of profile location IDs, currently used to represent a call stack.
 typedef std::vector<uint64_t> LocationIdVector;
 
@@ -100,6 +244,8 @@ struct SampleKey {
   Pid pid = 0;
   Tid tid = 0;
   uint64_t time_ns = 0;
+  // The start of the time bucket of the sample.
+  uint64_t time_bucket_ns = 0;
   ExecutionMode exec_mode = Unknown;
   // The index of the sample's command in the profile's string table.
   uint64_t comm = 0;
@@ -119,8 +265,9 @@ struct SampleKey {
 };
 
 struct SampleKeyEqualityTester {
-  bool operator()(const SampleKey a, const SampleKey b) const {
+  bool operator()(const SampleKey& a, const SampleKey& b) const {
     return ((a.pid == b.pid) && (a.tid == b.tid) && (a.time_ns == b.time_ns) &&
+            (a.time_bucket_ns == b.time_bucket_ns) &&
             (a.exec_mode == b.exec_mode) && (a.comm == b.comm) &&
             (a.thread_type == b.thread_type) &&
             (a.thread_comm == b.thread_comm) && (a.cgroup == b.cgroup) &&
@@ -132,11 +279,12 @@ struct SampleKeyEqualityTester {
 };
 
 struct SampleKeyHasher {
-  size_t operator()(const SampleKey k) const {
+  size_t operator()(const SampleKey& k) const {
     size_t hash = 0;
     hash ^= std::hash<int32_t>()(k.pid);
     hash ^= std::hash<int32_t>()(k.tid);
     hash ^= std::hash<uint64_t>()(k.time_ns);
+    hash ^= std::hash<uint64_t>()(k.time_bucket_ns);
     hash ^= std::hash<int>()(k.exec_mode);
     hash ^= std::hash<uint64_t>()(k.comm);
     hash ^= std::hash<uint64_t>()(k.thread_type);
@@ -165,11 +313,76 @@ typedef std::unordered_map<SampleKey, perftools::profiles::Sample*,
                            SampleKeyHasher, SampleKeyEqualityTester>
     SampleMap;
 
-// Map from a virtual address to a profile location ID. It only keys off the
-// address, not also the mapping ID since the map / its portions are invalidated
-// by Comm() and MMap() methods to force re-creation of those locations.
-//
-typedef std::map<uint64_t, uint64_t> LocationMap;
+// Open-addressing hash table from a handler mapping object and a virtual
+// address to a profile location ID. Each mmap makes a new mapping object, so
+// the addresses it covers get new keys and the locations of the mappings it
+// replaced are no longer found, without erasing them. Those stale entries
+// are few, as each has a location in the profile anyway.
+class LocationMap {
+ public:
+  // Returns the location ID of |addr| in |mapping|, or 0 if there is none.
+  uint64_t Find(const PerfDataHandler::Mapping* mapping, uint64_t addr) const {
+    if (slots_.empty()) return 0;
+    return slots_[FindSlot(mapping, addr)].id;
+  }
+
+  // Adds a location ID that Find() did not find.
+  void Insert(const PerfDataHandler::Mapping* mapping, uint64_t addr,
+              uint64_t id) {
+    // Keeps the table at most half full.
+    if (2 * (size_ + 1) > slots_.size()) {
+      Grow();
+    }
+    Slot& slot = slots_[FindSlot(mapping, addr)];
+    slot.mapping = mapping;
+    slot.addr = addr;
+    slot.id = id;
+    ++size_;
+  }
+
+  void clear() {
+    slots_.clear();
+    size_ = 0;
+  }
+
+ private:
+  struct Slot {
+    const PerfDataHandler::Mapping* mapping = nullptr;
+    uint64_t addr = 0;
+    uint64_t id = 0;  // 0 if the slot is empty.
+  };
+
+  // Returns the index of the slot holding the key or the empty slot where it
+  // belongs.
+  size_t FindSlot(const PerfDataHandler::Mapping* mapping,
+                  uint64_t addr) const {
+    const size_t mask = slots_.size() - 1;
+    // Addresses of nearby instructions differ in their low bits, so those
+    // are spread over the table by the multiplication.
+    uint64_t hash = addr ^ reinterpret_cast<uintptr_t>(mapping);
+    hash *= 0x9e3779b97f4a7c15ULL;
+    size_t i = (hash >> 32) & mask;
+    // Linear probing.
+    while (slots_[i].id != 0 &&
+           (slots_[i].addr != addr || slots_[i].mapping != mapping)) {
+      i = (i + 1) & mask;
+    }
+    return i;
+  }
+
+  void Grow() {
+    std::vector<Slot> old_slots(slots_.empty() ? 256 : 2 * slots_.size());
+    old_slots.swap(slots_);
+    for (const Slot& slot : old_slots) {
+      if (slot.id != 0) {
+        slots_[FindSlot(slot.mapping, slot.addr)] = slot;
+      }
+    }
+  }
+
+  std::vector<Slot> slots_;  // Size is zero or a power of 2.
+  size_t size_ = 0;
+};
 
 // Map from the handler mapping object to profile mapping ID. The mappings
 // the handler creates are immutable and reasonably shared (as in no new mapping
@@ -181,8 +394,10 @@ typedef std::unordered_map<const PerfDataHandler::Mapping*, uint64_t>
 // See docs on ProcessProfile in the header file for details on the fields.
 class ProcessMeta {
  public:
-  // Constructs the object for the specified PID.
-  explicit ProcessMeta(Pid pid) : pid_(pid) {}
+  // Constructs the object for the specified PID, the time window starting at
+  // |time_window_start_ns| and |group|.
+  ProcessMeta(Pid pid, int64_t time_window_start_ns, const std::string& group)
+      : pid_(pid), time_window_start_ns_(time_window_start_ns), group_(group) {}
 
   // Updates the bounding time interval ranges per specified timestamp.
   void UpdateTimestamps(int64_t time_nsec) {
@@ -194,23 +409,32 @@ class ProcessMeta {
     }
   }
 
-  std::unique_ptr<ProcessProfile> MakeProcessProfile(
-      Profile* data, const std::unordered_map<Pid, BuildIdStats>& stats) {
+  BuildIdStats* mutable_build_id_stats() { return &build_id_stats_; }
+
+  std::unique_ptr<ProcessProfile> MakeProcessProfile(Profile* data) {
     ProcessProfile* pp = new ProcessProfile();
     pp->pid = pid_;
-    pp->data.Swap(data);
+    if (data->GetArena() != nullptr) {
+      pp->arena_data = data;
+    } else {
+      pp->data.Swap(data);
+    }
     pp->min_sample_time_ns = min_sample_time_ns_;
     pp->max_sample_time_ns = max_sample_time_ns_;
-    if (stats.find(pid_) != stats.end()) {
-      pp->build_id_stats = stats.at(pid_);
-    }
+    pp->time_window_start_ns = time_window_start_ns_;
+    pp->group = group_;
+    pp->build_id_stats = std::move(build_id_stats_);
     return std::unique_ptr<ProcessProfile>(pp);
   }
 
  private:
   Pid pid_;
+  int64_t time_window_start_ns_;
+  std::string group_;
   int64_t min_sample_time_ns_ = 0;
   int64_t max_sample_time_ns_ = 0;
+  // The frames and IPs of the profile by the source of their build IDs.
+  BuildIdStats build_id_stats_;
 };
 
 class PerfDataConverter : public PerfDataHandler {
@@ -218,13 +442,50 @@ class PerfDataConverter : public PerfDataHandler {
   explicit PerfDataConverter(
       const quipper::PerfDataProto& perf_data,
       uint32_t sample_labels = kNoLabels, uint32_t options = kGroupByPids,
-      const std::map<Tid, std::string>& thread_types = {})
+      const std::map<Tid, std::string>& thread_types = {},
+      const ConversionParams& params = {})
       : perf_data_(perf_data),
         sample_labels_(sample_labels),
-        options_(options) {
+        options_(options),
+        params_(params),
+        group_samples_((options_ & (kGroupByCgroup | kGroupByCpu |
+                                    kGroupByComm | kGroupByThreadType)) ||
+                       params_.group_key) {
+    if (!group_samples_) {
+      group_names_.emplace_back();
+    }
+    // ValidParams() rejected the parameters the following relies on.
+    if (IncludeTimeBucketLabels() || (options_ & kGroupByTimeWindows)) {
+      DCHECK_GT(params_.time_bucket_ns, 0u);
+    }
+    if (options_ & kArenaProfiles) {
+      arena_ = std::make_shared<google::protobuf::Arena>();
+    }
+    if (params_.sample_rate < 1) {
+      DCHECK_GT(params_.sample_rate, 0);
+      keep_threshold_ =
+          static_cast<uint64_t>(std::ldexp(params_.sample_rate, 64));
+      sample_scale_ = 1 / params_.sample_rate;
+    }
     for (auto& it : thread_types) {
       thread_types_.insert(std::make_pair(it.first, it.second));
     }
+    // The kinds of labels requested, in the order they are added to samples.
+    const bool requested[kNumLabelKinds] = {
+        IncludePidLabels(),           IncludeTidLabels(),
+        IncludeCommLabels(),          IncludeTimestampNsLabels(),
+        IncludeTimeBucketLabels(),    IncludeExecutionModeLabels(),
+        IncludeThreadTypeLabels(),    IncludeThreadCommLabels(),
+        IncludeCgroupLabels(),        IncludeCodePageSizeLabels(),
+        IncludeDataPageSizeLabels(),  IncludeCpuLabels(),
+        IncludeCacheLatencyLabel(),   IncludeDataSrcLabels(),
+        IncludeDataSrcLabels(),
+    };
+    for (int kind = 0; kind < kNumLabelKinds; ++kind) {
+      if (requested[kind]) {
+        label_kinds_.push_back(static_cast<LabelKind>(kind));
+      }
+    }
   }
   PerfDataConverter(const PerfDataConverter&) = delete;
   PerfDataConverter& operator=(const PerfDataConverter&) = delete;
@@ -236,6 +497,7 @@ class PerfDataConverter : public PerfDataHandler {
   void Sample(const PerfDataHandler::SampleContext& sample) override;
   void Comm(const CommContext& comm) override;
   void MMap(const MMapContext& mmap) override;
+  bool KeepSample(const PerfDataHandler::SampleFields& sample) override;
 
  private:
   // Adds a new sample updating the event counters if such sample is not present
@@ -245,6 +507,26 @@ class PerfDataConverter : public PerfDataHandler {
                          const Pid& pid, const SampleKey& sample_key,
                          ProfileBuilder* builder);
 
+  // Adds the label of |kind| to |sample| if the sample has one.
+  void AddLabel(LabelKind kind, const PerfDataHandler::SampleContext& context,
+                const SampleKey& sample_key, LabelStringIds* ids,
+                ProfileBuilder* builder, perftools::profiles::Sample* sample);
+
+  // Returns the ID of the location in |builder| that is in a function named
+  // |name|, memoized in |*id|.
+  uint64_t MarkerLocationId(const char* name, uint64_t* id,
+                            ProfileBuilder* builder);
+
+  // Returns whether |sample_key| has as many frames as its stack is allowed.
+  bool StackFull(const SampleKey& sample_key) const {
+    return params_.max_stack_depth != 0 &&
+           sample_key.stack.size() >= params_.max_stack_depth;
+  }
+
+  // Returns the string ID in |builder| of the command of thread |tid| of
+  // process |pid|, which is cached until the thread's command changes.
+  int64_t CommStringId(Pid pid, Tid tid, ProfileBuilder* builder);
+
   // Adds a new location to the profile if such location is not present in the
   // profile, returning the ID of the location. It also adds the profile mapping
   // corresponding to the specified handler mapping.
@@ -269,6 +551,11 @@ class PerfDataConverter : public PerfDataHandler {
   bool IncludeTimestampNsLabels() const {
     return (sample_labels_ & kTimestampNsLabel);
   }
+  // Returns whether time bucket labels were requested for inclusion in the
+  // profile.proto's Sample.Label field.
+  bool IncludeTimeBucketLabels() const {
+    return (sample_labels_ & kTimeBucketLabel);
+  }
   // Returns whether execution_mode labels were requested for inclusion in the
   // profile.proto's Sample.Label field.
   bool IncludeExecutionModeLabels() const {
@@ -319,35 +606,126 @@ class PerfDataConverter : public PerfDataHandler {
       const PerfDataHandler::SampleContext& sample);
 
   const quipper::PerfDataProto& perf_data_;
+  // Holds the profiles with kArenaProfiles, and is then shared with the
+  // ProcessProfiles.
+  std::shared_ptr<google::protobuf::Arena> arena_;
   // Using deque so that appends do not invalidate existing pointers.
   std::deque<ProfileBuilder> builders_;
   std::deque<ProcessMeta> process_metas_;
+  std::deque<LabelStringIds> label_string_ids_;
+
+  // The key of one of the profiles of a process, or of all processes without
+  // kGroupByPids: the index of its time window, which is always 0 without
+  // kGroupByTimeWindows, and the index of its group in group_names_.
+  struct ProfileKey {
+    uint64_t window = 0;
+    uint32_t group = 0;
+    bool operator==(const ProfileKey& other) const {
+      return window == other.window && group == other.group;
+    }
+  };
+  struct ProfileKeyHasher {
+    size_t operator()(const ProfileKey& k) const {
+      return std::hash<uint64_t>()(k.window * 0x9e3779b97f4a7c15ULL ^ k.group);
+    }
+  };
 
-  struct PerPidInfo {
+  // The parts of the group of a sample, each left empty unless requested or
+  // if the sample has none.
+  struct GroupKey {
+    std::string cgroup;
+    bool has_cpu = false;
+    uint32_t cpu = 0;
+    std::string comm;
+    std::string thread_type;
+    std::string custom;
+    bool operator==(const GroupKey& other) const {
+      return cgroup == other.cgroup && has_cpu == other.has_cpu &&
+             cpu == other.cpu && comm == other.comm &&
+             thread_type == other.thread_type && custom == other.custom;
+    }
+  };
+  struct GroupKeyHasher {
+    size_t operator()(const GroupKey& k) const {
+      size_t hash = std::hash<std::string>()(k.cgroup);
+      for (const std::string* part : {&k.comm, &k.thread_type, &k.custom}) {
+        hash = hash * 0x9e3779b97f4a7c15ULL ^ std::hash<std::string>()(*part);
+      }
+      return hash * 0x9e3779b97f4a7c15ULL ^ (k.has_cpu ? k.cpu + 1 : 0);
+    }
+  };
+
+  // The state of the profile of a process, or of all processes without
+  // kGroupByPids, for a profile key.
+  struct PerProfileInfo {
     ProfileBuilder* builder = nullptr;
     ProcessMeta* process_meta = nullptr;
+    LabelStringIds* label_string_ids = nullptr;
     LocationMap location_map;
     MappingMap mapping_map;
-    std::unordered_map<Tid, std::string> tid_to_comm_map;
+    // The samples of the profile, in the info of the PID of its builder.
     SampleMap sample_map;
+    // The IDs of the locations that mark the cut stacks, or 0 until needed.
+    uint64_t truncated_location_id = 0;
+    uint64_t pruned_location_id = 0;
+    // The number of samples at which they are next pruned, or 0 until they
+    // first are.
+    uint64_t prune_size = 0;
+  };
+
+  struct PerPidInfo {
+    std::unordered_map<ProfileKey, PerProfileInfo, ProfileKeyHasher> profiles;
+    std::unordered_map<Tid, std::string> tid_to_comm_map;
+    // String IDs of the commands in tid_to_comm_map, and of the thread types
+    // of the threads.
+    std::unordered_map<Tid, CachedStringId> tid_to_comm_id;
+    std::unordered_map<Tid, CachedStringId> tid_to_thread_type_id;
     void clear() {
-      builder = nullptr;
-      process_meta = nullptr;
-      location_map.clear();
-      mapping_map.clear();
+      profiles.clear();
       tid_to_comm_map.clear();
-      sample_map.clear();
+      tid_to_comm_id.clear();
+      tid_to_thread_type_id.clear();
     }
   };
   std::unordered_map<Pid, PerPidInfo> per_pid_;
 
+  // Returns the state of the profile of |pid| for the current profile key.
+  PerProfileInfo& ProfileInfo(Pid pid) {
+    return per_pid_[pid].profiles[current_profile_];
+  }
+
+  // Returns the index in group_names_ of the group of |sample|.
+  uint32_t GroupIndex(const PerfDataHandler::SampleContext& sample);
+
+  // Folds all but the params_.max_samples heaviest samples of |info| into
+  // samples of their root frame under a pruned stack marker.
+  void PruneSamples(PerProfileInfo* info, ProfileBuilder* builder);
+
   const uint32_t sample_labels_;
   const uint32_t options_;
+  const ConversionParams params_;
+  // Whether any grouping other than by PID or time was requested.
+  const bool group_samples_;
+  // The key of the profile of the sample being converted.
+  ProfileKey current_profile_;
+  // The names of the groups, and the indices of their keys. Without
+  // group_samples_, all the samples are in group 0, of the empty name.
+  std::vector<std::string> group_names_;
+  std::unordered_map<GroupKey, uint32_t, GroupKeyHasher> group_indices_;
+  // The key of the group of the sample being converted, whose strings keep
+  // their capacity from sample to sample.
+  GroupKey group_key_;
+  // With a sample rate below 1, the samples are kept if their hash is below
+  // keep_threshold_, and their values scaled by sample_scale_.
+  uint64_t keep_threshold_ = 0;
+  double sample_scale_ = 1;
   std::unordered_map<Tid, std::string> thread_types_;
+  // The kinds of labels requested by sample_labels_, in order.
+  std::vector<LabelKind> label_kinds_;
 };
 
 // Test the bit and return the data_src string for sample key.
-std::string DataSrcString(uint64_t mem_lvl) {
+const char* DataSrcString(uint64_t mem_lvl) {
   if (!(mem_lvl & quipper::PERF_MEM_LVL_HIT)) return "";
   if (mem_lvl & quipper::PERF_MEM_LVL_L1) return "L1";
   if (mem_lvl & quipper::PERF_MEM_LVL_LFB) return "LFB";
@@ -366,7 +744,7 @@ std::string DataSrcString(uint64_t mem_lvl) {
 }
 
 // Test the bit and return the snoop_status string for sample key.
-std::string SnoopStatusString(uint64_t mem_snoop) {
+const char* SnoopStatusString(uint64_t mem_snoop) {
   if (mem_snoop & quipper::PERF_MEM_SNOOP_NONE) return "None";
   if (mem_snoop & quipper::PERF_MEM_SNOOP_HIT) return "Hit";
   if (mem_snoop & quipper::PERF_MEM_SNOOP_MISS) return "Miss";
@@ -384,27 +762,34 @@ SampleKey PerfDataConverter::MakeSampleKey(
       (IncludeTimestampNsLabels() && sample.sample.has_sample_time_ns())
           ? sample.sample.sample_time_ns()
           : 0;
+  if (IncludeTimeBucketLabels() && sample.sample.has_sample_time_ns()) {
+    const uint64_t time_ns = sample.sample.sample_time_ns();
+    sample_key.time_bucket_ns = time_ns - time_ns % params_.time_bucket_ns;
+  }
   if (IncludeExecutionModeLabels()) {
     sample_key.exec_mode = PerfExecMode(sample);
   }
   if (IncludeCommLabels() && sample.sample.has_pid()) {
     Pid pid = sample.sample.pid();
-    std::string comm = per_pid_[pid].tid_to_comm_map[pid];
-    sample_key.comm = UTF8StringId(comm, builder);
+    sample_key.comm = CommStringId(pid, pid, builder);
   }
   if (IncludeThreadTypeLabels() && sample.sample.has_tid()) {
     Tid tid = sample.sample.tid();
     auto it = thread_types_.find(tid);
     if (it != thread_types_.end()) {
-      sample_key.thread_type = UTF8StringId(it->second, builder);
+      CachedStringId& cached =
+          per_pid_[sample_key.pid].tid_to_thread_type_id[tid];
+      if (cached.builder != builder) {
+        cached.builder = builder;
+        cached.id = UTF8StringId(it->second, builder);
+      }
+      sample_key.thread_type = cached.id;
     }
   }
   if (IncludeThreadCommLabels() && sample.sample.has_pid() &&
       sample.sample.has_tid()) {
-    Pid pid = sample.sample.pid();
-    Tid tid = sample.sample.tid();
-    const std::string& comm = per_pid_[pid].tid_to_comm_map[tid];
-    sample_key.thread_comm = UTF8StringId(comm, builder);
+    sample_key.thread_comm =
+        CommStringId(sample.sample.pid(), sample.sample.tid(), builder);
   }
   if (IncludeCgroupLabels() && sample.cgroup) {
     sample_key.cgroup = UTF8StringId(*sample.cgroup, builder);
@@ -420,10 +805,9 @@ SampleKey PerfDataConverter::MakeSampleKey(
   // If sample has a weight_struct, we use its var1_dw field, which is the cache
   // latency. Otherwise, we use the weight field.
   if (IncludeCacheLatencyLabel()) {
-    if (sample.sample.has_weight_struct() &&
-        sample.sample.weight_struct().has_var1_dw()) {
+    if (sample.sample.has_weight_var1_dw()) {
       sample_key.weight =
-          static_cast<uint64_t>(sample.sample.weight_struct().var1_dw());
+          static_cast<uint64_t>(sample.sample.weight_var1_dw());
     } else if (sample.sample.has_weight()) {
       sample_key.weight = sample.sample.weight();
     }
@@ -440,17 +824,36 @@ SampleKey PerfDataConverter::MakeSampleKey(
   return sample_key;
 }
 
+int64_t PerfDataConverter::CommStringId(Pid pid, Tid tid,
+                                        ProfileBuilder* builder) {
+  PerPidInfo& per_pid = per_pid_[pid];
+  CachedStringId& cached = per_pid.tid_to_comm_id[tid];
+  if (cached.builder != builder) {
+    cached.builder = builder;
+    cached.id = UTF8StringId(per_pid.tid_to_comm_map[tid], builder);
+  }
+  return cached.id;
+}
+
 ProfileBuilder* PerfDataConverter::GetOrCreateBuilder(
     const PerfDataHandler::SampleContext& sample) {
   Pid builder_pid = (options_ & kGroupByPids) ? sample.sample.pid() : 0;
   VLOG(2) << "Processing sample for PID=" << sample.sample.pid();
-  auto& per_pid = per_pid_[builder_pid];
+  PerProfileInfo& per_pid = ProfileInfo(builder_pid);
   if (per_pid.builder == nullptr) {
     VLOG(2) << "Creating a new profile for PID key " << builder_pid;
-    builders_.push_back(ProfileBuilder());
+    builders_.emplace_back(arena_.get());
     per_pid.builder = &builders_.back();
-    process_metas_.push_back(ProcessMeta(builder_pid));
+    // The converter only refers to ids it was given by the builder, and
+    // Profiles() has no use for the result of checking.
+    per_pid.builder->SetCheckValid(false);
+    process_metas_.push_back(
+        ProcessMeta(builder_pid,
+                    current_profile_.window * params_.time_bucket_ns,
+                    group_names_[current_profile_.group]));
     per_pid.process_meta = &process_metas_.back();
+    label_string_ids_.emplace_back();
+    per_pid.label_string_ids = &label_string_ids_.back();
 
     ProfileBuilder* builder = per_pid.builder;
     Profile* profile = builder->mutable_profile();
@@ -535,7 +938,7 @@ uint64_t PerfDataConverter::AddOrGetMapping(
     return 0;
   }
 
-  MappingMap& mapmap = per_pid_[pid].mapping_map;
+  MappingMap& mapmap = ProfileInfo(pid).mapping_map;
   auto it = mapmap.find(smap);
   if (it != mapmap.end()) {
     return it->second;
@@ -565,94 +968,115 @@ uint64_t PerfDataConverter::AddOrGetMapping(
   return mapping_id;
 }
 
+void PerfDataConverter::AddLabel(LabelKind kind,
+                                 const PerfDataHandler::SampleContext& context,
+                                 const SampleKey& sample_key,
+                                 LabelStringIds* ids, ProfileBuilder* builder,
+                                 perftools::profiles::Sample* sample) {
+  int64_t num = 0;
+  int64_t str = 0;
+  int64_t* num_unit = nullptr;
+  const char* num_unit_str = nullptr;
+  switch (kind) {
+    case kPidLabelKind:
+      if (!context.sample.has_pid()) return;
+      num = static_cast<int64_t>(context.sample.pid());
+      break;
+    case kTidLabelKind:
+      if (!context.sample.has_tid()) return;
+      num = static_cast<int64_t>(context.sample.tid());
+      break;
+    case kCommLabelKind:
+      str = sample_key.comm;
+      break;
+    case kTimestampNsLabelKind:
+      if (!context.sample.has_sample_time_ns()) return;
+      num = static_cast<int64_t>(context.sample.sample_time_ns());
+      break;
+    case kTimeBucketLabelKind:
+      if (!context.sample.has_sample_time_ns()) return;
+      num = static_cast<int64_t>(sample_key.time_bucket_ns);
+      break;
+    case kExecutionModeLabelKind:
+      if (sample_key.exec_mode == Unknown) return;
+      break;
+    case kThreadTypeLabelKind:
+      str = sample_key.thread_type;
+      break;
+    case kThreadCommLabelKind:
+      str = sample_key.thread_comm;
+      break;
+    case kCgroupLabelKind:
+      str = sample_key.cgroup;
+      break;
+    case kCodePageSizeLabelKind:
+      num = sample_key.code_page_size;
+      break;
+    case kDataPageSizeLabelKind:
+      num = sample_key.data_page_size;
+      break;
+    case kCpuLabelKind:
+      if (!context.sample.has_cpu()) return;
+      num = static_cast<int64_t>(context.sample.cpu());
+      num_unit = &ids->cpu_unit;
+      num_unit_str = "cpu";
+      break;
+    case kCacheLatencyLabelKind:
+      num = sample_key.weight;
+      num_unit = &ids->cycles_unit;
+      num_unit_str = "cycles";
+      break;
+    case kDataSrcLabelKind:
+      str = sample_key.data_src;
+      break;
+    case kSnoopStatusLabelKind:
+      str = sample_key.snoop_status;
+      break;
+    case kNumLabelKinds:
+      return;
+  }
+  // The labels taken from the sample key are left out when unset.
+  const bool from_context = kind == kPidLabelKind || kind == kTidLabelKind ||
+                            kind == kTimestampNsLabelKind ||
+                            kind == kTimeBucketLabelKind ||
+                            kind == kExecutionModeLabelKind ||
+                            kind == kCpuLabelKind;
+  if (!from_context && num == 0 && str == 0) return;
+
+  auto* label = sample->add_label();
+  label->set_key(LabelStringIds::Get(&ids->keys[kind], kLabelKeys[kind],
+                                     builder));
+  if (kind == kExecutionModeLabelKind) {
+    str = LabelStringIds::Get(&ids->exec_modes[sample_key.exec_mode],
+                              ExecModeString(sample_key.exec_mode), builder);
+  }
+  if (str != 0) {
+    label->set_str(str);
+  } else {
+    label->set_num(num);
+  }
+  if (num_unit != nullptr) {
+    label->set_num_unit(LabelStringIds::Get(num_unit, num_unit_str, builder));
+  }
+}
+
 void PerfDataConverter::AddOrUpdateSample(
     const PerfDataHandler::SampleContext& context, const Pid& pid,
     const SampleKey& sample_key, ProfileBuilder* builder) {
-  perftools::profiles::Sample* sample = per_pid_[pid].sample_map[sample_key];
+  PerProfileInfo& info = ProfileInfo((options_ & kGroupByPids) ? pid : 0);
+  perftools::profiles::Sample*& sample = info.sample_map[sample_key];
 
-  if (sample == nullptr) {
+  const bool added = sample == nullptr;
+  if (added) {
     Profile* profile = builder->mutable_profile();
     sample = profile->add_sample();
-    per_pid_[pid].sample_map[sample_key] = sample;
     for (const auto& location_id : sample_key.stack) {
       sample->add_location_id(location_id);
     }
     // Emit any requested labels.
-    if (IncludePidLabels() && context.sample.has_pid()) {
-      auto* label = sample->add_label();
-      label->set_key(builder->StringId(PidLabelKey));
-      label->set_num(static_cast<int64_t>(context.sample.pid()));
-    }
-    if (IncludeTidLabels() && context.sample.has_tid()) {
-      auto* label = sample->add_label();
-      label->set_key(builder->StringId(TidLabelKey));
-      label->set_num(static_cast<int64_t>(context.sample.tid()));
-    }
-    if (IncludeCommLabels() && sample_key.comm != 0) {
-      auto* label = sample->add_label();
-      label->set_key(builder->StringId(CommLabelKey));
-      label->set_str(sample_key.comm);
-    }
-    if (IncludeTimestampNsLabels() && context.sample.has_sample_time_ns()) {
-      auto* label = sample->add_label();
-      label->set_key(builder->StringId(TimestampNsLabelKey));
-      int64_t timestamp_ns_as_int64 =
-          static_cast<int64_t>(context.sample.sample_time_ns());
-      label->set_num(timestamp_ns_as_int64);
-    }
-    if (IncludeExecutionModeLabels() && sample_key.exec_mode != Unknown) {
-      auto* label = sample->add_label();
-      label->set_key(builder->StringId(ExecutionModeLabelKey));
-      label->set_str(builder->StringId(ExecModeString(sample_key.exec_mode)));
-    }
-    if (IncludeThreadTypeLabels() && sample_key.thread_type != 0) {
-      auto* label = sample->add_label();
-      label->set_key(builder->StringId(ThreadTypeLabelKey));
-      label->set_str(sample_key.thread_type);
-    }
-    if (IncludeThreadCommLabels() && sample_key.thread_comm != 0) {
-      auto* label = sample->add_label();
-      label->set_key(builder->StringId(ThreadCommLabelKey));
-      label->set_str(sample_key.thread_comm);
-    }
-    if (IncludeCgroupLabels() && sample_key.cgroup != 0) {
-      auto* label = sample->add_label();
-      label->set_key(builder->StringId(CgroupLabelKey));
-      label->set_str(sample_key.cgroup);
-    }
-    if (IncludeCodePageSizeLabels() && sample_key.code_page_size != 0) {
-      auto* label = sample->add_label();
-      label->set_key(builder->StringId(CodePageSizeLabelKey));
-      label->set_num(sample_key.code_page_size);
-    }
-    if (IncludeDataPageSizeLabels() && sample_key.data_page_size != 0) {
-      auto* label = sample->add_label();
-      label->set_key(builder->StringId(DataPageSizeLabelKey));
-      label->set_num(sample_key.data_page_size);
-    }
-    if (IncludeCpuLabels() && context.sample.has_cpu()) {
-      auto* label = sample->add_label();
-      label->set_key(builder->StringId(CpuLabelKey));
-      label->set_num(static_cast<int64_t>(context.sample.cpu()));
-      label->set_num_unit(builder->StringId("cpu"));
-    }
-    if (IncludeCacheLatencyLabel() && sample_key.weight != 0) {
-      auto* label = sample->add_label();
-      label->set_key(builder->StringId(CacheLatencyLabelKey));
-      label->set_num(sample_key.weight);
-      label->set_num_unit(builder->StringId("cycles"));
-    }
-    if (IncludeDataSrcLabels()) {
-      if (sample_key.data_src != 0) {
-        auto* label = sample->add_label();
-        label->set_key(builder->StringId(DataSrcLabelKey));
-        label->set_str(sample_key.data_src);
-      }
-      if (sample_key.snoop_status != 0) {
-        auto* label = sample->add_label();
-        label->set_key(builder->StringId(SnoopStatusLabelKey));
-        label->set_str(sample_key.snoop_status);
-      }
+    for (LabelKind kind : label_kinds_) {
+      AddLabel(kind, context, sample_key, info.label_string_ids, builder,
+               sample);
     }
     // Two values per collected event: the first is sample counts, the second is
     // event counts (unsampled weight for each sample).
@@ -675,19 +1099,144 @@ void PerfDataConverter::AddOrUpdateSample(
       weight = period;
     }
   }
+  int64_t count = 1;
+  if (sample_scale_ != 1) {
+    // Rounds the scaled values up with the probability of their fractional
+    // part, so that they are not biased. The hash used is independent of the
+    // one that kept the sample.
+    const double fraction =
+        (SampleHash(context.sample, ~params_.sample_seed) >> 11) * 0x1.0p-53;
+    count = static_cast<int64_t>(sample_scale_ + fraction);
+    weight = static_cast<int64_t>(weight * sample_scale_ + fraction);
+  }
   int event_index = context.file_attrs_index;
-  sample->set_value(2 * event_index, sample->value(2 * event_index) + 1);
+  sample->set_value(2 * event_index, sample->value(2 * event_index) + count);
   sample->set_value(2 * event_index + 1,
                     sample->value(2 * event_index + 1) + weight);
+  if (added && params_.max_samples != 0 &&
+      info.sample_map.size() >= std::max(2 * params_.max_samples,
+                                         info.prune_size)) {
+    PruneSamples(&info, builder);
+  }
+}
+
+uint64_t PerfDataConverter::MarkerLocationId(const char* name, uint64_t* id,
+                                             ProfileBuilder* builder) {
+  if (*id == 0) {
+    Profile* profile = builder->mutable_profile();
+    perftools::profiles::Location* loc = profile->add_location();
+    *id = profile->location_size();
+    loc->set_id(*id);
+    // Without an address, the builder leaves it without a mapping.
+    loc->add_line()->set_function_id(builder->FunctionId(name, name, "", 0));
+  }
+  return *id;
+}
+
+// Returns the number of events of |sample|, which is the weight by which the
+// samples are pruned.
+int64_t SampleWeight(const perftools::profiles::Sample& sample) {
+  int64_t weight = 0;
+  for (int i = 1; i < sample.value_size(); i += 2) {
+    weight += sample.value(i);
+  }
+  return weight;
+}
+
+// Removes the label with the key of string ID |key| from |sample|.
+void DropLabel(int64_t key, perftools::profiles::Sample* sample) {
+  auto* labels = sample->mutable_label();
+  for (int i = 0; i < labels->size(); ++i) {
+    if (labels->Get(i).key() == key) {
+      labels->DeleteSubrange(i, 1);
+      return;
+    }
+  }
+}
+
+void PerfDataConverter::PruneSamples(PerProfileInfo* info,
+                                     ProfileBuilder* builder) {
+  auto* samples = builder->mutable_profile()->mutable_sample();
+  std::unordered_map<const perftools::profiles::Sample*, SampleKey> keys;
+  for (const auto& entry : info->sample_map) {
+    keys.emplace(entry.second, entry.first);
+  }
+  // Orders the samples by decreasing weight, and the samples of the same
+  // weight by their order in the profile, so that which are kept does not
+  // depend on the order of the map.
+  std::vector<int64_t> weights;
+  std::vector<int> order;
+  for (int i = 0; i < samples->size(); ++i) {
+    weights.push_back(SampleWeight(samples->Get(i)));
+    order.push_back(i);
+  }
+  auto heavier = [&weights](int a, int b) {
+    return weights[a] != weights[b] ? weights[a] > weights[b] : a < b;
+  };
+  std::nth_element(order.begin(), order.begin() + params_.max_samples,
+                   order.end(), heavier);
+  std::vector<bool> folded(samples->size());
+  for (size_t i = params_.max_samples; i < order.size(); ++i) {
+    folded[order[i]] = true;
+  }
+
+  const uint64_t pruned_location_id = MarkerLocationId(
+      PrunedStackFunctionName, &info->pruned_location_id, builder);
+  std::vector<bool> merged(samples->size());
+  for (int i = 0; i < samples->size(); ++i) {
+    if (!folded[i]) continue;
+    perftools::profiles::Sample* sample = samples->Mutable(i);
+    SampleKey& key = keys[sample];
+    const LocationIdVector pruned_stack = {pruned_location_id,
+                                           key.stack.back()};
+    if (key.stack == pruned_stack && key.time_ns == 0) continue;
+    info->sample_map.erase(key);
+    key.stack = pruned_stack;
+    // Every sample has a timestamp of its own, so folded samples lose theirs
+    // or they would never merge.
+    const bool drop_timestamp = key.time_ns != 0;
+    key.time_ns = 0;
+    perftools::profiles::Sample*& target = info->sample_map[key];
+    if (target != nullptr) {
+      for (int j = 0; j < sample->value_size(); ++j) {
+        target->set_value(j, target->value(j) + sample->value(j));
+      }
+      merged[i] = true;
+    } else {
+      target = sample;
+      sample->clear_location_id();
+      for (uint64_t location_id : pruned_stack) {
+        sample->add_location_id(location_id);
+      }
+      if (drop_timestamp) {
+        DropLabel(info->label_string_ids->keys[kTimestampNsLabelKind],
+                  sample);
+      }
+    }
+  }
+
+  // Removes the merged samples, keeping the others in order.
+  int kept = 0;
+  for (int i = 0; i < samples->size(); ++i) {
+    if (!merged[i]) {
+      samples->SwapElements(i, kept++);
+    }
+  }
+  samples->DeleteSubrange(kept, samples->size() - kept);
+  // The max_samples heaviest samples are followed by the folded ones, which
+  // labels other than the timestamps may keep many apart. Pruning again once
+  // at least as many new samples were added keeps the time spent pruning
+  // linear in the number of samples.
+  info->prune_size = 2 * info->sample_map.size() - params_.max_samples;
 }
 
 uint64_t PerfDataConverter::AddOrGetLocation(
     const Pid& pid, uint64_t addr, const PerfDataHandler::Mapping* mapping,
     ProfileBuilder* builder) {
-  LocationMap& loc_map = per_pid_[pid].location_map;
-  auto loc_it = loc_map.find(addr);
-  if (loc_it != loc_map.end()) {
-    return loc_it->second;
+  LocationMap& loc_map = ProfileInfo(pid).location_map;
+  const uint64_t found_id = loc_map.Find(mapping, addr);
+  if (found_id != 0) {
+    return found_id;
   }
 
   Profile* profile = builder->mutable_profile();
@@ -703,7 +1252,7 @@ uint64_t PerfDataConverter::AddOrGetLocation(
   }
   VLOG(2) << "Added location ID=" << loc_id << ", addr=" << addr
           << ", mapping_id=" << mapping_id;
-  loc_map[addr] = loc_id;
+  loc_map.Insert(mapping, addr, loc_id);
   return loc_id;
 }
 
@@ -718,15 +1267,70 @@ void PerfDataConverter::Comm(const CommContext& comm) {
   }
   per_pid_[pid].tid_to_comm_map[tid] = PerfDataHandler::NameOrMd5Prefix(
       comm.comm->comm(), comm.comm->comm_md5_prefix());
+  per_pid_[pid].tid_to_comm_id.erase(tid);
+}
+
+uint32_t PerfDataConverter::GroupIndex(
+    const PerfDataHandler::SampleContext& sample) {
+  GroupKey& key = group_key_;
+  key.cgroup.clear();
+  if ((options_ & kGroupByCgroup) && sample.cgroup != nullptr) {
+    key.cgroup = *sample.cgroup;
+  }
+  key.has_cpu = (options_ & kGroupByCpu) && sample.sample.has_cpu();
+  key.cpu = key.has_cpu ? sample.sample.cpu() : 0;
+  key.comm.clear();
+  if (options_ & kGroupByComm) {
+    const Pid pid = sample.sample.pid();
+    const auto& tid_to_comm = per_pid_[pid].tid_to_comm_map;
+    auto it = tid_to_comm.find(pid);
+    if (it != tid_to_comm.end()) key.comm = it->second;
+  }
+  key.thread_type.clear();
+  if ((options_ & kGroupByThreadType) && sample.sample.has_tid()) {
+    auto it = thread_types_.find(sample.sample.tid());
+    if (it != thread_types_.end()) key.thread_type = it->second;
+  }
+  key.custom.clear();
+  if (params_.group_key) {
+    key.custom = params_.group_key(sample);
+  }
+  auto found = group_indices_.find(key);
+  if (found != group_indices_.end()) {
+    return found->second;
+  }
+
+  // The name joins the requested parts, which only new groups need.
+  std::string name;
+  bool first = true;
+  auto add_part = [&name, &first](std::string_view part) {
+    if (!first) name += ';';
+    first = false;
+    name.append(part.data(), part.size());
+  };
+  if (options_ & kGroupByCgroup) add_part(key.cgroup);
+  if (options_ & kGroupByCpu) {
+    add_part(key.has_cpu ? std::to_string(key.cpu) : "");
+  }
+  if (options_ & kGroupByComm) add_part(key.comm);
+  if (options_ & kGroupByThreadType) add_part(key.thread_type);
+  if (params_.group_key) add_part(key.custom);
+  const uint32_t index = group_names_.size();
+  group_names_.push_back(std::move(name));
+  group_indices_.emplace(key, index);
+  return index;
 }
 
-// Invalidates the locations in location_map in the mmap event's range.
-void PerfDataConverter::MMap(const MMapContext& mmap) {
-  LocationMap& loc_map = per_pid_[mmap.pid].location_map;
-  loc_map.erase(loc_map.lower_bound(mmap.mapping->start),
-                loc_map.lower_bound(mmap.mapping->limit));
+bool PerfDataConverter::KeepSample(
+    const PerfDataHandler::SampleFields& sample) {
+  return sample_scale_ == 1 ||
+         SampleHash(sample, params_.sample_seed) < keep_threshold_;
 }
 
+// Nothing to do: the locations in the mmap event's range are keyed by the
+// mappings they were in, so the new mapping gets new ones.
+void PerfDataConverter::MMap(const MMapContext& /*mmap*/) {}
+
 void PerfDataConverter::Sample(const PerfDataHandler::SampleContext& sample) {
   if (sample.file_attrs_index < 0 ||
       sample.file_attrs_index >= perf_data_.file_attrs_size()) {
@@ -735,8 +1339,19 @@ void PerfDataConverter::Sample(const PerfDataHandler::SampleContext& sample) {
     return;
   }
 
+  current_profile_.window = 0;
+  if (options_ & kGroupByTimeWindows) {
+    current_profile_.window =
+        sample.sample.sample_time_ns() / params_.time_bucket_ns;
+  }
+  if (group_samples_) {
+    current_profile_.group = GroupIndex(sample);
+  }
   Pid event_pid = sample.sample.pid();
   ProfileBuilder* builder = GetOrCreateBuilder(sample);
+  BuildIdStats* build_id_stats =
+      ProfileInfo((options_ & kGroupByPids) ? event_pid : 0)
+          .process_meta->mutable_build_id_stats();
   SampleKey sample_key = MakeSampleKey(sample, builder);
 
   uint64_t ip = sample.sample_mapping != nullptr ? sample.sample.ip() : 0;
@@ -749,7 +1364,8 @@ void PerfDataConverter::Sample(const PerfDataHandler::SampleContext& sample) {
 
   // Leaf at stack[0]. Record the program counter of the sample as the leaf of
   // the stack. When kAddDataAddressFrames is set, add another leaf with the
-  // virtual data address of the access.
+  // virtual data address of the access. Once the stack has as many frames as
+  // params_.max_stack_depth allows, the rest are left out.
   if (options_ & kAddDataAddressFrames) {
     uint64_t addr = sample.addr_mapping != nullptr ? sample.sample.addr() : 0;
     if (addr != 0) {
@@ -763,13 +1379,14 @@ void PerfDataConverter::Sample(const PerfDataHandler::SampleContext& sample) {
   }
   sample_key.stack.push_back(
       AddOrGetLocation(event_pid, ip, sample.sample_mapping, builder));
-  IncBuildIdStats(event_pid, sample.sample_mapping);
+  IncBuildIdStats(sample.sample_mapping, build_id_stats);
 
   // LBR callstacks include only user call chains. If this is an LBR sample,
   // we get the kernel callstack from the sample's callchain, and the user
   // callstack from the sample's branch_stack.
   const bool lbr_sample = !sample.branch_stack.empty();
   bool skipped_dup = false;
+  bool truncated = false;
   for (const auto& frame : sample.callchain) {
     if (lbr_sample && frame.ip == quipper::PERF_CONTEXT_USER) {
       break;
@@ -802,10 +1419,14 @@ void PerfDataConverter::Sample(const PerfDataHandler::SampleContext& sample) {
       continue;
     }
 
+    if (StackFull(sample_key)) {
+      truncated = true;
+      break;
+    }
     // Subtract one so we point to the call instead of the return addr.
     sample_key.stack.push_back(
         AddOrGetLocation(event_pid, frame.ip - 1, frame.mapping, builder));
-    IncBuildIdStats(event_pid, frame.mapping);
+    IncBuildIdStats(frame.mapping, build_id_stats);
   }
   for (const auto& frame : sample.branch_stack) {
     // branch_stack entries are pairs of <from, to> locations corresponding to
@@ -820,9 +1441,20 @@ void PerfDataConverter::Sample(const PerfDataHandler::SampleContext& sample) {
     if (frame.from.ip < frame.from.mapping->start) {
       continue;
     }
+    if (truncated || StackFull(sample_key)) {
+      truncated = true;
+      break;
+    }
     sample_key.stack.push_back(AddOrGetLocation(event_pid, frame.from.ip,
                                                 frame.from.mapping, builder));
-    IncBuildIdStats(event_pid, frame.from.mapping);
+    IncBuildIdStats(frame.from.mapping, build_id_stats);
+  }
+  if (truncated) {
+    sample_key.stack.push_back(MarkerLocationId(
+        TruncatedStackFunctionName,
+        &ProfileInfo((options_ & kGroupByPids) ? event_pid : 0)
+             .truncated_location_id,
+        builder));
   }
   AddOrUpdateSample(sample, event_pid, sample_key, builder);
 }
@@ -831,9 +1463,12 @@ ProcessProfiles PerfDataConverter::Profiles() {
   ProcessProfiles pps;
   for (size_t i = 0; i < builders_.size(); i++) {
     auto& b = builders_[i];
+    if (params_.symbolizer != nullptr) {
+      params_.symbolizer->Symbolize(&b);
+    }
     b.Finalize();
-    auto pp = process_metas_[i].MakeProcessProfile(b.mutable_profile(),
-                                                   process_build_id_stats_);
+    auto pp = process_metas_[i].MakeProcessProfile(b.mutable_profile());
+    pp->arena = arena_;
     pps.push_back(std::move(pp));
   }
   return pps;
@@ -843,18 +1478,53 @@ ProcessProfiles PerfDataConverter::Profiles() {
 
 ProcessProfiles PerfDataProtoToProfiles(
     const quipper::PerfDataProto* perf_data, const uint32_t sample_labels,
-    const uint32_t options, const std::map<Tid, std::string>& thread_types) {
-  PerfDataConverter converter(*perf_data, sample_labels, options, thread_types);
+    const uint32_t options, const std::map<Tid, std::string>& thread_types,
+    const ConversionParams& params) {
+  if (!ValidParams(sample_labels, options, params)) {
+    return ProcessProfiles();
+  }
+  PerfDataConverter converter(
+      *perf_data, sample_labels, options, thread_types,
+      ResolveSampleRate(params, params.target_samples != 0
+                                    ? CountSamples(*perf_data)
+                                    : 0));
   PerfDataHandler::Process(*perf_data, &converter);
   return converter.Profiles();
 }
 
+ProcessProfiles PerfDataProtoStreamToProfiles(
+    quipper::PerfDataProtoStreamReader* reader, const uint32_t sample_labels,
+    const uint32_t options, const std::map<Tid, std::string>& thread_types,
+    const ConversionParams& params) {
+  if (!ValidParams(sample_labels, options, params)) {
+    return ProcessProfiles();
+  }
+  quipper::PerfDataProto header;
+  if (!reader->ReadHeader(&header)) {
+    LOG(ERROR) << "Could not read the header of the perf data stream";
+    return ProcessProfiles();
+  }
+  PerfDataConverter converter(header, sample_labels, options, thread_types,
+                              ResolveSampleRate(params, 0));
+  if (!PerfDataHandler::Process(header, reader, &converter)) {
+    LOG(ERROR) << "Could not read the events of the perf data stream";
+    return ProcessProfiles();
+  }
+  return converter.Profiles();
+}
+
 ProcessProfiles RawPerfDataToProfiles(
     const void* raw, const uint64_t raw_size,
     const std::map<std::string, std::string>& build_ids,
     const uint32_t sample_labels, const uint32_t options,
-    const std::map<Tid, std::string>& thread_types) {
+    const std::map<Tid, std::string>& thread_types,
+    const ConversionParams& params) {
+  if (!ValidParams(sample_labels, options, params)) {
+    return ProcessProfiles();
+  }
   quipper::PerfReader reader;
+  quipper::ColumnarSampleStore samples;
+  if (options & kColumnarSamples) reader.SetColumnarSampleStore(&samples);
   if (!reader.ReadFromPointer(reinterpret_cast<const char*>(raw), raw_size)) {
     LOG(ERROR) << "Could not read input perf.data";
     return ProcessProfiles();
@@ -875,8 +1545,12 @@ ProcessProfiles RawPerfDataToProfiles(
 
   // Use PerfParser to modify reader's events to have magic done to them such
   // as hugepage deduction and sorting events based on time, if timestamps are
-  // present.
+  // present. PerfDataHandler maps the sample addresses to the mappings of
+  // their processes as it normalizes them, so the parser does not map them
+  // first, and the share of mapped samples is checked after the handler's
+  // pass instead.
   quipper::PerfParserOptions opts;
+  opts.map_sample_events = false;
   opts.sort_events_by_time = true;
   opts.deduce_huge_page_mappings = true;
   opts.combine_mappings = true;
@@ -887,8 +1561,22 @@ ProcessProfiles RawPerfDataToProfiles(
     return ProcessProfiles();
   }
 
-  return PerfDataProtoToProfiles(&reader.proto(), sample_labels, options,
-                                 thread_types);
+  PerfDataConverter converter(
+      reader.proto(), sample_labels, options, thread_types,
+      ResolveSampleRate(params, params.target_samples != 0
+                                    ? CountSamples(reader.proto()) +
+                                          samples.size()
+                                    : 0));
+  PerfDataHandler::SampleStats stats;
+  if (options & kColumnarSamples) {
+    PerfDataHandler::Process(reader.proto(), samples, &converter, &stats);
+  } else {
+    PerfDataHandler::Process(reader.proto(), &converter, &stats);
+  }
+  if (!EnoughSamplesMapped(stats, opts.sample_mapping_percentage_threshold)) {
+    return ProcessProfiles();
+  }
+  return converter.Profiles();
 }
 
 }  // namespace perftools
@@ -8,7 +8,9 @@
 #ifndef PERFTOOLS_PERF_DATA_CONVERTER_H_
 #define PERFTOOLS_PERF_DATA_CONVERTER_H_
 
+#include <functional>
 #include <memory>
+#include <string>
 #include <vector>
 
 #include "src/profile.pb.h"
@@ -16,10 +18,13 @@
 
 namespace quipper {
 class PerfDataProto;
+class PerfDataProtoStreamReader;
 }  // namespace quipper
 
 namespace perftools {
 
+class Symbolizer;
+
 // Sample label options.
 enum SampleLabels {
   kNoLabels = 0,
@@ -66,6 +71,11 @@ enum SampleLabels {
   // Adds a label with DataSrcLabelKey and string value set to the level of
   // caches.
   kDataSrcLabel = 1 << 12,
+  // Adds label with key TimeBucketNsLabelKey and number value set to the start
+  // of the ConversionParams::time_bucket_ns wide bucket of nanoseconds since
+  // the system boot that this sample was taken in. Unlike kTimestampNsLabel,
+  // the samples of a bucket are aggregated.
+  kTimeBucketLabel = 1 << 13,
 };
 
 // Sample label key names.
@@ -83,6 +93,12 @@ const char CpuLabelKey[] = "cpu";
 const char CacheLatencyLabelKey[] = "cache_latency";
 const char DataSrcLabelKey[] = "data_src";
 const char SnoopStatusLabelKey[] = "snoop_status";
+const char TimeBucketNsLabelKey[] = "time_bucket_ns";
+
+// Names of the functions of the locations that mark the stacks cut by
+// ConversionParams::max_stack_depth and max_samples.
+const char TruncatedStackFunctionName[] = "[truncated]";
+const char PrunedStackFunctionName[] = "[pruned]";
 
 // Execution mode label values.
 const char ExecutionModeHostKernel[] = "Host Kernel";
@@ -108,6 +124,65 @@ enum ConversionOptions {
   // Whether to add sampled data addresses as leaf frames for converted
   // profiles.
   kAddDataAddressFrames = 8,
+  // Whether RawPerfDataToProfiles should keep sample events in a columnar
+  // store instead of in the PerfDataProto, which takes less memory and is
+  // faster to scan. Has no effect on PerfDataProtoToProfiles.
+  kColumnarSamples = 16,
+  // Whether to allocate the profiles on a protobuf arena shared by the
+  // returned ProcessProfiles, so that their many small messages are not
+  // individually allocated and freed. The profiles are then found in
+  // ProcessProfile::arena_data rather than ProcessProfile::data.
+  kArenaProfiles = 32,
+  // Whether to produce a profile per ConversionParams::time_bucket_ns wide
+  // window of sample times, in addition to any grouping by PID. Samples
+  // without a time are in the window starting at 0.
+  kGroupByTimeWindows = 64,
+  // Whether to produce a profile per cgroup, CPU, process command or thread
+  // type of the samples, in addition to any other grouping. Samples without
+  // one are grouped together. See ProcessProfile::group.
+  kGroupByCgroup = 128,
+  kGroupByCpu = 256,
+  kGroupByComm = 512,
+  kGroupByThreadType = 1024,
+};
+
+// Conversion parameters that are not simple flags.
+struct ConversionParams {
+  // The width of the time buckets of kTimeBucketLabel and of the windows of
+  // kGroupByTimeWindows, in nanoseconds. The conversion fails if it is 0 and
+  // either is requested.
+  uint64_t time_bucket_ns = 100000000;
+  // The fraction of the samples to convert. Which samples are converted is
+  // decided by a hash of each sample and sample_seed, so that it is the same
+  // for every conversion of the same data, and the values of the converted
+  // samples are scaled by the inverse of the fraction so that their totals
+  // are estimates of the totals of all the samples. The conversion fails if
+  // it is not positive.
+  double sample_rate = 1.0;
+  uint64_t sample_seed = 0;
+  // If not 0, sample_rate is ignored and chosen instead so that about this
+  // many samples are converted. PerfDataProtoStreamToProfiles, which does not
+  // know the number of samples ahead, then converts all of them.
+  uint64_t target_samples = 0;
+  // If not 0, the stacks of the samples are cut to their max_stack_depth
+  // leaf-most frames, followed by a location in a function named
+  // TruncatedStackFunctionName.
+  uint32_t max_stack_depth = 0;
+  // If not 0, bounds the number of samples of a profile, whatever the
+  // diversity of the stacks: whenever it reaches twice max_samples, all but
+  // the max_samples heaviest so far are folded into samples with the same
+  // labels but for kTimestampNsLabel, which they lose, and a stack of a
+  // location in a function named PrunedStackFunctionName under their root
+  // frame. Should the other labels keep more than max_samples folded samples
+  // apart, the samples are next pruned once as many new ones were added.
+  uint64_t max_samples = 0;
+  // If set, a profile is produced per value it returns for the samples, in
+  // addition to any other grouping. See ProcessProfile::group.
+  std::function<std::string(const PerfDataHandler::SampleContext&)>
+      group_key;
+  // If set, symbolizes the locations of the profiles, which then have lines
+  // in the functions of their addresses where they could be found.
+  Symbolizer* symbolizer = nullptr;
 };
 
 struct ProcessProfile {
@@ -116,15 +191,35 @@ struct ProcessProfile {
   uint32_t pid = 0;
   // Profile proto data.
   perftools::profiles::Profile data;
+  // With kArenaProfiles, the profile proto data instead, allocated on |arena|.
+  // The arena is shared by the profiles converted together and is freed with
+  // the last of them.
+  std::shared_ptr<google::protobuf::Arena> arena;
+  perftools::profiles::Profile* arena_data = nullptr;
   // Min timestamp of a sample, in nanoseconds since boot, or 0 if unknown.
   int64_t min_sample_time_ns = 0;
   // Max timestamp of a sample, in nanoseconds since boot, or 0 if unknown.
   int64_t max_sample_time_ns = 0;
+  // With kGroupByTimeWindows, the start of the profile's time window, in
+  // nanoseconds since boot.
+  int64_t time_window_start_ns = 0;
+  // With kGroupByCgroup, kGroupByCpu, kGroupByComm, kGroupByThreadType or a
+  // ConversionParams::group_key, the cgroup path, CPU number, command, thread
+  // type and key of the profile's samples, in that order, of those requested,
+  // joined by ';', with an empty part for what the samples have none of. This
+  // is only a name: profiles are grouped by the parts themselves, so parts
+  // holding ';' may give different profiles the same group.
+  std::string group;
   // Number of frames + IPs belonging to the given source of the build ID,
   // see go/gwp-buildid-mmap. The sum in the map is always exactly
   // equal to the total number of frames + IP in the profile, weighted by
   // sample count.
   BuildIdStats build_id_stats;
+
+  // Returns the profile proto data, whether or not it is on an arena.
+  const perftools::profiles::Profile& profile() const {
+    return arena_data != nullptr ? *arena_data : data;
+  }
 };
 
 // Type alias for a random access sequence of owned ProcessProfile objects.
@@ -144,18 +239,31 @@ using ProcessProfiles = std::vector<std::unique_ptr<ProcessProfile>>;
 // If sample_labels doesn't include ThreadTypeLabelKey *or* the TID is not in
 // |thread_types|, no ThreadTypeLabelKey will be applied to the sample.
 //
+// params holds the parameters of the labels and options that need them.
+//
 // Returns a vector of process profiles, empty if any error occurs.
 extern ProcessProfiles RawPerfDataToProfiles(
     const void* raw, uint64_t raw_size,
     const std::map<std::string, std::string>& build_ids,
     uint32_t sample_labels = kNoLabels, uint32_t options = kGroupByPids,
-    const std::map<uint32_t, std::string>& thread_types = {});
+    const std::map<uint32_t, std::string>& thread_types = {},
+    const ConversionParams& params = {});
 
 // Converts a PerfDataProto to a vector of process profiles.
 extern ProcessProfiles PerfDataProtoToProfiles(
     const quipper::PerfDataProto* perf_data, uint32_t sample_labels = kNoLabels,
     uint32_t options = kGroupByPids,
-    const std::map<uint32_t, std::string>& thread_types = {});
+    const std::map<uint32_t, std::string>& thread_types = {},
+    const ConversionParams& params = {});
+
+// Converts a PerfDataProto stream to a vector of process profiles, reading its
+// events one batch at a time. Returns an empty vector if the stream could not
+// be read.
+extern ProcessProfiles PerfDataProtoStreamToProfiles(
+    quipper::PerfDataProtoStreamReader* reader,
+    uint32_t sample_labels = kNoLabels, uint32_t options = kGroupByPids,
+    const std::map<uint32_t, std::string>& thread_types = {},
+    const ConversionParams& params = {});
 
 }  // namespace perftools
 
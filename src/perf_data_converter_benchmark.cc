@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2026, Google Inc.
+ * All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+// Times RawPerfDataToProfiles() on a perf data file, and measures its peak
+// memory, with the samples kept in the PerfDataProto and in a columnar store:
+//   perf_data_converter_benchmark <perf data file> [<iterations>]
+// Each mode runs in a child process of its own so that their peak resident
+// set sizes can be told apart.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>  // NOLINT(build/c++11)
+#include <vector>
+
+#include "src/perf_data_converter.h"
+#include "src/quipper/base/logging.h"
+#include "src/quipper/file_utils.h"
+
+namespace perftools {
+namespace {
+
+// Converts |raw| |iterations| times with |options| and prints how long the
+// conversions took, in a child process whose peak memory is printed as well.
+// Returns false if the child failed.
+bool Time(const char* name, const std::vector<char>& raw, int iterations,
+          uint32_t options) {
+  fflush(stdout);
+  const pid_t pid = fork();
+  if (pid < 0) {
+    PLOG(ERROR) << "fork";
+    return false;
+  }
+  if (pid == 0) {
+    size_t num_samples = 0;
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i) {
+      const ProcessProfiles profiles =
+          RawPerfDataToProfiles(raw.data(), raw.size(), {}, kNoLabels, options);
+      num_samples = 0;
+      for (const auto& profile : profiles) {
+        num_samples += profile->data.sample_size();
+      }
+    }
+    const double ms = std::chrono::duration<double, std::milli>(
+                          std::chrono::steady_clock::now() - start)
+                          .count() /
+                      iterations;
+    printf("%-9s %8.1f ms per conversion, %6.1f MB/s, %zu profile samples\n",
+           name, ms, raw.size() / 1e3 / ms, num_samples);
+    fflush(stdout);
+    _exit(EXIT_SUCCESS);
+  }
+
+  int status;
+  struct rusage usage;
+  if (wait4(pid, &status, 0, &usage) != pid || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != EXIT_SUCCESS) {
+    LOG(ERROR) << "The " << name << " conversion failed";
+    return false;
+  }
+  printf("%-9s %8ld MB peak RSS\n", name, usage.ru_maxrss / 1024);
+  return true;
+}
+
+}  // namespace
+}  // namespace perftools
+
+int main(int argc, char* argv[]) {
+  if (argc < 2 || argc > 3) {
+    LOG(ERROR) << "Usage: " << argv[0] << " <perf data file> [<iterations>]";
+    return EXIT_FAILURE;
+  }
+  const int iterations = argc == 3 ? atoi(argv[2]) : 3;
+  if (iterations <= 0) {
+    LOG(ERROR) << "The number of iterations must be positive";
+    return EXIT_FAILURE;
+  }
+  std::vector<char> raw;
+  if (!quipper::FileToBuffer(argv[1], &raw)) {
+    LOG(ERROR) << "Could not read " << argv[1];
+    return EXIT_FAILURE;
+  }
+
+  printf("%zu bytes\n", raw.size());
+  const bool ok =
+      perftools::Time("proto", raw, iterations, perftools::kGroupByPids) &&
+      perftools::Time("columnar", raw, iterations,
+                      perftools::kGroupByPids | perftools::kColumnarSamples);
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
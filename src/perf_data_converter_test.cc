@@ -31,6 +31,7 @@
 using perftools::ProcessProfiles;
 using perftools::profiles::Location;
 using perftools::profiles::Mapping;
+using perftools::profiles::Profile;
 using quipper::PerfDataProto;
 using testing::Contains;
 using testing::Eq;
@@ -366,6 +367,546 @@ TEST_F(PerfDataConverterTest, PreservesKallsymsRelocation) {
   EXPECT_THAT(mmaps, Contains(want_mmap_name));
 }
 
+TEST_F(PerfDataConverterTest, ColumnarSamplesMatchProtoSamples) {
+  for (const char* filename :
+       {"single-event-multi-process.perf.data", "with-callchain.perf.data"}) {
+    std::string path = GetResource(filename);
+    std::string raw_perf_data = GetContents(path);
+    ASSERT_FALSE(raw_perf_data.empty()) << path;
+
+    const ProcessProfiles want = RawPerfDataToProfiles(
+        reinterpret_cast<const void*>(raw_perf_data.c_str()),
+        raw_perf_data.size(), {}, kNoLabels, kGroupByPids);
+    const ProcessProfiles got = RawPerfDataToProfiles(
+        reinterpret_cast<const void*>(raw_perf_data.c_str()),
+        raw_perf_data.size(), {}, kNoLabels, kGroupByPids | kColumnarSamples);
+    ASSERT_EQ(want.size(), got.size()) << path;
+    for (size_t i = 0; i < want.size(); ++i) {
+      EXPECT_EQ(want[i]->pid, got[i]->pid) << path;
+      EXPECT_EQ(want[i]->data.SerializeAsString(),
+                got[i]->data.SerializeAsString())
+          << path;
+    }
+  }
+}
+
+TEST_F(PerfDataConverterTest, ArenaProfilesMatchHeapProfiles) {
+  std::string path = GetResource("with-callchain.perf.data");
+  std::string raw_perf_data = GetContents(path);
+  ASSERT_FALSE(raw_perf_data.empty()) << path;
+
+  const ProcessProfiles want = RawPerfDataToProfiles(
+      reinterpret_cast<const void*>(raw_perf_data.c_str()),
+      raw_perf_data.size(), {}, kNoLabels, kGroupByPids);
+  ProcessProfiles got = RawPerfDataToProfiles(
+      reinterpret_cast<const void*>(raw_perf_data.c_str()),
+      raw_perf_data.size(), {}, kNoLabels, kGroupByPids | kArenaProfiles);
+  ASSERT_EQ(want.size(), got.size());
+  for (size_t i = 0; i < want.size(); ++i) {
+    ASSERT_NE(nullptr, got[i]->arena_data);
+    EXPECT_EQ(got[i]->arena.get(), got[i]->arena_data->GetArena());
+    EXPECT_EQ(&got[i]->profile(), got[i]->arena_data);
+    EXPECT_EQ(want[i]->profile().SerializeAsString(),
+              got[i]->profile().SerializeAsString());
+  }
+  // The arena outlives all but the last of the profiles.
+  const std::string last = got.back()->profile().SerializeAsString();
+  std::unique_ptr<perftools::ProcessProfile> pp = std::move(got.back());
+  got.clear();
+  EXPECT_EQ(last, pp->profile().SerializeAsString());
+}
+
+TEST_F(PerfDataConverterTest, RemappedAddressesGetNewLocations) {
+  PerfDataProto perf_data_proto;
+  perf_data_proto.add_file_attrs()->add_ids(0);
+  auto add_mmap = [&](const std::string& filename) {
+    auto* event = perf_data_proto.add_events();
+    event->mutable_header()->set_type(quipper::PERF_RECORD_MMAP);
+    auto* mmap = event->mutable_mmap_event();
+    mmap->set_filename(filename);
+    mmap->set_pid(100);
+    mmap->set_tid(100);
+    mmap->set_start(0x10000);
+    mmap->set_len(0x1000);
+  };
+  auto add_sample = [&](uint64_t ip) {
+    auto* event = perf_data_proto.add_events();
+    event->mutable_header()->set_type(quipper::PERF_RECORD_SAMPLE);
+    auto* sample = event->mutable_sample_event();
+    sample->set_ip(ip);
+    sample->set_pid(100);
+    sample->set_tid(100);
+    sample->set_period(1);
+  };
+  add_mmap("/usr/lib/libfoo.so");
+  add_sample(0x10100);
+  add_sample(0x10200);
+  add_sample(0x10100);
+  // A JIT or dlopen remapping the same range.
+  add_mmap("/usr/lib/libbar.so");
+  add_sample(0x10100);
+  add_sample(0x10100);
+
+  const ProcessProfiles pps = PerfDataProtoToProfiles(&perf_data_proto);
+  ASSERT_EQ(1u, pps.size());
+  const auto& profile = pps[0]->data;
+  ASSERT_EQ(3, profile.location_size());
+  EXPECT_EQ(0x10100u, profile.location(0).address());
+  EXPECT_EQ(0x10200u, profile.location(1).address());
+  EXPECT_EQ(0x10100u, profile.location(2).address());
+  const auto& mapping_of = [&](const Location& location) {
+    for (const auto& mapping : profile.mapping()) {
+      if (mapping.id() == location.mapping_id()) {
+        return profile.string_table(mapping.filename());
+      }
+    }
+    return std::string();
+  };
+  EXPECT_EQ("/usr/lib/libfoo.so", mapping_of(profile.location(0)));
+  EXPECT_EQ("/usr/lib/libfoo.so", mapping_of(profile.location(1)));
+  EXPECT_EQ("/usr/lib/libbar.so", mapping_of(profile.location(2)));
+
+  ASSERT_EQ(3, profile.sample_size());
+  EXPECT_EQ(2, profile.sample(0).value(0));
+  EXPECT_EQ(1, profile.sample(1).value(0));
+  EXPECT_EQ(2, profile.sample(2).value(0));
+}
+
+TEST_F(PerfDataConverterTest, AddsRequestedLabelsInOrder) {
+  PerfDataProto perf_data_proto;
+  perf_data_proto.add_file_attrs()->add_ids(0);
+  auto add_comm = [&](uint32_t tid, const std::string& comm) {
+    auto* event = perf_data_proto.add_events();
+    event->mutable_header()->set_type(quipper::PERF_RECORD_COMM);
+    auto* comm_event = event->mutable_comm_event();
+    comm_event->set_pid(100);
+    comm_event->set_tid(tid);
+    comm_event->set_comm(comm);
+  };
+  auto add_sample = [&](uint32_t tid) {
+    auto* event = perf_data_proto.add_events();
+    event->mutable_header()->set_type(quipper::PERF_RECORD_SAMPLE);
+    event->mutable_header()->set_misc(quipper::PERF_RECORD_MISC_USER);
+    auto* sample = event->mutable_sample_event();
+    sample->set_ip(0x10100);
+    sample->set_pid(100);
+    sample->set_tid(tid);
+    sample->set_cpu(2);
+    sample->set_period(1);
+  };
+  add_comm(100, "app");
+  add_comm(101, "worker");
+  auto* event = perf_data_proto.add_events();
+  event->mutable_header()->set_type(quipper::PERF_RECORD_MMAP);
+  auto* mmap = event->mutable_mmap_event();
+  mmap->set_filename("/usr/bin/app");
+  mmap->set_pid(100);
+  mmap->set_tid(100);
+  mmap->set_start(0x10000);
+  mmap->set_len(0x1000);
+  add_sample(101);
+  add_sample(101);
+  add_comm(101, "renamed");
+  add_sample(101);
+  add_sample(100);
+
+  const ProcessProfiles pps = PerfDataProtoToProfiles(
+      &perf_data_proto,
+      kPidAndTidLabels | kCommLabel | kThreadCommLabel | kCpuLabel |
+          kExecutionModeLabel | kThreadTypeLabel,
+      kGroupByPids, {{101, "worker_type"}});
+  ASSERT_EQ(1u, pps.size());
+  const auto& profile = pps[0]->data;
+  auto labels = [&](int i) {
+    std::vector<std::string> labels;
+    for (const auto& label : profile.sample(i).label()) {
+      std::string text = profile.string_table(label.key()) + "=";
+      if (label.str() != 0) {
+        text += profile.string_table(label.str());
+      } else {
+        text += std::to_string(label.num());
+      }
+      if (label.num_unit() != 0) {
+        text += " " + profile.string_table(label.num_unit());
+      }
+      labels.push_back(text);
+    }
+    return labels;
+  };
+  ASSERT_EQ(3, profile.sample_size());
+  EXPECT_EQ(2, profile.sample(0).value(0));
+  EXPECT_THAT(labels(0),
+              testing::ElementsAre("pid=100", "tid=101", "comm=app",
+                                   "execution_mode=Host User",
+                                   "thread_type=worker_type",
+                                   "thread_comm=worker", "cpu=2 cpu"));
+  EXPECT_THAT(labels(1),
+              testing::ElementsAre("pid=100", "tid=101", "comm=app",
+                                   "execution_mode=Host User",
+                                   "thread_type=worker_type",
+                                   "thread_comm=renamed", "cpu=2 cpu"));
+  EXPECT_THAT(labels(2), testing::ElementsAre("pid=100", "tid=100", "comm=app",
+                                              "execution_mode=Host User",
+                                              "thread_comm=app", "cpu=2 cpu"));
+}
+
+TEST_F(PerfDataConverterTest, AggregatesSamplesByTime) {
+  PerfDataProto perf_data_proto;
+  perf_data_proto.add_file_attrs()->add_ids(0);
+  auto* event = perf_data_proto.add_events();
+  event->mutable_header()->set_type(quipper::PERF_RECORD_MMAP);
+  auto* mmap = event->mutable_mmap_event();
+  mmap->set_filename("/usr/bin/app");
+  mmap->set_pid(100);
+  mmap->set_tid(100);
+  mmap->set_start(0x10000);
+  mmap->set_len(0x1000);
+  // Samples in the buckets starting at 1000 and 2000, and one without a time.
+  for (uint64_t time_ns : {1100, 1900, 2500, 0}) {
+    event = perf_data_proto.add_events();
+    event->mutable_header()->set_type(quipper::PERF_RECORD_SAMPLE);
+    auto* sample = event->mutable_sample_event();
+    sample->set_ip(0x10100);
+    sample->set_pid(100);
+    sample->set_tid(100);
+    sample->set_period(1);
+    if (time_ns != 0) {
+      sample->set_sample_time_ns(time_ns);
+    }
+  }
+  ConversionParams params;
+  params.time_bucket_ns = 1000;
+
+  ProcessProfiles pps = PerfDataProtoToProfiles(
+      &perf_data_proto, kTimeBucketLabel, kGroupByPids, {}, params);
+  ASSERT_EQ(1u, pps.size());
+  const auto& profile = pps[0]->data;
+  ASSERT_EQ(3, profile.sample_size());
+  const std::vector<std::pair<int64_t, int64_t>> want_buckets = {
+      {1000, 2}, {2000, 1}};
+  for (int i = 0; i < 2; ++i) {
+    const auto& sample = profile.sample(i);
+    ASSERT_EQ(1, sample.label_size());
+    EXPECT_EQ(TimeBucketNsLabelKey,
+              profile.string_table(sample.label(0).key()));
+    EXPECT_EQ(want_buckets[i].first, sample.label(0).num());
+    EXPECT_EQ(want_buckets[i].second, sample.value(0));
+  }
+  EXPECT_EQ(0, profile.sample(2).label_size());
+
+  pps = PerfDataProtoToProfiles(&perf_data_proto, kNoLabels,
+                                kGroupByPids | kGroupByTimeWindows, {},
+                                params);
+  ASSERT_EQ(3u, pps.size());
+  const std::vector<int64_t> want_window_starts = {1000, 2000, 0};
+  const std::vector<int64_t> want_values = {2, 1, 1};
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_EQ(100u, pps[i]->pid);
+    EXPECT_EQ(want_window_starts[i], pps[i]->time_window_start_ns);
+    const auto& window = pps[i]->data;
+    ASSERT_EQ(1, window.sample_size());
+    EXPECT_EQ(want_values[i], window.sample(0).value(0));
+    ASSERT_EQ(1, window.location_size());
+    EXPECT_EQ(0x10100u, window.location(0).address());
+    // Only the IPs of the window's own samples are counted.
+    int64_t num_ips = 0;
+    for (const auto& stat : pps[i]->build_id_stats) {
+      num_ips += stat.second;
+    }
+    EXPECT_EQ(want_values[i], num_ips);
+  }
+
+  // Empty buckets are rejected rather than divided by.
+  params.time_bucket_ns = 0;
+  EXPECT_THAT(PerfDataProtoToProfiles(&perf_data_proto, kNoLabels,
+                                      kGroupByPids | kGroupByTimeWindows, {},
+                                      params),
+              IsEmpty());
+  EXPECT_THAT(PerfDataProtoToProfiles(&perf_data_proto, kTimeBucketLabel,
+                                      kGroupByPids, {}, params),
+              IsEmpty());
+  EXPECT_EQ(1u, PerfDataProtoToProfiles(&perf_data_proto, kNoLabels,
+                                        kGroupByPids, {}, params)
+                    .size());
+}
+
+TEST_F(PerfDataConverterTest, DownsamplesDeterministically) {
+  PerfDataProto perf_data_proto;
+  perf_data_proto.add_file_attrs()->add_ids(0);
+  auto* event = perf_data_proto.add_events();
+  event->mutable_header()->set_type(quipper::PERF_RECORD_MMAP);
+  auto* mmap = event->mutable_mmap_event();
+  mmap->set_filename("/usr/bin/app");
+  mmap->set_pid(100);
+  mmap->set_tid(100);
+  mmap->set_start(0x10000);
+  mmap->set_len(0x1000);
+  const int kNumSamples = 10000;
+  for (int i = 0; i < kNumSamples; ++i) {
+    event = perf_data_proto.add_events();
+    event->mutable_header()->set_type(quipper::PERF_RECORD_SAMPLE);
+    auto* sample = event->mutable_sample_event();
+    sample->set_ip(0x10000 + i % 0x1000);
+    sample->set_pid(100);
+    sample->set_tid(100);
+    sample->set_period(3);
+    sample->set_sample_time_ns(1000 + i);
+  }
+  // Each sample has its own timestamp label, so that the kept ones can be
+  // told apart.
+  auto convert = [&](const ConversionParams& params) {
+    ProcessProfiles pps = PerfDataProtoToProfiles(
+        &perf_data_proto, kTimestampNsLabel, kGroupByPids, {}, params);
+    EXPECT_EQ(1u, pps.size());
+    return std::move(pps[0]->data);
+  };
+  ConversionParams params;
+  params.sample_rate = 0.1;
+  const Profile downsampled = convert(params);
+  EXPECT_GT(downsampled.sample_size(), kNumSamples / 10 * 0.9);
+  EXPECT_LT(downsampled.sample_size(), kNumSamples / 10 * 1.1);
+  int64_t count = 0;
+  int64_t weight = 0;
+  for (const auto& sample : downsampled.sample()) {
+    EXPECT_EQ(10, sample.value(0));
+    count += sample.value(0);
+    weight += sample.value(1);
+  }
+  EXPECT_NEAR(kNumSamples, count, kNumSamples * 0.1);
+  EXPECT_NEAR(3 * kNumSamples, weight, 3 * kNumSamples * 0.1);
+
+  EXPECT_EQ(downsampled.SerializeAsString(),
+            convert(params).SerializeAsString());
+  params.sample_seed = 1;
+  EXPECT_NE(downsampled.SerializeAsString(),
+            convert(params).SerializeAsString());
+
+  ConversionParams target_params;
+  target_params.target_samples = kNumSamples / 10;
+  EXPECT_EQ(downsampled.SerializeAsString(),
+            convert(target_params).SerializeAsString());
+  target_params.target_samples = 2 * kNumSamples;
+  EXPECT_EQ(kNumSamples, convert(target_params).sample_size());
+}
+
+TEST_F(PerfDataConverterTest, TruncatesAndPrunesStacks) {
+  PerfDataProto perf_data_proto;
+  perf_data_proto.add_file_attrs()->add_ids(0);
+  auto* event = perf_data_proto.add_events();
+  event->mutable_header()->set_type(quipper::PERF_RECORD_MMAP);
+  auto* mmap = event->mutable_mmap_event();
+  mmap->set_filename("/usr/bin/app");
+  mmap->set_pid(100);
+  mmap->set_tid(100);
+  mmap->set_start(0x10000);
+  mmap->set_len(0x1000);
+  // Adds a sample at |ip| called from the root at 0x10800 through |depth|
+  // more frames.
+  auto add_sample = [&](uint64_t ip, int depth) {
+    event = perf_data_proto.add_events();
+    event->mutable_header()->set_type(quipper::PERF_RECORD_SAMPLE);
+    auto* sample = event->mutable_sample_event();
+    sample->set_ip(ip);
+    sample->set_pid(100);
+    sample->set_tid(100);
+    sample->set_period(1);
+    sample->add_callchain(ip);
+    for (int i = 0; i < depth; ++i) {
+      sample->add_callchain(0x10400 + i);
+    }
+    sample->add_callchain(0x10801);
+  };
+  auto function_name = [](const Profile& profile, uint64_t location_id) {
+    const auto& location = profile.location(location_id - 1);
+    if (location.line_size() != 1) return std::string();
+    const auto& function =
+        profile.function(location.line(0).function_id() - 1);
+    return profile.string_table(function.name());
+  };
+
+  add_sample(0x10100, 10);
+  ConversionParams params;
+  params.max_stack_depth = 4;
+  ProcessProfiles pps = PerfDataProtoToProfiles(&perf_data_proto, kNoLabels,
+                                                kGroupByPids, {}, params);
+  ASSERT_EQ(1u, pps.size());
+  {
+    const auto& profile = pps[0]->data;
+    ASSERT_EQ(1, profile.sample_size());
+    const auto& sample = profile.sample(0);
+    ASSERT_EQ(5, sample.location_id_size());
+    EXPECT_EQ(0x10100u, profile.location(sample.location_id(0) - 1).address());
+    EXPECT_EQ(0x103ffu, profile.location(sample.location_id(1) - 1).address());
+    EXPECT_EQ(TruncatedStackFunctionName,
+              function_name(profile, sample.location_id(4)));
+    EXPECT_EQ(0u, profile.location(sample.location_id(4) - 1).mapping_id());
+  }
+
+  perf_data_proto.mutable_events()->DeleteSubrange(1, 1);
+  for (int i = 0; i < 5; ++i) add_sample(0x10100, 0);
+  for (int i = 0; i < 3; ++i) add_sample(0x10200, 0);
+  for (uint64_t ip : {0x10300, 0x10301, 0x10302, 0x10303}) {
+    add_sample(ip, 0);
+  }
+  params = ConversionParams();
+  params.max_samples = 2;
+  pps = PerfDataProtoToProfiles(&perf_data_proto, kNoLabels, kGroupByPids, {},
+                                params);
+  ASSERT_EQ(1u, pps.size());
+  const auto& profile = pps[0]->data;
+  ASSERT_EQ(3, profile.sample_size());
+  EXPECT_EQ(5, profile.sample(0).value(0));
+  EXPECT_EQ(3, profile.sample(1).value(0));
+  const auto& pruned = profile.sample(2);
+  EXPECT_EQ(4, pruned.value(0));
+  EXPECT_EQ(4, pruned.value(1));
+  ASSERT_EQ(2, pruned.location_id_size());
+  EXPECT_EQ(PrunedStackFunctionName,
+            function_name(profile, pruned.location_id(0)));
+  EXPECT_EQ(0x10800u, profile.location(pruned.location_id(1) - 1).address());
+}
+
+TEST_F(PerfDataConverterTest, PrunesSamplesWithUniqueTimestamps) {
+  PerfDataProto perf_data_proto;
+  perf_data_proto.add_file_attrs()->add_ids(0);
+  auto* event = perf_data_proto.add_events();
+  event->mutable_header()->set_type(quipper::PERF_RECORD_MMAP);
+  auto* mmap = event->mutable_mmap_event();
+  mmap->set_filename("/usr/bin/app");
+  mmap->set_pid(100);
+  mmap->set_tid(100);
+  mmap->set_start(0x10000);
+  mmap->set_len(0x1000);
+  // Each sample is at a time of its own, with one of two roots.
+  const int kNumSamples = 1000;
+  for (int i = 0; i < kNumSamples; ++i) {
+    event = perf_data_proto.add_events();
+    event->mutable_header()->set_type(quipper::PERF_RECORD_SAMPLE);
+    auto* sample = event->mutable_sample_event();
+    sample->set_ip(0x10100 + i % 16);
+    sample->set_pid(100);
+    sample->set_tid(100);
+    sample->set_period(1);
+    sample->set_sample_time_ns(1000 + i);
+    sample->add_callchain(sample->ip());
+    sample->add_callchain(i % 2 ? 0x10801 : 0x10901);
+  }
+
+  ConversionParams params;
+  params.max_samples = 10;
+  const ProcessProfiles pps = PerfDataProtoToProfiles(
+      &perf_data_proto, kTimestampNsLabel, kGroupByPids, {}, params);
+  ASSERT_EQ(1u, pps.size());
+  const auto& profile = pps[0]->data;
+  // The map shrinks at each pruning, to the heaviest samples and one folded
+  // sample per root.
+  EXPECT_LT(profile.sample_size(), 2 * 10);
+  int64_t total = 0;
+  int num_pruned = 0;
+  for (const auto& sample : profile.sample()) {
+    total += sample.value(0);
+    const auto& leaf = profile.location(sample.location_id(0) - 1);
+    if (leaf.line_size() == 0) continue;
+    const auto& function = profile.function(leaf.line(0).function_id() - 1);
+    if (profile.string_table(function.name()) != PrunedStackFunctionName) {
+      EXPECT_EQ(1, sample.label_size());
+      continue;
+    }
+    ++num_pruned;
+    EXPECT_EQ(0, sample.label_size());
+  }
+  EXPECT_EQ(2, num_pruned);
+  EXPECT_EQ(kNumSamples, total);
+}
+
+TEST_F(PerfDataConverterTest, GroupsSamplesByKeys) {
+  PerfDataProto perf_data_proto;
+  perf_data_proto.add_file_attrs()->add_ids(0);
+  for (uint32_t pid : {100, 200}) {
+    auto* event = perf_data_proto.add_events();
+    event->mutable_header()->set_type(quipper::PERF_RECORD_COMM);
+    auto* comm = event->mutable_comm_event();
+    comm->set_pid(pid);
+    comm->set_tid(pid);
+    comm->set_comm(pid == 100 ? "app" : "db");
+    event = perf_data_proto.add_events();
+    event->mutable_header()->set_type(quipper::PERF_RECORD_MMAP);
+    auto* mmap = event->mutable_mmap_event();
+    mmap->set_filename(pid == 100 ? "/usr/bin/app" : "/usr/bin/db");
+    mmap->set_pid(pid);
+    mmap->set_tid(pid);
+    mmap->set_start(0x10000);
+    mmap->set_len(0x1000);
+  }
+  auto add_sample = [&](uint32_t pid, uint32_t tid, uint32_t cpu) {
+    auto* event = perf_data_proto.add_events();
+    event->mutable_header()->set_type(quipper::PERF_RECORD_SAMPLE);
+    auto* sample = event->mutable_sample_event();
+    sample->set_ip(0x10100);
+    sample->set_pid(pid);
+    sample->set_tid(tid);
+    sample->set_cpu(cpu);
+    sample->set_period(1);
+  };
+  add_sample(100, 100, 1);
+  add_sample(100, 101, 2);
+  add_sample(200, 200, 1);
+  add_sample(100, 101, 1);
+
+  auto groups = [](const ProcessProfiles& pps) {
+    std::vector<std::pair<std::string, int64_t>> groups;
+    for (const auto& pp : pps) {
+      int64_t total = 0;
+      for (const auto& sample : pp->data.sample()) {
+        total += sample.value(0);
+      }
+      groups.emplace_back(pp->group, total);
+    }
+    return groups;
+  };
+  using Groups = std::vector<std::pair<std::string, int64_t>>;
+  EXPECT_EQ((Groups{{"1", 3}, {"2", 1}}),
+            groups(PerfDataProtoToProfiles(&perf_data_proto, kNoLabels,
+                                           kGroupByCpu)));
+  EXPECT_EQ((Groups{{"1;app", 2}, {"2;app", 1}, {"1;db", 1}}),
+            groups(PerfDataProtoToProfiles(&perf_data_proto, kNoLabels,
+                                           kGroupByCpu | kGroupByComm)));
+
+  ConversionParams params;
+  params.group_key = [](const PerfDataHandler::SampleContext& sample) {
+    return sample.sample.tid() % 2 == 0 ? std::string("even")
+                                        : std::string("odd");
+  };
+  const ProcessProfiles pps = PerfDataProtoToProfiles(
+      &perf_data_proto, kNoLabels, kGroupByPids, {}, params);
+  EXPECT_EQ((Groups{{"even", 1}, {"odd", 2}, {"even", 1}}), groups(pps));
+  EXPECT_EQ(100u, pps[1]->pid);
+  EXPECT_EQ(200u, pps[2]->pid);
+  // Each group counts the build ID sources of its own samples.
+  for (const auto& pp : pps) {
+    int64_t num_ips = 0;
+    for (const auto& stat : pp->build_id_stats) {
+      num_ips += stat.second;
+    }
+    int64_t num_samples = 0;
+    for (const auto& sample : pp->data.sample()) {
+      num_samples += sample.value(0);
+    }
+    EXPECT_EQ(num_samples, num_ips) << pp->group;
+  }
+
+  // Parts are not told apart by the ';' that joins the names: a command
+  // "app;x" with the key "y" is not in the group of "app" with "x;y".
+  perf_data_proto.mutable_events(0)->mutable_comm_event()->set_comm("app;x");
+  perf_data_proto.mutable_events(2)->mutable_comm_event()->set_comm("app");
+  params.group_key = [](const PerfDataHandler::SampleContext& sample) {
+    return sample.sample.pid() == 100 ? std::string("y") : std::string("x;y");
+  };
+  EXPECT_EQ((Groups{{"app;x;y", 3}, {"app;x;y", 1}}),
+            groups(PerfDataProtoToProfiles(&perf_data_proto, kNoLabels,
+                                           kGroupByComm, {}, params)));
+}
+
 TEST_F(PerfDataConverterTest, HandlesDataAddresses) {
   struct TestCase {
     std::string desc;
@@ -1086,6 +1627,58 @@ TEST_F(PerfDataConverterTest, HandlesAlternateKernelNames) {
   }
 }
 
+TEST_F(PerfDataConverterTest, RejectsMostlyUnmappedSamples) {
+  // Returns the raw perf.data of a process with one mmap, |num_mapped|
+  // samples in it and |num_unmapped| samples outside of any mapping.
+  const auto raw_perf_data = [](int num_mapped, int num_unmapped) {
+    PerfDataProto perf_data_proto;
+    perf_data_proto.add_metadata_mask(0);
+    auto* file_attr = perf_data_proto.add_file_attrs();
+    file_attr->add_ids(0);
+    auto* attr = file_attr->mutable_attr();
+    attr->set_type(quipper::PERF_TYPE_HARDWARE);
+    attr->set_size(sizeof(quipper::perf_event_attr));
+    attr->set_sample_type(quipper::PERF_SAMPLE_IP | quipper::PERF_SAMPLE_TID |
+                          quipper::PERF_SAMPLE_PERIOD);
+    perf_data_proto.add_event_types()->set_name("cycles");
+    auto* mmap_event = perf_data_proto.add_events();
+    mmap_event->mutable_header()->set_type(quipper::PERF_RECORD_MMAP);
+    auto* mmap = mmap_event->mutable_mmap_event();
+    mmap->set_filename("/usr/bin/foo");
+    mmap->set_pid(100);
+    mmap->set_tid(100);
+    mmap->set_start(0x10000);
+    mmap->set_len(0x1000);
+    for (int i = 0; i < num_mapped + num_unmapped; ++i) {
+      auto* event = perf_data_proto.add_events();
+      event->mutable_header()->set_type(quipper::PERF_RECORD_SAMPLE);
+      auto* sample = event->mutable_sample_event();
+      sample->set_ip(i < num_mapped ? 0x10100 : 0x90100);
+      sample->set_pid(100);
+      sample->set_tid(100);
+      sample->set_period(1);
+    }
+    std::string str;
+    quipper::PerfReader reader;
+    EXPECT_TRUE(reader.Deserialize(perf_data_proto));
+    EXPECT_TRUE(reader.WriteToString(&str));
+    return str;
+  };
+
+  // quipper::PerfParserOptions requires 95% of the samples to be mapped.
+  for (uint32_t options :
+       {uint32_t{kGroupByPids}, uint32_t{kGroupByPids | kColumnarSamples}}) {
+    const std::string mapped = raw_perf_data(19, 1);
+    EXPECT_EQ(1, RawPerfDataToProfiles(mapped.data(), mapped.size(), {},
+                                       kNoLabels, options)
+                     .size());
+    const std::string unmapped = raw_perf_data(2, 18);
+    EXPECT_THAT(RawPerfDataToProfiles(unmapped.data(), unmapped.size(), {},
+                                      kNoLabels, options),
+                IsEmpty());
+  }
+}
+
 TEST_F(PerfDataConverterTest, BuildIdFromMmapEvents) {
   std::string ascii_pb(
       GetContents(GetResource("perf-buildid-mmap-events.textproto")));
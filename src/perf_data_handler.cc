@@ -22,8 +22,10 @@
 #include "src/intervalmap.h"
 #include "src/path_matching.h"
 #include "src/quipper/binary_data_utils.h"
+#include "src/quipper/columnar_sample_store.h"
 #include "src/quipper/dso.h"
 #include "src/quipper/kernel/perf_event.h"
+#include "src/quipper/perf_proto_stream.h"
 #include "src/quipper/perf_reader.h"
 
 using quipper::PerfDataProto;
@@ -50,13 +52,57 @@ bool HasSuffixString(const std::string& s, const char* substr) {
          s.compare(s_len - substr_len, substr_len, substr) == 0;
 }
 
+// The branch stack of a row of a ColumnarSampleStore.
+struct ColumnarBranchStack {
+  size_t size() const { return num_entries; }
+  const quipper::ColumnarSampleStore::BranchEntry& operator[](size_t i) const {
+    return entries[i];
+  }
+
+  const quipper::ColumnarSampleStore::BranchEntry* entries;
+  size_t num_entries;
+};
+
+// Sets the ips and the flags of |pair| from |entry|.
+void SetBranchStackPair(const quipper::PerfDataProto::BranchStackEntry& entry,
+                        PerfDataHandler::BranchStackPair* pair) {
+  pair->from.ip = entry.from_ip();
+  pair->to.ip = entry.to_ip();
+  pair->mispredicted = entry.mispredicted();
+  pair->predicted = entry.predicted();
+  pair->in_transaction = entry.in_transaction();
+  pair->abort = entry.abort();
+  pair->cycles = entry.cycles();
+  pair->spec = entry.spec();
+}
+
+void SetBranchStackPair(const quipper::ColumnarSampleStore::BranchEntry& entry,
+                        PerfDataHandler::BranchStackPair* pair) {
+  using BranchEntry = quipper::ColumnarSampleStore::BranchEntry;
+  pair->from.ip = entry.from_ip;
+  pair->to.ip = entry.to_ip;
+  pair->mispredicted = entry.flags & BranchEntry::kMispredicted;
+  pair->predicted = entry.flags & BranchEntry::kPredicted;
+  pair->in_transaction = entry.flags & BranchEntry::kInTransaction;
+  pair->abort = entry.flags & BranchEntry::kAbort;
+  pair->cycles = entry.cycles;
+  pair->spec = entry.spec;
+}
+
 // Normalizer processes a PerfDataProto and maintains tables to the
 // current metadata for each process.  It drives callbacks to
 // PerfDataHandler with samples in a fully normalized form.
 class Normalizer {
  public:
-  Normalizer(const PerfDataProto& perf_proto, PerfDataHandler* handler)
-      : perf_proto_(perf_proto), handler_(handler) {
+  // |samples|, if not null, holds sample events to be handled along with the
+  // events of |perf_proto|.
+  Normalizer(const PerfDataProto& perf_proto,
+             const quipper::ColumnarSampleStore* samples,
+             PerfDataHandler* handler)
+      : perf_proto_(perf_proto), samples_(samples), handler_(handler) {
+    if (samples_ != nullptr) {
+      sample_merger_.reset(new quipper::ColumnarSampleStore::Merger(*samples_));
+    }
     for (const auto& build_id : perf_proto_.build_ids()) {
       const std::string& bytes = build_id.build_id_hash();
       std::stringstream hex;
@@ -128,6 +174,15 @@ class Normalizer {
       LOG(WARNING) << "Invalid perf version: " << perf_version;
     }
 
+    // Perf keeps the tracking bits (e.g. comm_exec) in only one of the events'
+    // file_attrs.
+    for (const auto& fa : perf_proto_.file_attrs()) {
+      if (fa.attr().comm_exec()) {
+        has_comm_exec_support_ = true;
+        break;
+      }
+    }
+
     uint64_t current_event_index = 0;
     for (const auto& attr : perf_proto_.file_attrs()) {
       for (uint64_t id : attr.ids()) {
@@ -145,6 +200,15 @@ class Normalizer {
   // Convert to a protobuf using quipper and then aggregate the results.
   void Normalize();
 
+  // Like Normalize(), but handles the events of the batches read from
+  // |reader| instead of those of |perf_proto_|, which holds the stream's
+  // header. Returns false if the stream could not be read to its end.
+  bool NormalizeStream(quipper::PerfDataProtoStreamReader* reader);
+
+  const PerfDataHandler::SampleStats& sample_stats() const {
+    return sample_stats_;
+  }
+
  private:
   // Using a 32-bit type for the PID values as the max PID value on 64-bit
   // systems is 2^22, see http://man7.org/linux/man-pages/man5/proc.5.html.
@@ -165,9 +229,28 @@ class Normalizer {
   void UpdateMapsWithForkEvent(const quipper::PerfDataProto_ForkEvent& fork);
   void LogStats();
 
-  // Normalize the sample_event in event_proto and call handler_->Sample
+  // Updates the tables with |event_proto| and calls the handler for it.
+  void HandleEvent(const quipper::PerfDataProto::PerfEvent& event_proto);
+
+  // Calls HandleSample for the rows of |samples_| that precede
+  // |event_proto|, the next event of |perf_proto_|, or for all remaining rows
+  // if |event_proto| is null.
+  void InvokeHandleColumnarSamples(
+      const quipper::PerfDataProto::PerfEvent* event_proto);
+
+  // Calls HandleSample for the sample_event in event_proto.
   void InvokeHandleSample(const quipper::PerfDataProto::PerfEvent& event_proto);
 
+  // Normalize the sample with the header |header|, the fields |sample|, the
+  // callchain of |callchain_size| ips at |callchain| and the branch stack
+  // |branch_stack|, and call handler_->Sample. The entries of |branch_stack|
+  // are read with SetBranchStackPair().
+  template <typename BranchStack>
+  void HandleSample(const quipper::PerfDataProto::EventHeader& header,
+                    const PerfDataHandler::SampleFields& sample,
+                    const uint64_t* callchain, size_t callchain_size,
+                    const BranchStack& branch_stack);
+
   // Handles the perf LOST event or LOST_SAMPLE event.
   void HandleLost(const quipper::PerfDataProto::PerfEvent& event_proto);
 
@@ -199,11 +282,19 @@ class Normalizer {
   // Returns the event index corresponding to the id for this sample, or
   // -1 for an error.
   int64_t GetEventIndexForSample(
-      const quipper::PerfDataProto_SampleEvent& sample) const;
+      const PerfDataHandler::SampleFields& sample) const;
 
   const quipper::PerfDataProto& perf_proto_;
+  const quipper::ColumnarSampleStore* samples_;  // unowned, may be null.
   PerfDataHandler* handler_;  // unowned.
 
+  // Places the rows of |samples_| among the events, if |samples_| is set.
+  std::unique_ptr<quipper::ColumnarSampleStore::Merger> sample_merger_;
+  // The next row of |samples_| to be handled.
+  size_t next_sample_row_ = 0;
+  // The header of the row being handled, reused for all rows.
+  quipper::PerfDataProto::EventHeader columnar_header_;
+
   // Mapping we have allocated.
   std::vector<std::unique_ptr<PerfDataHandler::Mapping>> owned_mappings_;
   std::vector<std::unique_ptr<quipper::PerfDataProto_MMapEvent>>
@@ -240,6 +331,12 @@ class Normalizer {
   // pid_to_comm_event maps a pid to the corresponding comm event.
   PidToCommMap pid_to_comm_event_;
 
+  // Whether the comm events in |pid_to_comm_event_| are copied into
+  // |owned_comm_events_|, for when the events do not outlive the normalizer.
+  bool copy_comm_events_ = false;
+  std::vector<std::unique_ptr<quipper::PerfDataProto_CommEvent>>
+      owned_comm_events_;
+
   // pid_to_mmaps maps a pid to all mmap events that correspond to that pid.
   std::unordered_map<uint32_t, std::unique_ptr<MMapIntervalMap>> pid_to_mmaps_;
 
@@ -273,6 +370,9 @@ class Normalizer {
   // older perf data.
   bool use_lost_sample_ = false;
 
+  // Whether the kernel marks the comm events that are due to exec().
+  bool has_comm_exec_support_ = false;
+
   struct {
     int64_t samples = 0;
     int64_t samples_with_addr = 0;
@@ -289,6 +389,8 @@ class Normalizer {
 
     int64_t no_event_errors = 0;
   } stat_;
+
+  PerfDataHandler::SampleStats sample_stats_;
 };
 
 void Normalizer::UpdateMapsWithForkEvent(
@@ -316,101 +418,173 @@ static constexpr char kLostMappingFilename[] = "[lost]";
 static const uint64_t kLostMd5Prefix = quipper::Md5Prefix(kLostMappingFilename);
 
 void Normalizer::Normalize() {
-  // Perf keeps the tracking bits (e.g. comm_exec) in only one of the events'
-  // file_attrs.
-  bool has_comm_exec_support = false;
-  for (const auto& fa : perf_proto_.file_attrs()) {
-    if (fa.attr().comm_exec()) {
-      has_comm_exec_support = true;
-      break;
+  for (int i = 0; i < perf_proto_.events_size(); ++i) {
+    const auto& event_proto = perf_proto_.events(i);
+    if (samples_ != nullptr) InvokeHandleColumnarSamples(&event_proto);
+    HandleEvent(event_proto);
+  }
+  if (samples_ != nullptr) InvokeHandleColumnarSamples(nullptr);
+
+  LogStats();
+}
+
+bool Normalizer::NormalizeStream(quipper::PerfDataProtoStreamReader* reader) {
+  // The events of a batch are gone once the next one is read.
+  copy_comm_events_ = true;
+  quipper::PerfDataProto batch;
+  while (reader->ReadEventBatch(&batch)) {
+    for (const auto& event_proto : batch.events()) {
+      HandleEvent(event_proto);
     }
   }
-  for (const auto& event_proto : perf_proto_.events()) {
-    if (event_proto.has_mmap_event()) {
-      UpdateMapsWithMMapEvent(&event_proto.mmap_event());
-      pid_had_any_mmap_.insert(event_proto.mmap_event().pid());
-    } else if (event_proto.has_comm_event()) {
-      PerfDataHandler::CommContext comm_context;
-      if (event_proto.comm_event().pid() == event_proto.comm_event().tid()) {
-        if (!has_comm_exec_support ||
-            event_proto.header().misc() & quipper::PERF_RECORD_MISC_COMM_EXEC ||
-            pid_had_any_mmap_.find(event_proto.comm_event().pid()) ==
-                pid_had_any_mmap_.end()) {
-          // Based on the perf data collected, comm events (with pid == tid) can
-          // be generated (1) on exec() or (2) when the main thread name is set
-          // after exec (generating another COMM EVENT, e.g. using PR_SET_NAME
-          // http://man7.org/linux/man-pages/man2/prctl.2.html).
-          // We want to identify if a comm event (with pid == tid) is due to
-          // exec() (the first case) and erase the pid to executable mapping in
-          // |pid_to_executable_mmap_| if so.
-          // One way to know that comm event is due to exec() is to check if the
-          // misc bit is set to PERF_RECORD_MISC_COMM_EXEC. However, this misc
-          // bit is only set in newer kernels (>= 3.16) and for execs that
-          // happen after perf collection start. Thus, we need to have some
-          // heuristics to cover other cases and identify possible comm events
-          // that happen due to exec().
-          // Another way is to find the contrary scenario for the second case.
-          // Commonly found patterns of comm events on setting the main thread
-          // name can look like this: FORK EVENT -> COMM EVENT (on exec()) ->
-          // MMAP EVENTs -> SAMPLE EVENTs -> COMM EVENT (on setting main thread
-          // name) -> SAMPLE EVENTs ... Thus, if a mmap event is already found
-          // for a pid before a comm event, this comm event is due to setting
-          // the main thread name. Vice versa, if the mmap event is not yet
-          // found for the pid, it is very likely this comm event happens due
-          // to exec() and |pid_to_executable_mmap_| should be erased.
-          // Also note that for older kernels (< 3.16), where the comm_exec
-          // in perf file attribute is not set, we will erase the mapping in
-          // |pid_to_executable_mmap_| at the occurrence of a comm event.
-          // Thus we have the following heuristics:
-          // The pid to executable mapping in |pid_to_executable_mmap_| is
-          // erased when either one of the following is true (1) comm_exec in
-          // perf file attribute is not set (kernel < 3.16) (2) comm_event's
-          // PERF_RECORD_MISC_COMM_EXEC misc bit is set in header, meaning an
-          // exec() happened, (3) no mmap event for this pid has been found,
-          // meaning this is the first comm event after an exec().
-          pid_to_executable_mmap_.erase(event_proto.comm_event().pid());
-          // is_exec is true if the comm event happened due to exec(), this flag
-          // is passed to perf_data_converter and used to modify PerPidInfo.
-          comm_context.is_exec = true;
-        }
-        pid_to_comm_event_[event_proto.comm_event().pid()] =
-            &event_proto.comm_event();
+
+  LogStats();
+  return reader->at_end();
+}
+
+void Normalizer::HandleEvent(
+    const quipper::PerfDataProto::PerfEvent& event_proto) {
+  if (event_proto.has_mmap_event()) {
+    UpdateMapsWithMMapEvent(&event_proto.mmap_event());
+    pid_had_any_mmap_.insert(event_proto.mmap_event().pid());
+  } else if (event_proto.has_comm_event()) {
+    PerfDataHandler::CommContext comm_context;
+    if (event_proto.comm_event().pid() == event_proto.comm_event().tid()) {
+      if (!has_comm_exec_support_ ||
+          event_proto.header().misc() & quipper::PERF_RECORD_MISC_COMM_EXEC ||
+          pid_had_any_mmap_.find(event_proto.comm_event().pid()) ==
+              pid_had_any_mmap_.end()) {
+        // Based on the perf data collected, comm events (with pid == tid) can
+        // be generated (1) on exec() or (2) when the main thread name is set
+        // after exec (generating another COMM EVENT, e.g. using PR_SET_NAME
+        // http://man7.org/linux/man-pages/man2/prctl.2.html).
+        // We want to identify if a comm event (with pid == tid) is due to
+        // exec() (the first case) and erase the pid to executable mapping in
+        // |pid_to_executable_mmap_| if so.
+        // One way to know that comm event is due to exec() is to check if the
+        // misc bit is set to PERF_RECORD_MISC_COMM_EXEC. However, this misc
+        // bit is only set in newer kernels (>= 3.16) and for execs that
+        // happen after perf collection start. Thus, we need to have some
+        // heuristics to cover other cases and identify possible comm events
+        // that happen due to exec().
+        // Another way is to find the contrary scenario for the second case.
+        // Commonly found patterns of comm events on setting the main thread
+        // name can look like this: FORK EVENT -> COMM EVENT (on exec()) ->
+        // MMAP EVENTs -> SAMPLE EVENTs -> COMM EVENT (on setting main thread
+        // name) -> SAMPLE EVENTs ... Thus, if a mmap event is already found
+        // for a pid before a comm event, this comm event is due to setting
+        // the main thread name. Vice versa, if the mmap event is not yet
+        // found for the pid, it is very likely this comm event happens due
+        // to exec() and |pid_to_executable_mmap_| should be erased.
+        // Also note that for older kernels (< 3.16), where the comm_exec
+        // in perf file attribute is not set, we will erase the mapping in
+        // |pid_to_executable_mmap_| at the occurrence of a comm event.
+        // Thus we have the following heuristics:
+        // The pid to executable mapping in |pid_to_executable_mmap_| is
+        // erased when either one of the following is true (1) comm_exec in
+        // perf file attribute is not set (kernel < 3.16) (2) comm_event's
+        // PERF_RECORD_MISC_COMM_EXEC misc bit is set in header, meaning an
+        // exec() happened, (3) no mmap event for this pid has been found,
+        // meaning this is the first comm event after an exec().
+        pid_to_executable_mmap_.erase(event_proto.comm_event().pid());
+        // is_exec is true if the comm event happened due to exec(), this flag
+        // is passed to perf_data_converter and used to modify PerPidInfo.
+        comm_context.is_exec = true;
       }
-      comm_context.comm = &event_proto.comm_event();
-      handler_->Comm(comm_context);
-    } else if (event_proto.has_fork_event()) {
-      UpdateMapsWithForkEvent(event_proto.fork_event());
-    } else if (event_proto.has_cgroup_event()) {
-      const auto& cgroup = event_proto.cgroup_event();
-      cgroup_map_.insert({cgroup.id(), cgroup.path()});
-    } else if (event_proto.has_lost_samples_event() ||
-               event_proto.has_lost_event()) {
-      HandleLost(event_proto);
-    } else if (event_proto.has_sample_event()) {
-      InvokeHandleSample(event_proto);
+      const quipper::PerfDataProto_CommEvent* comm = &event_proto.comm_event();
+      if (copy_comm_events_) {
+        owned_comm_events_.emplace_back(
+            new quipper::PerfDataProto_CommEvent(*comm));
+        comm = owned_comm_events_.back().get();
+      }
+      pid_to_comm_event_[comm->pid()] = comm;
     }
+    comm_context.comm = &event_proto.comm_event();
+    handler_->Comm(comm_context);
+  } else if (event_proto.has_fork_event()) {
+    UpdateMapsWithForkEvent(event_proto.fork_event());
+  } else if (event_proto.has_cgroup_event()) {
+    const auto& cgroup = event_proto.cgroup_event();
+    cgroup_map_.insert({cgroup.id(), cgroup.path()});
+  } else if (event_proto.has_lost_samples_event() ||
+             event_proto.has_lost_event()) {
+    HandleLost(event_proto);
+  } else if (event_proto.has_sample_event()) {
+    InvokeHandleSample(event_proto);
   }
+}
 
-  LogStats();
+void Normalizer::InvokeHandleColumnarSamples(
+    const quipper::PerfDataProto::PerfEvent* event_proto) {
+  const size_t end = sample_merger_->RowsBefore(event_proto);
+  for (; next_sample_row_ < end; ++next_sample_row_) {
+    const size_t row = next_sample_row_;
+    columnar_header_.Clear();
+    columnar_header_.set_type(quipper::PERF_RECORD_SAMPLE);
+    if (samples_->presence(row) & quipper::ColumnarSampleStore::kMisc) {
+      columnar_header_.set_misc(samples_->misc(row));
+    }
+    HandleSample(columnar_header_,
+                 PerfDataHandler::SampleFields(*samples_, row),
+                 samples_->callchain(row), samples_->callchain_size(row),
+                 ColumnarBranchStack{samples_->branch_stack(row),
+                                     samples_->branch_stack_size(row)});
+  }
 }
 
 void Normalizer::InvokeHandleSample(
     const quipper::PerfDataProto::PerfEvent& event_proto) {
   CHECK(event_proto.has_sample_event());
   const auto& sample = event_proto.sample_event();
-  PerfDataHandler::SampleContext context(event_proto.header(),
-                                         event_proto.sample_event());
-  context.file_attrs_index = GetEventIndexForSample(context.sample);
+  // The stacks may have been moved into tables shared by all samples.
+  const auto* callchain = &sample.callchain();
+  if (sample.has_callchain_index()) {
+    if (sample.callchain_index() >=
+        static_cast<uint32_t>(perf_proto_.callchains_size())) {
+      LOG(ERROR) << "Invalid callchain index " << sample.callchain_index();
+      return;
+    }
+    callchain = &perf_proto_.callchains(sample.callchain_index()).ips();
+  }
+  const auto* branch_stack = &sample.branch_stack();
+  if (sample.has_branch_stack_index()) {
+    if (sample.branch_stack_index() >=
+        static_cast<uint32_t>(perf_proto_.branch_stacks_size())) {
+      LOG(ERROR) << "Invalid branch stack index "
+                 << sample.branch_stack_index();
+      return;
+    }
+    branch_stack =
+        &perf_proto_.branch_stacks(sample.branch_stack_index()).entries();
+  }
+
+  HandleSample(event_proto.header(),
+               PerfDataHandler::SampleFields(event_proto.header(), sample),
+               callchain->data(), callchain->size(), *branch_stack);
+}
+
+template <typename BranchStack>
+void Normalizer::HandleSample(
+    const quipper::PerfDataProto::EventHeader& header,
+    const PerfDataHandler::SampleFields& sample, const uint64_t* callchain,
+    size_t callchain_size, const BranchStack& branch_stack) {
+  PerfDataHandler::SampleContext context(header, sample);
+  context.file_attrs_index = GetEventIndexForSample(sample);
   if (context.file_attrs_index == -1) {
     ++stat_.no_event_errors;
     return;
   }
+  if (!handler_->KeepSample(sample)) {
+    return;
+  }
   ++stat_.samples;
+  ++sample_stats_.samples;
 
   uint32_t pid = sample.pid();
 
   context.sample_mapping = GetMappingFromPidAndIP(pid, sample.ip(), false);
   stat_.missing_sample_mmap += context.sample_mapping == nullptr;
+  bool all_mapped = context.sample_mapping != nullptr;
 
   if (sample.has_addr()) {
     ++stat_.samples_with_addr;
@@ -422,7 +596,7 @@ void Normalizer::InvokeHandleSample(
   std::unique_ptr<PerfDataHandler::Mapping> fake;
   // Kernel samples might take some extra work.
   if (context.main_mapping == nullptr &&
-      (event_proto.header().misc() & quipper::PERF_RECORD_MISC_CPUMODE_MASK) ==
+      (sample.misc() & quipper::PERF_RECORD_MISC_CPUMODE_MASK) ==
           quipper::PERF_RECORD_MISC_KERNEL) {
     auto comm_it = pid_to_comm_event_.find(pid);
     auto kernel_it = pid_to_executable_mmap_.find(kKernelPid);
@@ -448,44 +622,41 @@ void Normalizer::InvokeHandleSample(
 
   bool ip_in_user_context = false;
   // Normalize the callchain.
-  context.callchain.resize(sample.callchain_size());
-  for (int i = 0; i < sample.callchain_size(); ++i) {
+  context.callchain.resize(callchain_size);
+  for (size_t i = 0; i < callchain_size; ++i) {
     ++stat_.callchain_ips;
-    if (sample.callchain(i) == quipper::PERF_CONTEXT_USER) {
+    const uint64_t ip = callchain[i];
+    if (ip == quipper::PERF_CONTEXT_USER) {
       ip_in_user_context = true;
-    } else if (sample.callchain(i) >= quipper::PERF_CONTEXT_MAX) {
+    } else if (ip >= quipper::PERF_CONTEXT_MAX) {
       ip_in_user_context = false;
     }
-    context.callchain[i].ip = sample.callchain(i);
+    context.callchain[i].ip = ip;
     context.callchain[i].mapping =
-        GetMappingFromPidAndIP(pid, sample.callchain(i), ip_in_user_context);
+        GetMappingFromPidAndIP(pid, ip, ip_in_user_context);
     stat_.missing_callchain_mmap += context.callchain[i].mapping == nullptr;
+    // Like quipper::PerfParser, skip the context markers and the sample's own
+    // ip, which was looked up above.
+    if (ip < quipper::PERF_CONTEXT_MAX && ip != sample.ip()) {
+      all_mapped &= context.callchain[i].mapping != nullptr;
+    }
   }
 
   // Normalize the branch_stack.
-  context.branch_stack.resize(sample.branch_stack_size());
-  for (int i = 0; i < sample.branch_stack_size(); ++i) {
+  context.branch_stack.resize(branch_stack.size());
+  for (size_t i = 0; i < context.branch_stack.size(); ++i) {
     stat_.branch_stack_ips += 2;
-    auto entry = sample.branch_stack(i);
+    PerfDataHandler::BranchStackPair& pair = context.branch_stack[i];
+    SetBranchStackPair(branch_stack[i], &pair);
     // from
-    context.branch_stack[i].from.ip = entry.from_ip();
-    context.branch_stack[i].from.mapping =
-        GetMappingFromPidAndIP(pid, entry.from_ip(), false);
-    stat_.missing_branch_stack_mmap +=
-        context.branch_stack[i].from.mapping == nullptr;
+    pair.from.mapping = GetMappingFromPidAndIP(pid, pair.from.ip, false);
+    stat_.missing_branch_stack_mmap += pair.from.mapping == nullptr;
     // to
-    context.branch_stack[i].to.ip = entry.to_ip();
-    context.branch_stack[i].to.mapping =
-        GetMappingFromPidAndIP(pid, entry.to_ip(), false);
-    stat_.missing_branch_stack_mmap +=
-        context.branch_stack[i].to.mapping == nullptr;
-    context.branch_stack[i].mispredicted = entry.mispredicted();
-    context.branch_stack[i].predicted = entry.predicted();
-    context.branch_stack[i].in_transaction = entry.in_transaction();
-    context.branch_stack[i].abort = entry.abort();
-    context.branch_stack[i].cycles = entry.cycles();
-    context.branch_stack[i].spec = entry.spec();
+    pair.to.mapping = GetMappingFromPidAndIP(pid, pair.to.ip, false);
+    stat_.missing_branch_stack_mmap += pair.to.mapping == nullptr;
+    all_mapped &= pair.from.mapping != nullptr && pair.to.mapping != nullptr;
   }
+  sample_stats_.mapped_samples += all_mapped;
 
   if (sample.has_cgroup()) {
     auto cgrp_it = cgroup_map_.find(sample.cgroup());
@@ -540,11 +711,17 @@ void Normalizer::HandleLost(
     sample.set_tid(event_proto.lost_event().sample_info().tid());
   }
 
-  int64_t event_index = GetEventIndexForSample(sample);
+  quipper::PerfDataProto::EventHeader header;
+  int64_t event_index =
+      GetEventIndexForSample(PerfDataHandler::SampleFields(header, sample));
   if (event_index == -1) {
     ++stat_.no_event_errors;
     return;
   }
+  // All of the samples lost by the event are kept or dropped together.
+  if (!handler_->KeepSample(PerfDataHandler::SampleFields(header, sample))) {
+    return;
+  }
 
   // Use a special address and associated mapping for synthesized lost
   // samples, so we can differentiate them from actual unmapped samples, see
@@ -559,8 +736,8 @@ void Normalizer::HandleLost(
   // remapping. Here, we set the highest byte of the synthesized lost sample
   // addresses to 0x9, to avoid any collisions.
   sample.set_ip(9ULL << 60);
-  quipper::PerfDataProto::EventHeader header;
-  PerfDataHandler::SampleContext context(header, sample);
+  const PerfDataHandler::SampleFields fields(header, sample);
+  PerfDataHandler::SampleContext context(header, fields);
   context.file_attrs_index = event_index;
   context.sample_mapping =
       GetOrAddFakeMapping(kLostMappingFilename, BuildId("", kBuildIdMissing),
@@ -797,7 +974,7 @@ const PerfDataHandler::Mapping* Normalizer::GetMainMMapFromPid(
 }
 
 int64_t Normalizer::GetEventIndexForSample(
-    const quipper::PerfDataProto_SampleEvent& sample) const {
+    const PerfDataHandler::SampleFields& sample) const {
   if (perf_proto_.file_attrs().size() == 1) {
     return 0;
   }
@@ -844,10 +1021,85 @@ bool IsVersionedSharedObject(const std::string& path) {
 
 PerfDataHandler::PerfDataHandler() {}
 
+PerfDataHandler::SampleFields::SampleFields(
+    const quipper::PerfDataProto::EventHeader& header,
+    const quipper::PerfDataProto::SampleEvent& sample)
+    : presence_(0),
+      misc_(header.misc()),
+      ip_(sample.ip()),
+      pid_(sample.pid()),
+      tid_(sample.tid()),
+      sample_time_ns_(sample.sample_time_ns()),
+      addr_(sample.addr()),
+      id_(sample.id()),
+      period_(sample.period()),
+      cpu_(sample.cpu()),
+      weight_(sample.weight()),
+      weight_var1_dw_(sample.weight_struct().var1_dw()),
+      data_src_(sample.data_src()),
+      cgroup_(sample.cgroup()),
+      code_page_size_(sample.code_page_size()),
+      data_page_size_(sample.data_page_size()) {
+  if (header.has_misc()) presence_ |= Field::kMisc;
+  if (sample.has_ip()) presence_ |= Field::kIp;
+  if (sample.has_pid()) presence_ |= Field::kPid;
+  if (sample.has_tid()) presence_ |= Field::kTid;
+  if (sample.has_sample_time_ns()) presence_ |= Field::kTime;
+  if (sample.has_addr()) presence_ |= Field::kAddr;
+  if (sample.has_id()) presence_ |= Field::kId;
+  if (sample.has_period()) presence_ |= Field::kPeriod;
+  if (sample.has_cpu()) presence_ |= Field::kCpu;
+  if (sample.has_weight()) presence_ |= Field::kWeight;
+  if (sample.has_weight_struct() && sample.weight_struct().has_var1_dw()) {
+    presence_ |= Field::kWeightVar1Dw;
+  }
+  if (sample.has_data_src()) presence_ |= Field::kDataSrc;
+  if (sample.has_cgroup()) presence_ |= Field::kCgroup;
+  if (sample.has_code_page_size()) presence_ |= Field::kCodePageSize;
+  if (sample.has_data_page_size()) presence_ |= Field::kDataPageSize;
+}
+
+PerfDataHandler::SampleFields::SampleFields(
+    const quipper::ColumnarSampleStore& samples, size_t row)
+    : presence_(samples.presence(row)),
+      misc_(samples.misc(row)),
+      ip_(samples.ip(row)),
+      pid_(samples.pid(row)),
+      tid_(samples.tid(row)),
+      sample_time_ns_(samples.time_ns(row)),
+      addr_(samples.addr(row)),
+      id_(samples.id(row)),
+      period_(samples.period(row)),
+      cpu_(samples.cpu(row)),
+      weight_(samples.weight(row)),
+      weight_var1_dw_(samples.weight_var1_dw(row)),
+      data_src_(samples.data_src(row)),
+      cgroup_(samples.cgroup(row)),
+      code_page_size_(samples.code_page_size(row)),
+      data_page_size_(samples.data_page_size(row)) {}
+
+void PerfDataHandler::Process(const quipper::PerfDataProto& perf_proto,
+                              PerfDataHandler* handler, SampleStats* stats) {
+  Normalizer Normalizer(perf_proto, nullptr, handler);
+  Normalizer.Normalize();
+  if (stats != nullptr) *stats = Normalizer.sample_stats();
+}
+
 void PerfDataHandler::Process(const quipper::PerfDataProto& perf_proto,
-                              PerfDataHandler* handler) {
-  Normalizer Normalizer(perf_proto, handler);
-  return Normalizer.Normalize();
+                              const quipper::ColumnarSampleStore& samples,
+                              PerfDataHandler* handler, SampleStats* stats) {
+  Normalizer Normalizer(perf_proto, &samples, handler);
+  Normalizer.Normalize();
+  if (stats != nullptr) *stats = Normalizer.sample_stats();
+}
+
+bool PerfDataHandler::Process(const quipper::PerfDataProto& header,
+                              quipper::PerfDataProtoStreamReader* reader,
+                              PerfDataHandler* handler, SampleStats* stats) {
+  Normalizer Normalizer(header, nullptr, handler);
+  bool ok = Normalizer.NormalizeStream(reader);
+  if (stats != nullptr) *stats = Normalizer.sample_stats();
+  return ok;
 }
 
 std::string PerfDataHandler::NameOrMd5Prefix(std::string name,
@@ -864,11 +1116,11 @@ std::string PerfDataHandler::MappingFilename(const Mapping* m) {
   return NameOrMd5Prefix(m->filename, m->filename_md5_prefix);
 }
 
-void PerfDataHandler::IncBuildIdStats(uint32_t pid,
-                                      const PerfDataHandler::Mapping* mapping) {
+void PerfDataHandler::IncBuildIdStats(const PerfDataHandler::Mapping* mapping,
+                                      BuildIdStats* stats) {
   BuildIdSource source =
       mapping != nullptr ? mapping->build_id.source : kBuildIdNoMmap;
-  process_build_id_stats_[pid][source]++;
+  (*stats)[source]++;
 }
 
 }  // namespace perftools
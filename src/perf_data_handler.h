@@ -11,8 +11,13 @@
 #include <unordered_map>
 #include <vector>
 
+#include "src/quipper/columnar_sample_store.h"
 #include "src/quipper/perf_data.pb.h"
 
+namespace quipper {
+class PerfDataProtoStreamReader;
+}  // namespace quipper
+
 namespace perftools {
 
 // The source of a build ID. It is supposed to be used in conjunction with the
@@ -128,9 +133,76 @@ class PerfDataHandler {
     uint32_t spec;
   };
 
+  // The scalar fields of a sample event, read from either a SampleEvent
+  // message or a row of a quipper::ColumnarSampleStore. The accessors are named
+  // after those of the SampleEvent message; the callchain and branch stack are
+  // in SampleContext.
+  class SampleFields {
+   public:
+    SampleFields(const quipper::PerfDataProto::EventHeader& header,
+                 const quipper::PerfDataProto::SampleEvent& sample);
+    SampleFields(const quipper::ColumnarSampleStore& samples, size_t row);
+
+    // The misc bits of the event's header.
+    bool has_misc() const { return Has(Field::kMisc); }
+    uint32_t misc() const { return misc_; }
+    bool has_ip() const { return Has(Field::kIp); }
+    uint64_t ip() const { return ip_; }
+    bool has_pid() const { return Has(Field::kPid); }
+    uint32_t pid() const { return pid_; }
+    bool has_tid() const { return Has(Field::kTid); }
+    uint32_t tid() const { return tid_; }
+    bool has_sample_time_ns() const { return Has(Field::kTime); }
+    uint64_t sample_time_ns() const { return sample_time_ns_; }
+    bool has_addr() const { return Has(Field::kAddr); }
+    uint64_t addr() const { return addr_; }
+    bool has_id() const { return Has(Field::kId); }
+    uint64_t id() const { return id_; }
+    bool has_period() const { return Has(Field::kPeriod); }
+    uint64_t period() const { return period_; }
+    bool has_cpu() const { return Has(Field::kCpu); }
+    uint32_t cpu() const { return cpu_; }
+    bool has_weight() const { return Has(Field::kWeight); }
+    uint64_t weight() const { return weight_; }
+    // weight_struct.var1_dw of the SampleEvent message.
+    bool has_weight_var1_dw() const { return Has(Field::kWeightVar1Dw); }
+    uint32_t weight_var1_dw() const { return weight_var1_dw_; }
+    bool has_data_src() const { return Has(Field::kDataSrc); }
+    uint64_t data_src() const { return data_src_; }
+    bool has_cgroup() const { return Has(Field::kCgroup); }
+    uint64_t cgroup() const { return cgroup_; }
+    bool has_code_page_size() const { return Has(Field::kCodePageSize); }
+    uint64_t code_page_size() const { return code_page_size_; }
+    bool has_data_page_size() const { return Has(Field::kDataPageSize); }
+    uint64_t data_page_size() const { return data_page_size_; }
+
+   private:
+    using Field = quipper::ColumnarSampleStore::Field;
+
+    bool Has(Field field) const { return (presence_ & field) != 0; }
+
+    // The Field bits of the fields present.
+    uint32_t presence_;
+    uint32_t misc_;
+    uint64_t ip_;
+    uint32_t pid_;
+    uint32_t tid_;
+    uint64_t sample_time_ns_;
+    uint64_t addr_;
+    uint64_t id_;
+    uint64_t period_;
+    uint32_t cpu_;
+    uint64_t weight_;
+    uint32_t weight_var1_dw_;
+    uint64_t data_src_;
+    uint64_t cgroup_;
+    uint64_t code_page_size_;
+    uint64_t data_page_size_;
+  };
+
   struct SampleContext {
     SampleContext(const quipper::PerfDataProto::EventHeader& h,
-                  const quipper::PerfDataProto::SampleEvent& s)
+                  const SampleFields& s)
         : header(h),
           sample(s),
           main_mapping(nullptr),
@@ -139,10 +211,11 @@ class PerfDataHandler {
           file_attrs_index(-1),
           cgroup(nullptr) {}
 
-    // The event's header.
-    const quipper::PerfDataProto::EventHeader &header;
-    // An event.
-    const quipper::PerfDataProto::SampleEvent &sample;
+    // The event's header. For a row of a quipper::ColumnarSampleStore, only
+    // its type and misc bits are set.
+    const quipper::PerfDataProto::EventHeader& header;
+    // The fields of the sample event, including its header's misc bits.
+    const SampleFields& sample;
     // The mapping for the main binary for this program.
     const Mapping* main_mapping;
     // The mapping in which event.ip is found.
@@ -175,13 +248,38 @@ class PerfDataHandler {
     uint32_t pid;
   };
 
+  // Counts of the sample events passed to Sample(). Samples synthesized for
+  // lost events are not counted.
+  struct SampleStats {
+    int64_t samples = 0;
+    // The samples whose ip, callchain and branch stack addresses were all
+    // found in a mapping, as counted by quipper::PerfParser.
+    int64_t mapped_samples = 0;
+  };
+
   PerfDataHandler(const PerfDataHandler&) = delete;
   PerfDataHandler& operator=(const PerfDataHandler&) = delete;
 
   // Process initiates processing of perf_proto.  handler.Sample will
-  // be called for every event in the profile.
+  // be called for every event in the profile. If |stats| is not null, it is
+  // set to the counts of the samples handled.
   static void Process(const quipper::PerfDataProto& perf_proto,
-                      PerfDataHandler* handler);
+                      PerfDataHandler* handler, SampleStats* stats = nullptr);
+
+  // Like the above, but also calls handler.Sample for every row of |samples|,
+  // interleaved with the events of perf_proto as they were in the input. The
+  // rows must have been sorted by time if and only if the events were.
+  static void Process(const quipper::PerfDataProto& perf_proto,
+                      const quipper::ColumnarSampleStore& samples,
+                      PerfDataHandler* handler, SampleStats* stats = nullptr);
+
+  // Like the above, but for a PerfDataProto stream: |header| is the header
+  // already read from |reader|, and the events are read and handled one
+  // batch at a time. Returns false if the stream could not be read to its
+  // end, in which case the events read before the error were handled.
+  static bool Process(const quipper::PerfDataProto& header,
+                      quipper::PerfDataProtoStreamReader* reader,
+                      PerfDataHandler* handler, SampleStats* stats = nullptr);
 
   // Returns name string if it's non empty or hex string of md5_prefix.
   static std::string NameOrMd5Prefix(std::string name, uint64_t md5_prefix);
@@ -200,16 +298,20 @@ class PerfDataHandler {
   virtual void Comm(const CommContext& comm) = 0;
   // Called for every mmap event.
   virtual void MMap(const MMapContext& mmap) = 0;
+  // May be overridden to convert only some of the samples: called for every
+  // sample before it is normalized, and only the samples it returns true for
+  // are normalized and passed to Sample().
+  virtual bool KeepSample(const SampleFields& /*sample*/) {
+    return true;
+  }
 
  protected:
   PerfDataHandler();
 
-  // The build ID source count of each process; key by process ID.
-  std::unordered_map<uint32_t, BuildIdStats> process_build_id_stats_;
-
-  // Increments the counter of the corresponding Build ID Stat of the process
-  // according to the given mapping.
-  void IncBuildIdStats(uint32_t pid, const PerfDataHandler::Mapping* mapping);
+  // Increments the counter in |stats| of the source of the build ID of the
+  // given mapping.
+  static void IncBuildIdStats(const PerfDataHandler::Mapping* mapping,
+                              BuildIdStats* stats);
 };
 
 }  // namespace perftools
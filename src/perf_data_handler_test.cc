@@ -15,8 +15,11 @@
 #include <gtest/gtest.h>
 #include "src/path_matching.h"
 #include "src/quipper/binary_data_utils.h"
+#include "src/quipper/columnar_sample_store.h"
 #include "src/quipper/kernel/perf_event.h"
 #include "src/quipper/perf_buildid.h"
+#include "src/quipper/perf_data_utils.h"
+#include "src/quipper/perf_proto_stream.h"
 
 using BranchStackEntry = quipper::PerfDataProto::BranchStackEntry;
 
@@ -275,6 +278,39 @@ TEST(PerfDataHandlerTest, SampleBranchStackMatches) {
   PerfDataHandler::Process(proto, &handler);
 }
 
+TEST(PerfDataHandlerTest, DeduplicatedSampleBranchStackMatches) {
+  quipper::PerfDataProto proto;
+
+  uint64_t file_attr_id = 0;
+  auto* file_attr = proto.add_file_attrs();
+  file_attr->add_ids(file_attr_id);
+
+  std::vector<BranchStackEntry> branch_stack;
+  // Two samples with the same branch stack.
+  for (int i = 0; i < 2; ++i) {
+    auto* sample_event = proto.add_events()->mutable_sample_event();
+    sample_event->set_ip(123);
+    sample_event->set_pid(5805);
+    sample_event->set_tid(5805);
+    sample_event->set_sample_time_ns(456 + i);
+    sample_event->set_period(1);
+    sample_event->set_id(file_attr_id);
+    auto* entry = sample_event->add_branch_stack();
+    entry->set_from_ip(101);
+    entry->set_to_ip(102);
+    entry->set_predicted(true);
+    entry->set_cycles(4);
+    if (i == 0) branch_stack.push_back(*entry);
+  }
+  quipper::DeduplicateSampleStacks(&proto);
+  ASSERT_EQ(1, proto.branch_stacks_size());
+  ASSERT_EQ(0, proto.events(1).sample_event().branch_stack_size());
+
+  TestPerfDataHandler handler(branch_stack,
+                              std::unordered_map<std::string, std::string>());
+  PerfDataHandler::Process(proto, &handler);
+}
+
 TEST(PerfDataHandlerTest, AddressMappingIsSet) {
   quipper::PerfDataProto proto;
 
@@ -334,6 +370,118 @@ TEST(PerfDataHandlerTest, AddressMappingIsSet) {
   EXPECT_EQ(0x1000, mapping->file_offset);
 }
 
+TEST(PerfDataHandlerTest, ProcessesColumnarSamples) {
+  quipper::PerfDataProto proto;
+
+  uint64_t file_attr_id = 0;
+  auto* file_attr = proto.add_file_attrs();
+  file_attr->add_ids(file_attr_id);
+
+  auto* mmap_event = proto.add_events()->mutable_mmap_event();
+  mmap_event->set_filename("/foo/bar");
+  mmap_event->set_pid(100);
+  mmap_event->set_tid(100);
+  mmap_event->set_start(0x1000);
+  mmap_event->set_len(0x1000);
+  mmap_event->set_pgoff(0);
+
+  mmap_event = proto.add_events()->mutable_mmap_event();
+  mmap_event->set_filename("/foo/baz");
+  mmap_event->set_pid(100);
+  mmap_event->set_tid(100);
+  mmap_event->set_start(0x3000);
+  mmap_event->set_len(0x1000);
+  mmap_event->set_pgoff(0x1000);
+
+  // The samples are kept apart from the events: the first one came between
+  // the two mmaps, the others after them.
+  std::vector<BranchStackEntry> branch_stack;
+  quipper::ColumnarSampleStore samples;
+  for (uint64_t addr : {0x3100, 0, 0x3100}) {
+    quipper::PerfDataProto::PerfEvent event;
+    auto* sample_event = event.mutable_sample_event();
+    sample_event->set_ip(0x1100);
+    sample_event->set_pid(100);
+    sample_event->set_tid(100);
+    if (addr != 0) sample_event->set_addr(addr);
+    sample_event->set_sample_time_ns(456);
+    sample_event->set_period(1);
+    sample_event->set_id(file_attr_id);
+    auto* entry = sample_event->add_branch_stack();
+    entry->set_from_ip(0x1200);
+    entry->set_to_ip(0x3200);
+    entry->set_mispredicted(true);
+    entry->set_cycles(4);
+    if (branch_stack.empty()) branch_stack.push_back(*entry);
+    samples.Append(event, samples.empty() ? 1 : 2);
+  }
+
+  TestPerfDataHandler handler(branch_stack,
+                              std::unordered_map<std::string, std::string>{});
+  PerfDataHandler::Process(proto, samples, &handler);
+  auto& addr_mappings = handler.SeenAddrMappings();
+  ASSERT_EQ(3u, addr_mappings.size());
+  EXPECT_EQ(nullptr, addr_mappings[0]);
+  EXPECT_EQ(nullptr, addr_mappings[1]);
+  ASSERT_TRUE(addr_mappings[2] != nullptr);
+  EXPECT_EQ("/foo/baz", addr_mappings[2]->filename);
+}
+
+TEST(PerfDataHandlerTest, ProcessesStreamOneBatchAtATime) {
+  quipper::PerfDataProto proto;
+
+  uint64_t file_attr_id = 0;
+  auto* file_attr = proto.add_file_attrs();
+  file_attr->add_ids(file_attr_id);
+
+  auto* comm_event = proto.add_events()->mutable_comm_event();
+  comm_event->set_comm("foo");
+  comm_event->set_pid(100);
+  comm_event->set_tid(100);
+
+  auto* mmap_event = proto.add_events()->mutable_mmap_event();
+  mmap_event->set_filename("/foo/baz");
+  mmap_event->set_pid(100);
+  mmap_event->set_tid(100);
+  mmap_event->set_start(0x3000);
+  mmap_event->set_len(0x1000);
+  mmap_event->set_pgoff(0x1000);
+
+  // The samples are in later batches than the comm and mmap events.
+  for (uint64_t addr : {0, 0x3100}) {
+    auto* sample_event = proto.add_events()->mutable_sample_event();
+    sample_event->set_ip(123);
+    sample_event->set_pid(100);
+    sample_event->set_tid(100);
+    if (addr != 0) sample_event->set_addr(addr);
+    sample_event->set_sample_time_ns(456);
+    sample_event->set_period(1);
+    sample_event->set_id(file_attr_id);
+  }
+
+  std::string stream;
+  {
+    google::protobuf::io::StringOutputStream output(&stream);
+    quipper::PerfDataProtoStreamWriter writer(&output);
+    ASSERT_TRUE(writer.WritePerfDataProto(proto, 1));
+  }
+
+  google::protobuf::io::ArrayInputStream input(stream.data(), stream.size());
+  quipper::PerfDataProtoStreamReader reader(&input);
+  quipper::PerfDataProto header;
+  ASSERT_TRUE(reader.ReadHeader(&header));
+  EXPECT_EQ(0, header.events_size());
+
+  TestPerfDataHandler handler(std::vector<BranchStackEntry>{},
+                              std::unordered_map<std::string, std::string>{});
+  EXPECT_TRUE(PerfDataHandler::Process(header, &reader, &handler));
+  auto& addr_mappings = handler.SeenAddrMappings();
+  ASSERT_EQ(2u, addr_mappings.size());
+  EXPECT_EQ(nullptr, addr_mappings[0]);
+  ASSERT_TRUE(addr_mappings[1] != nullptr);
+  EXPECT_EQ("/foo/baz", addr_mappings[1]->filename);
+}
+
 TEST(PerfDataHandlerTest, MappingBuildIdAndSourceAreSet) {
   quipper::PerfDataProto proto;
 
@@ -0,0 +1,306 @@
+/*
+ * Copyright (c) 2016, Google Inc.
+ * All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include "src/profile_encoder.h"
+
+#include <utility>
+
+#include "base/logging.h"
+#include "google/protobuf/wire_format_lite.h"
+
+using google::protobuf::internal::WireFormatLite;
+using google::protobuf::io::CodedOutputStream;
+using google::protobuf::io::FileOutputStream;
+using google::protobuf::io::GzipOutputStream;
+using google::protobuf::io::StringOutputStream;
+
+namespace perftools {
+namespace profiles {
+
+namespace {
+
+// ProfileEncoder has structs of the same names.
+typedef Function FunctionMessage;
+typedef Label LabelMessage;
+typedef Line LineMessage;
+
+// All of the fields of the messages within a Profile have numbers below 16,
+// so their tags take one byte.
+void AppendTag(int field, WireFormatLite::WireType type, string *out) {
+  out->push_back(static_cast<char>(WireFormatLite::MakeTag(field, type)));
+}
+
+void AppendVarint(uint64 value, string *out) {
+  while (value >= 0x80) {
+    out->push_back(static_cast<char>(value | 0x80));
+    value >>= 7;
+  }
+  out->push_back(static_cast<char>(value));
+}
+
+// Returns the size of a varint field holding |value|, which is not written if
+// it is zero.
+size_t VarintFieldSize(uint64 value) {
+  return value == 0 ? 0 : 1 + CodedOutputStream::VarintSize64(value);
+}
+
+void AppendVarintField(int field, uint64 value, string *out) {
+  if (value == 0) return;
+  AppendTag(field, WireFormatLite::WIRETYPE_VARINT, out);
+  AppendVarint(value, out);
+}
+
+template <typename T>
+void AppendPackedField(int field, const std::vector<T> &values, string *out) {
+  if (values.empty()) return;
+  size_t size = 0;
+  for (T value : values) {
+    size += CodedOutputStream::VarintSize64(static_cast<uint64>(value));
+  }
+  AppendTag(field, WireFormatLite::WIRETYPE_LENGTH_DELIMITED, out);
+  AppendVarint(size, out);
+  for (T value : values) {
+    AppendVarint(static_cast<uint64>(value), out);
+  }
+}
+
+}  // namespace
+
+ProfileEncoder::ProfileEncoder(string *output, bool compress) {
+  output->clear();
+  string_output_.reset(new StringOutputStream(output));
+  Init(string_output_.get(), compress);
+}
+
+ProfileEncoder::ProfileEncoder(int fd, bool compress) {
+  file_output_.reset(new FileOutputStream(fd));
+  Init(file_output_.get(), compress);
+}
+
+ProfileEncoder::~ProfileEncoder() {
+  if (!finished_) {
+    Finish();
+  }
+}
+
+void ProfileEncoder::Init(google::protobuf::io::ZeroCopyOutputStream *output,
+                          bool compress) {
+  if (compress) {
+    gzip_output_.reset(new GzipOutputStream(output));
+    output = gzip_output_.get();
+  }
+  coded_output_.reset(new CodedOutputStream(output));
+  // string_table[0] must be ""
+  record_.clear();
+  WriteRecord(Profile::kStringTableFieldNumber);
+}
+
+void ProfileEncoder::WriteRecord(int field) {
+  CHECK(!finished_) << "Cannot add to a finished profile";
+  coded_output_->WriteTag(WireFormatLite::MakeTag(
+      field, WireFormatLite::WIRETYPE_LENGTH_DELIMITED));
+  coded_output_->WriteVarint32(record_.size());
+  coded_output_->WriteRaw(record_.data(), record_.size());
+}
+
+void ProfileEncoder::WriteVarint(int field, uint64 value) {
+  CHECK(!finished_) << "Cannot add to a finished profile";
+  if (value == 0) return;
+  coded_output_->WriteTag(
+      WireFormatLite::MakeTag(field, WireFormatLite::WIRETYPE_VARINT));
+  coded_output_->WriteVarint64(value);
+}
+
+int64 ProfileEncoder::StringId(const char *str) {
+  if (str == nullptr) {
+    return 0;
+  }
+  return StringId(std::string_view(str));
+}
+
+int64 ProfileEncoder::StringId(std::string_view str) {
+  if (str.empty()) {
+    return 0;
+  }
+
+  const int64 index = strings_.size() + 1;
+  const auto inserted = strings_.emplace(string(str), index);
+  if (!inserted.second) {
+    // Failed to insert -- use existing id.
+    return inserted.first->second;
+  }
+  record_ = inserted.first->first;
+  WriteRecord(Profile::kStringTableFieldNumber);
+  return index;
+}
+
+uint64 ProfileEncoder::FunctionId(const char *name, const char *system_name,
+                                  const char *file, int64 start_line) {
+  int64 name_index = StringId(name);
+  int64 system_name_index = StringId(system_name);
+  int64 file_index = StringId(file);
+
+  Function fn(name_index, system_name_index, file_index, start_line);
+
+  uint64 index = functions_.size() + 1;
+  const auto inserted = functions_.insert(std::make_pair(fn, index));
+  if (!inserted.second) {
+    return inserted.first->second;
+  }
+
+  record_.clear();
+  AppendVarintField(FunctionMessage::kIdFieldNumber, index, &record_);
+  AppendVarintField(FunctionMessage::kNameFieldNumber, name_index, &record_);
+  AppendVarintField(FunctionMessage::kSystemNameFieldNumber, system_name_index,
+                    &record_);
+  AppendVarintField(FunctionMessage::kFilenameFieldNumber, file_index,
+                    &record_);
+  AppendVarintField(FunctionMessage::kStartLineFieldNumber, start_line,
+                    &record_);
+  WriteRecord(Profile::kFunctionFieldNumber);
+  return index;
+}
+
+uint64 ProfileEncoder::AddMapping(uint64 memory_start, uint64 memory_limit,
+                                  uint64 file_offset, int64 filename,
+                                  int64 build_id) {
+  return AddMapping(memory_start, memory_limit, file_offset, filename,
+                    build_id, MappingFlags());
+}
+
+uint64 ProfileEncoder::AddMapping(uint64 memory_start, uint64 memory_limit,
+                                  uint64 file_offset, int64 filename,
+                                  int64 build_id, const MappingFlags &flags) {
+  const uint64 id = ++num_mappings_;
+  record_.clear();
+  AppendVarintField(Mapping::kIdFieldNumber, id, &record_);
+  AppendVarintField(Mapping::kMemoryStartFieldNumber, memory_start, &record_);
+  AppendVarintField(Mapping::kMemoryLimitFieldNumber, memory_limit, &record_);
+  AppendVarintField(Mapping::kFileOffsetFieldNumber, file_offset, &record_);
+  AppendVarintField(Mapping::kFilenameFieldNumber, filename, &record_);
+  AppendVarintField(Mapping::kBuildIdFieldNumber, build_id, &record_);
+  AppendVarintField(Mapping::kHasFunctionsFieldNumber, flags.has_functions,
+                    &record_);
+  AppendVarintField(Mapping::kHasFilenamesFieldNumber, flags.has_filenames,
+                    &record_);
+  AppendVarintField(Mapping::kHasLineNumbersFieldNumber, flags.has_line_numbers,
+                    &record_);
+  AppendVarintField(Mapping::kHasInlineFramesFieldNumber,
+                    flags.has_inline_frames, &record_);
+  WriteRecord(Profile::kMappingFieldNumber);
+  return id;
+}
+
+uint64 ProfileEncoder::AddLocation(uint64 mapping_id, uint64 address,
+                                   const std::vector<Line> &lines,
+                                   bool is_folded) {
+  const uint64 id = ++num_locations_;
+  record_.clear();
+  AppendVarintField(Location::kIdFieldNumber, id, &record_);
+  AppendVarintField(Location::kMappingIdFieldNumber, mapping_id, &record_);
+  AppendVarintField(Location::kAddressFieldNumber, address, &record_);
+  for (const auto &line : lines) {
+    AppendTag(Location::kLineFieldNumber,
+              WireFormatLite::WIRETYPE_LENGTH_DELIMITED, &record_);
+    AppendVarint(VarintFieldSize(line.function_id) + VarintFieldSize(line.line),
+                 &record_);
+    AppendVarintField(LineMessage::kFunctionIdFieldNumber, line.function_id,
+                      &record_);
+    AppendVarintField(LineMessage::kLineFieldNumber, line.line, &record_);
+  }
+  AppendVarintField(Location::kIsFoldedFieldNumber, is_folded, &record_);
+  WriteRecord(Profile::kLocationFieldNumber);
+  return id;
+}
+
+void ProfileEncoder::AddSample(const std::vector<uint64> &location_ids,
+                               const std::vector<int64> &values,
+                               const std::vector<Label> &labels) {
+  record_.clear();
+  AppendPackedField(Sample::kLocationIdFieldNumber, location_ids, &record_);
+  AppendPackedField(Sample::kValueFieldNumber, values, &record_);
+  for (const auto &label : labels) {
+    AppendTag(Sample::kLabelFieldNumber,
+              WireFormatLite::WIRETYPE_LENGTH_DELIMITED, &record_);
+    AppendVarint(VarintFieldSize(label.key) + VarintFieldSize(label.str) +
+                     VarintFieldSize(label.num) +
+                     VarintFieldSize(label.num_unit),
+                 &record_);
+    AppendVarintField(LabelMessage::kKeyFieldNumber, label.key, &record_);
+    AppendVarintField(LabelMessage::kStrFieldNumber, label.str, &record_);
+    AppendVarintField(LabelMessage::kNumFieldNumber, label.num, &record_);
+    AppendVarintField(LabelMessage::kNumUnitFieldNumber, label.num_unit,
+                      &record_);
+  }
+  WriteRecord(Profile::kSampleFieldNumber);
+}
+
+void ProfileEncoder::AddSampleType(int64 type, int64 unit) {
+  record_.clear();
+  AppendVarintField(ValueType::kTypeFieldNumber, type, &record_);
+  AppendVarintField(ValueType::kUnitFieldNumber, unit, &record_);
+  WriteRecord(Profile::kSampleTypeFieldNumber);
+}
+
+void ProfileEncoder::AddComment(int64 comment) {
+  // An unpacked element of the packed comment field, which parsers accept.
+  CHECK(!finished_) << "Cannot add to a finished profile";
+  coded_output_->WriteTag(WireFormatLite::MakeTag(
+      Profile::kCommentFieldNumber, WireFormatLite::WIRETYPE_VARINT));
+  coded_output_->WriteVarint64(comment);
+}
+
+void ProfileEncoder::SetDefaultSampleType(int64 type) {
+  WriteVarint(Profile::kDefaultSampleTypeFieldNumber, type);
+}
+
+void ProfileEncoder::SetDropFrames(int64 drop_frames) {
+  WriteVarint(Profile::kDropFramesFieldNumber, drop_frames);
+}
+
+void ProfileEncoder::SetKeepFrames(int64 keep_frames) {
+  WriteVarint(Profile::kKeepFramesFieldNumber, keep_frames);
+}
+
+void ProfileEncoder::SetTimeNanos(int64 time_nanos) {
+  WriteVarint(Profile::kTimeNanosFieldNumber, time_nanos);
+}
+
+void ProfileEncoder::SetDurationNanos(int64 duration_nanos) {
+  WriteVarint(Profile::kDurationNanosFieldNumber, duration_nanos);
+}
+
+void ProfileEncoder::SetPeriodType(int64 type, int64 unit) {
+  record_.clear();
+  AppendVarintField(ValueType::kTypeFieldNumber, type, &record_);
+  AppendVarintField(ValueType::kUnitFieldNumber, unit, &record_);
+  WriteRecord(Profile::kPeriodTypeFieldNumber);
+}
+
+void ProfileEncoder::SetPeriod(int64 period) {
+  WriteVarint(Profile::kPeriodFieldNumber, period);
+}
+
+bool ProfileEncoder::Finish() {
+  CHECK(!finished_) << "The profile was already finished";
+  finished_ = true;
+  bool ok = !coded_output_->HadError();
+  // Hands the unused part of the buffer back to the underlying stream.
+  coded_output_.reset();
+  if (gzip_output_ != nullptr && !gzip_output_->Close()) {
+    LOG(ERROR) << "Failed to compress the profile";
+    ok = false;
+  }
+  if (file_output_ != nullptr && !file_output_->Flush()) {
+    LOG(ERROR) << "Failed to write the profile";
+    ok = false;
+  }
+  return ok;
+}
+
+}  // namespace profiles
+}  // namespace perftools
@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2016, Google Inc.
+ * All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef PERFTOOLS_PROFILES_PROTO_PROFILE_ENCODER_H_
+#define PERFTOOLS_PROFILES_PROTO_PROFILE_ENCODER_H_
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+#include "google/protobuf/io/coded_stream.h"
+#include "google/protobuf/io/gzip_stream.h"
+#include "google/protobuf/io/zero_copy_stream_impl.h"
+#include "src/builder.h"
+
+namespace perftools {
+namespace profiles {
+
+// Writes a profile in the profile.proto wire format as it is being built,
+// without a Profile message. Every string, mapping, function, location and
+// sample is encoded into the output as soon as it is added, optionally gzipped
+// on the fly, so the memory used does not grow with the size of the profile
+// apart from the tables that deduplicate strings and functions.
+//
+// The encoder does not check the profile for consistency the way
+// Builder::CheckValid() does; callers must only refer to ids they have been
+// given by the encoder.
+class ProfileEncoder {
+ public:
+  struct Label {
+    int64 key = 0;       // Index into string table.
+    int64 str = 0;       // Index into string table.
+    int64 num = 0;
+    int64 num_unit = 0;  // Index into string table.
+  };
+
+  struct Line {
+    uint64 function_id = 0;
+    int64 line = 0;
+  };
+
+  // What a mapping's locations were symbolized with, as in Mapping.
+  struct MappingFlags {
+    bool has_functions = false;
+    bool has_filenames = false;
+    bool has_line_numbers = false;
+    bool has_inline_frames = false;
+  };
+
+  // Writes to |output|, replacing its contents.
+  ProfileEncoder(string *output, bool compress);
+  // Writes to the file represented by |fd|, which remains owned by the caller.
+  ProfileEncoder(int fd, bool compress);
+  ~ProfileEncoder();
+
+  // Like Builder::StringId(), but writes the string out the first time it is
+  // seen.
+  int64 StringId(const char *str);
+  int64 StringId(std::string_view str);
+
+  // Like Builder::FunctionId(), but writes the function out the first time it
+  // is seen.
+  uint64 FunctionId(const char *name, const char *system_name,
+                    const char *file, int64 start_line);
+
+  // Adds a mapping and returns its id.
+  uint64 AddMapping(uint64 memory_start, uint64 memory_limit,
+                    uint64 file_offset, int64 filename, int64 build_id);
+  uint64 AddMapping(uint64 memory_start, uint64 memory_limit,
+                    uint64 file_offset, int64 filename, int64 build_id,
+                    const MappingFlags &flags);
+
+  // Adds a location and returns its id. |mapping_id| may be 0 for none.
+  uint64 AddLocation(uint64 mapping_id, uint64 address,
+                     const std::vector<Line> &lines = {},
+                     bool is_folded = false);
+
+  // Adds a sample.
+  void AddSample(const std::vector<uint64> &location_ids,
+                 const std::vector<int64> &values,
+                 const std::vector<Label> &labels = {});
+
+  // Set the fields of the profile that are not tables.
+  void AddSampleType(int64 type, int64 unit);
+  void AddComment(int64 comment);
+  void SetDefaultSampleType(int64 type);
+  void SetDropFrames(int64 drop_frames);
+  void SetKeepFrames(int64 keep_frames);
+  void SetTimeNanos(int64 time_nanos);
+  void SetDurationNanos(int64 duration_nanos);
+  void SetPeriodType(int64 type, int64 unit);
+  void SetPeriod(int64 period);
+
+  // Flushes the output, completing the gzip stream if compressing. Must be
+  // called once, after everything was added. Returns false if there were
+  // errors writing the output, which then does not hold a valid profile.
+  bool Finish();
+
+ private:
+  // Sets up the encoder to write to |output|.
+  void Init(google::protobuf::io::ZeroCopyOutputStream *output, bool compress);
+  // Writes |field| of Profile holding the message in |record_|.
+  void WriteRecord(int field);
+  // Writes |field| of Profile as a varint, if |value| is not zero.
+  void WriteVarint(int field, uint64 value);
+
+  // One of these is the output.
+  std::unique_ptr<google::protobuf::io::StringOutputStream> string_output_;
+  std::unique_ptr<google::protobuf::io::FileOutputStream> file_output_;
+  // Set when compressing, on top of the output.
+  std::unique_ptr<google::protobuf::io::GzipOutputStream> gzip_output_;
+  std::unique_ptr<google::protobuf::io::CodedOutputStream> coded_output_;
+
+  // The encoded fields of the message being written.
+  string record_;
+
+  // Hashes to deduplicate strings and functions, as in Builder.
+  std::unordered_map<string, int64> strings_;
+  typedef std::tuple<int64, int64, int64, int64> Function;
+  struct FunctionHasher {
+    size_t operator()(const Function &f) const {
+      int64 hash = std::get<0>(f);
+      hash = hash + ((hash << 8) ^ std::get<1>(f));
+      hash = hash + ((hash << 8) ^ std::get<2>(f));
+      hash = hash + ((hash << 8) ^ std::get<3>(f));
+      return static_cast<size_t>(hash);
+    }
+  };
+  std::unordered_map<Function, uint64, FunctionHasher> functions_;
+
+  uint64 num_mappings_ = 0;
+  uint64 num_locations_ = 0;
+  bool finished_ = false;
+
+  ProfileEncoder(const ProfileEncoder &) = delete;
+  ProfileEncoder &operator=(const ProfileEncoder &) = delete;
+};
+
+}  // namespace profiles
+}  // namespace perftools
+
+#endif  // PERFTOOLS_PROFILES_PROTO_PROFILE_ENCODER_H_
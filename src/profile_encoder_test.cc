@@ -0,0 +1,178 @@
+/*
+ * Copyright (c) 2016, Google Inc.
+ * All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include "src/profile_encoder.h"
+
+#include <stdio.h>
+
+#include <string>
+
+#include <gtest/gtest.h>
+#include "google/protobuf/io/gzip_stream.h"
+#include "google/protobuf/io/zero_copy_stream_impl_lite.h"
+#include "google/protobuf/util/message_differencer.h"
+
+namespace perftools {
+namespace profiles {
+namespace {
+
+using google::protobuf::util::MessageDifferencer;
+
+std::string Gunzip(const std::string& compressed) {
+  google::protobuf::io::ArrayInputStream input(compressed.data(),
+                                               compressed.size());
+  google::protobuf::io::GzipInputStream gzip_input(
+      &input, google::protobuf::io::GzipInputStream::GZIP);
+  std::string output;
+  const void* data;
+  int size;
+  while (gzip_input.Next(&data, &size)) {
+    output.append(static_cast<const char*>(data), size);
+  }
+  return output;
+}
+
+// Adds the same profile to |encoder| as is returned by ExpectedProfile().
+void EncodeProfile(ProfileEncoder* encoder) {
+  const int64 samples = encoder->StringId("samples");
+  encoder->AddSampleType(samples, encoder->StringId("count"));
+  const int64 cpu = encoder->StringId("cpu");
+  encoder->SetPeriodType(cpu, encoder->StringId("cycles"));
+  encoder->SetPeriod(100003);
+  encoder->SetTimeNanos(1234);
+  encoder->AddComment(encoder->StringId("a comment"));
+  const int64 filename = encoder->StringId("/lib.so");
+  ProfileEncoder::MappingFlags flags;
+  flags.has_functions = true;
+  flags.has_line_numbers = true;
+  const uint64 mapping_id = encoder->AddMapping(
+      0x1000, 0x2000, 0x400, filename, encoder->StringId("abcdef"), flags);
+  const uint64 foo = encoder->FunctionId("foo", "_Z3foov", "foo.cc", 10);
+  const uint64 bar = encoder->FunctionId("bar", "bar", "foo.cc", 0);
+  EXPECT_EQ(foo, encoder->FunctionId("foo", "_Z3foov", "foo.cc", 10));
+  const uint64 leaf =
+      encoder->AddLocation(mapping_id, 0x1100, {{foo, 12}, {bar, 0}});
+  const uint64 root = encoder->AddLocation(0, 0x3000, {}, /*is_folded=*/true);
+  ProfileEncoder::Label pid;
+  pid.key = encoder->StringId("pid");
+  pid.num = 42;
+  ProfileEncoder::Label comm;
+  comm.key = encoder->StringId("comm");
+  comm.str = encoder->StringId("foo");
+  encoder->AddSample({leaf, root}, {3}, {pid, comm});
+  encoder->AddSample({root}, {1 << 20});
+  encoder->AddSample({}, {0});
+}
+
+Profile ExpectedProfile() {
+  Builder builder;
+  Profile* profile = builder.mutable_profile();
+  auto* sample_type = profile->add_sample_type();
+  sample_type->set_type(builder.StringId("samples"));
+  sample_type->set_unit(builder.StringId("count"));
+  profile->mutable_period_type()->set_type(builder.StringId("cpu"));
+  profile->mutable_period_type()->set_unit(builder.StringId("cycles"));
+  profile->set_period(100003);
+  profile->set_time_nanos(1234);
+  profile->add_comment(builder.StringId("a comment"));
+  auto* mapping = profile->add_mapping();
+  mapping->set_id(1);
+  mapping->set_memory_start(0x1000);
+  mapping->set_memory_limit(0x2000);
+  mapping->set_file_offset(0x400);
+  mapping->set_filename(builder.StringId("/lib.so"));
+  mapping->set_build_id(builder.StringId("abcdef"));
+  mapping->set_has_functions(true);
+  mapping->set_has_line_numbers(true);
+  const uint64 foo = builder.FunctionId("foo", "_Z3foov", "foo.cc", 10);
+  const uint64 bar = builder.FunctionId("bar", "bar", "foo.cc", 0);
+  auto* leaf = profile->add_location();
+  leaf->set_id(1);
+  leaf->set_mapping_id(1);
+  leaf->set_address(0x1100);
+  auto* line = leaf->add_line();
+  line->set_function_id(foo);
+  line->set_line(12);
+  leaf->add_line()->set_function_id(bar);
+  auto* root = profile->add_location();
+  root->set_id(2);
+  root->set_address(0x3000);
+  root->set_is_folded(true);
+  auto* sample = profile->add_sample();
+  sample->add_location_id(1);
+  sample->add_location_id(2);
+  sample->add_value(3);
+  auto* label = sample->add_label();
+  label->set_key(builder.StringId("pid"));
+  label->set_num(42);
+  label = sample->add_label();
+  label->set_key(builder.StringId("comm"));
+  label->set_str(builder.StringId("foo"));
+  sample = profile->add_sample();
+  sample->add_location_id(2);
+  sample->add_value(1 << 20);
+  profile->add_sample()->add_value(0);
+  EXPECT_TRUE(builder.Finalize());
+  return *builder.Consume();
+}
+
+TEST(ProfileEncoderTest, EncodesLikeBuilder) {
+  const Profile expected = ExpectedProfile();
+  for (bool compress : {false, true}) {
+    std::string output = "stale contents";
+    ProfileEncoder encoder(&output, compress);
+    EncodeProfile(&encoder);
+    ASSERT_TRUE(encoder.Finish());
+
+    Profile profile;
+    ASSERT_TRUE(profile.ParseFromString(compress ? Gunzip(output) : output));
+    EXPECT_TRUE(MessageDifferencer::Equals(expected, profile))
+        << profile.DebugString();
+  }
+}
+
+TEST(ProfileEncoderTest, EncodesEmptyProfile) {
+  std::string output;
+  {
+    ProfileEncoder encoder(&output, true);
+  }
+  Profile profile;
+  ASSERT_TRUE(profile.ParseFromString(Gunzip(output)));
+  ASSERT_EQ(1, profile.string_table_size());
+  EXPECT_EQ("", profile.string_table(0));
+}
+
+TEST(ProfileEncoderTest, EncodesToFile) {
+  FILE* file = tmpfile();
+  ASSERT_NE(nullptr, file);
+  {
+    ProfileEncoder encoder(fileno(file), true);
+    EncodeProfile(&encoder);
+    ASSERT_TRUE(encoder.Finish());
+  }
+
+  std::string compressed;
+  rewind(file);
+  char buffer[4096];
+  size_t size;
+  while ((size = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    compressed.append(buffer, size);
+  }
+  fclose(file);
+  Profile profile;
+  ASSERT_TRUE(profile.ParseFromString(Gunzip(compressed)));
+  EXPECT_TRUE(MessageDifferencer::Equals(ExpectedProfile(), profile));
+}
+
+}  // namespace
+}  // namespace profiles
+}  // namespace perftools
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,442 @@
+/*
+ * Copyright (c) 2016, Google Inc.
+ * All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include "src/profile_merge.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+
+#include "base/logging.h"
+#include "src/quipper/parallel_for.h"
+
+namespace perftools {
+namespace profiles {
+
+namespace {
+
+// Adds profiles one at a time to a merged profile.
+class ProfileMerger {
+ public:
+  ProfileMerger() : profile_(builder_.mutable_profile()) {}
+
+  // Merges |src| into the profile. Returns false if |src| is not
+  // internally consistent or its sample types differ from those of the
+  // profiles added before.
+  bool Add(const Profile &src);
+
+  // Returns the merged profile. No more profiles can be added after this.
+  std::unique_ptr<Profile> Consume() { return builder_.Consume(); }
+
+ private:
+  // The contents of an entry of one of the tables, with the strings and
+  // ids it refers to already remapped.
+  typedef std::vector<uint64> Key;
+  struct KeyHasher {
+    size_t operator()(const Key &key) const {
+      uint64 hash = key.size();
+      for (uint64 value : key) {
+        hash ^= value + 0x9e3779b97f4a7c15ULL + (hash << 6) + (hash >> 2);
+      }
+      return static_cast<size_t>(hash);
+    }
+  };
+  typedef std::unordered_map<Key, uint64, KeyHasher> KeyMap;
+
+  // Returns the value of key_ in |keys|, first adding it with |value| if it
+  // is not present. Sets |*inserted| to whether it was added.
+  uint64 FindOrInsert(KeyMap *keys, uint64 value, bool *inserted);
+
+  // Sets |*out| to the merged index of string |index| of the profile being
+  // added. Returns false if there is no such string.
+  bool RemapString(int64 index, int64 *out) const;
+  // Sets |*out| to the merged id of |id| in |ids|, which holds the ids of
+  // the profile being added. An id of 0 remains 0.
+  static bool RemapId(const std::unordered_map<uint64, uint64> &ids, uint64 id,
+                      uint64 *out);
+
+  bool AddSampleTypes(const Profile &src);
+  bool AddMappings(const Profile &src);
+  bool AddFunctions(const Profile &src);
+  bool AddLocations(const Profile &src);
+  bool AddSamples(const Profile &src);
+  bool AddScalars(const Profile &src);
+
+  Builder builder_;
+  Profile *profile_;
+  bool first_ = true;
+
+  // The merged ids of the strings, mappings, functions and locations of
+  // the profile being added.
+  std::vector<int64> strings_;
+  std::unordered_map<uint64, uint64> mappings_;
+  std::unordered_map<uint64, uint64> functions_;
+  std::unordered_map<uint64, uint64> locations_;
+
+  // The merged mapping, function and location ids, and the indices of the
+  // merged samples, by their contents.
+  KeyMap mapping_ids_;
+  KeyMap function_ids_;
+  KeyMap location_ids_;
+  KeyMap sample_indices_;
+  // The key being looked up.
+  Key key_;
+};
+
+uint64 ProfileMerger::FindOrInsert(KeyMap *keys, uint64 value,
+                                   bool *inserted) {
+  const auto it = keys->find(key_);
+  if (it != keys->end()) {
+    *inserted = false;
+    return it->second;
+  }
+  keys->emplace(key_, value);
+  *inserted = true;
+  return value;
+}
+
+bool ProfileMerger::RemapString(int64 index, int64 *out) const {
+  if (index == 0) {
+    // Also for a profile without a string table.
+    *out = 0;
+    return true;
+  }
+  if (index < 0 || index >= static_cast<int64>(strings_.size())) {
+    LOG(ERROR) << "Missing string " << index;
+    return false;
+  }
+  *out = strings_[index];
+  return true;
+}
+
+bool ProfileMerger::RemapId(const std::unordered_map<uint64, uint64> &ids,
+                            uint64 id, uint64 *out) {
+  if (id == 0) {
+    *out = 0;
+    return true;
+  }
+  const auto it = ids.find(id);
+  if (it == ids.end()) {
+    LOG(ERROR) << "Missing id " << id;
+    return false;
+  }
+  *out = it->second;
+  return true;
+}
+
+bool ProfileMerger::Add(const Profile &src) {
+  strings_.clear();
+  strings_.reserve(src.string_table_size());
+  for (const auto &str : src.string_table()) {
+    strings_.push_back(builder_.StringId(std::string_view(str)));
+  }
+  mappings_.clear();
+  functions_.clear();
+  locations_.clear();
+
+  if (!AddSampleTypes(src) || !AddMappings(src) || !AddFunctions(src) ||
+      !AddLocations(src) || !AddSamples(src) || !AddScalars(src)) {
+    return false;
+  }
+  first_ = false;
+  return true;
+}
+
+bool ProfileMerger::AddSampleTypes(const Profile &src) {
+  if (first_) {
+    for (const auto &src_type : src.sample_type()) {
+      auto *type = profile_->add_sample_type();
+      int64 index;
+      if (!RemapString(src_type.type(), &index)) return false;
+      type->set_type(index);
+      if (!RemapString(src_type.unit(), &index)) return false;
+      type->set_unit(index);
+    }
+    return true;
+  }
+  if (src.sample_type_size() != profile_->sample_type_size()) {
+    LOG(ERROR) << "Cannot merge a profile with " << src.sample_type_size()
+               << " sample types into one with "
+               << profile_->sample_type_size();
+    return false;
+  }
+  for (int i = 0; i < src.sample_type_size(); ++i) {
+    int64 type, unit;
+    if (!RemapString(src.sample_type(i).type(), &type) ||
+        !RemapString(src.sample_type(i).unit(), &unit)) {
+      return false;
+    }
+    if (type != profile_->sample_type(i).type() ||
+        unit != profile_->sample_type(i).unit()) {
+      LOG(ERROR) << "Cannot merge profiles with different sample types";
+      return false;
+    }
+  }
+  return true;
+}
+
+bool ProfileMerger::AddMappings(const Profile &src) {
+  for (const auto &src_mapping : src.mapping()) {
+    int64 filename, build_id;
+    if (!RemapString(src_mapping.filename(), &filename) ||
+        !RemapString(src_mapping.build_id(), &build_id)) {
+      return false;
+    }
+    key_.assign({src_mapping.memory_start(), src_mapping.memory_limit(),
+                 src_mapping.file_offset(), static_cast<uint64>(filename),
+                 static_cast<uint64>(build_id)});
+    bool inserted;
+    const uint64 id =
+        FindOrInsert(&mapping_ids_, profile_->mapping_size() + 1, &inserted);
+    Mapping *mapping;
+    if (inserted) {
+      mapping = profile_->add_mapping();
+      mapping->set_id(id);
+      mapping->set_memory_start(src_mapping.memory_start());
+      mapping->set_memory_limit(src_mapping.memory_limit());
+      mapping->set_file_offset(src_mapping.file_offset());
+      mapping->set_filename(filename);
+      mapping->set_build_id(build_id);
+    } else {
+      mapping = profile_->mutable_mapping(id - 1);
+    }
+    // A mapping has whatever any of the profiles have for it.
+    mapping->set_has_functions(mapping->has_functions() ||
+                               src_mapping.has_functions());
+    mapping->set_has_filenames(mapping->has_filenames() ||
+                               src_mapping.has_filenames());
+    mapping->set_has_line_numbers(mapping->has_line_numbers() ||
+                                  src_mapping.has_line_numbers());
+    mapping->set_has_inline_frames(mapping->has_inline_frames() ||
+                                   src_mapping.has_inline_frames());
+    if (src_mapping.id() != 0 &&
+        !mappings_.emplace(src_mapping.id(), id).second) {
+      LOG(ERROR) << "Duplicate mapping id: " << src_mapping.id();
+      return false;
+    }
+  }
+  return true;
+}
+
+bool ProfileMerger::AddFunctions(const Profile &src) {
+  for (const auto &src_function : src.function()) {
+    int64 name, system_name, filename;
+    if (!RemapString(src_function.name(), &name) ||
+        !RemapString(src_function.system_name(), &system_name) ||
+        !RemapString(src_function.filename(), &filename)) {
+      return false;
+    }
+    key_.assign({static_cast<uint64>(name), static_cast<uint64>(system_name),
+                 static_cast<uint64>(filename),
+                 static_cast<uint64>(src_function.start_line())});
+    bool inserted;
+    const uint64 id =
+        FindOrInsert(&function_ids_, profile_->function_size() + 1, &inserted);
+    if (inserted) {
+      auto *function = profile_->add_function();
+      function->set_id(id);
+      function->set_name(name);
+      function->set_system_name(system_name);
+      function->set_filename(filename);
+      function->set_start_line(src_function.start_line());
+    }
+    if (src_function.id() != 0 &&
+        !functions_.emplace(src_function.id(), id).second) {
+      LOG(ERROR) << "Duplicate function id: " << src_function.id();
+      return false;
+    }
+  }
+  return true;
+}
+
+bool ProfileMerger::AddLocations(const Profile &src) {
+  for (const auto &src_location : src.location()) {
+    uint64 mapping_id;
+    if (!RemapId(mappings_, src_location.mapping_id(), &mapping_id)) {
+      return false;
+    }
+    key_.assign({mapping_id, src_location.address(),
+                 static_cast<uint64>(src_location.is_folded())});
+    for (const auto &line : src_location.line()) {
+      uint64 function_id;
+      if (!RemapId(functions_, line.function_id(), &function_id)) {
+        return false;
+      }
+      key_.push_back(function_id);
+      key_.push_back(static_cast<uint64>(line.line()));
+    }
+    bool inserted;
+    const uint64 id =
+        FindOrInsert(&location_ids_, profile_->location_size() + 1, &inserted);
+    if (inserted) {
+      auto *location = profile_->add_location();
+      location->set_id(id);
+      location->set_mapping_id(mapping_id);
+      location->set_address(src_location.address());
+      location->set_is_folded(src_location.is_folded());
+      for (size_t i = 3; i < key_.size(); i += 2) {
+        auto *line = location->add_line();
+        line->set_function_id(key_[i]);
+        line->set_line(static_cast<int64>(key_[i + 1]));
+      }
+    }
+    if (src_location.id() != 0 &&
+        !locations_.emplace(src_location.id(), id).second) {
+      LOG(ERROR) << "Duplicate location id: " << src_location.id();
+      return false;
+    }
+  }
+  return true;
+}
+
+bool ProfileMerger::AddSamples(const Profile &src) {
+  const int num_values = profile_->sample_type_size();
+  for (const auto &src_sample : src.sample()) {
+    if (src_sample.value_size() != num_values) {
+      LOG(ERROR) << "Found sample with " << src_sample.value_size()
+                 << " values, expecting " << num_values;
+      return false;
+    }
+    key_.clear();
+    key_.push_back(src_sample.location_id_size());
+    for (uint64 src_id : src_sample.location_id()) {
+      uint64 location_id;
+      if (!RemapId(locations_, src_id, &location_id)) {
+        return false;
+      }
+      key_.push_back(location_id);
+    }
+    for (const auto &label : src_sample.label()) {
+      int64 key, str, num_unit;
+      if (!RemapString(label.key(), &key) || !RemapString(label.str(), &str) ||
+          !RemapString(label.num_unit(), &num_unit)) {
+        return false;
+      }
+      key_.push_back(static_cast<uint64>(key));
+      key_.push_back(static_cast<uint64>(str));
+      key_.push_back(static_cast<uint64>(label.num()));
+      key_.push_back(static_cast<uint64>(num_unit));
+    }
+    bool inserted;
+    const uint64 index =
+        FindOrInsert(&sample_indices_, profile_->sample_size(), &inserted);
+    if (inserted) {
+      auto *sample = profile_->add_sample();
+      const size_t num_locations = key_[0];
+      for (size_t i = 1; i <= num_locations; ++i) {
+        sample->add_location_id(key_[i]);
+      }
+      for (size_t i = 1 + num_locations; i < key_.size(); i += 4) {
+        auto *label = sample->add_label();
+        label->set_key(static_cast<int64>(key_[i]));
+        label->set_str(static_cast<int64>(key_[i + 1]));
+        label->set_num(static_cast<int64>(key_[i + 2]));
+        label->set_num_unit(static_cast<int64>(key_[i + 3]));
+      }
+      *sample->mutable_value() = src_sample.value();
+    } else {
+      auto *values = profile_->mutable_sample(index)->mutable_value();
+      for (int i = 0; i < num_values; ++i) {
+        values->Set(i, values->Get(i) + src_sample.value(i));
+      }
+    }
+  }
+  return true;
+}
+
+bool ProfileMerger::AddScalars(const Profile &src) {
+  int64 index;
+  for (int64 comment : src.comment()) {
+    if (!RemapString(comment, &index)) return false;
+    profile_->add_comment(index);
+  }
+  if (profile_->drop_frames() == 0) {
+    if (!RemapString(src.drop_frames(), &index)) return false;
+    profile_->set_drop_frames(index);
+  }
+  if (profile_->keep_frames() == 0) {
+    if (!RemapString(src.keep_frames(), &index)) return false;
+    profile_->set_keep_frames(index);
+  }
+  if (profile_->default_sample_type() == 0) {
+    if (!RemapString(src.default_sample_type(), &index)) return false;
+    profile_->set_default_sample_type(index);
+  }
+  if (!profile_->has_period_type() && src.has_period_type()) {
+    auto *period_type = profile_->mutable_period_type();
+    if (!RemapString(src.period_type().type(), &index)) return false;
+    period_type->set_type(index);
+    if (!RemapString(src.period_type().unit(), &index)) return false;
+    period_type->set_unit(index);
+  }
+  if (src.time_nanos() != 0 && (profile_->time_nanos() == 0 ||
+                                src.time_nanos() < profile_->time_nanos())) {
+    profile_->set_time_nanos(src.time_nanos());
+  }
+  profile_->set_duration_nanos(profile_->duration_nanos() +
+                               src.duration_nanos());
+  profile_->set_period(std::max(profile_->period(), src.period()));
+  return true;
+}
+
+}  // namespace
+
+bool MergeProfiles(const std::vector<const Profile *> &profiles,
+                   int num_threads, Profile *merged) {
+  if (profiles.empty()) {
+    merged->Clear();
+    return true;
+  }
+  num_threads = std::max(1, num_threads);
+
+  // Merges contiguous runs of the profiles.
+  const size_t num_runs = std::min<size_t>(profiles.size(), num_threads);
+  std::vector<std::unique_ptr<Profile>> partial(num_runs);
+  std::atomic<bool> ok(true);
+  quipper::ParallelFor(num_runs, num_threads, [&](size_t run) {
+    ProfileMerger merger;
+    const size_t begin = profiles.size() * run / num_runs;
+    const size_t end = profiles.size() * (run + 1) / num_runs;
+    for (size_t i = begin; i < end && ok; ++i) {
+      if (!merger.Add(*profiles[i])) {
+        LOG(ERROR) << "Could not merge profile " << i;
+        ok = false;
+      }
+    }
+    partial[run] = merger.Consume();
+  });
+
+  // Merges the runs pairwise, keeping them in order.
+  while (ok && partial.size() > 1) {
+    std::vector<std::unique_ptr<Profile>> next((partial.size() + 1) / 2);
+    quipper::ParallelFor(next.size(), num_threads, [&](size_t i) {
+      if (2 * i + 1 == partial.size()) {
+        next[i] = std::move(partial[2 * i]);
+        return;
+      }
+      ProfileMerger merger;
+      if (!merger.Add(*partial[2 * i]) || !merger.Add(*partial[2 * i + 1])) {
+        ok = false;
+      }
+      partial[2 * i].reset();
+      partial[2 * i + 1].reset();
+      next[i] = merger.Consume();
+    });
+    partial.swap(next);
+  }
+  if (!ok) {
+    return false;
+  }
+  merged->Swap(partial[0].get());
+  return true;
+}
+
+}  // namespace profiles
+}  // namespace perftools
@@ -0,0 +1,41 @@
+/*
+ * Copyright (c) 2016, Google Inc.
+ * All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef PERFTOOLS_PROFILES_PROTO_PROFILE_MERGE_H_
+#define PERFTOOLS_PROFILES_PROTO_PROFILE_MERGE_H_
+
+#include <vector>
+
+#include "src/builder.h"
+
+namespace perftools {
+namespace profiles {
+
+// Merges |profiles| into |merged|, replacing its contents. The string,
+// mapping, function and location tables are joined on their contents, and
+// samples with the same locations and labels are aggregated by summing
+// their values. Every entry of the merged tables is numbered in the order
+// of its first appearance across |profiles|. The time is the earliest of
+// the profiles, the duration their sum, and the period their maximum; the
+// comments are concatenated, and the remaining fields taken from the first
+// profile that sets them.
+//
+// Contiguous runs of the profiles are merged by up to |num_threads|
+// threads, and the results merged pairwise in a tree. Because of the
+// numbering by first appearance, |merged| is the same whatever
+// |num_threads| is, and only one partially merged profile per thread is
+// held at a time.
+//
+// Returns false if the profiles could not be merged, because their sample
+// types differ or one of them is not internally consistent.
+bool MergeProfiles(const std::vector<const Profile *> &profiles,
+                   int num_threads, Profile *merged);
+
+}  // namespace profiles
+}  // namespace perftools
+
+#endif  // PERFTOOLS_PROFILES_PROTO_PROFILE_MERGE_H_
@@ -0,0 +1,184 @@
+/*
+ * Copyright (c) 2016, Google Inc.
+ * All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include "src/profile_merge.h"
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace perftools {
+namespace profiles {
+namespace {
+
+// Returns a profile of |num_samples| samples over |num_functions|
+// functions in two mappings, with strings and ids numbered according to
+// |seed| so that the profiles of different seeds overlap but differ.
+Profile MakeProfile(int seed, int num_samples, int num_functions) {
+  Builder builder;
+  Profile* profile = builder.mutable_profile();
+  // Interns some strings first so that the indices differ between seeds.
+  for (int i = 0; i < seed % 5; ++i) {
+    builder.StringId(("unused_" + std::to_string(seed * 10 + i)).c_str());
+  }
+  auto* sample_type = profile->add_sample_type();
+  sample_type->set_type(builder.StringId("samples"));
+  sample_type->set_unit(builder.StringId("count"));
+  sample_type = profile->add_sample_type();
+  sample_type->set_type(builder.StringId("cpu"));
+  sample_type->set_unit(builder.StringId("nanoseconds"));
+  profile->set_time_nanos(1000 + seed);
+  profile->set_duration_nanos(10);
+  profile->set_period(seed);
+  profile->add_comment(builder.StringId(("host" + std::to_string(seed % 3))
+                                            .c_str()));
+  for (int i = 0; i < 2; ++i) {
+    auto* mapping = profile->add_mapping();
+    mapping->set_id(10 * seed + i + 1);
+    mapping->set_memory_start(0x10000 * (i + 1));
+    mapping->set_memory_limit(0x10000 * (i + 2) - 1);
+    mapping->set_filename(builder.StringId(i == 0 ? "/bin/app" : "/lib.so"));
+    mapping->set_has_functions(seed % 2 == i);
+  }
+  std::vector<uint64> function_ids;
+  for (int i = 0; i < num_functions; ++i) {
+    const std::string name = "fn" + std::to_string((i + seed) % num_functions);
+    function_ids.push_back(
+        builder.FunctionId(name.c_str(), name.c_str(), "file.cc", 0));
+  }
+  for (int i = 0; i < num_functions; ++i) {
+    auto* location = profile->add_location();
+    // Ids need not be dense.
+    location->set_id(1000 * seed + 7 * i + 1);
+    const int address_index = (i + seed) % num_functions;
+    location->set_mapping_id(10 * seed + address_index % 2 + 1);
+    location->set_address(0x10000 * (address_index % 2 + 1) + address_index);
+    auto* line = location->add_line();
+    line->set_function_id(function_ids[i]);
+    line->set_line(address_index);
+  }
+  const int64 pid = builder.StringId("pid");
+  for (int i = 0; i < num_samples; ++i) {
+    auto* sample = profile->add_sample();
+    for (int j = 0; j <= i % 4; ++j) {
+      const int location_index = (i * 3 + j) % num_functions;
+      sample->add_location_id(1000 * seed + 7 * location_index + 1);
+    }
+    sample->add_value(1);
+    sample->add_value(i);
+    auto* label = sample->add_label();
+    label->set_key(pid);
+    label->set_num(i % 3);
+  }
+  EXPECT_TRUE(builder.Finalize());
+  return *builder.Consume();
+}
+
+std::vector<const Profile*> Pointers(const std::vector<Profile>& profiles) {
+  std::vector<const Profile*> pointers;
+  for (const auto& profile : profiles) {
+    pointers.push_back(&profile);
+  }
+  return pointers;
+}
+
+// Returns the total of each of the values of the samples of |profile|.
+std::vector<int64> Totals(const Profile& profile) {
+  std::vector<int64> totals(profile.sample_type_size());
+  for (const auto& sample : profile.sample()) {
+    for (int i = 0; i < sample.value_size(); ++i) {
+      totals[i] += sample.value(i);
+    }
+  }
+  return totals;
+}
+
+TEST(ProfileMergeTest, MergesTablesAndAggregatesSamples) {
+  const std::vector<Profile> profiles = {MakeProfile(1, 20, 8),
+                                         MakeProfile(2, 30, 8)};
+  Profile merged;
+  ASSERT_TRUE(MergeProfiles(Pointers(profiles), 1, &merged));
+  EXPECT_TRUE(Builder::CheckValid(merged));
+
+  // Both profiles have the same two mappings, functions and locations.
+  EXPECT_EQ(2, merged.mapping_size());
+  EXPECT_TRUE(merged.mapping(0).has_functions());
+  EXPECT_TRUE(merged.mapping(1).has_functions());
+  EXPECT_EQ(8, merged.function_size());
+  EXPECT_EQ(8, merged.location_size());
+  EXPECT_LT(merged.sample_size(), 50);
+  const std::vector<int64> totals1 = Totals(profiles[0]);
+  const std::vector<int64> totals2 = Totals(profiles[1]);
+  EXPECT_EQ((std::vector<int64>{totals1[0] + totals2[0],
+                                totals1[1] + totals2[1]}),
+            Totals(merged));
+
+  EXPECT_EQ(1001, merged.time_nanos());
+  EXPECT_EQ(20, merged.duration_nanos());
+  EXPECT_EQ(2, merged.period());
+  ASSERT_EQ(2, merged.comment_size());
+  EXPECT_EQ("host1", merged.string_table(merged.comment(0)));
+  EXPECT_EQ("host2", merged.string_table(merged.comment(1)));
+  EXPECT_EQ("samples", merged.string_table(merged.sample_type(0).type()));
+}
+
+TEST(ProfileMergeTest, ParallelMergeMatchesSequentialMerge) {
+  std::vector<Profile> profiles;
+  for (int seed = 0; seed < 37; ++seed) {
+    profiles.push_back(MakeProfile(seed, 50 + seed, 10 + seed % 7));
+  }
+  Profile sequential;
+  ASSERT_TRUE(MergeProfiles(Pointers(profiles), 1, &sequential));
+  EXPECT_TRUE(Builder::CheckValid(sequential));
+  for (int num_threads : {2, 3, 4, 8, 64}) {
+    Profile parallel;
+    ASSERT_TRUE(MergeProfiles(Pointers(profiles), num_threads, &parallel));
+    EXPECT_EQ(sequential.SerializeAsString(), parallel.SerializeAsString())
+        << num_threads << " threads";
+  }
+}
+
+TEST(ProfileMergeTest, RejectsIncompatibleProfiles) {
+  Profile merged;
+  std::vector<Profile> profiles = {MakeProfile(1, 5, 4), MakeProfile(2, 5, 4)};
+  profiles[1].mutable_sample_type(1)->set_unit(
+      profiles[1].sample_type(0).unit());
+  EXPECT_FALSE(MergeProfiles(Pointers(profiles), 1, &merged));
+  EXPECT_FALSE(MergeProfiles(Pointers(profiles), 2, &merged));
+
+  profiles = {MakeProfile(1, 5, 4), MakeProfile(2, 5, 4)};
+  profiles[1].mutable_sample(0)->add_location_id(12345);
+  EXPECT_FALSE(MergeProfiles(Pointers(profiles), 2, &merged));
+
+  profiles = {MakeProfile(1, 5, 4), MakeProfile(2, 5, 4)};
+  // A string that does not exist.
+  profiles[0].mutable_mapping(0)->set_filename(
+      profiles[0].string_table_size());
+  EXPECT_FALSE(MergeProfiles(Pointers(profiles), 1, &merged));
+}
+
+TEST(ProfileMergeTest, MergesNoProfiles) {
+  Profile merged;
+  merged.add_sample();
+  ASSERT_TRUE(MergeProfiles({}, 4, &merged));
+  EXPECT_EQ(0, merged.sample_size());
+
+  const Profile empty;
+  ASSERT_TRUE(MergeProfiles({&empty, &empty}, 2, &merged));
+  ASSERT_EQ(1, merged.string_table_size());
+  EXPECT_EQ("", merged.string_table(0));
+}
+
+}  // namespace
+}  // namespace profiles
+}  // namespace perftools
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -6,23 +6,40 @@
 
 #include <stdint.h>
 
+#include <algorithm>
 #include <vector>
 
 #include "base/logging.h"
 
 namespace quipper {
 
-AddressMapper::AddressMapper(const AddressMapper& other) {
-  // Copy over most members naively.
-  mappings_ = other.mappings_;
-  page_alignment_ = other.page_alignment_;
+namespace {
 
-  // Reconstruct mapping of real addresses to mapped ranges.
-  for (auto iter = mappings_.begin(); iter != mappings_.end(); ++iter) {
-    real_addr_to_mapped_range_[iter->real_addr] = iter;
-  }
+// Orders ranges by their real address, for searches of the real address
+// blocks.
+template <typename Range>
+bool RealAddrLess(const Range& range, uint64_t real_addr) {
+  return range.real_addr < real_addr;
+}
+
+template <typename Range>
+bool RealAddrGreater(uint64_t real_addr, const Range& range) {
+  return real_addr < range.real_addr;
+}
+
+// Returns the treap priority of a range at |mapped_addr|. This is a bijective
+// mix of the address, so no two ranges share a priority.
+uint64_t Priority(uint64_t mapped_addr) {
+  mapped_addr ^= mapped_addr >> 33;
+  mapped_addr *= 0xff51afd7ed558ccdULL;
+  mapped_addr ^= mapped_addr >> 33;
+  mapped_addr *= 0xc4ceb9fe1a85ec53ULL;
+  mapped_addr ^= mapped_addr >> 33;
+  return mapped_addr;
 }
 
+}  // namespace
+
 bool AddressMapper::MapWithID(const uint64_t real_addr, const uint64_t size,
                               const uint64_t id, const uint64_t offset_base,
                               bool remove_existing_mappings,
@@ -54,42 +71,39 @@ bool AddressMapper::MapWithID(const uint64_t real_addr, const uint64_t size,
   // Check for collision with an existing mapping. This must be an overlap that
   // does not result in one range being completely covered by another.
 
-  // First determine the range of mappings that could overlap with the new
-  // mapping in real space.
-
-  // lower_bound returns the first range with starting addr >= |real_addr|. The
-  // preceding range could also possibly overlap with the new range.
-  auto map_iter_start = real_addr_to_mapped_range_.lower_bound(real_addr);
-  if (map_iter_start != real_addr_to_mapped_range_.begin()) --map_iter_start;
-  // lower_bound returns the first range with starting addr beyond the end of
-  // the new mapping range.
-  auto map_iter_end = real_addr_to_mapped_range_.lower_bound(real_addr + size);
-
-  std::vector<MappingList::iterator> mappings_to_delete;
-  MappingList::iterator old_range_iter = mappings_.end();
-  for (auto map_iter = map_iter_start; map_iter != map_iter_end; ++map_iter) {
-    auto iter = map_iter->second;
-    if (!iter->Intersects(range)) continue;
-    // Quit if existing ranges that collide aren't supposed to be removed.
-    if (!remove_existing_mappings) return false;
-    if (old_range_iter == mappings_.end() && iter->Covers(range) &&
-        iter->size > range.size) {
-      old_range_iter = iter;
-      continue;
+  // The mappings that could overlap with the new mapping in real space start
+  // from the last one that begins before |real_addr|, and end with the last
+  // one that begins before the end of the new mapping, which may be the end of
+  // the address space.
+  uint32_t iter = FindRealBelow(real_addr, false);
+  if (iter == kNoRange) iter = FindRealAbove(real_addr, true);
+  bool has_old_range = false;
+  uint32_t old_index = kNoRange;
+  MappedRange old_range = {};
+  while (iter != kNoRange && (real_addr + size == 0 ||
+                              mappings_[iter].real_addr < real_addr + size)) {
+    const MappedRange& existing = mappings_[iter];
+    const uint32_t next = FindRealAbove(existing.real_addr, false);
+    if (existing.Intersects(range)) {
+      // Quit if existing ranges that collide aren't supposed to be removed.
+      if (!remove_existing_mappings) return false;
+      if (!has_old_range && existing.Covers(range) &&
+          existing.size > range.size) {
+        // Make a copy of the old mapping before removing it.
+        old_range = existing;
+        old_index = iter;
+        has_old_range = true;
+      } else {
+        Unmap(iter);
+      }
     }
-    mappings_to_delete.push_back(iter);
+    iter = next;
   }
 
-  for (MappingList::iterator mapping_iter : mappings_to_delete)
-    Unmap(mapping_iter);
-  mappings_to_delete.clear();
-
   // Otherwise check for this range being covered by another range.  If that
   // happens, split or reduce the existing range to make room.
-  if (old_range_iter != mappings_.end()) {
-    // Make a copy of the old mapping before removing it.
-    const MappedRange old_range = *old_range_iter;
-    Unmap(old_range_iter);
+  if (has_old_range) {
+    Unmap(old_index);
 
     uint64_t gap_before = range.real_addr - old_range.real_addr;
     uint64_t gap_after =
@@ -149,28 +163,30 @@ bool AddressMapper::MapWithID(const uint64_t real_addr, const uint64_t size,
   // If there is no existing mapping, add it to the beginning of quipper space.
   if (IsEmpty()) {
     range.mapped_addr = page_offset;
-    range.unmapped_space_after = UINT64_MAX - range.size - page_offset;
-    mappings_.push_back(range);
-    real_addr_to_mapped_range_.insert(
-        std::make_pair(range.real_addr, mappings_.begin()));
+    Insert(range, UINT64_MAX - range.size - page_offset);
     return true;
   }
 
   // If there is space before the first mapped range in quipper space, use it.
-  if (mappings_.begin()->mapped_addr >= range.size + page_offset) {
+  const uint64_t first_mapped_addr =
+      mappings_[FindMappedAbove(0, true)].mapped_addr;
+  if (first_mapped_addr >= range.size + page_offset) {
     range.mapped_addr = page_offset;
-    range.unmapped_space_after =
-        mappings_.begin()->mapped_addr - range.size - page_offset;
-    mappings_.push_front(range);
-    MappingList::iterator iter = mappings_.begin();
-    real_addr_to_mapped_range_.insert(std::make_pair(range.real_addr, iter));
+    Insert(range, first_mapped_addr - range.size - page_offset);
     return true;
   }
 
   // Otherwise, search through the existing mappings for a free block after one
-  // of them.
-  for (auto iter = mappings_.begin(); iter != mappings_.end(); ++iter) {
-    MappedRange& existing_mapping = *iter;
+  // of them. The tree skips those with less unmapped space after them than the
+  // new mapping and its page offset need. With page alignment, the next page
+  // boundary may still leave too little space, and then the search goes on.
+  for (uint32_t iter =
+           FindUnmappedSpace(mapped_root_, range.size + page_offset, 0);
+       iter != kNoRange;
+       iter = FindUnmappedSpace(mapped_root_, range.size + page_offset,
+                                mappings_[iter].mapped_addr + 1)) {
+    const MappedRange& existing_mapping = mappings_[iter];
+    uint64_t unmapped_space_after;
     if (page_alignment_) {
       uint64_t end_of_existing_mapping =
           existing_mapping.mapped_addr + existing_mapping.size;
@@ -194,22 +210,17 @@ bool AddressMapper::MapWithID(const uint64_t real_addr, const uint64_t size,
       if (end_of_new_mapping > end_of_unmapped_space_after) continue;
 
       range.mapped_addr = next_page_boundary + mapping_offset;
-      range.unmapped_space_after =
-          end_of_unmapped_space_after - end_of_new_mapping;
-      existing_mapping.unmapped_space_after =
-          range.mapped_addr - end_of_existing_mapping;
+      unmapped_space_after = end_of_unmapped_space_after - end_of_new_mapping;
+      SetUnmappedSpaceAfter(mapped_root_, existing_mapping.mapped_addr,
+                            range.mapped_addr - end_of_existing_mapping);
     } else {
-      if (existing_mapping.unmapped_space_after < range.size) continue;
       // Insert the new mapping range immediately after the existing one.
       range.mapped_addr = existing_mapping.mapped_addr + existing_mapping.size;
-      range.unmapped_space_after =
-          existing_mapping.unmapped_space_after - range.size;
-      existing_mapping.unmapped_space_after = 0;
+      unmapped_space_after = existing_mapping.unmapped_space_after - range.size;
+      SetUnmappedSpaceAfter(mapped_root_, existing_mapping.mapped_addr, 0);
     }
 
-    mappings_.insert(++iter, range);
-    --iter;
-    real_addr_to_mapped_range_.insert(std::make_pair(range.real_addr, iter));
+    Insert(range, unmapped_space_after);
     return true;
   }
 
@@ -222,12 +233,14 @@ bool AddressMapper::MapWithID(const uint64_t real_addr, const uint64_t size,
 }
 
 void AddressMapper::DumpToLog() const {
-  MappingList::const_iterator it;
-  for (it = mappings_.begin(); it != mappings_.end(); ++it) {
-    LOG(INFO) << " real_addr: 0x" << std::hex << it->real_addr << " mapped: 0x"
-              << std::hex << it->mapped_addr << " base: 0x" << std::hex
-              << it->mapped_addr << " id: 0x" << std::hex << it->id
-              << " size: 0x" << std::hex << it->size;
+  for (const auto& entries : real_blocks_) {
+    for (const RealAddrEntry& entry : entries) {
+      const MappedRange* it = &mappings_[entry.index];
+      LOG(INFO) << " real_addr: 0x" << std::hex << it->real_addr
+                << " mapped: 0x" << std::hex << it->mapped_addr << " base: 0x"
+                << std::hex << it->mapped_addr << " id: 0x" << std::hex
+                << it->id << " size: 0x" << std::hex << it->size;
+    }
   }
 }
 
@@ -257,46 +270,285 @@ void AddressMapper::GetMappedIDAndOffset(
 uint64_t AddressMapper::GetMaxMappedLength() const {
   if (IsEmpty()) return 0;
 
-  uint64_t min = mappings_.begin()->mapped_addr;
-
-  MappingList::const_iterator iter = mappings_.end();
-  --iter;
-  uint64_t max = iter->mapped_addr + iter->size;
+  const MappedRange& front = mappings_[FindMappedAbove(0, true)];
+  const MappedRange& back = mappings_[FindMappedBelow(UINT64_MAX, true)];
+  uint64_t min = front.mapped_addr;
+  uint64_t max = back.mapped_addr + back.size;
 
   return max - min;
 }
 
-void AddressMapper::Unmap(MappingList::iterator mapping_iter) {
+void AddressMapper::Unmap(uint32_t index) {
+  const MappedRange& range = mappings_[index];
   // Add the freed up space to the free space counter of the previous
   // mapped region, if it exists.
-  if (mapping_iter != mappings_.begin()) {
-    const MappedRange& range = *mapping_iter;
-    MappingList::iterator previous_range_iter = std::prev(mapping_iter);
-    previous_range_iter->unmapped_space_after +=
-        range.size + range.unmapped_space_after;
+  const uint32_t prev = FindMappedBelow(range.mapped_addr, false);
+  if (prev != kNoRange) {
+    SetUnmappedSpaceAfter(mapped_root_, mappings_[prev].mapped_addr,
+                          mappings_[prev].unmapped_space_after + range.size +
+                              range.unmapped_space_after);
+  }
+  RemoveFromTree(&mapped_root_, range.mapped_addr);
+  RemoveRealAddrEntry(range.real_addr);
+  free_slots_.push_back(index);
+}
+
+void AddressMapper::Insert(const MappedRange& range,
+                           uint64_t unmapped_space_after) {
+  uint32_t index;
+  if (free_slots_.empty()) {
+    index = mappings_.size();
+    mappings_.push_back(range);
+  } else {
+    index = free_slots_.back();
+    free_slots_.pop_back();
+    mappings_[index] = range;
   }
-  real_addr_to_mapped_range_.erase(mapping_iter->real_addr);
-  mappings_.erase(mapping_iter);
+  MappedRange& inserted = mappings_[index];
+  inserted.unmapped_space_after = unmapped_space_after;
+  inserted.max_unmapped_space = unmapped_space_after;
+  inserted.mapped_left = inserted.mapped_right = kNoRange;
+  AddToTree(&mapped_root_, index);
+  AddRealAddrEntry(range.real_addr, index);
 }
 
 AddressMapper::MappingList::const_iterator
 AddressMapper::GetRangeContainingAddress(uint64_t real_addr) const {
-  // Find the first range that has a higher real address than the given one.
-  MappingMap::const_iterator target_map_iter =
-      real_addr_to_mapped_range_.upper_bound(real_addr);
-
-  if (target_map_iter == real_addr_to_mapped_range_.begin()) {
-    // The lowest real address in existing mappings is higher than the new
-    // mapping address, so |real_addr| does not fall into any mapping.
+  // Only the last range that starts at or before |real_addr| could contain it.
+  const uint32_t index = FindRealBelow(real_addr, true);
+  if (index == kNoRange || !mappings_[index].ContainsAddress(real_addr)) {
     return mappings_.end();
   }
+  return mappings_.begin() + index;
+}
+
+uint32_t AddressMapper::FindRealBelow(uint64_t addr, bool or_equal) const {
+  // The range is in the last block that starts below |addr|, or at it.
+  auto start = or_equal ? std::upper_bound(real_block_starts_.begin(),
+                                           real_block_starts_.end(), addr)
+                        : std::lower_bound(real_block_starts_.begin(),
+                                           real_block_starts_.end(), addr);
+  if (start == real_block_starts_.begin()) return kNoRange;
+  const auto& entries =
+      real_blocks_[std::prev(start) - real_block_starts_.begin()];
+  auto entry = or_equal ? std::upper_bound(entries.begin(), entries.end(), addr,
+                                           RealAddrGreater<RealAddrEntry>)
+                        : std::lower_bound(entries.begin(), entries.end(), addr,
+                                           RealAddrLess<RealAddrEntry>);
+  return std::prev(entry)->index;
+}
+
+uint32_t AddressMapper::FindRealAbove(uint64_t addr, bool or_equal) const {
+  // The range is in the last block that starts at or below |addr|, or else it
+  // starts the next block.
+  auto start = std::upper_bound(real_block_starts_.begin(),
+                                real_block_starts_.end(), addr);
+  if (start != real_block_starts_.begin()) {
+    const auto& entries =
+        real_blocks_[std::prev(start) - real_block_starts_.begin()];
+    auto entry = or_equal ? std::lower_bound(entries.begin(), entries.end(),
+                                             addr, RealAddrLess<RealAddrEntry>)
+                          : std::upper_bound(entries.begin(), entries.end(),
+                                             addr,
+                                             RealAddrGreater<RealAddrEntry>);
+    if (entry != entries.end()) return entry->index;
+  }
+  if (start == real_block_starts_.end()) return kNoRange;
+  return real_blocks_[start - real_block_starts_.begin()].front().index;
+}
 
-  // Otherwise, the previous mapping could possibly contain |real_addr|.
-  --target_map_iter;
-  MappingList::const_iterator list_iter = target_map_iter->second;
-  if (!list_iter->ContainsAddress(real_addr)) return mappings_.end();
+void AddressMapper::AddRealAddrEntry(uint64_t real_addr, uint32_t index) {
+  if (real_blocks_.empty()) {
+    real_blocks_.emplace_back();
+    real_block_starts_.push_back(real_addr);
+  }
+  // Add the entry to the last block that starts at or before it, or to the
+  // first block if there is none.
+  size_t block = std::upper_bound(real_block_starts_.begin(),
+                                  real_block_starts_.end(), real_addr) -
+                 real_block_starts_.begin();
+  if (block > 0) --block;
+  auto& entries = real_blocks_[block];
+  entries.insert(std::upper_bound(entries.begin(), entries.end(), real_addr,
+                                  RealAddrGreater<RealAddrEntry>),
+                 RealAddrEntry{real_addr, index});
+  real_block_starts_[block] = entries.front().real_addr;
+  if (entries.size() <= kMaxRealBlockSize) return;
+
+  // Move the upper half of a full block to a new one after it.
+  std::vector<RealAddrEntry> upper(entries.begin() + entries.size() / 2,
+                                   entries.end());
+  entries.resize(entries.size() / 2);
+  real_block_starts_.insert(real_block_starts_.begin() + block + 1,
+                            upper.front().real_addr);
+  real_blocks_.insert(real_blocks_.begin() + block + 1, std::move(upper));
+}
 
-  return list_iter;
+void AddressMapper::RemoveRealAddrEntry(uint64_t real_addr) {
+  const size_t block = std::upper_bound(real_block_starts_.begin(),
+                                        real_block_starts_.end(), real_addr) -
+                       real_block_starts_.begin() - 1;
+  auto& entries = real_blocks_[block];
+  auto entry = std::lower_bound(entries.begin(), entries.end(), real_addr,
+                                RealAddrLess<RealAddrEntry>);
+  CHECK(entry != entries.end() && entry->real_addr == real_addr);
+  entries.erase(entry);
+  if (!entries.empty()) real_block_starts_[block] = entries.front().real_addr;
+
+  // Keep the blocks from dwindling, so that there are at most about twice as
+  // many as full blocks would take. An empty block merges with either
+  // neighbor, and goes away with the last range.
+  MergeRealBlocks(block);
+  if (block > 0) MergeRealBlocks(block - 1);
+  if (real_blocks_.size() == 1 && real_blocks_.front().empty()) {
+    real_blocks_.clear();
+    real_block_starts_.clear();
+  }
+}
+
+void AddressMapper::MergeRealBlocks(size_t block) {
+  if (block + 1 >= real_blocks_.size() ||
+      real_blocks_[block].size() + real_blocks_[block + 1].size() >
+          kMaxRealBlockSize) {
+    return;
+  }
+  auto& entries = real_blocks_[block];
+  const auto& next = real_blocks_[block + 1];
+  entries.insert(entries.end(), next.begin(), next.end());
+  real_block_starts_[block] = entries.front().real_addr;
+  real_blocks_.erase(real_blocks_.begin() + block + 1);
+  real_block_starts_.erase(real_block_starts_.begin() + block + 1);
+}
+
+uint32_t AddressMapper::FindMappedBelow(uint64_t addr, bool or_equal) const {
+  uint32_t found = kNoRange;
+  for (uint32_t node = mapped_root_; node != kNoRange;) {
+    const MappedRange& range = mappings_[node];
+    if (range.mapped_addr < addr || (or_equal && range.mapped_addr == addr)) {
+      found = node;
+      node = range.mapped_right;
+    } else {
+      node = range.mapped_left;
+    }
+  }
+  return found;
+}
+
+uint32_t AddressMapper::FindMappedAbove(uint64_t addr, bool or_equal) const {
+  uint32_t found = kNoRange;
+  for (uint32_t node = mapped_root_; node != kNoRange;) {
+    const MappedRange& range = mappings_[node];
+    if (range.mapped_addr > addr || (or_equal && range.mapped_addr == addr)) {
+      found = node;
+      node = range.mapped_left;
+    } else {
+      node = range.mapped_right;
+    }
+  }
+  return found;
+}
+
+uint32_t AddressMapper::Merge(uint32_t left, uint32_t right) {
+  if (left == kNoRange) return right;
+  if (right == kNoRange) return left;
+  if (Priority(mappings_[left].mapped_addr) >
+      Priority(mappings_[right].mapped_addr)) {
+    const uint32_t merged = Merge(mappings_[left].mapped_right, right);
+    mappings_[left].mapped_right = merged;
+    UpdateMaxUnmappedSpace(left);
+    return left;
+  }
+  const uint32_t merged = Merge(left, mappings_[right].mapped_left);
+  mappings_[right].mapped_left = merged;
+  UpdateMaxUnmappedSpace(right);
+  return right;
+}
+
+void AddressMapper::Split(uint32_t root, uint64_t mapped_addr, uint32_t* less,
+                          uint32_t* rest) {
+  if (root == kNoRange) {
+    *less = *rest = kNoRange;
+    return;
+  }
+  MappedRange& range = mappings_[root];
+  if (range.mapped_addr < mapped_addr) {
+    uint32_t right_less;
+    Split(range.mapped_right, mapped_addr, &right_less, rest);
+    range.mapped_right = right_less;
+    *less = root;
+  } else {
+    uint32_t left_rest;
+    Split(range.mapped_left, mapped_addr, less, &left_rest);
+    range.mapped_left = left_rest;
+    *rest = root;
+  }
+  UpdateMaxUnmappedSpace(root);
+}
+
+void AddressMapper::AddToTree(uint32_t* root, uint32_t index) {
+  uint32_t less, rest;
+  Split(*root, mappings_[index].mapped_addr, &less, &rest);
+  *root = Merge(Merge(less, index), rest);
+}
+
+void AddressMapper::RemoveFromTree(uint32_t* root, uint64_t mapped_addr) {
+  CHECK_NE(*root, kNoRange);
+  MappedRange& range = mappings_[*root];
+  if (mapped_addr < range.mapped_addr) {
+    RemoveFromTree(&range.mapped_left, mapped_addr);
+  } else if (mapped_addr > range.mapped_addr) {
+    RemoveFromTree(&range.mapped_right, mapped_addr);
+  } else {
+    *root = Merge(range.mapped_left, range.mapped_right);
+    return;
+  }
+  UpdateMaxUnmappedSpace(*root);
+}
+
+void AddressMapper::UpdateMaxUnmappedSpace(uint32_t index) {
+  MappedRange& range = mappings_[index];
+  range.max_unmapped_space = range.unmapped_space_after;
+  if (range.mapped_left != kNoRange) {
+    range.max_unmapped_space =
+        std::max(range.max_unmapped_space,
+                 mappings_[range.mapped_left].max_unmapped_space);
+  }
+  if (range.mapped_right != kNoRange) {
+    range.max_unmapped_space =
+        std::max(range.max_unmapped_space,
+                 mappings_[range.mapped_right].max_unmapped_space);
+  }
+}
+
+uint32_t AddressMapper::FindUnmappedSpace(uint32_t root, uint64_t size,
+                                          uint64_t min_mapped_addr) const {
+  if (root == kNoRange || mappings_[root].max_unmapped_space < size) {
+    return kNoRange;
+  }
+  const MappedRange& range = mappings_[root];
+  if (range.mapped_addr >= min_mapped_addr) {
+    const uint32_t found =
+        FindUnmappedSpace(range.mapped_left, size, min_mapped_addr);
+    if (found != kNoRange) return found;
+    if (range.unmapped_space_after >= size) return root;
+  }
+  return FindUnmappedSpace(range.mapped_right, size, min_mapped_addr);
+}
+
+void AddressMapper::SetUnmappedSpaceAfter(uint32_t root, uint64_t mapped_addr,
+                                          uint64_t unmapped_space_after) {
+  CHECK_NE(root, kNoRange);
+  MappedRange& range = mappings_[root];
+  if (mapped_addr < range.mapped_addr) {
+    SetUnmappedSpaceAfter(range.mapped_left, mapped_addr,
+                          unmapped_space_after);
+  } else if (mapped_addr > range.mapped_addr) {
+    SetUnmappedSpaceAfter(range.mapped_right, mapped_addr,
+                          unmapped_space_after);
+  } else {
+    range.unmapped_space_after = unmapped_space_after;
+  }
+  UpdateMaxUnmappedSpace(root);
 }
 
 }  // namespace quipper
@@ -8,8 +8,7 @@
 #include <stddef.h>
 #include <stdint.h>
 
-#include <list>
-#include <map>
+#include <vector>
 
 namespace quipper {
 
@@ -18,14 +17,16 @@ class AddressMapper {
   struct MappedRange;
 
  public:
-  AddressMapper() : page_alignment_(0) {}
+  AddressMapper() : mapped_root_(kNoRange), page_alignment_(0) {}
 
   // Copy constructor: copies mappings from |source| to this AddressMapper. This
   // is useful for copying mappings from parent to child process upon fork(). It
   // is also useful to copy kernel mappings to any process that is created.
-  AddressMapper(const AddressMapper& other);
+  // The mappings and their indices are flat arrays, so this is a few array
+  // copies.
+  AddressMapper(const AddressMapper& other) = default;
 
-  typedef std::list<MappedRange> MappingList;
+  typedef std::vector<MappedRange> MappingList;
 
   // Maps a new address range [real_addr, real_addr + length) to quipper space.
   // |id| is an identifier value to be stored along with the mapping.
@@ -51,7 +52,7 @@ class AddressMapper {
                  bool allow_unaligned_jit_mappings);
 
   // Looks up |real_addr| and returns the mapped address and MappingList
-  // iterator.
+  // iterator. The iterator is valid until the next change to the mappings.
   bool GetMappedAddressAndListIterator(const uint64_t real_addr,
                                        uint64_t* mapped_addr,
                                        MappingList::const_iterator* iter) const;
@@ -64,10 +65,12 @@ class AddressMapper {
                             uint64_t* id, uint64_t* offset) const;
 
   // Returns true if there are no mappings.
-  bool IsEmpty() const { return mappings_.empty(); }
+  bool IsEmpty() const { return mapped_root_ == kNoRange; }
 
   // Returns the number of address ranges that are currently mapped.
-  size_t GetNumMappedRanges() const { return mappings_.size(); }
+  size_t GetNumMappedRanges() const {
+    return mappings_.size() - free_slots_.size();
+  }
 
   // Returns the maximum length of quipper space containing mapped areas.
   // There may be gaps in between blocks.
@@ -88,8 +91,6 @@ class AddressMapper {
   void DumpToLog() const;
 
  private:
-  typedef std::map<uint64_t, MappingList::iterator> MappingMap;
-
   struct MappedRange {
     uint64_t real_addr;
     uint64_t mapped_addr;
@@ -98,8 +99,15 @@ class AddressMapper {
     uint64_t id;
     uint64_t offset_base;
 
-    // Length of unmapped space after this range.
+    // Length of unmapped space after this range in quipper space, and the
+    // greatest such length in this range's subtree of the quipper space tree.
     uint64_t unmapped_space_after;
+    uint64_t max_unmapped_space;
+
+    // Indices in |mappings_| of the children of this range in the quipper
+    // space tree, or kNoRange.
+    uint32_t mapped_left;
+    uint32_t mapped_right;
 
     // Determines if this range intersects another range in real space.
     inline bool Intersects(const MappedRange& range) const {
@@ -126,14 +134,81 @@ class AddressMapper {
     }
   };
 
+  // Marks a missing range, child or tree.
+  static constexpr uint32_t kNoRange = UINT32_MAX;
+
+  // The most ranges that a block of |real_blocks_| holds.
+  static constexpr size_t kMaxRealBlockSize = 256;
+
+  // A range in |mappings_|, at |index|, ordered by its real address.
+  struct RealAddrEntry {
+    uint64_t real_addr;
+    uint32_t index;
+  };
+
   // Returns an iterator to a MappedRange in |mappings_| that contains
   // |real_addr|. Returns |mappings_.end()| if no range contains |real_addr|.
   MappingList::const_iterator GetRangeContainingAddress(
       uint64_t real_addr) const;
 
-  // Removes an existing address mapping, given by an iterator pointing to an
-  // element of |mappings_|.
-  void Unmap(MappingList::iterator mapping_iter);
+  // Removes the existing address mapping at |index| in |mappings_|.
+  void Unmap(uint32_t index);
+
+  // Adds |range| to |mappings_| with |unmapped_space_after| of unmapped space
+  // after it in quipper space.
+  void Insert(const MappedRange& range, uint64_t unmapped_space_after);
+
+  // Returns the index in |mappings_| of the range with the greatest real or
+  // mapped address below |addr|, or at |addr| too if |or_equal| is set.
+  // Returns kNoRange if there is none.
+  uint32_t FindRealBelow(uint64_t addr, bool or_equal) const;
+  uint32_t FindMappedBelow(uint64_t addr, bool or_equal) const;
+
+  // Likewise, for the lowest real or mapped address above |addr|.
+  uint32_t FindRealAbove(uint64_t addr, bool or_equal) const;
+  uint32_t FindMappedAbove(uint64_t addr, bool or_equal) const;
+
+  // Adds the range at |index| in |mappings_| to |real_blocks_|, or removes the
+  // one at |real_addr|.
+  void AddRealAddrEntry(uint64_t real_addr, uint32_t index);
+  void RemoveRealAddrEntry(uint64_t real_addr);
+
+  // Merges the blocks at |block| and |block + 1| in |real_blocks_| if they fit
+  // in one.
+  void MergeRealBlocks(size_t block);
+
+  // Operations on the quipper space tree, a treap whose priorities are hashes
+  // of the mapped addresses, so that its shape depends only on the ranges it
+  // holds.
+
+  // Joins the trees at |left| and |right|, whose ranges all come first in
+  // |left|, and returns the root of the result.
+  uint32_t Merge(uint32_t left, uint32_t right);
+
+  // Splits the tree at |root| into the ranges below |mapped_addr|, at |*less|,
+  // and the rest, at |*rest|.
+  void Split(uint32_t root, uint64_t mapped_addr, uint32_t* less,
+             uint32_t* rest);
+
+  // Adds the range at |index| to the tree at |*root|, or removes the one at
+  // |mapped_addr|.
+  void AddToTree(uint32_t* root, uint32_t index);
+  void RemoveFromTree(uint32_t* root, uint64_t mapped_addr);
+
+  // Recomputes |max_unmapped_space| of the range at |index| from its own and
+  // its children's.
+  void UpdateMaxUnmappedSpace(uint32_t index);
+
+  // Returns the first range in quipper space, at |min_mapped_addr| or after
+  // it, that has at least |size| of unmapped space after it. Returns kNoRange
+  // if there is none.
+  uint32_t FindUnmappedSpace(uint32_t root, uint64_t size,
+                             uint64_t min_mapped_addr) const;
+
+  // Sets the unmapped space after the range at |mapped_addr| in quipper space,
+  // in the tree at |root|.
+  void SetUnmappedSpaceAfter(uint32_t root, uint64_t mapped_addr,
+                             uint64_t unmapped_space_after);
 
   // Given an address, and a nonzero, power-of-two |page_alignment_| value,
   // returns the offset of the address from the start of the page it is on.
@@ -143,12 +218,22 @@ class AddressMapper {
     return addr & (page_alignment_ - 1);
   }
 
-  // Container for all the existing mappings.
+  // Container for all the existing mappings, in no particular order. Slots of
+  // unmapped ranges are listed in |free_slots_| for reuse.
   MappingList mappings_;
-
-  // Maps real addresses to iterators pointing to entries within |mappings_|.
-  // Must maintain a 1:1 entry correspondence with |mappings_|.
-  MappingMap real_addr_to_mapped_range_;
+  std::vector<uint32_t> free_slots_;
+
+  // The mappings sorted by real address, for lookups, in consecutive blocks of
+  // up to kMaxRealBlockSize, and the first real address of each block. Lookups
+  // are binary searches of flat arrays, and adding or removing a mapping moves
+  // the entries of one block and the block table rather than all of them.
+  std::vector<std::vector<RealAddrEntry>> real_blocks_;
+  std::vector<uint64_t> real_block_starts_;
+
+  // Root of the tree of |mappings_| ordered by mapped address, in which each
+  // range also knows the largest unmapped space after any range below it, to
+  // find the first free space for a new mapping without visiting every range.
+  uint32_t mapped_root_;
 
   // If set to nonzero, use this as a mapping page boundary. If a mapping does
   // not begin at a multiple of this value, the remapped address should be given
@@ -299,6 +299,66 @@ TEST_F(AddressMapperTest, EndOfMemory) {
   TestMappedRange(kEndRegion, 0);
 }
 
+// Map a region that extends to the end of the address space over existing
+// ranges.
+TEST_F(AddressMapperTest, EndOfMemoryOverExistingRanges) {
+  const Range kEndRegion(0xffffffff00000000, 0x100000000, 0x3456, 0);
+  const Range kNearEndRegion(0xfffffffff0000000, 0x1000, 0x4567, 0);
+
+  for (const Range& range : kMapRanges) {
+    ASSERT_TRUE(MapRange(range, false, false));
+  }
+  ASSERT_TRUE(MapRange(kNearEndRegion, false, false));
+  ASSERT_FALSE(MapRange(kEndRegion, false, false));
+  ASSERT_TRUE(MapRange(kEndRegion, true, false));
+  EXPECT_EQ(arraysize(kMapRanges) + 1, mapper_->GetNumMappedRanges());
+
+  // The end region takes the place of the region it replaced, after the others
+  // in quipper space.
+  const Range& last_range = kMapRanges[arraysize(kMapRanges) - 1];
+  TestMappedRange(kEndRegion,
+                  GetMappedAddressFromRanges(kMapRanges, arraysize(kMapRanges),
+                                             last_range.addr) +
+                      last_range.size);
+}
+
+// Test that space in quipper space freed by remapping is reused first-fit, with
+// many ranges.
+TEST_F(AddressMapperTest, ReusesFreedSpaceFirstFit) {
+  const size_t kNumRanges = 1000;
+  const uint64_t kSize = 0x1000;
+  for (size_t i = 0; i < kNumRanges; ++i) {
+    ASSERT_TRUE(MapRange(Range(i * 0x10000, kSize, i, 0), false, false));
+  }
+
+  // Replace every third range, from the last, with one half its size that
+  // overlaps its end. Each takes the place in quipper space of the range that
+  // it replaced, the first free space large enough, and leaves half of it free.
+  auto replacement = [=](size_t i) {
+    return Range(i * 0x10000 + kSize * 3 / 4, kSize / 2, kNumRanges + i, 0);
+  };
+  for (size_t i = (kNumRanges - 1) / 3 * 3; i < kNumRanges; i -= 3) {
+    ASSERT_TRUE(MapRange(replacement(i), true, false));
+  }
+  EXPECT_EQ(kNumRanges, mapper_->GetNumMappedRanges());
+  for (size_t i = 0; i < kNumRanges; ++i) {
+    if (i % 3 == 0) {
+      TestMappedRange(replacement(i), i * kSize);
+    } else {
+      TestMappedRange(Range(i * 0x10000, kSize, i, 0), i * kSize);
+    }
+  }
+
+  // A range that fits in the freed space goes into the first of it, and one
+  // that does not goes after the last range, which was replaced.
+  const Range kSmallRange(kNumRanges * 0x10000, kSize / 2, 0x1234, 0);
+  const Range kLargeRange((kNumRanges + 1) * 0x10000, kSize * 2, 0x5678, 0);
+  ASSERT_TRUE(MapRange(kSmallRange, false, false));
+  ASSERT_TRUE(MapRange(kLargeRange, false, false));
+  TestMappedRange(kSmallRange, kSize / 2);
+  TestMappedRange(kLargeRange, (kNumRanges - 1) * kSize + kSize / 2);
+}
+
 // Test mapping of an out-of-bounds mapping.
 TEST_F(AddressMapperTest, OutOfBounds) {
   // A region toward the end of address space that overruns the end of the
@@ -0,0 +1,68 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "arena_block_pool.h"
+
+#include <utility>
+
+namespace quipper {
+
+namespace {
+
+// The in-memory PerfDataProto representation of an event is several times
+// larger than the raw event: every event becomes a message with its own header
+// submessage, and repeated fields such as callchains carry extra bookkeeping.
+constexpr size_t kArenaBytesPerInputByte = 4;
+
+}  // namespace
+
+ArenaBlockPool::ArenaBlockPool(size_t max_cached_bytes)
+    : max_cached_bytes_(max_cached_bytes) {}
+
+ArenaBlockPool::~ArenaBlockPool() {}
+
+size_t ArenaBlockPool::BlockSizeForInput(size_t input_size) {
+  size_t wanted = input_size;
+  if (wanted > kMaxBlockSize / kArenaBytesPerInputByte) return kMaxBlockSize;
+  wanted *= kArenaBytesPerInputByte;
+  size_t size = kMinBlockSize;
+  while (size < wanted) size <<= 1;
+  return size;
+}
+
+std::unique_ptr<char[]> ArenaBlockPool::Acquire(size_t input_size,
+                                                size_t* size) {
+  const size_t block_size = BlockSizeForInput(input_size);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // Reuse the smallest idle block that is large enough, unless it would
+    // waste more than half of its memory.
+    auto it = free_blocks_.lower_bound(block_size);
+    if (it != free_blocks_.end() && it->first <= 2 * block_size) {
+      std::unique_ptr<char[]> block = std::move(it->second.back());
+      it->second.pop_back();
+      *size = it->first;
+      cached_bytes_ -= it->first;
+      if (it->second.empty()) free_blocks_.erase(it);
+      return block;
+    }
+  }
+  *size = block_size;
+  return std::unique_ptr<char[]>(new char[block_size]);
+}
+
+void ArenaBlockPool::Release(std::unique_ptr<char[]> block, size_t size) {
+  if (!block) return;
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (cached_bytes_ + size > max_cached_bytes_) return;
+  free_blocks_[size].push_back(std::move(block));
+  cached_bytes_ += size;
+}
+
+size_t ArenaBlockPool::cached_bytes() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return cached_bytes_;
+}
+
+}  // namespace quipper
@@ -0,0 +1,70 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMIUMOS_WIDE_PROFILING_ARENA_BLOCK_POOL_H_
+#define CHROMIUMOS_WIDE_PROFILING_ARENA_BLOCK_POOL_H_
+
+#include <stddef.h>
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace quipper {
+
+// A thread-safe pool of memory blocks to be used as the initial block of a
+// protobuf arena. A PerfReader that is given a pool takes its initial arena
+// block from the pool and hands it back when it is reset or destroyed, so that
+// the next input starts out with one large, already touched block instead of
+// growing a fresh arena through a series of small allocations.
+//
+// A single pool may be shared by any number of PerfReaders on any number of
+// threads.
+class ArenaBlockPool {
+ public:
+  // Blocks are never smaller than this.
+  static constexpr size_t kMinBlockSize = 64 * 1024;
+  // Blocks are never larger than this. Arenas that need more memory allocate
+  // additional blocks on their own.
+  static constexpr size_t kMaxBlockSize = 256 * 1024 * 1024;
+  // Default upper bound on the total size of the idle blocks kept in a pool.
+  static constexpr size_t kDefaultMaxCachedBytes = 1024 * 1024 * 1024;
+
+  // |max_cached_bytes| bounds the total size of the blocks held by the pool
+  // while they are not in use. Blocks released beyond this bound are freed.
+  explicit ArenaBlockPool(size_t max_cached_bytes = kDefaultMaxCachedBytes);
+  ~ArenaBlockPool();
+
+  // Returns the initial block size suited to an arena that will hold the
+  // PerfDataProto parsed from |input_size| bytes of raw perf data. Block sizes
+  // are powers of two between kMinBlockSize and kMaxBlockSize.
+  static size_t BlockSizeForInput(size_t input_size);
+
+  // Returns a block of BlockSizeForInput(|input_size|) bytes, or a cached block
+  // of at most twice that size. The size of the returned block is written to
+  // |*size|.
+  std::unique_ptr<char[]> Acquire(size_t input_size, size_t* size);
+
+  // Returns |block| of |size| bytes to the pool.
+  void Release(std::unique_ptr<char[]> block, size_t size);
+
+  // Total size of the idle blocks currently held by the pool.
+  size_t cached_bytes() const;
+
+ private:
+  const size_t max_cached_bytes_;
+
+  mutable std::mutex mutex_;
+  // Idle blocks, keyed by block size.
+  std::map<size_t, std::vector<std::unique_ptr<char[]>>> free_blocks_;
+  size_t cached_bytes_ = 0;
+
+  ArenaBlockPool(const ArenaBlockPool&) = delete;
+  ArenaBlockPool& operator=(const ArenaBlockPool&) = delete;
+};
+
+}  // namespace quipper
+
+#endif  // CHROMIUMOS_WIDE_PROFILING_ARENA_BLOCK_POOL_H_
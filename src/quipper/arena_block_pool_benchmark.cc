@@ -0,0 +1,105 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Times back-to-back reads of a perf data file on a number of threads, as a
+// conversion service handling many uploads would, with a new PerfReader per
+// request and with one PerfReader per thread that is reset between requests
+// and takes its arena blocks from a shared ArenaBlockPool:
+//   arena_block_pool_benchmark <perf data file> [<threads>] [<requests>]
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>  // NOLINT(build/c++11)
+#include <functional>
+#include <thread>  // NOLINT(build/c++11)
+#include <vector>
+
+#include "arena_block_pool.h"
+#include "base/logging.h"
+#include "file_utils.h"
+#include "perf_reader.h"
+
+namespace quipper {
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Reads |input| |num_requests| times and appends the microseconds taken by
+// each read to |latencies|. With |pool| set, a single reader is reset and
+// reused for all the requests.
+void ServeRequests(const std::vector<char>& input, int num_requests,
+                   ArenaBlockPool* pool, std::vector<double>* latencies) {
+  PerfReader pooled_reader(pool);
+  for (int i = 0; i < num_requests; ++i) {
+    const auto start = Clock::now();
+    if (pool) {
+      pooled_reader.Reset(input.size());
+      CHECK(pooled_reader.ReadFromVector(input));
+    } else {
+      PerfReader reader;
+      CHECK(reader.ReadFromVector(input));
+    }
+    latencies->push_back(
+        std::chrono::duration<double, std::micro>(Clock::now() - start)
+            .count());
+  }
+}
+
+// Serves |num_requests| requests on each of |num_threads| threads, and prints
+// the request rate and the latency percentiles.
+void Time(const char* name, const std::vector<char>& input, int num_threads,
+          int num_requests, ArenaBlockPool* pool) {
+  std::vector<std::vector<double>> latencies(num_threads);
+  std::vector<std::thread> threads;
+  const auto start = Clock::now();
+  for (int i = 0; i < num_threads; ++i) {
+    threads.emplace_back(ServeRequests, std::cref(input), num_requests, pool,
+                         &latencies[i]);
+  }
+  for (auto& thread : threads) thread.join();
+  const double seconds =
+      std::chrono::duration<double>(Clock::now() - start).count();
+
+  std::vector<double> all;
+  for (const auto& thread_latencies : latencies) {
+    all.insert(all.end(), thread_latencies.begin(), thread_latencies.end());
+  }
+  std::sort(all.begin(), all.end());
+  auto percentile = [&all](double p) {
+    return all[std::min(all.size() - 1, static_cast<size_t>(p * all.size()))];
+  };
+  printf("%-8s %10.0f requests/s   p50 %8.0f us   p99 %8.0f us\n", name,
+         all.size() / seconds, percentile(0.5), percentile(0.99));
+}
+
+}  // namespace
+}  // namespace quipper
+
+int main(int argc, char* argv[]) {
+  if (argc < 2 || argc > 4) {
+    LOG(ERROR) << "Usage: " << argv[0]
+               << " <perf data file> [<threads>] [<requests>]";
+    return EXIT_FAILURE;
+  }
+  const int num_threads = argc > 2 ? atoi(argv[2]) : 8;
+  const int num_requests = argc > 3 ? atoi(argv[3]) : 1000;
+  if (num_threads <= 0 || num_requests <= 0) {
+    LOG(ERROR) << "The numbers of threads and requests must be positive";
+    return EXIT_FAILURE;
+  }
+  std::vector<char> input;
+  if (!quipper::FileToBuffer(argv[1], &input)) {
+    LOG(ERROR) << "Could not read " << argv[1];
+    return EXIT_FAILURE;
+  }
+
+  printf("%zu bytes, %d threads, %d requests per thread\n", input.size(),
+         num_threads, num_requests);
+  quipper::Time("fresh", input, num_threads, num_requests, nullptr);
+  quipper::ArenaBlockPool pool;
+  quipper::Time("pooled", input, num_threads, num_requests, &pool);
+  return EXIT_SUCCESS;
+}
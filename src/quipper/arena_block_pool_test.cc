@@ -0,0 +1,60 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "arena_block_pool.h"
+
+#include <utility>
+
+#include "compat/test.h"
+
+namespace quipper {
+
+TEST(ArenaBlockPoolTest, BlockSizeForInput) {
+  EXPECT_EQ(ArenaBlockPool::kMinBlockSize,
+            ArenaBlockPool::BlockSizeForInput(0));
+  EXPECT_EQ(ArenaBlockPool::kMinBlockSize,
+            ArenaBlockPool::BlockSizeForInput(1024));
+  EXPECT_EQ(4 * 1024 * 1024, ArenaBlockPool::BlockSizeForInput(1024 * 1024));
+  EXPECT_EQ(8 * 1024 * 1024,
+            ArenaBlockPool::BlockSizeForInput(1024 * 1024 + 1));
+  EXPECT_EQ(ArenaBlockPool::kMaxBlockSize,
+            ArenaBlockPool::BlockSizeForInput(~static_cast<size_t>(0)));
+}
+
+TEST(ArenaBlockPoolTest, ReusesReleasedBlocks) {
+  ArenaBlockPool pool;
+  size_t size = 0;
+  std::unique_ptr<char[]> block = pool.Acquire(1024 * 1024, &size);
+  ASSERT_NE(nullptr, block);
+  EXPECT_EQ(4 * 1024 * 1024, size);
+  const char* data = block.get();
+
+  pool.Release(std::move(block), size);
+  EXPECT_EQ(size, pool.cached_bytes());
+
+  // A much smaller input does not take the large block.
+  size_t small_size = 0;
+  std::unique_ptr<char[]> small_block = pool.Acquire(0, &small_size);
+  EXPECT_EQ(ArenaBlockPool::kMinBlockSize, small_size);
+  EXPECT_EQ(size, pool.cached_bytes());
+
+  // A slightly smaller input does.
+  size_t reused_size = 0;
+  std::unique_ptr<char[]> reused = pool.Acquire(768 * 1024, &reused_size);
+  EXPECT_EQ(data, reused.get());
+  EXPECT_EQ(size, reused_size);
+  EXPECT_EQ(0, pool.cached_bytes());
+}
+
+TEST(ArenaBlockPoolTest, BoundsCachedBytes) {
+  ArenaBlockPool pool(ArenaBlockPool::kMinBlockSize);
+  size_t size1 = 0, size2 = 0;
+  std::unique_ptr<char[]> block1 = pool.Acquire(0, &size1);
+  std::unique_ptr<char[]> block2 = pool.Acquire(0, &size2);
+  pool.Release(std::move(block1), size1);
+  pool.Release(std::move(block2), size2);
+  EXPECT_EQ(ArenaBlockPool::kMinBlockSize, pool.cached_bytes());
+}
+
+}  // namespace quipper
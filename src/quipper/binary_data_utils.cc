@@ -13,6 +13,7 @@
 #include <cstdlib>
 #include <cstring>
 #include <fstream>  
+#include <memory>
 
 #include "base/logging.h"
 
@@ -30,11 +31,13 @@ static uint64_t Md5Prefix(const unsigned char* data,
   uint64_t digest_prefix = 0;
   unsigned char digest[MD5_DIGEST_LENGTH + 1];
 
-  EVP_MD_CTX* ctx = EVP_MD_CTX_new();
-  EVP_DigestInit_ex(ctx, EVP_md5(), NULL);
-  EVP_DigestUpdate(ctx, data, length);
-  EVP_DigestFinal(ctx, digest, NULL);
-  EVP_MD_CTX_free(ctx);
+  // Each thread reuses its digest context, which EVP_DigestInit_ex() resets,
+  // rather than allocating one for each string.
+  static thread_local std::unique_ptr<EVP_MD_CTX, void (*)(EVP_MD_CTX*)> ctx(
+      EVP_MD_CTX_new(), EVP_MD_CTX_free);
+  EVP_DigestInit_ex(ctx.get(), EVP_md5(), NULL);
+  EVP_DigestUpdate(ctx.get(), data, length);
+  EVP_DigestFinal_ex(ctx.get(), digest, NULL);
   // We need 64-bits / # of bits in a byte.
   for (size_t i = 0; i < sizeof(uint64_t); i++) {
     digest_prefix = (digest_prefix << 8) | digest[i];
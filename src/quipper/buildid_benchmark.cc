@@ -0,0 +1,113 @@
+// Copyright 2016 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Times reading the build IDs of the ELF files under a directory, from their
+// note segments and from their note sections with libelf:
+//   buildid_benchmark <directory> [<iterations>]
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>  // NOLINT(build/c++11)
+#include <string>
+#include <vector>
+
+#include "base/logging.h"
+#include "dso.h"
+
+namespace {
+
+// Appends |path| to |files| if it is a regular file, or the regular files
+// under it if it is a directory, without following symbolic links.
+// Directories below |path| that cannot be read are skipped. Returns false if
+// |path| itself cannot be read.
+bool AddFiles(const std::string& path, std::vector<std::string>* files) {
+  struct stat s;
+  if (lstat(path.c_str(), &s) != 0) return false;
+  if (S_ISREG(s.st_mode)) {
+    files->push_back(path);
+    return true;
+  }
+  if (!S_ISDIR(s.st_mode)) return true;
+  DIR* dir = opendir(path.c_str());
+  if (dir == nullptr) return false;
+  while (const struct dirent* entry = readdir(dir)) {
+    const std::string name = entry->d_name;
+    if (name == "." || name == "..") continue;
+    AddFiles(path + "/" + name, files);
+  }
+  closedir(dir);
+  return true;
+}
+
+// Reads the build IDs of |fds| |iterations| times with |read|, and prints how
+// many it found and how long it took.
+void Time(const char* name, bool (*read)(int, std::string*),
+          const std::vector<int>& fds, int iterations,
+          std::vector<std::string>* buildids) {
+  size_t found = 0;
+  const auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; ++i) {
+    found = 0;
+    for (size_t j = 0; j < fds.size(); ++j) {
+      (*buildids)[j].clear();
+      if (read(fds[j], &(*buildids)[j])) ++found;
+    }
+  }
+  const double us = std::chrono::duration<double, std::micro>(
+                        std::chrono::steady_clock::now() - start)
+                        .count() /
+                    iterations;
+  printf("%-8s %zu of %zu build IDs in %.0f us, %.2f us per file\n", name,
+         found, fds.size(), us, fds.empty() ? 0.0 : us / fds.size());
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  if (argc < 2 || argc > 3) {
+    LOG(ERROR) << "Usage: " << argv[0] << " <directory> [<iterations>]";
+    return EXIT_FAILURE;
+  }
+  const int iterations = argc == 3 ? atoi(argv[2]) : 10;
+  std::vector<std::string> paths;
+  if (!AddFiles(argv[1], &paths)) {
+    LOG(ERROR) << "Could not walk " << argv[1];
+    return EXIT_FAILURE;
+  }
+
+  // Keeps only the ELF files.
+  std::vector<int> fds;
+  for (const auto& path : paths) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) continue;
+    char magic[4];
+    if (pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+        std::string(magic, sizeof(magic)) == "\177ELF") {
+      fds.push_back(fd);
+    } else {
+      close(fd);
+    }
+  }
+
+  quipper::InitializeLibelf();
+  std::vector<std::string> note_buildids(fds.size());
+  std::vector<std::string> section_buildids(fds.size());
+  Time("notes", quipper::ReadElfNoteBuildId, fds, iterations, &note_buildids);
+  Time("libelf", quipper::ReadElfSectionBuildId, fds, iterations,
+       &section_buildids);
+  size_t mismatches = 0;
+  for (size_t i = 0; i < fds.size(); ++i) {
+    if (!note_buildids[i].empty() && note_buildids[i] != section_buildids[i]) {
+      ++mismatches;
+    }
+    close(fds[i]);
+  }
+  printf("%zu build IDs differ\n", mismatches);
+  return mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
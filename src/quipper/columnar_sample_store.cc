@@ -0,0 +1,394 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "columnar_sample_store.h"
+
+#include <algorithm>
+#include <numeric>
+#include <unordered_map>
+
+#include "base/logging.h"
+#include "kernel/perf_event.h"
+#include "kernel/perf_internals.h"
+
+namespace quipper {
+
+namespace {
+
+template <typename T>
+void PermuteColumn(const std::vector<size_t>& order, std::vector<T>* column) {
+  std::vector<T> permuted;
+  permuted.reserve(column->size());
+  for (size_t index : order) permuted.push_back((*column)[index]);
+  column->swap(permuted);
+}
+
+template <typename T>
+size_t ColumnBytes(const std::vector<T>& column) {
+  return column.capacity() * sizeof(T);
+}
+
+}  // namespace
+
+ColumnarSampleStore::ColumnarSampleStore() {}
+
+ColumnarSampleStore::~ColumnarSampleStore() {}
+
+void ColumnarSampleStore::Clear() {
+  presence_.clear();
+  misc_.clear();
+  ip_.clear();
+  pid_.clear();
+  tid_.clear();
+  time_ns_.clear();
+  addr_.clear();
+  id_.clear();
+  period_.clear();
+  cpu_.clear();
+  weight_.clear();
+  weight_var1_dw_.clear();
+  data_src_.clear();
+  cgroup_.clear();
+  code_page_size_.clear();
+  data_page_size_.clear();
+  event_index_.clear();
+  time_rank_.clear();
+  callchain_offset_.clear();
+  callchain_size_.clear();
+  branch_offset_.clear();
+  branch_stack_size_.clear();
+  callchain_pool_.clear();
+  branch_pool_.clear();
+  sorted_by_time_ = false;
+}
+
+void ColumnarSampleStore::Append(const PerfDataProto_PerfEvent& event,
+                                 size_t event_index) {
+  const PerfDataProto_SampleEvent& sample = event.sample_event();
+  uint32_t presence = 0;
+  if (event.header().has_misc()) presence |= kMisc;
+  if (sample.has_ip()) presence |= kIp;
+  if (sample.has_pid()) presence |= kPid;
+  if (sample.has_tid()) presence |= kTid;
+  if (sample.has_sample_time_ns()) presence |= kTime;
+  if (sample.has_addr()) presence |= kAddr;
+  if (sample.has_id()) presence |= kId;
+  if (sample.has_period()) presence |= kPeriod;
+  if (sample.has_cpu()) presence |= kCpu;
+  if (sample.has_weight()) presence |= kWeight;
+  if (sample.has_weight_struct() && sample.weight_struct().has_var1_dw()) {
+    presence |= kWeightVar1Dw;
+  }
+  if (sample.has_data_src()) presence |= kDataSrc;
+  if (sample.has_cgroup()) presence |= kCgroup;
+  if (sample.has_code_page_size()) presence |= kCodePageSize;
+  if (sample.has_data_page_size()) presence |= kDataPageSize;
+
+  presence_.push_back(presence);
+  misc_.push_back(event.header().misc());
+  ip_.push_back(sample.ip());
+  pid_.push_back(sample.pid());
+  tid_.push_back(sample.tid());
+  time_ns_.push_back(sample.sample_time_ns());
+  addr_.push_back(sample.addr());
+  id_.push_back(sample.id());
+  period_.push_back(sample.period());
+  cpu_.push_back(sample.cpu());
+  weight_.push_back(sample.weight());
+  weight_var1_dw_.push_back(sample.weight_struct().var1_dw());
+  data_src_.push_back(sample.data_src());
+  cgroup_.push_back(sample.cgroup());
+  code_page_size_.push_back(sample.code_page_size());
+  data_page_size_.push_back(sample.data_page_size());
+  event_index_.push_back(event_index);
+  time_rank_.push_back(0);
+
+  callchain_offset_.push_back(callchain_pool_.size());
+  callchain_size_.push_back(sample.callchain_size());
+  callchain_pool_.insert(callchain_pool_.end(), sample.callchain().begin(),
+                         sample.callchain().end());
+
+  branch_offset_.push_back(branch_pool_.size());
+  branch_stack_size_.push_back(sample.branch_stack_size());
+  for (const auto& entry : sample.branch_stack()) {
+    BranchEntry branch;
+    branch.from_ip = entry.from_ip();
+    branch.to_ip = entry.to_ip();
+    branch.cycles = entry.cycles();
+    branch.type = entry.type();
+    branch.spec = entry.spec();
+    if (entry.mispredicted()) branch.flags |= BranchEntry::kMispredicted;
+    if (entry.predicted()) branch.flags |= BranchEntry::kPredicted;
+    if (entry.in_transaction()) branch.flags |= BranchEntry::kInTransaction;
+    if (entry.abort()) branch.flags |= BranchEntry::kAbort;
+    branch_pool_.push_back(branch);
+  }
+
+  // Appending keeps the rows in stream order, which is no longer sorted by
+  // time in general.
+  sorted_by_time_ = false;
+}
+
+void ColumnarSampleStore::Append(uint16_t misc, const perf_sample& sample,
+                                 uint64_t sample_type, size_t event_index) {
+  // PerfSerializer sets the misc bits of every event and each sample field
+  // whose PERF_SAMPLE_* bit is set.
+  uint32_t presence = kMisc;
+  if (sample_type & PERF_SAMPLE_IP) presence |= kIp;
+  if (sample_type & PERF_SAMPLE_TID) presence |= kPid | kTid;
+  if (sample_type & PERF_SAMPLE_TIME) presence |= kTime;
+  if (sample_type & PERF_SAMPLE_ADDR) presence |= kAddr;
+  if (sample_type & (PERF_SAMPLE_ID | PERF_SAMPLE_IDENTIFIER)) presence |= kId;
+  if (sample_type & PERF_SAMPLE_PERIOD) presence |= kPeriod;
+  if (sample_type & PERF_SAMPLE_CPU) presence |= kCpu;
+  if (sample_type & PERF_SAMPLE_WEIGHT) presence |= kWeight;
+  if (sample_type & PERF_SAMPLE_WEIGHT_STRUCT) presence |= kWeightVar1Dw;
+  if (sample_type & PERF_SAMPLE_DATA_SRC) presence |= kDataSrc;
+  if (sample_type & PERF_SAMPLE_CGROUP) presence |= kCgroup;
+  if (sample_type & PERF_SAMPLE_CODE_PAGE_SIZE) presence |= kCodePageSize;
+  if (sample_type & PERF_SAMPLE_DATA_PAGE_SIZE) presence |= kDataPageSize;
+
+  // Fields missing from |presence| are zero.
+  const auto value = [presence](Field field, uint64_t v) {
+    return (presence & field) ? v : 0;
+  };
+  presence_.push_back(presence);
+  misc_.push_back(misc);
+  ip_.push_back(value(kIp, sample.ip));
+  pid_.push_back(value(kPid, sample.pid));
+  tid_.push_back(value(kTid, sample.tid));
+  time_ns_.push_back(value(kTime, sample.time));
+  addr_.push_back(value(kAddr, sample.addr));
+  id_.push_back(value(kId, sample.id));
+  period_.push_back(value(kPeriod, sample.period));
+  cpu_.push_back(value(kCpu, sample.cpu));
+  weight_.push_back(value(kWeight, sample.weight.full));
+  weight_var1_dw_.push_back(value(kWeightVar1Dw, sample.weight.var1_dw));
+  data_src_.push_back(value(kDataSrc, sample.data_src));
+  cgroup_.push_back(value(kCgroup, sample.cgroup));
+  code_page_size_.push_back(value(kCodePageSize, sample.code_page_size));
+  data_page_size_.push_back(value(kDataPageSize, sample.data_page_size));
+  event_index_.push_back(event_index);
+  time_rank_.push_back(0);
+
+  callchain_offset_.push_back(callchain_pool_.size());
+  if ((sample_type & PERF_SAMPLE_CALLCHAIN) && sample.callchain != nullptr) {
+    callchain_size_.push_back(static_cast<uint32_t>(sample.callchain->nr));
+    callchain_pool_.insert(callchain_pool_.end(), sample.callchain->ips,
+                           sample.callchain->ips + sample.callchain->nr);
+  } else {
+    callchain_size_.push_back(0);
+  }
+
+  branch_offset_.push_back(branch_pool_.size());
+  if ((sample_type & PERF_SAMPLE_BRANCH_STACK) &&
+      sample.branch_stack != nullptr) {
+    branch_stack_size_.push_back(
+        static_cast<uint32_t>(sample.branch_stack->nr));
+    for (size_t i = 0; i < sample.branch_stack->nr; ++i) {
+      const struct branch_entry& entry = sample.branch_stack->entries[i];
+      BranchEntry branch;
+      branch.from_ip = entry.from;
+      branch.to_ip = entry.to;
+      branch.cycles = entry.flags.cycles;
+      branch.type = entry.flags.type;
+      branch.spec = entry.flags.spec;
+      if (entry.flags.mispred) branch.flags |= BranchEntry::kMispredicted;
+      if (entry.flags.predicted) branch.flags |= BranchEntry::kPredicted;
+      if (entry.flags.in_tx) branch.flags |= BranchEntry::kInTransaction;
+      if (entry.flags.abort) branch.flags |= BranchEntry::kAbort;
+      if (entry.flags.reserved != 0) {
+        LOG(WARNING) << "Ignoring branch stack entry reserved bits: "
+                     << entry.flags.reserved;
+      }
+      branch_pool_.push_back(branch);
+    }
+  } else {
+    branch_stack_size_.push_back(0);
+  }
+
+  sorted_by_time_ = false;
+}
+
+void ColumnarSampleStore::GetEvent(size_t row,
+                                   PerfDataProto_PerfEvent* event) const {
+  event->Clear();
+  const uint32_t presence = presence_[row];
+  auto* header = event->mutable_header();
+  header->set_type(PERF_RECORD_SAMPLE);
+  if (presence & kMisc) header->set_misc(misc_[row]);
+  event->set_timestamp(time_ns_[row]);
+
+  auto* sample = event->mutable_sample_event();
+  if (presence & kIp) sample->set_ip(ip_[row]);
+  if (presence & kPid) sample->set_pid(pid_[row]);
+  if (presence & kTid) sample->set_tid(tid_[row]);
+  if (presence & kTime) sample->set_sample_time_ns(time_ns_[row]);
+  if (presence & kAddr) sample->set_addr(addr_[row]);
+  if (presence & kId) sample->set_id(id_[row]);
+  if (presence & kPeriod) sample->set_period(period_[row]);
+  if (presence & kCpu) sample->set_cpu(cpu_[row]);
+  if (presence & kWeight) sample->set_weight(weight_[row]);
+  if (presence & kWeightVar1Dw) {
+    sample->mutable_weight_struct()->set_var1_dw(weight_var1_dw_[row]);
+  }
+  if (presence & kDataSrc) sample->set_data_src(data_src_[row]);
+  if (presence & kCgroup) sample->set_cgroup(cgroup_[row]);
+  if (presence & kCodePageSize) {
+    sample->set_code_page_size(code_page_size_[row]);
+  }
+  if (presence & kDataPageSize) {
+    sample->set_data_page_size(data_page_size_[row]);
+  }
+
+  const uint64_t* ips = callchain(row);
+  sample->mutable_callchain()->Reserve(callchain_size_[row]);
+  for (uint32_t i = 0; i < callchain_size_[row]; ++i) {
+    sample->add_callchain(ips[i]);
+  }
+
+  const BranchEntry* branches = branch_stack(row);
+  for (uint32_t i = 0; i < branch_stack_size_[row]; ++i) {
+    const BranchEntry& branch = branches[i];
+    auto* entry = sample->add_branch_stack();
+    entry->set_from_ip(branch.from_ip);
+    entry->set_to_ip(branch.to_ip);
+    if (branch.flags & BranchEntry::kMispredicted) {
+      entry->set_mispredicted(true);
+    }
+    if (branch.flags & BranchEntry::kPredicted) entry->set_predicted(true);
+    if (branch.flags & BranchEntry::kInTransaction) {
+      entry->set_in_transaction(true);
+    }
+    if (branch.flags & BranchEntry::kAbort) entry->set_abort(true);
+    if (branch.cycles) entry->set_cycles(branch.cycles);
+    if (branch.type) entry->set_type(branch.type);
+    if (branch.spec) entry->set_spec(branch.spec);
+  }
+}
+
+void ColumnarSampleStore::SortByTime(
+    const RepeatedPtrField<PerfDataProto_PerfEvent>& events) {
+  // A sample goes after the non-sample events with an earlier time, and after
+  // those with an equal time that preceded it in the stream. Count the latter
+  // while the rows are still in stream order.
+  std::unordered_map<uint64_t, uint32_t> events_at_time;
+  size_t row = 0;
+  for (int i = 0; i <= events.size(); ++i) {
+    for (; row < size() && event_index_[row] <= static_cast<size_t>(i); ++row) {
+      auto it = events_at_time.find(time_ns_[row]);
+      time_rank_[row] = it != events_at_time.end() ? it->second : 0;
+    }
+    if (i < events.size()) ++events_at_time[events.Get(i).timestamp()];
+  }
+  CHECK_EQ(row, size());
+
+  std::vector<size_t> order(size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+    return time_ns_[a] < time_ns_[b];
+  });
+  Permute(order);
+  sorted_by_time_ = true;
+}
+
+void ColumnarSampleStore::MergeInto(
+    RepeatedPtrField<PerfDataProto_PerfEvent>* events) const {
+  const int num_events = events->size();
+  for (size_t row = 0; row < size(); ++row) {
+    GetEvent(row, events->Add());
+  }
+
+  // Interleave the samples, now at the end, with the other events. This only
+  // moves pointers around.
+  std::vector<PerfDataProto_PerfEvent*> merged;
+  merged.reserve(events->size());
+  Merger merger(*this);
+  size_t row = 0;
+  for (int i = 0; i <= num_events; ++i) {
+    const size_t end =
+        merger.RowsBefore(i < num_events ? &events->Get(i) : nullptr);
+    for (; row < end; ++row) {
+      merged.push_back(events->Mutable(num_events + row));
+    }
+    if (i < num_events) merged.push_back(events->Mutable(i));
+  }
+  std::copy(merged.begin(), merged.end(), events->pointer_begin());
+}
+
+size_t ColumnarSampleStore::Merger::RowsBefore(
+    const PerfDataProto_PerfEvent* event) {
+  if (event == nullptr) return next_row_ = store_.size();
+  const size_t event_index = num_events_++;
+
+  if (!store_.sorted_by_time()) {
+    // A row goes right before the event that followed it in the stream.
+    while (next_row_ < store_.size() &&
+           store_.event_index(next_row_) <= event_index) {
+      ++next_row_;
+    }
+    return next_row_;
+  }
+
+  // A row goes before the events with a later time, and before those with the
+  // same time that followed it in the stream.
+  const uint64_t time = event->timestamp();
+  if (event_index > 0 && time == last_time_) {
+    ++last_time_rank_;
+  } else {
+    last_time_ = time;
+    last_time_rank_ = 0;
+  }
+  while (next_row_ < store_.size()) {
+    const uint64_t row_time = store_.time_ns(next_row_);
+    if (row_time > time ||
+        (row_time == time && store_.time_rank(next_row_) > last_time_rank_)) {
+      break;
+    }
+    ++next_row_;
+  }
+  return next_row_;
+}
+
+void ColumnarSampleStore::Permute(const std::vector<size_t>& order) {
+  PermuteColumn(order, &presence_);
+  PermuteColumn(order, &misc_);
+  PermuteColumn(order, &ip_);
+  PermuteColumn(order, &pid_);
+  PermuteColumn(order, &tid_);
+  PermuteColumn(order, &time_ns_);
+  PermuteColumn(order, &addr_);
+  PermuteColumn(order, &id_);
+  PermuteColumn(order, &period_);
+  PermuteColumn(order, &cpu_);
+  PermuteColumn(order, &weight_);
+  PermuteColumn(order, &weight_var1_dw_);
+  PermuteColumn(order, &data_src_);
+  PermuteColumn(order, &cgroup_);
+  PermuteColumn(order, &code_page_size_);
+  PermuteColumn(order, &data_page_size_);
+  PermuteColumn(order, &event_index_);
+  PermuteColumn(order, &time_rank_);
+  // The pools stay put; only the rows' references into them move.
+  PermuteColumn(order, &callchain_offset_);
+  PermuteColumn(order, &callchain_size_);
+  PermuteColumn(order, &branch_offset_);
+  PermuteColumn(order, &branch_stack_size_);
+}
+
+size_t ColumnarSampleStore::MemoryUsage() const {
+  return ColumnBytes(presence_) + ColumnBytes(misc_) + ColumnBytes(ip_) +
+         ColumnBytes(pid_) + ColumnBytes(tid_) + ColumnBytes(time_ns_) +
+         ColumnBytes(addr_) + ColumnBytes(id_) + ColumnBytes(period_) +
+         ColumnBytes(cpu_) + ColumnBytes(weight_) +
+         ColumnBytes(weight_var1_dw_) + ColumnBytes(data_src_) +
+         ColumnBytes(cgroup_) + ColumnBytes(code_page_size_) +
+         ColumnBytes(data_page_size_) + ColumnBytes(event_index_) +
+         ColumnBytes(time_rank_) + ColumnBytes(callchain_offset_) +
+         ColumnBytes(callchain_size_) + ColumnBytes(branch_offset_) +
+         ColumnBytes(branch_stack_size_) + ColumnBytes(callchain_pool_) +
+         ColumnBytes(branch_pool_);
+}
+
+}  // namespace quipper
@@ -0,0 +1,209 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMIUMOS_WIDE_PROFILING_COLUMNAR_SAMPLE_STORE_H_
+#define CHROMIUMOS_WIDE_PROFILING_COLUMNAR_SAMPLE_STORE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "compat/proto.h"
+
+namespace quipper {
+
+struct perf_sample;
+
+// Stores PERF_RECORD_SAMPLE events as a struct of arrays instead of one
+// PerfDataProto_PerfEvent message per event. Each sample is a row; the fields
+// of all rows are kept in per-field vectors, and the variable-length callchains
+// and branch stacks of all rows share one pool each.
+//
+// Only the fields used for profile conversion are kept: the header's misc
+// bits, ip, pid, tid, sample time, addr, id, period, cpu, weight (including
+// weight_struct.var1_dw), data_src, cgroup, code and data page sizes,
+// callchain and branch stack. Other fields are dropped.
+//
+// Samples are stored apart from the other events, so every row records its
+// position in the event stream: the number of non-sample events that preceded
+// it. See PerfDataHandler::Process() for how the two are put back together.
+class ColumnarSampleStore {
+ public:
+  // Bits in presence() recording which optional fields a sample has.
+  enum Field : uint32_t {
+    kMisc = 1 << 0,
+    kIp = 1 << 1,
+    kPid = 1 << 2,
+    kTid = 1 << 3,
+    kTime = 1 << 4,
+    kAddr = 1 << 5,
+    kId = 1 << 6,
+    kPeriod = 1 << 7,
+    kCpu = 1 << 8,
+    kWeight = 1 << 9,
+    kWeightVar1Dw = 1 << 10,
+    kDataSrc = 1 << 11,
+    kCgroup = 1 << 12,
+    kCodePageSize = 1 << 13,
+    kDataPageSize = 1 << 14,
+  };
+
+  struct BranchEntry {
+    // Bits in |flags|.
+    enum : uint8_t {
+      kMispredicted = 1 << 0,
+      kPredicted = 1 << 1,
+      kInTransaction = 1 << 2,
+      kAbort = 1 << 3,
+    };
+    uint64_t from_ip = 0;
+    uint64_t to_ip = 0;
+    uint32_t cycles = 0;
+    uint32_t type = 0;
+    uint32_t spec = 0;
+    uint8_t flags = 0;
+  };
+
+  ColumnarSampleStore();
+  ~ColumnarSampleStore();
+
+  size_t size() const { return presence_.size(); }
+  bool empty() const { return presence_.empty(); }
+
+  // Removes all rows.
+  void Clear();
+
+  // Appends the sample in |event|, which follows |event_index| non-sample
+  // events in the event stream.
+  void Append(const PerfDataProto_PerfEvent& event, size_t event_index);
+
+  // Like the above, but for a sample read from a raw event with the header
+  // misc bits |misc|, whose attr has the PERF_SAMPLE_* bits |sample_type|. The
+  // row is the same as for the event PerfSerializer makes from the raw event.
+  void Append(uint16_t misc, const perf_sample& sample, uint64_t sample_type,
+              size_t event_index);
+
+  // Overwrites |event| with the header and sample stored in |row|. |event| is
+  // cleared first, so one message can be reused for many rows without
+  // reallocating its fields.
+  void GetEvent(size_t row, PerfDataProto_PerfEvent* event) const;
+
+  // Stable-sorts the rows by sample time, with the same outcome for the samples
+  // as PerfReader::MaybeSortEventsByTime() has on a stream that holds them as
+  // events. |events| must be the non-sample events in their original order,
+  // i.e. this must be called before they are sorted. Afterwards, time_rank()
+  // tells where a sample goes among the non-sample events with an equal time.
+  void SortByTime(const RepeatedPtrField<PerfDataProto_PerfEvent>& events);
+  bool sorted_by_time() const { return sorted_by_time_; }
+
+  // Returns the number of bytes allocated by the store.
+  size_t MemoryUsage() const;
+
+  // Adds the rows to |events| as sample events, each at its place among the
+  // non-sample events it was stored along with, which |events| must hold in
+  // their current order: stream order, or time order after SortByTime(). Only
+  // the fields kept by the store are set in the added events.
+  void MergeInto(RepeatedPtrField<PerfDataProto_PerfEvent>* events) const;
+
+  // Tells where the rows go among the non-sample events they were stored along
+  // with. Those events must be passed to RowsBefore() one by one, in the order
+  // described for MergeInto().
+  class Merger {
+   public:
+    explicit Merger(const ColumnarSampleStore& store) : store_(store) {}
+
+    // Returns the end of the rows that go before |event|, the next non-sample
+    // event; the rows from the end returned by the previous call up to it go
+    // right before |event|. With |event| null, returns size(), as the
+    // remaining rows go after the last event.
+    size_t RowsBefore(const PerfDataProto_PerfEvent* event);
+
+   private:
+    const ColumnarSampleStore& store_;
+    // The end returned by the previous call.
+    size_t next_row_ = 0;
+    // The number of events passed so far.
+    size_t num_events_ = 0;
+    // The timestamp of the previous event, and the number of events before it
+    // with the same timestamp.
+    uint64_t last_time_ = 0;
+    uint32_t last_time_rank_ = 0;
+  };
+
+  // Per-row accessors. Fields missing from a row's presence() are zero.
+  uint32_t presence(size_t row) const { return presence_[row]; }
+  uint16_t misc(size_t row) const { return misc_[row]; }
+  uint64_t time_ns(size_t row) const { return time_ns_[row]; }
+  uint32_t pid(size_t row) const { return pid_[row]; }
+  uint32_t tid(size_t row) const { return tid_[row]; }
+  uint64_t ip(size_t row) const { return ip_[row]; }
+  uint64_t addr(size_t row) const { return addr_[row]; }
+  uint64_t id(size_t row) const { return id_[row]; }
+  uint64_t period(size_t row) const { return period_[row]; }
+  uint32_t cpu(size_t row) const { return cpu_[row]; }
+  uint64_t weight(size_t row) const { return weight_[row]; }
+  uint32_t weight_var1_dw(size_t row) const { return weight_var1_dw_[row]; }
+  uint64_t data_src(size_t row) const { return data_src_[row]; }
+  uint64_t cgroup(size_t row) const { return cgroup_[row]; }
+  uint64_t code_page_size(size_t row) const { return code_page_size_[row]; }
+  uint64_t data_page_size(size_t row) const { return data_page_size_[row]; }
+  // The number of non-sample events that preceded the sample.
+  size_t event_index(size_t row) const { return event_index_[row]; }
+  // After SortByTime(), the number of non-sample events with the same time as
+  // the sample that preceded it.
+  uint32_t time_rank(size_t row) const { return time_rank_[row]; }
+  const uint64_t* callchain(size_t row) const {
+    return callchain_pool_.data() + callchain_offset_[row];
+  }
+  uint32_t callchain_size(size_t row) const { return callchain_size_[row]; }
+  const BranchEntry* branch_stack(size_t row) const {
+    return branch_pool_.data() + branch_offset_[row];
+  }
+  uint32_t branch_stack_size(size_t row) const {
+    return branch_stack_size_[row];
+  }
+
+ private:
+  // Reorders all per-row vectors so that row i takes the values of row
+  // |order[i]|.
+  void Permute(const std::vector<size_t>& order);
+
+  std::vector<uint32_t> presence_;
+  std::vector<uint16_t> misc_;
+  std::vector<uint64_t> ip_;
+  std::vector<uint32_t> pid_;
+  std::vector<uint32_t> tid_;
+  std::vector<uint64_t> time_ns_;
+  std::vector<uint64_t> addr_;
+  std::vector<uint64_t> id_;
+  std::vector<uint64_t> period_;
+  std::vector<uint32_t> cpu_;
+  std::vector<uint64_t> weight_;
+  std::vector<uint32_t> weight_var1_dw_;
+  std::vector<uint64_t> data_src_;
+  std::vector<uint64_t> cgroup_;
+  std::vector<uint64_t> code_page_size_;
+  std::vector<uint64_t> data_page_size_;
+
+  std::vector<size_t> event_index_;
+  std::vector<uint32_t> time_rank_;
+
+  // Offsets and lengths into the shared pools.
+  std::vector<size_t> callchain_offset_;
+  std::vector<uint32_t> callchain_size_;
+  std::vector<size_t> branch_offset_;
+  std::vector<uint32_t> branch_stack_size_;
+  std::vector<uint64_t> callchain_pool_;
+  std::vector<BranchEntry> branch_pool_;
+
+  bool sorted_by_time_ = false;
+
+  ColumnarSampleStore(const ColumnarSampleStore&) = delete;
+  ColumnarSampleStore& operator=(const ColumnarSampleStore&) = delete;
+};
+
+}  // namespace quipper
+
+#endif  // CHROMIUMOS_WIDE_PROFILING_COLUMNAR_SAMPLE_STORE_H_
@@ -0,0 +1,132 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "columnar_sample_store.h"
+
+#include "compat/test.h"
+#include "kernel/perf_event.h"
+
+namespace quipper {
+
+namespace {
+
+PerfDataProto_PerfEvent MakeSample(uint64_t time_ns, uint64_t ip) {
+  PerfDataProto_PerfEvent event;
+  event.mutable_header()->set_type(PERF_RECORD_SAMPLE);
+  event.set_timestamp(time_ns);
+  event.mutable_sample_event()->set_sample_time_ns(time_ns);
+  event.mutable_sample_event()->set_ip(ip);
+  return event;
+}
+
+PerfDataProto_PerfEvent MakeMmap(uint64_t time_ns) {
+  PerfDataProto_PerfEvent event;
+  event.mutable_header()->set_type(PERF_RECORD_MMAP);
+  event.set_timestamp(time_ns);
+  event.mutable_mmap_event()->mutable_sample_info()->set_sample_time_ns(
+      time_ns);
+  return event;
+}
+
+}  // namespace
+
+TEST(ColumnarSampleStoreTest, RoundTripsSamples) {
+  PerfDataProto_PerfEvent full;
+  full.mutable_header()->set_type(PERF_RECORD_SAMPLE);
+  full.mutable_header()->set_misc(PERF_RECORD_MISC_USER);
+  full.set_timestamp(1000);
+  PerfDataProto_SampleEvent* sample = full.mutable_sample_event();
+  sample->set_ip(0x1234);
+  sample->set_pid(10);
+  sample->set_tid(11);
+  sample->set_sample_time_ns(1000);
+  sample->set_addr(0x5678);
+  sample->set_id(7);
+  sample->set_period(100000);
+  sample->set_cpu(3);
+  sample->set_weight(42);
+  sample->set_data_src(0x99);
+  sample->set_cgroup(5);
+  sample->set_code_page_size(4096);
+  sample->set_data_page_size(2 * 1024 * 1024);
+  sample->add_callchain(PERF_CONTEXT_USER);
+  sample->add_callchain(0x1234);
+  sample->add_callchain(0x2345);
+  auto* branch = sample->add_branch_stack();
+  branch->set_from_ip(0x100);
+  branch->set_to_ip(0x200);
+  branch->set_mispredicted(true);
+  branch->set_cycles(3);
+  branch = sample->add_branch_stack();
+  branch->set_from_ip(0x300);
+  branch->set_to_ip(0x400);
+  branch->set_predicted(true);
+  branch->set_in_transaction(true);
+
+  // Only the fields that are present come back.
+  PerfDataProto_PerfEvent sparse = MakeSample(0, 0x10);
+  sparse.mutable_sample_event()->clear_sample_time_ns();
+
+  ColumnarSampleStore store;
+  store.Append(full, 0);
+  store.Append(sparse, 2);
+  ASSERT_EQ(2, store.size());
+  EXPECT_EQ(0, store.event_index(0));
+  EXPECT_EQ(2, store.event_index(1));
+  EXPECT_EQ(3, store.callchain_size(0));
+  EXPECT_EQ(0x2345, store.callchain(0)[2]);
+  EXPECT_EQ(0, store.callchain_size(1));
+  EXPECT_EQ(2, store.branch_stack_size(0));
+  EXPECT_EQ(0x300, store.branch_stack(0)[1].from_ip);
+  EXPECT_FALSE(store.presence(1) & ColumnarSampleStore::kTime);
+
+  // Reuse one message for both rows, as the consumers of the store do.
+  PerfDataProto_PerfEvent event;
+  store.GetEvent(0, &event);
+  EXPECT_EQ(full.SerializeAsString(), event.SerializeAsString());
+  store.GetEvent(1, &event);
+  EXPECT_EQ(sparse.SerializeAsString(), event.SerializeAsString());
+
+  EXPECT_LT(0, store.MemoryUsage());
+  store.Clear();
+  EXPECT_TRUE(store.empty());
+}
+
+TEST(ColumnarSampleStoreTest, SortsByTimeAmongEvents) {
+  // The event stream is:
+  //   mmap@100, sample@300, mmap@200, sample@200, mmap@200, sample@100
+  RepeatedPtrField<PerfDataProto_PerfEvent> events;
+  *events.Add() = MakeMmap(100);
+  *events.Add() = MakeMmap(200);
+  *events.Add() = MakeMmap(200);
+
+  ColumnarSampleStore store;
+  store.Append(MakeSample(300, 0x1), 1);
+  store.Append(MakeSample(200, 0x2), 2);
+  store.Append(MakeSample(100, 0x3), 3);
+  EXPECT_FALSE(store.sorted_by_time());
+  store.SortByTime(events);
+  EXPECT_TRUE(store.sorted_by_time());
+
+  ASSERT_EQ(3, store.size());
+  EXPECT_EQ(100, store.time_ns(0));
+  EXPECT_EQ(0x3, store.ip(0));
+  // After the mmap@100.
+  EXPECT_EQ(1, store.time_rank(0));
+  EXPECT_EQ(200, store.time_ns(1));
+  EXPECT_EQ(0x2, store.ip(1));
+  // Between the two mmaps@200.
+  EXPECT_EQ(1, store.time_rank(1));
+  EXPECT_EQ(300, store.time_ns(2));
+  EXPECT_EQ(0x1, store.ip(2));
+  EXPECT_EQ(0, store.time_rank(2));
+
+  // The rows moved with all of their fields.
+  PerfDataProto_PerfEvent event;
+  store.GetEvent(0, &event);
+  EXPECT_EQ(0x3, event.sample_event().ip());
+  EXPECT_EQ(100, event.timestamp());
+}
+
+}  // namespace quipper
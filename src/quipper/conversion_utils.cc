@@ -71,6 +71,10 @@ bool ReadInput(const FormatAndFile& input, PerfReader* reader,
     return reader->Deserialize(perf_data_proto);
   }
 
+  if (format == kProtoStreamFormat) {
+    return ReadProtobufFromStreamFile(reader, input.filename);
+  }
+
   LOG(ERROR) << "Unimplemented read format: " << input.format;
   return false;
 }
@@ -92,7 +96,8 @@ bool WriteOutput(const FormatAndFile& output, const PerfParserOptions& options,
   }
 
   if (output.format == kProtoTextFormat ||
-      output.format == kProtoBinaryFormat) {
+      output.format == kProtoBinaryFormat ||
+      output.format == kProtoStreamFormat) {
     PerfDataProto perf_data_proto;
     reader->Serialize(&perf_data_proto);
 
@@ -103,6 +108,9 @@ bool WriteOutput(const FormatAndFile& output, const PerfParserOptions& options,
     // testing.
     perf_data_proto.set_timestamp_sec(0);
 
+    if (output.format == kProtoStreamFormat) {
+      return WriteProtobufToStreamFile(perf_data_proto, output.filename);
+    }
     if (output.format == kProtoTextFormat) {
       if (!TextFormat::PrintToString(perf_data_proto, &output_string))
         return false;
@@ -128,6 +136,9 @@ constexpr char kProtoTextFormat[] = "text";
 // Format string for protobuf binary format.
 constexpr char kProtoBinaryFormat[] = "proto";
 
+// Format string for a PerfDataProto stream.
+constexpr char kProtoStreamFormat[] = "stream";
+
 bool ConvertFile(const FormatAndFile& input, const FormatAndFile& output) {
   PerfReader reader;
   PerfParserOptions options;
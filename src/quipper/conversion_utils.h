@@ -18,13 +18,17 @@ extern const char kProtoTextFormat[];
 // Format string for protobuf binary format.
 extern const char kProtoBinaryFormat[];
 
+// Format string for a PerfDataProto stream, see perf_proto_stream.h.
+extern const char kProtoStreamFormat[];
+
 // Structure to hold the format and file of an input or output.
 struct FormatAndFile {
   // The name of the file.
   std::string filename;
 
   // The format of the file. Options are "perf" for perf data files, "text" for
-  // proto text files and "proto" for proto binary files.
+  // proto text files, "proto" for proto binary files and "stream" for
+  // PerfDataProto streams.
   std::string format;
 };
 
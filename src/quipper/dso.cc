@@ -5,6 +5,7 @@
 #include "dso.h"
 
 #include <elf.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <gelf.h>
 #include <libelf.h>
@@ -14,9 +15,11 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <utility>
 #include <vector>
 
 #include "base/logging.h"
+#include "buffer_reader.h"
 #include "file_reader.h"
 
 namespace quipper {
@@ -95,6 +98,57 @@ bool GetBuildID(Elf *elf, std::string *buildid) {
   return false;
 }
 
+// The largest note segment read by ReadElfNoteBuildId(). Build ID notes
+// are a few dozen bytes, in segments of a few notes.
+const size_t kMaxNoteSegmentSize = 1 << 20;
+
+// Reads |size| bytes at |offset| of |fd| into |buf|.
+bool ReadFully(int fd, void *buf, size_t size, off_t offset) {
+  char *out = static_cast<char *>(buf);
+  while (size > 0) {
+    const ssize_t bytes = pread(fd, out, size, offset);
+    if (bytes < 0 && errno == EINTR) continue;
+    if (bytes <= 0) return false;
+    out += bytes;
+    size -= bytes;
+    offset += bytes;
+  }
+  return true;
+}
+
+// Reads the build ID from the PT_NOTE segments of an ELF file of the byte
+// order of the host, with the headers |Ehdr| and |Phdr| of its class.
+template <typename Ehdr, typename Phdr>
+bool ReadNoteSegmentBuildId(int fd, std::string *buildid) {
+  Ehdr ehdr;
+  if (!ReadFully(fd, &ehdr, sizeof(ehdr), 0) ||
+      ehdr.e_phentsize != sizeof(Phdr) || ehdr.e_phnum == 0 ||
+      ehdr.e_phnum == PN_XNUM) {
+    return false;
+  }
+  std::vector<Phdr> phdrs(ehdr.e_phnum);
+  if (!ReadFully(fd, phdrs.data(), phdrs.size() * sizeof(Phdr),
+                 ehdr.e_phoff)) {
+    return false;
+  }
+  std::vector<char> notes;
+  for (const Phdr &phdr : phdrs) {
+    if (phdr.p_type != PT_NOTE || phdr.p_filesz == 0 ||
+        phdr.p_filesz > kMaxNoteSegmentSize) {
+      continue;
+    }
+    notes.resize(phdr.p_filesz);
+    if (!ReadFully(fd, notes.data(), notes.size(), phdr.p_offset)) continue;
+    // Notes are padded to the alignment of their segment, which is 4, or 8
+    // for the segments of 8-byte aligned notes such as GNU properties.
+    BufferReader reader(notes.data(), notes.size());
+    if (ReadBuildIdNote(&reader, phdr.p_align == 8 ? 8 : 4, buildid)) {
+      return true;
+    }
+  }
+  return false;
+}
+
 }  // namespace
 
 void InitializeLibelf() {
@@ -114,12 +168,37 @@ bool ReadElfBuildId(const std::string &filename, std::string *buildid) {
 }
 
 bool ReadElfBuildId(int fd, std::string *buildid) {
+  return ReadElfNoteBuildId(fd, buildid) || ReadElfSectionBuildId(fd, buildid);
+}
+
+bool ReadElfNoteBuildId(int fd, std::string *buildid) {
+  unsigned char ident[EI_NIDENT];
+  if (!ReadFully(fd, ident, sizeof(ident), 0) ||
+      memcmp(ident, ELFMAG, SELFMAG) != 0) {
+    return false;
+  }
+  // Files of the other byte order are left to libelf.
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  if (ident[EI_DATA] != ELFDATA2LSB) return false;
+#else
+  if (ident[EI_DATA] != ELFDATA2MSB) return false;
+#endif
+  switch (ident[EI_CLASS]) {
+    case ELFCLASS32:
+      return ReadNoteSegmentBuildId<Elf32_Ehdr, Elf32_Phdr>(fd, buildid);
+    case ELFCLASS64:
+      return ReadNoteSegmentBuildId<Elf64_Ehdr, Elf64_Phdr>(fd, buildid);
+    default:
+      return false;
+  }
+}
+
+bool ReadElfSectionBuildId(int fd, std::string *buildid) {
   InitializeLibelf();
 
   Elf *elf = elf_begin(fd, ELF_C_READ_MMAP, nullptr);
   if (elf == nullptr) {
     LOG(ERROR) << "Could not read ELF file.";
-    close(fd);
     return false;
   }
 
@@ -130,6 +209,72 @@ bool ReadElfBuildId(int fd, std::string *buildid) {
   return err;
 }
 
+bool ReadElfSymbols(const std::string &filename,
+                    std::vector<ElfSymbol> *symbols,
+                    std::vector<ElfLoadSegment> *segments) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    if (errno != ENOENT) LOG(ERROR) << "Failed to open ELF file: " << filename;
+    return false;
+  }
+  InitializeLibelf();
+
+  Elf *elf = elf_begin(fd, ELF_C_READ_MMAP, nullptr);
+  if (elf == nullptr || elf_kind(elf) != ELF_K_ELF) {
+    LOG(ERROR) << "Could not read ELF file: " << filename;
+    if (elf != nullptr) elf_end(elf);
+    close(fd);
+    return false;
+  }
+
+  size_t num_phdrs = 0;
+  if (elf_getphdrnum(elf, &num_phdrs) == 0) {
+    for (size_t i = 0; i < num_phdrs; ++i) {
+      GElf_Phdr phdr;
+      if (gelf_getphdr(elf, i, &phdr) != nullptr && phdr.p_type == PT_LOAD) {
+        ElfLoadSegment segment;
+        segment.offset = phdr.p_offset;
+        segment.vaddr = phdr.p_vaddr;
+        segment.size = phdr.p_filesz;
+        segments->push_back(segment);
+      }
+    }
+  }
+
+  Elf_Scn *sec = nullptr;
+  while ((sec = elf_nextscn(elf, sec)) != nullptr) {
+    GElf_Shdr shdr;
+    if (gelf_getshdr(sec, &shdr) == nullptr ||
+        (shdr.sh_type != SHT_SYMTAB && shdr.sh_type != SHT_DYNSYM) ||
+        shdr.sh_entsize == 0) {
+      continue;
+    }
+    Elf_Data *data = elf_getdata(sec, nullptr);
+    if (data == nullptr) continue;
+    const size_t num_syms = shdr.sh_size / shdr.sh_entsize;
+    for (size_t i = 0; i < num_syms; ++i) {
+      GElf_Sym sym;
+      if (gelf_getsym(data, i, &sym) == nullptr) continue;
+      const int type = GELF_ST_TYPE(sym.st_info);
+      if ((type != STT_FUNC && type != STT_GNU_IFUNC) ||
+          sym.st_shndx == SHN_UNDEF || sym.st_value == 0) {
+        continue;
+      }
+      const char *name = elf_strptr(elf, shdr.sh_link, sym.st_name);
+      if (name == nullptr || *name == '\0') continue;
+      ElfSymbol symbol;
+      symbol.address = sym.st_value;
+      symbol.size = sym.st_size;
+      symbol.name = name;
+      symbols->push_back(std::move(symbol));
+    }
+  }
+
+  elf_end(elf);
+  close(fd);
+  return true;
+}
+
 // read /sys/module/<module_name>/notes/.note.gnu.build-id
 bool ReadModuleBuildId(const std::string &module_name, std::string *buildid) {
   std::string note_filename =
@@ -142,17 +287,28 @@ bool ReadModuleBuildId(const std::string &module_name, std::string *buildid) {
 }
 
 bool ReadBuildIdNote(DataReader *data, std::string *buildid) {
+  return ReadBuildIdNote(data, 4, buildid);
+}
+
+bool ReadBuildIdNote(DataReader *data, size_t alignment,
+                     std::string *buildid) {
   GElf_Nhdr note_header;
 
   while (data->ReadData(sizeof(note_header), &note_header)) {
-    size_t name_size = Align<4>(note_header.n_namesz);
-    size_t desc_size = Align<4>(note_header.n_descsz);
+    // The descriptor is aligned within the note, after its header.
+    size_t name_size = (sizeof(note_header) + note_header.n_namesz +
+                        alignment - 1) / alignment * alignment -
+                       sizeof(note_header);
+    size_t desc_size =
+        (note_header.n_descsz + alignment - 1) / alignment * alignment;
 
     std::string name;
     if (!data->ReadString(name_size, &name)) return false;
     std::string desc;
     if (!data->ReadDataString(desc_size, &desc)) return false;
     if (note_header.n_type == NT_GNU_BUILD_ID && name == ELF_NOTE_GNU) {
+      // Without the padding.
+      desc.resize(note_header.n_descsz);
       *buildid = desc;
       return true;
     }
@@ -7,8 +7,10 @@
 
 #include <sys/stat.h>
 
+#include <string>
 #include <unordered_set>
 #include <utility>
+#include <vector>
 
 #include "data_reader.h"
 
@@ -35,15 +37,45 @@ bool SameInode(const DSOInfo& dso, const struct stat* s);
 
 // Must be called at least once before using libelf.
 void InitializeLibelf();
-// Read buildid from an ELF file using libelf.
+// Read buildid from an ELF file, from its note segments, or from its note
+// sections using libelf if that fails.
 bool ReadElfBuildId(const std::string& filename, std::string* buildid);
 bool ReadElfBuildId(int fd, std::string* buildid);
+// Read buildid from the PT_NOTE segments of an ELF file, reading only its
+// headers and notes with pread(). (Does not use libelf.)
+bool ReadElfNoteBuildId(int fd, std::string* buildid);
+// Read buildid from the note sections of an ELF file using libelf.
+bool ReadElfSectionBuildId(int fd, std::string* buildid);
+
+// A function symbol of an ELF file.
+struct ElfSymbol {
+  u64 address = 0;
+  u64 size = 0;
+  std::string name;
+};
+
+// A loadable segment of an ELF file: |size| bytes from |offset| in the file
+// are loaded at virtual address |vaddr|.
+struct ElfLoadSegment {
+  u64 offset = 0;
+  u64 vaddr = 0;
+  u64 size = 0;
+};
+
+// Read the function symbols of an ELF file, from both its symbol table and
+// its dynamic symbol table, and its loadable segments using libelf.
+bool ReadElfSymbols(const std::string& filename,
+                    std::vector<ElfSymbol>* symbols,
+                    std::vector<ElfLoadSegment>* segments);
 
 // Read buildid from /sys/module/<module_name>/notes/.note.gnu.build-id
 // (Does not use libelf.)
 bool ReadModuleBuildId(const std::string& module_name, std::string* buildid);
 // Read builid from Elf note data section.
 bool ReadBuildIdNote(DataReader* data, std::string* buildid);
+// Same, for notes padded to |alignment| bytes rather than 4.
+bool ReadBuildIdNote(DataReader* data, size_t alignment,
+                     std::string* buildid);
 
 // Is |name| match one of the things reported by the kernel that is known
 // not to be a kernel module?
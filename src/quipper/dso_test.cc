@@ -127,4 +127,60 @@ TEST(DsoTest, ReadsSysfsModuleBuildidNote) {
   EXPECT_EQ(std::string(note_desc, sizeof(note_desc)), buildid);
 }
 
+TEST(DsoTest, ReadsBuildIdFromNoteSegments) {
+  InitializeLibelf();
+  int fd = open("/proc/self/exe", O_RDONLY);
+  ASSERT_GE(fd, 0);
+  std::string expected_buildid;
+  if (!ReadElfSectionBuildId(fd, &expected_buildid)) {
+    close(fd);
+    GTEST_SKIP() << "The test binary has no build ID";
+  }
+  std::string buildid;
+  EXPECT_TRUE(ReadElfNoteBuildId(fd, &buildid));
+  EXPECT_EQ(expected_buildid, buildid);
+  close(fd);
+
+  // Files without program headers are left to libelf.
+  ScopedTempFile elf("/tmp/tempelf.");
+  testing::WriteElfWithBuildid(elf.path(), ".note.gnu.build-id",
+                               "\xde\xad\xf0\x0d");
+  fd = open(elf.path().c_str(), O_RDONLY);
+  ASSERT_GE(fd, 0);
+  EXPECT_FALSE(ReadElfNoteBuildId(fd, &buildid));
+  EXPECT_TRUE(ReadElfBuildId(fd, &buildid));
+  EXPECT_EQ("\xde\xad\xf0\x0d", buildid);
+  close(fd);
+}
+
+TEST(DsoTest, ReadsEightByteAlignedBuildidNote) {
+  // A GNU property note, whose descriptor is padded to 8 bytes, before the
+  // build ID note.
+  const GElf_Nhdr property_header = {
+      .n_namesz = 4,
+      .n_descsz = 12,
+      .n_type = NT_GNU_PROPERTY_TYPE_0,
+  };
+  const GElf_Nhdr buildid_header = {
+      .n_namesz = 4,
+      .n_descsz = 4,
+      .n_type = NT_GNU_BUILD_ID,
+  };
+  std::string data;
+  data.append(reinterpret_cast<const char*>(&property_header),
+              sizeof(property_header));
+  data.append(ELF_NOTE_GNU, 4);
+  data.append(16, '\x01');
+  data.append(reinterpret_cast<const char*>(&buildid_header),
+              sizeof(buildid_header));
+  data.append(ELF_NOTE_GNU, 4);
+  data.append("\xde\xad\xf0\x0d", 4);
+  data.append(4, '\0');
+
+  BufferReader data_reader(data.data(), data.size());
+  std::string buildid;
+  EXPECT_TRUE(ReadBuildIdNote(&data_reader, 8, &buildid));
+  EXPECT_EQ("\xde\xad\xf0\x0d", buildid);
+}
+
 }  // namespace quipper
@@ -7,6 +7,8 @@
 #include <sys/mman.h>
 
 #include <limits>
+#include <unordered_map>
+#include <vector>
 
 #include "base/logging.h"
 #include "perf_data_utils.h"
@@ -150,138 +152,67 @@ void SetMmapFilename(PerfEvent* event, const std::string& new_filename,
 
 namespace {
 
-// A map from PID to ranges of mmap events associated with the PID.
-class PerPidMMapEventRange {
- public:
-  using event_itr_t = RepeatedPtrField<PerfEvent>::iterator;
-  using key_t = int32_t;
-  using value_t = std::pair<event_itr_t, event_itr_t>;
-  using container = std::unordered_map<key_t, value_t>;
-
-  // Abstracts a range of mmap events between [begin, end).
-  class MMapEventIterator {
-   public:
-    MMapEventIterator(key_t pid, event_itr_t begin, event_itr_t end)
-        : itr_(begin), end_(end), pid_(pid), has_events_(true) {}
-    MMapEventIterator() : has_events_(false) {}
-
-    bool operator==(const MMapEventIterator& x) const {
-      if (!has_events_) {
-        return !x.has_events_;
-      }
-      if (!x.has_events_) {
-        return false;
-      }
-      assert(pid_ == x.pid_);
-      return itr_ == x.itr_;
-    }
-
-    bool operator!=(const MMapEventIterator& x) const { return !(*this == x); }
-
-    PerfEvent* operator*() const { return &*itr_; }
-
-    PerfEvent* operator->() const { return &*itr_; }
-
-    MMapEventIterator& operator++() {
-      for (++itr_; itr_ != end_; ++itr_) {
-        if (!itr_->has_mmap_event()) {
-          continue;
-        }
-        key_t itr_pid = -1;
-        if (itr_->mmap_event().has_pid()) {
-          itr_pid = itr_->mmap_event().pid();
-        }
-        if (itr_pid == pid_) {
-          // Found next matching mmap_event for pid.
-          return *this;
-        }
-      }
-      has_events_ = false;
-      return *this;
+// Returns the indices in |events| of the mmap events of each PID, in order,
+// with the PIDs in the order of their first event.
+//
+// Only dynamic mmap() events are skipped: hugepage deduction only works on
+// mmaps as synthesized by perf from /proc/${pid}/maps, which have
+// timestamp==0. Support for deducing hugepages from a sequence of
+// mmap()/mremap() calls would require additional deduction logic. The events
+// of a PID run from its first to its last synthesized mmap event, including
+// any dynamic ones in between.
+std::vector<std::vector<int>> MMapEventsByPid(
+    const RepeatedPtrField<PerfEvent>& events) {
+  std::unordered_map<int32_t, size_t> pid_to_bucket;
+  std::vector<std::vector<int>> buckets;
+  // The number of events of each bucket up to its last synthesized one.
+  std::vector<size_t> bucket_sizes;
+  for (int i = 0; i < events.size(); ++i) {
+    const PerfEvent& event = events.Get(i);
+    if (!event.has_mmap_event()) {
+      continue;
     }
-
-   private:
-    // Current iterator position.
-    event_itr_t itr_;
-    // 1 beyond the last event in this range.
-    event_itr_t end_;
-    // PID of events this iterator is going through.
-    key_t pid_;
-    // Cleared when the iterator runs out of events.
-    bool has_events_;
-  };
-
-  class MMapEventsForPid {
-   public:
-    MMapEventsForPid(container::const_iterator itr) : itr_(itr) {}
-
-    MMapEventIterator begin() const {
-      return MMapEventIterator(itr_->first, itr_->second.first,
-                               itr_->second.second);
-    }
-    MMapEventIterator end() const { return MMapEventIterator(); }
-
-    const MMapEventsForPid& operator*() const { return *this; }
-
-    bool operator==(const MMapEventsForPid& x) const { return itr_ == x.itr_; }
-
-    bool operator!=(const MMapEventsForPid& x) const { return !(*this == x); }
-
-    MMapEventsForPid& operator++() {
-      ++itr_;
-      return *this;
+    const bool is_synthesized = event.timestamp() == 0;
+    int32_t pid = -1;
+    if (event.mmap_event().has_pid()) {
+      pid = event.mmap_event().pid();
     }
-
-   private:
-    container::const_iterator itr_;
-  };
-
-  PerPidMMapEventRange(RepeatedPtrField<PerfEvent>* events) {
-    auto cur = events->begin();
-    auto end = events->end();
-    for (; cur != end; ++cur) {
-      if (!cur->has_mmap_event()) {
-        continue;
-      }
-      // Skip dynamic mmap() events. Hugepage deduction only works on mmaps as
-      // synthesized by perf from /proc/${pid}/maps, which have timestamp==0.
-      // Support for deducing hugepages from a sequence of mmap()/mremap() calls
-      // would require additional deduction logic.
-      if (cur->timestamp() != 0) {
+    auto entry = pid_to_bucket.find(pid);
+    if (entry == pid_to_bucket.end()) {
+      if (!is_synthesized) {
         continue;
       }
-      key_t pid = -1;
-      if (cur->mmap_event().has_pid()) {
-        pid = cur->mmap_event().pid();
-      }
-      auto entry = map_.find(pid);
-      if (entry == map_.end()) {
-        map_[pid] = {cur, cur + 1};
-      } else {
-        entry->second.second = cur + 1;
-      }
+      entry = pid_to_bucket.emplace(pid, buckets.size()).first;
+      buckets.emplace_back();
+      bucket_sizes.push_back(0);
+    }
+    std::vector<int>& bucket = buckets[entry->second];
+    bucket.push_back(i);
+    if (is_synthesized) {
+      bucket_sizes[entry->second] = bucket.size();
     }
   }
+  for (size_t i = 0; i < buckets.size(); ++i) {
+    buckets[i].resize(bucket_sizes[i]);
+  }
+  return buckets;
+}
 
-  MMapEventsForPid begin() const { return MMapEventsForPid(map_.begin()); }
-
-  MMapEventsForPid end() const { return MMapEventsForPid(map_.end()); }
-
- private:
-  container map_;
-};
-
-void UpdateRangeFromNext(PerPidMMapEventRange::MMapEventIterator first,
-                         PerPidMMapEventRange::MMapEventIterator last,
-                         PerPidMMapEventRange::MMapEventIterator end,
+// Deduces the file offsets and names of the huge pages mmap events
+// |mmaps[first]| to |mmaps[last]| from the mmap event |next|, at
+// |mmaps[next_index]|, that follows them.
+void UpdateRangeFromNext(RepeatedPtrField<PerfEvent>* events,
+                         const std::vector<int>& mmaps, size_t first,
+                         size_t last, size_t next_index,
                          const MMapEvent& next) {
-  const uint64_t range_length = last->mmap_event().start() -
-                                first->mmap_event().start() +
-                                last->mmap_event().len();
+  const MMapEvent& first_mmap = events->Get(mmaps[first]).mmap_event();
+  const MMapEvent& last_mmap = events->Get(mmaps[last]).mmap_event();
+  const uint64_t range_length =
+      last_mmap.start() - first_mmap.start() + last_mmap.len();
   const uint64_t start_pgoff = next.pgoff() - range_length;
   uint64_t pgoff = start_pgoff;
-  for (; first != end; ++first) {
-    PerfEvent* event = *first;
+  for (size_t i = first; i != next_index; ++i) {
+    PerfEvent* event = events->Mutable(mmaps[i]);
     MMapEvent* mmap = event->mutable_mmap_event();
     // As perf will rename huge pages to the executable name but not update the
     // pgoff, treat any offset of 0 as a huge page.
@@ -320,29 +251,29 @@ void UpdateRangeFromNext(PerPidMMapEventRange::MMapEventIterator first,
 }  // namespace
 
 void DeduceHugePages(RepeatedPtrField<PerfEvent>* events) {
-  PerPidMMapEventRange ranges(events);
+  // Unset positions in the mmap events of a PID.
+  constexpr size_t kNone = std::numeric_limits<size_t>::max();
 
-  for (auto mmap_range : ranges) {
-    // mmap_range is a set of mmap events associated with a PID. We care here
-    // just about fixing huge pages to look like regular pages from a file for a
-    // PID.
+  for (const std::vector<int>& mmaps : MMapEventsByPid(*events)) {
+    // mmaps are the mmap events associated with a PID. We care here just about
+    // fixing huge pages to look like regular pages from a file for a PID.
 
-    using iterator = PerPidMMapEventRange::MMapEventIterator;
     // Assigned the start of a set of huge mmapped pages.
-    iterator huge_mmap_range_first = mmap_range.end();
+    size_t huge_mmap_range_first = kNone;
     // Assigned the last of a set of huge mmapped pages.
-    iterator huge_mmap_range_last = mmap_range.end();
+    size_t huge_mmap_range_last = kNone;
     // Assigned to the last non-mmap entry.
-    iterator pre_mmap_range_last = mmap_range.end();
-    for (auto itr = mmap_range.begin(); itr != mmap_range.end(); ++itr) {
-      const auto& cur_mmap = itr->mmap_event();
+    size_t pre_mmap_range_last = kNone;
+    for (size_t i = 0; i < mmaps.size(); ++i) {
+      const auto& cur_mmap = events->Get(mmaps[i]).mmap_event();
       if (IsHugePage(cur_mmap)) {
-        if (huge_mmap_range_first == mmap_range.end()) {
+        if (huge_mmap_range_first == kNone) {
           // New range.
-          huge_mmap_range_first = itr;
-          huge_mmap_range_last = itr;
+          huge_mmap_range_first = i;
+          huge_mmap_range_last = i;
         } else {
-          const auto& mmap_range_last = huge_mmap_range_last->mmap_event();
+          const auto& mmap_range_last =
+              events->Get(mmaps[huge_mmap_range_last]).mmap_event();
           if (IsVmaContiguous(mmap_range_last, cur_mmap) &&
               (mmap_range_last.filename() == cur_mmap.filename() ||
                (IsMergeableAnon(mmap_range_last, cur_mmap))) &&
@@ -351,25 +282,28 @@ void DeduceHugePages(RepeatedPtrField<PerfEvent>* events) {
             // Ranges match exactly: //anon,//anon, or file,file; If they use
             // different names, then deduction needs to consider them
             // independently.
-            huge_mmap_range_last = itr;
+            huge_mmap_range_last = i;
           } else {
             // Discontiguous range, start a new range.
-            huge_mmap_range_first = itr;
-            huge_mmap_range_last = itr;
-            pre_mmap_range_last = mmap_range.end();
+            huge_mmap_range_first = i;
+            huge_mmap_range_last = i;
+            pre_mmap_range_last = kNone;
           }
         }
       } else {
-        if (huge_mmap_range_first != mmap_range.end()) {
-          const auto& mmap_range_first = huge_mmap_range_first->mmap_event();
-          const auto& mmap_range_last = huge_mmap_range_last->mmap_event();
+        if (huge_mmap_range_first != kNone) {
+          const auto& mmap_range_first =
+              events->Get(mmaps[huge_mmap_range_first]).mmap_event();
+          const auto& mmap_range_last =
+              events->Get(mmaps[huge_mmap_range_last]).mmap_event();
           // Not a huge page but there's a pending range to process.
           uint64_t huge_mmap_range_length = mmap_range_last.start() -
                                             mmap_range_first.start() +
                                             mmap_range_last.len();
           uint64_t start_pgoff = 0;
-          if (pre_mmap_range_last != mmap_range.end()) {
-            const auto& pre_mmap = pre_mmap_range_last->mmap_event();
+          if (pre_mmap_range_last != kNone) {
+            const auto& pre_mmap =
+                events->Get(mmaps[pre_mmap_range_last]).mmap_event();
             if (IsVmaContiguous(pre_mmap, mmap_range_first) &&
                 IsEquivalentFile(pre_mmap, mmap_range_first) &&
                 IsEquivalentFile(pre_mmap, cur_mmap)) {
@@ -380,26 +314,26 @@ void DeduceHugePages(RepeatedPtrField<PerfEvent>* events) {
               IsEquivalentFile(mmap_range_last, cur_mmap) &&
               cur_mmap.pgoff() >= huge_mmap_range_length &&
               cur_mmap.pgoff() - huge_mmap_range_length == start_pgoff) {
-            UpdateRangeFromNext(huge_mmap_range_first, huge_mmap_range_last,
-                                itr, cur_mmap);
+            UpdateRangeFromNext(events, mmaps, huge_mmap_range_first,
+                                huge_mmap_range_last, i, cur_mmap);
           }
-          huge_mmap_range_first = mmap_range.end();
-          huge_mmap_range_last = mmap_range.end();
+          huge_mmap_range_first = kNone;
+          huge_mmap_range_last = kNone;
         }
-        pre_mmap_range_last = itr;
+        pre_mmap_range_last = i;
       }
     }
   }
 }
 
 void CombineMappings(RepeatedPtrField<PerfEvent>* events) {
-  // Combine mappings
-  RepeatedPtrField<PerfEvent> new_events;
-  new_events.Reserve(events->size());
+  // Combine mappings in place: the events that are kept are moved down to the
+  // first |num_kept| events, over the ones that were merged into them, which
+  // are deleted at the end.
+  int num_kept = 0;
   std::unordered_map<int32_t, int> pid_to_prev_map;
 
-  // |prev| is the index of the last mmap_event in |new_events| (or
-  // |new_events.size()| if no mmap_events have been inserted yet).
+  // |pid_to_prev_map| has the index of the last kept mmap_event of each PID.
   for (int i = 0; i < events->size(); ++i) {
     PerfEvent* event = events->Mutable(i);
     bool should_merge = false;
@@ -414,7 +348,7 @@ void CombineMappings(RepeatedPtrField<PerfEvent>* events) {
       auto itr = pid_to_prev_map.find(pid);
       should_merge = itr != pid_to_prev_map.end();
       if (should_merge) {
-        prev_mmap_event = new_events.Mutable(itr->second);
+        prev_mmap_event = events->Mutable(itr->second);
         prev_mmap = prev_mmap_event->mutable_mmap_event();
       }
     }
@@ -442,13 +376,16 @@ void CombineMappings(RepeatedPtrField<PerfEvent>* events) {
     } else {
       // Remember the last mmap event for a PID.
       if (mmap != nullptr) {
-        pid_to_prev_map[pid] = new_events.size();
+        pid_to_prev_map[pid] = num_kept;
+      }
+      if (num_kept != i) {
+        events->SwapElements(num_kept, i);
       }
-      new_events.Add()->Swap(event);
+      ++num_kept;
     }
   }
 
-  events->Swap(&new_events);
+  events->DeleteSubrange(num_kept, events->size() - num_kept);
 }
 
 }  // namespace quipper
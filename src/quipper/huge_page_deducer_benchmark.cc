@@ -0,0 +1,77 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Times DeduceHugePages() and CombineMappings() on system-wide captures of
+// an increasing number of processes, whose mmap events are interleaved:
+//   huge_page_deducer_benchmark [<mmaps per pid>] [<max pids>]
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <chrono>  // NOLINT(build/c++11)
+#include <string>
+
+#include "base/logging.h"
+#include "compat/proto.h"
+#include "huge_page_deducer.h"
+
+namespace quipper {
+namespace {
+
+using PerfEvent = PerfDataProto::PerfEvent;
+
+// Adds |mmaps_per_pid| synthesized mmap events for each of |num_pids| PIDs,
+// interleaved across the PIDs: the text of a binary split by huge pages, then
+// its libraries.
+void AddMmaps(int num_pids, int mmaps_per_pid,
+              RepeatedPtrField<PerfEvent>* events) {
+  for (int i = 0; i < mmaps_per_pid; ++i) {
+    for (int pid = 1; pid <= num_pids; ++pid) {
+      PerfDataProto::MMapEvent* mmap = events->Add()->mutable_mmap_event();
+      mmap->set_pid(pid);
+      mmap->set_start(0x400000 + i * 0x200000);
+      mmap->set_len(0x200000);
+      if (i < 4) {
+        mmap->set_filename(i % 2 == 0 ? "/usr/bin/main" : "//anon");
+        mmap->set_pgoff(i % 2 == 0 ? i * 0x200000 : 0);
+      } else {
+        mmap->set_filename("/usr/lib/lib" + std::to_string(i) + ".so");
+        mmap->set_pgoff(0);
+      }
+    }
+  }
+}
+
+// Returns the milliseconds |function| takes on |events|.
+double Time(void (*function)(RepeatedPtrField<PerfEvent>*),
+            RepeatedPtrField<PerfEvent>* events) {
+  const auto start = std::chrono::steady_clock::now();
+  function(events);
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+}  // namespace
+}  // namespace quipper
+
+int main(int argc, char* argv[]) {
+  if (argc > 3) {
+    LOG(ERROR) << "Usage: " << argv[0] << " [<mmaps per pid>] [<max pids>]";
+    return EXIT_FAILURE;
+  }
+  const int mmaps_per_pid = argc > 1 ? atoi(argv[1]) : 32;
+  const int max_pids = argc > 2 ? atoi(argv[2]) : 8192;
+  printf("%8s %10s %12s %12s\n", "pids", "events", "deduce ms", "combine ms");
+  for (int num_pids = 16; num_pids <= max_pids; num_pids *= 2) {
+    quipper::RepeatedPtrField<quipper::PerfDataProto::PerfEvent> events;
+    quipper::AddMmaps(num_pids, mmaps_per_pid, &events);
+    const int num_events = events.size();
+    const double deduce_ms = quipper::Time(quipper::DeduceHugePages, &events);
+    const double combine_ms = quipper::Time(quipper::CombineMappings, &events);
+    printf("%8d %10d %12.1f %12.1f\n", num_pids, num_events, deduce_ms,
+           combine_ms);
+  }
+  return EXIT_SUCCESS;
+}
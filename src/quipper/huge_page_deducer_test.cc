@@ -711,6 +711,45 @@ TEST(HugePageDeducer, Regression117238226) {
                 }));
 }
 
+TEST(HugePageDeducer, InterleavedPids) {
+  // System-wide captures interleave the mmap events of processes.
+  RepeatedPtrField<PerfEvent> events;
+  for (uint32_t pid : {10, 20}) {
+    AddMmap(pid, 0x1000000, 0x200000, 0, "main", &events);
+  }
+  for (uint32_t pid : {10, 20}) {
+    AddMmap(pid, 0x1200000, 0x400000, 0, "//anon", &events);
+  }
+  for (uint32_t pid : {10, 20}) {
+    AddMmap(pid, 0x1600000, 0x100000, 0x600000, "main", &events);
+  }
+
+  DeduceHugePages(&events);
+
+  EXPECT_THAT(
+      events,
+      Pointwise(Partially(EqualsProto()),
+                {
+                    "mmap_event: { pid: 10 pgoff: 0 filename: 'main' }",
+                    "mmap_event: { pid: 20 pgoff: 0 filename: 'main' }",
+                    "mmap_event: { pid: 10 pgoff: 0x200000 filename: 'main' }",
+                    "mmap_event: { pid: 20 pgoff: 0x200000 filename: 'main' }",
+                    "mmap_event: { pid: 10 pgoff: 0x600000 filename: 'main' }",
+                    "mmap_event: { pid: 20 pgoff: 0x600000 filename: 'main' }",
+                }));
+
+  CombineMappings(&events);
+
+  EXPECT_THAT(events,
+              Pointwise(Partially(EqualsProto()),
+                        {
+                            "mmap_event: { pid: 10 start: 0x1000000 "
+                            "len: 0x700000 pgoff: 0 filename: 'main' }",
+                            "mmap_event: { pid: 20 start: 0x1000000 "
+                            "len: 0x700000 pgoff: 0 filename: 'main' }",
+                        }));
+}
+
 TEST(HugePageDeducer, CombineMappings) {
   RepeatedPtrField<PerfEvent> events;
   // Interchange 2 sets of mmaps that will be combined.
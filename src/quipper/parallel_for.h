@@ -0,0 +1,40 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMIUMOS_WIDE_PROFILING_PARALLEL_FOR_H_
+#define CHROMIUMOS_WIDE_PROFILING_PARALLEL_FOR_H_
+
+#include <stddef.h>
+
+#include <algorithm>
+#include <atomic>
+#include <thread>  // NOLINT(build/c++11)
+#include <vector>
+
+namespace quipper {
+
+// Runs |work(i)| for each i in [0, n) on up to |num_threads| threads, the
+// calling thread being one of them. The indices are handed out one at a time,
+// so items that take longer than others do not hold up the rest.
+template <typename Work>
+void ParallelFor(size_t n, int num_threads, const Work& work) {
+  std::atomic<size_t> next(0);
+  auto worker = [&]() {
+    for (size_t i = next++; i < n; i = next++) {
+      work(i);
+    }
+  };
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < std::min<size_t>(n, num_threads); ++i) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+}
+
+}  // namespace quipper
+
+#endif  // CHROMIUMOS_WIDE_PROFILING_PARALLEL_FOR_H_
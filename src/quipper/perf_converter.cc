@@ -15,6 +15,7 @@
 using quipper::FormatAndFile;
 using quipper::kPerfFormat;
 using quipper::kProtoBinaryFormat;
+using quipper::kProtoStreamFormat;
 using quipper::kProtoTextFormat;
 
 namespace {
@@ -75,7 +76,9 @@ void PrintUsage() {
             << " -o <output filename> -O <output format> -v <verbosity level>";
   LOG(INFO) << "Format options are: '" << kPerfFormat << "' for perf.data"
             << ", '" << kProtoTextFormat << "' for proto text"
-            << " and '" << kProtoBinaryFormat << "' for proto binary encoding.";
+            << ", '" << kProtoBinaryFormat << "' for proto binary encoding"
+            << " and '" << kProtoStreamFormat << "' for a stream of proto"
+            << " event batches.";
 
   LOG(INFO) << "By default it reads from perf.data and outputs to /dev/stdout"
             << " in proto text format.";
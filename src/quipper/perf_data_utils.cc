@@ -6,6 +6,7 @@
 
 #include <cstdint>
 #include <string>
+#include <unordered_map>
 
 #include "base/logging.h"
 #include "compat/proto.h"
@@ -43,6 +44,20 @@ bool GetUint64AlignedStringLength(const char* str, size_t max_size,
   return true;
 }
 
+// Returns a key that is equal for two branch stacks iff their entries are.
+std::string BranchStackKey(
+    const RepeatedPtrField<PerfDataProto_BranchStackEntry>& entries) {
+  std::string key;
+  for (const auto& entry : entries) {
+    // Prefix each entry with its length, so that entries can't run together.
+    const std::string bytes = entry.SerializeAsString();
+    const uint32_t size = bytes.size();
+    key.append(reinterpret_cast<const char*>(&size), sizeof(size));
+    key.append(bytes);
+  }
+  return key;
+}
+
 }  // namespace
 
 event_t* CallocMemoryForEvent(size_t size) {
@@ -651,4 +666,86 @@ size_t GetEventDataSize(const PerfDataProto_PerfEvent& event) {
   return size;
 }
 
+void DeduplicateSampleStacks(PerfDataProto* perf_data) {
+  // Stacks already in the tables, e.g. from an earlier call, are reused.
+  std::unordered_map<std::string, uint32_t> callchain_indices;
+  for (int i = 0; i < perf_data->callchains_size(); ++i) {
+    const auto& ips = perf_data->callchains(i).ips();
+    callchain_indices.emplace(
+        std::string(reinterpret_cast<const char*>(ips.data()),
+                    ips.size() * sizeof(uint64_t)),
+        i);
+  }
+  std::unordered_map<std::string, uint32_t> branch_stack_indices;
+  for (int i = 0; i < perf_data->branch_stacks_size(); ++i) {
+    branch_stack_indices.emplace(
+        BranchStackKey(perf_data->branch_stacks(i).entries()), i);
+  }
+
+  for (auto& event : *perf_data->mutable_events()) {
+    if (!event.has_sample_event()) continue;
+    PerfDataProto_SampleEvent* sample = event.mutable_sample_event();
+
+    if (sample->callchain_size() > 0) {
+      auto inserted = callchain_indices.emplace(
+          std::string(reinterpret_cast<const char*>(sample->callchain().data()),
+                      sample->callchain_size() * sizeof(uint64_t)),
+          perf_data->callchains_size());
+      if (inserted.second) {
+        perf_data->add_callchains()->mutable_ips()->Swap(
+            sample->mutable_callchain());
+      } else {
+        sample->clear_callchain();
+      }
+      sample->set_callchain_index(inserted.first->second);
+    }
+
+    if (sample->branch_stack_size() > 0) {
+      auto inserted = branch_stack_indices.emplace(
+          BranchStackKey(sample->branch_stack()),
+          perf_data->branch_stacks_size());
+      if (inserted.second) {
+        perf_data->add_branch_stacks()->mutable_entries()->Swap(
+            sample->mutable_branch_stack());
+      } else {
+        sample->clear_branch_stack();
+      }
+      sample->set_branch_stack_index(inserted.first->second);
+    }
+  }
+}
+
+bool InlineSampleStacks(PerfDataProto* perf_data) {
+  for (auto& event : *perf_data->mutable_events()) {
+    if (!event.has_sample_event()) continue;
+    PerfDataProto_SampleEvent* sample = event.mutable_sample_event();
+
+    if (sample->has_callchain_index()) {
+      const uint32_t index = sample->callchain_index();
+      if (index >= static_cast<uint32_t>(perf_data->callchains_size())) {
+        LOG(ERROR) << "Sample refers to callchain " << index << " of "
+                   << perf_data->callchains_size();
+        return false;
+      }
+      *sample->mutable_callchain() = perf_data->callchains(index).ips();
+      sample->clear_callchain_index();
+    }
+
+    if (sample->has_branch_stack_index()) {
+      const uint32_t index = sample->branch_stack_index();
+      if (index >= static_cast<uint32_t>(perf_data->branch_stacks_size())) {
+        LOG(ERROR) << "Sample refers to branch stack " << index << " of "
+                   << perf_data->branch_stacks_size();
+        return false;
+      }
+      *sample->mutable_branch_stack() =
+          perf_data->branch_stacks(index).entries();
+      sample->clear_branch_stack_index();
+    }
+  }
+  perf_data->clear_callchains();
+  perf_data->clear_branch_stacks();
+  return true;
+}
+
 }  // namespace quipper
@@ -14,6 +14,7 @@
 
 namespace quipper {
 
+class PerfDataProto;
 class PerfDataProto_PerfEvent;
 class PerfDataProto_SampleInfo;
 
@@ -104,6 +105,16 @@ bool GetEventDataVariablePayloadSize(const PerfDataProto_PerfEvent& event,
 size_t GetEventDataSize(const event_t& event);
 size_t GetEventDataSize(const PerfDataProto_PerfEvent& event);
 
+// Moves the callchain and branch stack of every sample in |perf_data| into
+// |perf_data->callchains| and |perf_data->branch_stacks|, storing each distinct
+// callchain and branch stack only once. The samples refer to them by index.
+void DeduplicateSampleStacks(PerfDataProto* perf_data);
+
+// Undoes DeduplicateSampleStacks(): copies the callchain and branch stack of
+// every sample back into the sample and clears the tables. Returns false if a
+// sample refers to a table entry that doesn't exist.
+bool InlineSampleStacks(PerfDataProto* perf_data);
+
 }  // namespace quipper
 
 #endif  // CHROMIUMOS_WIDE_PROFILING_PERF_DATA_UTILS_H_
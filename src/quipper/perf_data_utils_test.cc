@@ -145,4 +145,51 @@ TEST(PerfDataUtilsTest, GetEventDataSizeWithProtoForUnsupportedEvent) {
   EXPECT_EQ(0, GetEventDataSize(event));
 }
 
+TEST(PerfDataUtilsTest, DeduplicatesAndInlinesSampleStacks) {
+  PerfDataProto proto;
+  // Three samples: two with the same stacks, one with different stacks.
+  for (uint64_t ip : {0x1000, 0x2000, 0x1000}) {
+    PerfDataProto_SampleEvent* sample =
+        proto.add_events()->mutable_sample_event();
+    sample->add_callchain(PERF_CONTEXT_USER);
+    sample->add_callchain(ip);
+    PerfDataProto_BranchStackEntry* entry = sample->add_branch_stack();
+    entry->set_from_ip(ip);
+    entry->set_to_ip(ip + 0x10);
+  }
+  // A sample without stacks and a non-sample event are left alone.
+  proto.add_events()->mutable_sample_event()->set_ip(0x3000);
+  proto.add_events()->mutable_mmap_event()->set_pid(1);
+  const PerfDataProto original = proto;
+
+  DeduplicateSampleStacks(&proto);
+  ASSERT_EQ(2, proto.callchains_size());
+  ASSERT_EQ(2, proto.branch_stacks_size());
+  EXPECT_EQ(0x2000, proto.callchains(1).ips(1));
+  EXPECT_EQ(0x2000, proto.branch_stacks(1).entries(0).from_ip());
+  for (int i = 0; i < 3; ++i) {
+    const PerfDataProto_SampleEvent& sample = proto.events(i).sample_event();
+    EXPECT_EQ(0, sample.callchain_size());
+    EXPECT_EQ(0, sample.branch_stack_size());
+    EXPECT_EQ(i % 2, sample.callchain_index());
+    EXPECT_EQ(i % 2, sample.branch_stack_index());
+  }
+  EXPECT_FALSE(proto.events(3).sample_event().has_callchain_index());
+
+  // Deduplicating again changes nothing.
+  const PerfDataProto deduplicated = proto;
+  DeduplicateSampleStacks(&proto);
+  EXPECT_EQ(deduplicated.SerializeAsString(), proto.SerializeAsString());
+
+  ASSERT_TRUE(InlineSampleStacks(&proto));
+  EXPECT_EQ(original.SerializeAsString(), proto.SerializeAsString());
+}
+
+TEST(PerfDataUtilsTest, InlineSampleStacksRejectsInvalidIndex) {
+  PerfDataProto proto;
+  proto.add_callchains()->add_ips(0x1000);
+  proto.add_events()->mutable_sample_event()->set_callchain_index(1);
+  EXPECT_FALSE(InlineSampleStacks(&proto));
+}
+
 }  // namespace quipper
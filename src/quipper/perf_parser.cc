@@ -12,9 +12,12 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <chrono>  // NOLINT(build/c++11)
 #include <memory>
+#include <mutex>  // NOLINT(build/c++11)
 #include <set>
-#include <sstream>
+#include <tuple>
+#include <unordered_map>
 
 #include "base/logging.h"
 #include "address_mapper.h"
@@ -22,6 +25,8 @@
 #include "compat/proto.h"
 #include "dso.h"
 #include "huge_page_deducer.h"
+#include "parallel_for.h"
+#include "symbol_cache.h"
 
 namespace quipper {
 
@@ -99,24 +104,8 @@ bool PerfParser::ParseRawEvents() {
   if (!options_.discard_unused_events) return true;
 
   // Some MMAP/MMAP2 events' mapped regions will not have any samples. These
-  // MMAP/MMAP2 events should be dropped. |parsed_events_| should be
-  // reconstructed without these events.
-  write_index = 0;
-  size_t read_index;
-  for (read_index = 0; read_index < parsed_events_.size(); ++read_index) {
-    const ParsedEvent& event = parsed_events_[read_index];
-    if (event.event_ptr->has_mmap_event() &&
-        event.num_samples_in_mmap_region == 0) {
-      continue;
-    }
-    if (read_index != write_index) parsed_events_[write_index] = event;
-    ++write_index;
-  }
-  CHECK_LE(write_index, parsed_events_.size());
-  parsed_events_.resize(write_index);
-
-  // Update the events in |reader_| to match the updated events.
-  UpdatePerfEventsFromParsedEvents();
+  // MMAP/MMAP2 events should be dropped, from |parsed_events_| and |reader_|.
+  DiscardUnusedEvents();
 
   return true;
 }
@@ -142,8 +131,15 @@ bool PerfParser::ProcessUserEvents(PerfEvent& event) {
   return true;
 }
 
+bool PerfParser::MapsSampleEvents() const {
+  return options_.map_sample_events || options_.do_remap ||
+         options_.discard_unused_events || options_.read_missing_buildids;
+}
+
 bool PerfParser::ProcessEvents() {
   stats_ = {0};
+  // Without mapping the samples, no AddressMappers are kept either.
+  const bool map_sample_events = MapsSampleEvents();
 
   stats_.did_remap = false;  // Explicitly clear the remap flag.
 
@@ -182,7 +178,7 @@ bool PerfParser::ProcessEvents() {
         // previously-endian-swapped location. This used to log ip.
         VLOG(1) << "SAMPLE";
         ++stats_.num_sample_events;
-        MapSampleEvent(&parsed_event);
+        if (map_sample_events) MapSampleEvent(&parsed_event);
         break;
       case PERF_RECORD_MMAP:
       case PERF_RECORD_MMAP2: {
@@ -195,8 +191,10 @@ bool PerfParser::ProcessEvents() {
             (event.header().misc() & quipper::PERF_RECORD_MISC_CPUMODE_MASK) ==
                 quipper::PERF_RECORD_MISC_KERNEL;
         // Use the array index of the current mmap event as a unique identifier.
-        CHECK(MapMmapEvent(event.mutable_mmap_event(), i, is_kernel))
-            << "Unable to map " << mmap_type_name << " event!";
+        if (map_sample_events) {
+          CHECK(MapMmapEvent(event.mutable_mmap_event(), i, is_kernel))
+              << "Unable to map " << mmap_type_name << " event!";
+        }
         // No samples in this MMAP region yet, hopefully.
         parsed_event.num_samples_in_mmap_region = 0;
         DSOInfo dso_info;
@@ -220,7 +218,10 @@ bool PerfParser::ProcessEvents() {
                 << ":" << event.fork_event().tid();
         // clang-format on
         ++stats_.num_fork_events;
-        CHECK(MapForkEvent(event.fork_event())) << "Unable to map FORK event!";
+        if (map_sample_events) {
+          CHECK(MapForkEvent(event.fork_event()))
+              << "Unable to map FORK event!";
+        }
         break;
       case PERF_RECORD_EXIT:
         // EXIT events have the same structure as FORK events.
@@ -238,7 +239,9 @@ bool PerfParser::ProcessEvents() {
                 << event.comm_event().comm();
         // clang-format on
         ++stats_.num_comm_events;
-        CHECK(MapCommEvent(event.comm_event()));
+        if (map_sample_events) {
+          CHECK(MapCommEvent(event.comm_event()));
+        }
         commands_.insert(event.comm_event().comm());
         const PidTid pidtid =
             std::make_pair(event.comm_event().pid(), event.comm_event().tid());
@@ -287,12 +290,18 @@ bool PerfParser::ProcessEvents() {
         reader_->event_types_to_skip_when_serializing().end()) {
       LOG(INFO) << "Input perf.data has no sample events due to "
                    "PERF_RECORD_SAMPLE being skipped.";
+    } else if (reader_->columnar_sample_store() != nullptr &&
+               !reader_->columnar_sample_store()->empty()) {
+      LOG(INFO) << "Input perf.data has no sample events due to "
+                   "PERF_RECORD_SAMPLE being stored in columnar form.";
     } else {
       LOG(ERROR) << "Input perf.data has no sample events.";
     }
     return false;
   }
 
+  if (!map_sample_events) return true;
+
   float sample_mapping_percentage =
       static_cast<float>(stats_.num_sample_events_mapped) /
       stats_.num_sample_events * 100.;
@@ -337,6 +346,7 @@ std::pair<uint32_t, uint32_t> splitU64(uint64_t value) {
 }
 
 bool ReadElfBuildIdIfSameInode(const std::string& dso_path, const DSOInfo& dso,
+                               const SymbolCache* cache,
                                std::string* buildid) {
   int fd = open(dso_path.c_str(), O_RDONLY);
   FdCloser fd_closer(fd);
@@ -350,13 +360,35 @@ bool ReadElfBuildIdIfSameInode(const std::string& dso_path, const DSOInfo& dso,
   // Only reject based on inode if we actually have device info (from MMAP2).
   if (dso.maj != 0 && dso.min != 0 && !SameInode(dso, &s)) return false;
 
+  if (cache != nullptr) return cache->ReadElfBuildId(fd, buildid);
   return ReadElfBuildId(fd, buildid);
 }
 
-// Looks up build ID of a given DSO by reading directly from the file system.
-// - Does not support reading build ID of the main kernel binary.
-// - Reads build IDs of kernel modules and other DSOs using functions in dso.h.
-std::string FindDsoBuildId(const DSOInfo& dso_info) {
+// Looks up the build IDs of DSOs by reading directly from the file system. It
+// may be used by several threads at once, which share what it learns about the
+// /proc/<id>/root directories of the processes and threads.
+class DsoBuildIdFinder {
+ public:
+  explicit DsoBuildIdFinder(const SymbolCache* cache) : cache_(cache) {}
+
+  // Looks up build ID of a given DSO.
+  // - Does not support reading build ID of the main kernel binary.
+  // - Reads build IDs of kernel modules and other DSOs using functions in
+  //   dso.h, or from |cache_| if it is not null.
+  std::string FindDsoBuildId(const DSOInfo& dso_info);
+
+ private:
+  // Returns whether /proc/<id>/root exists, checking each id only once, so
+  // that the files of the processes that have exited are not tried for each
+  // of their DSOs.
+  bool ProcRootExists(uint32_t id);
+
+  const SymbolCache* cache_;
+  std::mutex mutex_;
+  std::unordered_map<uint32_t, bool> proc_root_exists_;
+};
+
+std::string DsoBuildIdFinder::FindDsoBuildId(const DSOInfo& dso_info) {
   std::string buildid_bin;
   const std::string& dso_name = dso_info.name;
   if (IsKernelNonModuleName(dso_name)) return buildid_bin;  // still empty
@@ -375,10 +407,10 @@ std::string FindDsoBuildId(const DSOInfo& dso_info) {
   for (auto pidtid_it : threads) {
     uint32_t pid, tid;
     std::tie(pid, tid) = splitU64(pidtid_it);
-    std::stringstream dso_path_stream;
-    dso_path_stream << "/proc/" << tid << "/root/" << dso_name;
-    std::string dso_path = dso_path_stream.str();
-    if (ReadElfBuildIdIfSameInode(dso_path, dso_info, &buildid_bin)) {
+    if (ProcRootExists(tid) &&
+        ReadElfBuildIdIfSameInode(
+            "/proc/" + std::to_string(tid) + "/root/" + dso_name, dso_info,
+            cache_, &buildid_bin)) {
       return buildid_bin;
     }
     // Avoid re-trying the parent process if it's the same for multiple threads.
@@ -386,62 +418,135 @@ std::string FindDsoBuildId(const DSOInfo& dso_info) {
     if (pid == last_pid || pid == tid) continue;
     last_pid = pid;
     // Try the parent process:
-    std::stringstream parent_dso_path_stream;
-    parent_dso_path_stream << "/proc/" << pid << "/root/" << dso_name;
-    std::string parent_dso_path = parent_dso_path_stream.str();
-    if (ReadElfBuildIdIfSameInode(parent_dso_path, dso_info, &buildid_bin)) {
+    if (ProcRootExists(pid) &&
+        ReadElfBuildIdIfSameInode(
+            "/proc/" + std::to_string(pid) + "/root/" + dso_name, dso_info,
+            cache_, &buildid_bin)) {
       return buildid_bin;
     }
   }
   // Still don't have a buildid. Try our own filesystem:
-  if (ReadElfBuildIdIfSameInode(dso_name, dso_info, &buildid_bin)) {
+  if (ReadElfBuildIdIfSameInode(dso_name, dso_info, cache_, &buildid_bin)) {
     return buildid_bin;
   }
   return buildid_bin;  // still empty.
 }
 
+bool DsoBuildIdFinder::ProcRootExists(uint32_t id) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = proc_root_exists_.find(id);
+    if (it != proc_root_exists_.end()) return it->second;
+  }
+  struct stat s;
+  const bool exists =
+      stat(("/proc/" + std::to_string(id) + "/root").c_str(), &s) == 0;
+  std::lock_guard<std::mutex> lock(mutex_);
+  proc_root_exists_.emplace(id, exists);
+  return exists;
+}
+
 }  // namespace
 
 bool PerfParser::FillInDsoBuildIds() {
   std::map<std::string, std::string> filenames_to_build_ids;
   reader_->GetFilenamesToBuildIDs(&filenames_to_build_ids);
 
-  std::map<std::string, std::string> new_buildids;
-
+  // The DSOs whose build IDs are read from the file system, grouped by the
+  // file they map where MMAP2 events tell it, so that each file is only read
+  // once however many names and containers it is mapped from.
+  std::vector<std::vector<DSOInfo*>> lookups;
+  std::map<std::tuple<u32, u32, u64>, size_t> inode_lookups;
   for (std::pair<const std::string, DSOInfo>& kv : name_to_dso_) {
     DSOInfo& dso_info = kv.second;
     const auto it = filenames_to_build_ids.find(dso_info.name);
     if (it != filenames_to_build_ids.end()) {
       dso_info.build_id = it->second;
     }
-    // If there is both an existing build ID and a new build ID returned by
-    // FindDsoBuildId(), overwrite the existing build ID.
-    if (options_.read_missing_buildids && dso_info.hit) {
-      std::string buildid_bin = FindDsoBuildId(dso_info);
-      if (!buildid_bin.empty()) {
-        dso_info.build_id = RawDataToHexString(buildid_bin);
-        new_buildids[dso_info.name] = dso_info.build_id;
-      }
+    if (!options_.read_missing_buildids || !dso_info.hit) continue;
+    if (dso_info.maj == 0 && dso_info.min == 0) {
+      lookups.push_back({&dso_info});
+      continue;
+    }
+    auto inserted = inode_lookups.emplace(
+        std::make_tuple(dso_info.maj, dso_info.min, dso_info.ino),
+        lookups.size());
+    if (inserted.second) lookups.emplace_back();
+    lookups[inserted.first->second].push_back(&dso_info);
+  }
+  if (lookups.empty()) return true;
+
+  const auto start = std::chrono::steady_clock::now();
+  InitializeLibelf();
+  std::unique_ptr<SymbolCache> cache;
+  if (!options_.symbol_cache_dir.empty()) {
+    cache.reset(new SymbolCache(options_.symbol_cache_dir));
+  }
+  DsoBuildIdFinder finder(cache.get());
+  // The build ID of each lookup, empty if none was found from any of the
+  // names of its file.
+  std::vector<std::string> buildids(lookups.size());
+  ParallelFor(lookups.size(), options_.num_buildid_threads, [&](size_t i) {
+    for (const DSOInfo* dso_info : lookups[i]) {
+      buildids[i] = finder.FindDsoBuildId(*dso_info);
+      if (!buildids[i].empty()) break;
+    }
+  });
+
+  // If there is both an existing build ID and a new build ID returned by
+  // FindDsoBuildId(), overwrite the existing build ID.
+  std::map<std::string, std::string> new_buildids;
+  for (size_t i = 0; i < lookups.size(); ++i) {
+    if (buildids[i].empty()) continue;
+    ++stats_.num_buildids_read;
+    const std::string buildid = RawDataToHexString(buildids[i]);
+    for (DSOInfo* dso_info : lookups[i]) {
+      dso_info->build_id = buildid;
+      new_buildids[dso_info->name] = buildid;
     }
   }
+  stats_.num_buildid_lookups = lookups.size();
+  stats_.buildid_lookup_ns =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now() - start)
+          .count();
+  VLOG(1) << "Read " << stats_.num_buildids_read << " of "
+          << stats_.num_buildid_lookups
+          << " build IDs from the file system in "
+          << stats_.buildid_lookup_ns / 1000000 << " ms";
 
   if (new_buildids.empty()) return true;
   return reader_->InjectBuildIDs(new_buildids);
 }
 
-void PerfParser::UpdatePerfEventsFromParsedEvents() {
-  // Reorder the events in |reader_| to match the order of |parsed_events_|.
-  // The |event_ptr|'s in |parsed_events_| are pointers to existing events in
-  // |reader_|.
-  RepeatedPtrField<PerfEvent> new_events;
-  new_events.Reserve(parsed_events_.size());
-  for (ParsedEvent& parsed_event : parsed_events_) {
-    PerfEvent* new_event = new_events.Add();
-    new_event->Swap(parsed_event.event_ptr);
-    parsed_event.event_ptr = new_event;
+void PerfParser::DiscardUnusedEvents() {
+  // |parsed_events_| holds the events of |reader_| other than
+  // PERF_RECORD_FINISHED_ROUND, in the same order. Both are compacted in one
+  // pass: the events kept are swapped forward, which only moves pointers, so
+  // the |event_ptr|'s stay valid and the kept events keep their order.
+  RepeatedPtrField<PerfEvent>* events = reader_->mutable_events();
+  size_t read_index = 0;
+  int write_index = 0;
+  for (int i = 0; i < events->size(); ++i) {
+    if (events->Get(i).header().type() == PERF_RECORD_FINISHED_ROUND) continue;
+    CHECK_LT(read_index, parsed_events_.size());
+    const ParsedEvent& event = parsed_events_[read_index++];
+    CHECK_EQ(events->Mutable(i), event.event_ptr);
+    if (event.event_ptr->has_mmap_event() &&
+        event.num_samples_in_mmap_region == 0) {
+      continue;
+    }
+    if (i != write_index) {
+      events->SwapElements(i, write_index);
+      parsed_events_[write_index] = event;
+    }
+    ++write_index;
   }
+  CHECK_EQ(read_index, parsed_events_.size());
+  parsed_events_.resize(write_index);
 
-  reader_->mutable_events()->Swap(&new_events);
+  // Deletes the dropped events, or leaves them to the arena of |reader_|.
+  events->DeleteSubrange(write_index, events->size() - write_index);
 }
 
 void PerfParser::MapSampleEvent(ParsedEvent* parsed_event) {
@@ -142,6 +142,12 @@ struct PerfEventStats {
   uint32_t num_data_sample_events;
   uint32_t num_data_sample_events_mapped;
 
+  // Number of files whose build IDs were looked up on the file system, how
+  // many of these were found, and how long the lookups took.
+  uint32_t num_buildid_lookups;
+  uint32_t num_buildids_read;
+  uint64_t buildid_lookup_ns;
+
   // Whether address remapping was enabled during event parsing.
   bool did_remap;
 };
@@ -149,6 +155,12 @@ struct PerfEventStats {
 struct PerfParserOptions {
   // For synthetic address mapping.
   bool do_remap = false;
+  // Maps the addresses of sample events to the mappings of their processes,
+  // for parsed_events() and the sample mapping stats. Consumers that map the
+  // addresses themselves, like perftools::PerfDataHandler, turn it off so that
+  // each address is only mapped once. Ignored when |do_remap|,
+  // |discard_unused_events| or |read_missing_buildids| need the mappings.
+  bool map_sample_events = true;
   // Set this flag to discard non-sample events that don't have any associated
   // sample events. e.g. MMAP regions with no samples in them.
   bool discard_unused_events = false;
@@ -165,6 +177,11 @@ struct PerfParserOptions {
   // If buildids are missing from the input data, they can be retrieved from
   // the filesystem.
   bool read_missing_buildids = false;
+  // If not empty, a SymbolCache directory shared by conversions, consulted
+  // for the build IDs read from the filesystem before reading the files.
+  std::string symbol_cache_dir;
+  // The number of threads reading the missing build IDs.
+  int num_buildid_threads = 8;
   // Deduces file names and offsets for hugepage-backed mappings, as
   // hugepage_text replaces these with anonymous mappings without filename or
   // offset information..
@@ -212,6 +229,9 @@ class PerfParser {
   // Used for processing events.  e.g. remapping with synthetic addresses.
   bool ProcessEvents();
 
+  // Returns whether ProcessEvents() maps the addresses of sample events.
+  bool MapsSampleEvents() const;
+
   // Used for processing user events.
   bool ProcessUserEvents(PerfEvent& event);
 
@@ -220,10 +240,10 @@ class PerfParser {
   // new build ID read using dso.h, this will overwrite the existing build ID.
   bool FillInDsoBuildIds();
 
-  // Updates |reader_->events| based on the contents of |parsed_events_|. For
-  // example, if |parsed_events_| had some events removed or reordered,
-  // |reader_| would be updated to contain the new sequence of events.
-  void UpdatePerfEventsFromParsedEvents();
+  // Removes the MMAP/MMAP2 events without samples in their mapped regions, and
+  // the PERF_RECORD_FINISHED_ROUND events, from |reader_| in place, and the
+  // former from |parsed_events_|, keeping the order of the other events.
+  void DiscardUnusedEvents();
 
   // Performs a sample event remap including for code and data addresses if
   // present. It increments stats counters for samples that could be mapped,
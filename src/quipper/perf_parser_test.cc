@@ -551,6 +551,85 @@ TEST(PerfParserTest, MapsSampleEventIp) {
   EXPECT_EQ(0x300b, events[13].event_ptr->sample_event().ip());
 }
 
+TEST(PerfParserTest, MapsSampleEventsOnlyWhenNeeded) {
+  std::stringstream input;
+
+  // header
+  testing::ExamplePipedPerfDataFileHeader().WriteTo(&input);
+
+  // data
+
+  // PERF_RECORD_HEADER_ATTR
+  testing::ExamplePerfEventAttrEvent_Hardware(PERF_SAMPLE_IP | PERF_SAMPLE_TID,
+                                              true /*sample_id_all*/)
+      .WriteTo(&input);
+
+  // PERF_RECORD_MMAP
+  testing::ExampleMmapEvent(1001, 0x1c1000, 0x1000, 0, "/usr/lib/foo.so",
+                            testing::SampleInfo().Tid(1001))
+      .WriteTo(&input);  // 0
+
+  // PERF_RECORD_SAMPLE
+  testing::ExamplePerfSampleEvent(
+      testing::SampleInfo().Ip(0x00000000001c100a).Tid(1001))
+      .WriteTo(&input);  // 1
+  testing::ExamplePerfSampleEvent(
+      testing::SampleInfo().Ip(0x00000000001c2bad).Tid(1001))
+      .WriteTo(&input);  // 2 (not mapped)
+
+  //
+  // Parse input without mapping the samples.
+  //
+
+  PerfReader reader;
+  EXPECT_TRUE(reader.ReadFromString(input.str()));
+
+  PerfParserOptions options;
+  options.map_sample_events = false;
+  PerfParser parser(&reader, options);
+  EXPECT_TRUE(parser.ParseRawEvents());
+
+  EXPECT_EQ(1, parser.stats().num_mmap_events);
+  EXPECT_EQ(2, parser.stats().num_sample_events);
+  EXPECT_EQ(0, parser.stats().num_sample_events_mapped);
+  EXPECT_FALSE(parser.stats().did_remap);
+
+  {
+    const std::vector<ParsedEvent>& events = parser.parsed_events();
+    ASSERT_EQ(3, events.size());
+    EXPECT_EQ(0x1c1000, events[0].event_ptr->mmap_event().start());
+    EXPECT_EQ("", events[1].dso_and_offset.dso_name());
+    EXPECT_EQ(0x1c100a, events[1].event_ptr->sample_event().ip());
+    EXPECT_EQ("", events[2].dso_and_offset.dso_name());
+    EXPECT_EQ(0x1c2bad, events[2].event_ptr->sample_event().ip());
+  }
+
+  //
+  // Remapping needs the samples mapped.
+  //
+
+  PerfReader remap_reader;
+  EXPECT_TRUE(remap_reader.ReadFromString(input.str()));
+
+  options.do_remap = true;
+  options.sample_mapping_percentage_threshold = 0;
+  PerfParser remap_parser(&remap_reader, options);
+  EXPECT_TRUE(remap_parser.ParseRawEvents());
+
+  EXPECT_EQ(2, remap_parser.stats().num_sample_events);
+  EXPECT_EQ(1, remap_parser.stats().num_sample_events_mapped);
+  EXPECT_TRUE(remap_parser.stats().did_remap);
+
+  {
+    const std::vector<ParsedEvent>& events = remap_parser.parsed_events();
+    ASSERT_EQ(3, events.size());
+    EXPECT_EQ(0, events[0].event_ptr->mmap_event().start());
+    EXPECT_EQ("/usr/lib/foo.so", events[1].dso_and_offset.dso_name());
+    EXPECT_EQ(0xa, events[1].event_ptr->sample_event().ip());
+    EXPECT_EQ(0x80000000001c2bad, events[2].event_ptr->sample_event().ip());
+  }
+}
+
 TEST(PerfParserTest, MapsSampleEventAddr) {
   std::stringstream input;
 
@@ -2872,6 +2951,81 @@ TEST(PerfParserTest, OnlyReadsBuildidIfSampled) {
   EXPECT_EQ(filenames_to_build_ids.end(), it) << it->first << " " << it->second;
 }
 
+TEST(PerfParserTest, ReadsEachBuildidFileOnce) {
+  ScopedTempDir tmpdir("/tmp/quipper_tmp.");
+  const std::string file = tmpdir.path() + "file";
+  const std::string hard_link = tmpdir.path() + "link_to_file";
+  const std::string missing_file = tmpdir.path() + "missing_file";
+  InitializeLibelf();
+  testing::WriteElfWithBuildid(file, ".note.gnu.build-id",
+                               "\xc0\x01\xd0\x0d");
+  ASSERT_EQ(0, link(file.c_str(), hard_link.c_str()));
+  struct stat file_stat;
+  ASSERT_EQ(0, stat(file.c_str(), &file_stat));
+
+  std::stringstream input;
+
+  // header
+  testing::ExamplePipedPerfDataFileHeader().WriteTo(&input);
+
+  // data
+
+  // PERF_RECORD_HEADER_ATTR
+  testing::ExamplePerfEventAttrEvent_Hardware(PERF_SAMPLE_IP | PERF_SAMPLE_TID,
+                                              true /*sample_id_all*/)
+      .WriteTo(&input);
+
+  // PERF_RECORD_MMAP2
+  // - the same file by two names
+  testing::ExampleMmap2Event(1001, 0x1c1000, 0x1000, 0, file,
+                             testing::SampleInfo().Tid(1001))
+      .WithDeviceInfo(major(file_stat.st_dev), minor(file_stat.st_dev),
+                      file_stat.st_ino)
+      .WriteTo(&input);  // 0
+  testing::ExampleMmap2Event(1002, 0x1c1000, 0x1000, 0, hard_link,
+                             testing::SampleInfo().Tid(1002))
+      .WithDeviceInfo(major(file_stat.st_dev), minor(file_stat.st_dev),
+                      file_stat.st_ino)
+      .WriteTo(&input);  // 1
+  // - a file that does not exist
+  testing::ExampleMmap2Event(1003, 0x1c1000, 0x1000, 0, missing_file,
+                             testing::SampleInfo().Tid(1003))
+      .WithDeviceInfo(major(file_stat.st_dev), minor(file_stat.st_dev),
+                      file_stat.st_ino + 1)
+      .WriteTo(&input);  // 2
+
+  // PERF_RECORD_SAMPLE
+  for (u32 pid : {1001, 1002, 1003}) {
+    testing::ExamplePerfSampleEvent(
+        testing::SampleInfo().Ip(0x00000000001c1000).Tid(pid))
+        .WriteTo(&input);  // 3, 4, 5
+  }
+
+  //
+  // Parse input.
+  //
+
+  PerfReader reader;
+  EXPECT_TRUE(reader.ReadFromString(input.str()));
+
+  PerfParserOptions options;
+  options.read_missing_buildids = true;
+  options.sample_mapping_percentage_threshold = 0;
+  options.num_buildid_threads = 2;
+  PerfParser parser(&reader, options);
+  EXPECT_TRUE(parser.ParseRawEvents());
+
+  EXPECT_EQ(3, parser.stats().num_sample_events_mapped);
+  EXPECT_EQ(2, parser.stats().num_buildid_lookups);
+  EXPECT_EQ(1, parser.stats().num_buildids_read);
+
+  const std::vector<ParsedEvent> &events = parser.parsed_events();
+  ASSERT_EQ(6, events.size());
+  EXPECT_EQ("c001d00d", events[3].dso_and_offset.build_id());
+  EXPECT_EQ("c001d00d", events[4].dso_and_offset.build_id());
+  EXPECT_EQ("", events[5].dso_and_offset.build_id());
+}
+
 TEST(PerfParserTest, HandlesFinishedRoundEventsAndSortsByTime) {
   // For now at least, we are ignoring PERF_RECORD_FINISHED_ROUND events.
 
@@ -2945,6 +3099,76 @@ TEST(PerfParserTest, HandlesFinishedRoundEventsAndSortsByTime) {
   EXPECT_EQ(12300050, events[4].event_ptr->sample_event().sample_time_ns());
 }
 
+TEST(PerfParserTest, DiscardsUnusedEventsInPlace) {
+  std::stringstream input;
+
+  // header
+  testing::ExamplePipedPerfDataFileHeader().WriteTo(&input);
+
+  // data
+
+  // PERF_RECORD_HEADER_ATTR
+  testing::ExamplePerfEventAttrEvent_Hardware(PERF_SAMPLE_IP | PERF_SAMPLE_TID,
+                                              true /*sample_id_all*/)
+      .WriteTo(&input);
+
+  // PERF_RECORD_MMAP
+  testing::ExampleMmapEvent(1001, 0x1c1000, 0x1000, 0, "/usr/lib/foo.so",
+                            testing::SampleInfo().Tid(1001))
+      .WriteTo(&input);  // 0 (unused)
+  testing::ExampleMmapEvent(1001, 0x1c3000, 0x1000, 0, "/usr/lib/bar.so",
+                            testing::SampleInfo().Tid(1001))
+      .WriteTo(&input);  // 1
+  // PERF_RECORD_FINISHED_ROUND
+  testing::FinishedRoundEvent().WriteTo(&input);  // N/A
+  testing::ExampleMmapEvent(1001, 0x1c5000, 0x1000, 0, "/usr/lib/baz.so",
+                            testing::SampleInfo().Tid(1001))
+      .WriteTo(&input);  // 2 (unused)
+
+  // PERF_RECORD_SAMPLE
+  testing::ExamplePerfSampleEvent(
+      testing::SampleInfo().Ip(0x00000000001c3010).Tid(1001))
+      .WriteTo(&input);  // 3
+  // PERF_RECORD_FINISHED_ROUND
+  testing::FinishedRoundEvent().WriteTo(&input);  // N/A
+  testing::ExamplePerfSampleEvent(
+      testing::SampleInfo().Ip(0x00000000001c7000).Tid(1001))
+      .WriteTo(&input);  // 4 (not mapped)
+
+  //
+  // Parse input.
+  //
+
+  PerfReader reader;
+  EXPECT_TRUE(reader.ReadFromString(input.str()));
+
+  PerfParserOptions options;
+  options.sample_mapping_percentage_threshold = 0;
+  options.discard_unused_events = true;
+  PerfParser parser(&reader, options);
+  EXPECT_TRUE(parser.ParseRawEvents());
+
+  EXPECT_EQ(3, parser.stats().num_mmap_events);
+  EXPECT_EQ(2, parser.stats().num_sample_events);
+  EXPECT_EQ(1, parser.stats().num_sample_events_mapped);
+
+  // The events kept are in their original order, in both |reader| and the
+  // parsed events, which point to the events of |reader|.
+  const std::vector<ParsedEvent>& events = parser.parsed_events();
+  ASSERT_EQ(3, events.size());
+  ASSERT_EQ(3, reader.events().size());
+  for (size_t i = 0; i < events.size(); ++i) {
+    EXPECT_EQ(&reader.events().Get(i), events[i].event_ptr);
+  }
+
+  EXPECT_EQ("/usr/lib/bar.so", events[0].event_ptr->mmap_event().filename());
+  EXPECT_EQ(1, events[0].num_samples_in_mmap_region);
+  EXPECT_EQ("/usr/lib/bar.so", events[1].dso_and_offset.dso_name());
+  EXPECT_EQ(0x10, events[1].dso_and_offset.offset());
+  EXPECT_EQ(PERF_RECORD_SAMPLE, events[2].event_ptr->header().type());
+  EXPECT_EQ("", events[2].dso_and_offset.dso_name());
+}
+
 TEST(PerfParserTest, MmapCoversEntireAddressSpace) {
   std::stringstream input;
 
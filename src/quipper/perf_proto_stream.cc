@@ -0,0 +1,214 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "perf_proto_stream.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <limits>
+#include <memory>
+
+#include "base/logging.h"
+#include "google/protobuf//io/coded_stream.h"
+#include "google/protobuf//util/delimited_message_util.h"
+#include "google/protobuf//util/field_mask_util.h"
+#include "google/protobuf//wire_format_lite.h"
+
+namespace quipper {
+
+using ::google::protobuf::io::CodedInputStream;
+using ::google::protobuf::io::CodedOutputStream;
+using ::google::protobuf::internal::WireFormatLite;
+
+const char kPerfProtoStreamMagic[] = "QUIPSTRM";
+
+namespace {
+
+const size_t kMagicSize = sizeof(kPerfProtoStreamMagic) - 1;
+
+}  // namespace
+
+PerfDataProtoStreamWriter::PerfDataProtoStreamWriter(
+    google::protobuf::io::ZeroCopyOutputStream* output)
+    : output_(output) {}
+
+bool PerfDataProtoStreamWriter::WriteHeader(const PerfDataProto& header) {
+  if (wrote_header_) {
+    LOG(ERROR) << "The header was already written.";
+    return false;
+  }
+  if (header.events_size() > 0) {
+    LOG(ERROR) << "The header must not have any events.";
+    return false;
+  }
+  {
+    CodedOutputStream coded(output_);
+    coded.WriteRaw(kPerfProtoStreamMagic, kMagicSize);
+    if (coded.HadError()) return false;
+  }
+  if (!google::protobuf::util::SerializeDelimitedToZeroCopyStream(header,
+                                                                  output_)) {
+    LOG(ERROR) << "Could not write the header.";
+    return false;
+  }
+  wrote_header_ = true;
+  return true;
+}
+
+bool PerfDataProtoStreamWriter::WriteEvents(
+    const RepeatedPtrField<PerfDataProto_PerfEvent>& events, int begin,
+    int end) {
+  if (!wrote_header_ || finished_) {
+    LOG(ERROR) << "Events must be written between the header and the end.";
+    return false;
+  }
+  CHECK_LE(0, begin);
+  CHECK_LE(end, events.size());
+  // An empty batch would read back as the end of the stream.
+  if (begin >= end) return true;
+
+  const uint32_t tag = WireFormatLite::MakeTag(
+      PerfDataProto::kEventsFieldNumber,
+      WireFormatLite::WIRETYPE_LENGTH_DELIMITED);
+  const size_t tag_size = CodedOutputStream::VarintSize32(tag);
+  size_t batch_size = 0;
+  for (int i = begin; i < end; ++i) {
+    const size_t event_size = events.Get(i).ByteSizeLong();
+    batch_size +=
+        tag_size + CodedOutputStream::VarintSize64(event_size) + event_size;
+  }
+  if (batch_size > static_cast<size_t>(std::numeric_limits<int>::max())) {
+    LOG(ERROR) << "Batch of " << end - begin << " events is too large: "
+               << batch_size << " bytes.";
+    return false;
+  }
+
+  CodedOutputStream coded(output_);
+  coded.WriteVarint32(static_cast<uint32_t>(batch_size));
+  for (int i = begin; i < end; ++i) {
+    const PerfDataProto_PerfEvent& event = events.Get(i);
+    coded.WriteTag(tag);
+    // The sizes were cached by ByteSizeLong() above.
+    coded.WriteVarint32(static_cast<uint32_t>(event.GetCachedSize()));
+    event.SerializeWithCachedSizes(&coded);
+  }
+  return !coded.HadError();
+}
+
+bool PerfDataProtoStreamWriter::Finish() {
+  if (!wrote_header_ || finished_) {
+    LOG(ERROR) << "The end must be written once, after the header.";
+    return false;
+  }
+  CodedOutputStream coded(output_);
+  coded.WriteVarint32(0);
+  finished_ = !coded.HadError();
+  return finished_;
+}
+
+bool PerfDataProtoStreamWriter::WritePerfDataProto(const PerfDataProto& proto,
+                                                   int events_per_batch) {
+  CHECK_GT(events_per_batch, 0);
+  // Copy everything but the events into the header.
+  google::protobuf::FieldMask mask;
+  const auto* descriptor = PerfDataProto::descriptor();
+  for (int i = 0; i < descriptor->field_count(); ++i) {
+    const auto* field = descriptor->field(i);
+    if (field->number() != PerfDataProto::kEventsFieldNumber) {
+      mask.add_paths(field->name());
+    }
+  }
+  PerfDataProto header;
+  google::protobuf::util::FieldMaskUtil::MergeMessageTo(
+      proto, mask, google::protobuf::util::FieldMaskUtil::MergeOptions(),
+      &header);
+  if (!WriteHeader(header)) return false;
+
+  for (int begin = 0; begin < proto.events_size();
+       begin += events_per_batch) {
+    int end = begin + std::min(events_per_batch, proto.events_size() - begin);
+    if (!WriteEvents(proto.events(), begin, end)) return false;
+  }
+  return Finish();
+}
+
+PerfDataProtoStreamReader::PerfDataProtoStreamReader(
+    google::protobuf::io::ZeroCopyInputStream* input)
+    : input_(input) {}
+
+bool PerfDataProtoStreamReader::ReadHeader(PerfDataProto* header) {
+  if (read_header_) {
+    LOG(ERROR) << "The header was already read.";
+    return false;
+  }
+  {
+    CodedInputStream coded(input_);
+    char magic[kMagicSize];
+    if (!coded.ReadRaw(magic, kMagicSize) ||
+        memcmp(magic, kPerfProtoStreamMagic, kMagicSize) != 0) {
+      LOG(ERROR) << "Not a PerfDataProto stream.";
+      return false;
+    }
+  }
+  header->Clear();
+  if (!google::protobuf::util::ParseDelimitedFromZeroCopyStream(
+          header, input_, nullptr)) {
+    LOG(ERROR) << "Could not read the header.";
+    return false;
+  }
+  if (header->events_size() > 0) {
+    LOG(ERROR) << "The header has events.";
+    return false;
+  }
+  read_header_ = true;
+  return true;
+}
+
+bool PerfDataProtoStreamReader::ReadEventBatch(PerfDataProto* batch) {
+  if (!read_header_) {
+    LOG(ERROR) << "The header must be read first.";
+    return false;
+  }
+  if (at_end_) return false;
+  batch->Clear();
+  bool clean_eof = false;
+  if (!google::protobuf::util::ParseDelimitedFromZeroCopyStream(
+          batch, input_, &clean_eof)) {
+    if (clean_eof) {
+      LOG(ERROR) << "The stream ended without an end marker.";
+    } else {
+      LOG(ERROR) << "Could not read a batch of events.";
+    }
+    return false;
+  }
+  if (batch->events_size() == 0) {
+    at_end_ = true;
+    return false;
+  }
+  return true;
+}
+
+bool PerfDataProtoStreamReader::ReadPerfDataProto(PerfDataProto* proto) {
+  if (!ReadHeader(proto)) return false;
+  // Swapping messages is only cheap within one arena, so the batches are read
+  // on the arena of |proto|, if any.
+  google::protobuf::Arena* arena = proto->GetArena();
+  std::unique_ptr<PerfDataProto> owned_batch;
+  PerfDataProto* batch;
+  if (arena != nullptr) {
+    batch = google::protobuf::Arena::CreateMessage<PerfDataProto>(arena);
+  } else {
+    owned_batch.reset(new PerfDataProto);
+    batch = owned_batch.get();
+  }
+  while (ReadEventBatch(batch)) {
+    for (auto& event : *batch->mutable_events()) {
+      proto->add_events()->Swap(&event);
+    }
+  }
+  return at_end();
+}
+
+}  // namespace quipper
@@ -0,0 +1,100 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMIUMOS_WIDE_PROFILING_PERF_PROTO_STREAM_H_
+#define CHROMIUMOS_WIDE_PROFILING_PERF_PROTO_STREAM_H_
+
+#include <stddef.h>
+
+#include "compat/proto.h"
+
+namespace quipper {
+
+// A PerfDataProto can be written as a stream of length-delimited messages
+// instead of one message, so that neither the writer nor the reader has to
+// hold all of its serialized events at once, and so that the 2 GB limit on
+// the size of a message applies to each part rather than to the whole. The
+// stream is:
+//   - kPerfProtoStreamMagic.
+//   - The header: a PerfDataProto with all of the fields except the events.
+//   - Any number of event batches: PerfDataProtos with one or more events and
+//     no other fields.
+//   - An empty PerfDataProto, which marks the end of the stream.
+// Each message is preceded by its size as a varint. Since the wire format of
+// a message is the concatenation of its fields, the header merged with all of
+// the batches is the original PerfDataProto.
+extern const char kPerfProtoStreamMagic[];
+
+// The number of events per batch used when writing a whole PerfDataProto.
+constexpr int kDefaultEventsPerBatch = 4096;
+
+// Writes a PerfDataProto stream to a ZeroCopyOutputStream.
+class PerfDataProtoStreamWriter {
+ public:
+  // |output| must outlive the writer.
+  explicit PerfDataProtoStreamWriter(
+      google::protobuf::io::ZeroCopyOutputStream* output);
+
+  // Writes the magic and |header|, which must not have any events. Must be
+  // called once, before any events are written.
+  bool WriteHeader(const PerfDataProto& header);
+
+  // Writes |events| in [begin, end) as one batch. The events are serialized
+  // straight from |events|, without being copied into a batch message first.
+  bool WriteEvents(const RepeatedPtrField<PerfDataProto_PerfEvent>& events,
+                   int begin, int end);
+
+  // Writes the end of the stream. No more events may be written afterwards.
+  bool Finish();
+
+  // Writes all of |proto|: its header, its events in batches of
+  // |events_per_batch|, and the end of the stream.
+  bool WritePerfDataProto(const PerfDataProto& proto, int events_per_batch);
+
+ private:
+  google::protobuf::io::ZeroCopyOutputStream* output_;  // unowned.
+  bool wrote_header_ = false;
+  bool finished_ = false;
+
+  PerfDataProtoStreamWriter(const PerfDataProtoStreamWriter&) = delete;
+  PerfDataProtoStreamWriter& operator=(const PerfDataProtoStreamWriter&) =
+      delete;
+};
+
+// Reads a PerfDataProto stream from a ZeroCopyInputStream, one batch of events
+// at a time.
+class PerfDataProtoStreamReader {
+ public:
+  // |input| must outlive the reader.
+  explicit PerfDataProtoStreamReader(
+      google::protobuf::io::ZeroCopyInputStream* input);
+
+  // Reads the magic and the header into |header|. Must be called once, before
+  // any batches are read.
+  bool ReadHeader(PerfDataProto* header);
+
+  // Reads the next batch of events into |batch|, which is cleared first.
+  // Returns false if there are no more batches or the stream could not be
+  // read; at_end() tells the two apart.
+  bool ReadEventBatch(PerfDataProto* batch);
+
+  // Whether the end of the stream has been read.
+  bool at_end() const { return at_end_; }
+
+  // Reads the header and all of the batches into |proto|.
+  bool ReadPerfDataProto(PerfDataProto* proto);
+
+ private:
+  google::protobuf::io::ZeroCopyInputStream* input_;  // unowned.
+  bool read_header_ = false;
+  bool at_end_ = false;
+
+  PerfDataProtoStreamReader(const PerfDataProtoStreamReader&) = delete;
+  PerfDataProtoStreamReader& operator=(const PerfDataProtoStreamReader&) =
+      delete;
+};
+
+}  // namespace quipper
+
+#endif  // CHROMIUMOS_WIDE_PROFILING_PERF_PROTO_STREAM_H_
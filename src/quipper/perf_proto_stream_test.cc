@@ -0,0 +1,164 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "perf_proto_stream.h"
+
+#include <string>
+#include <vector>
+
+#include "compat/test.h"
+#include "kernel/perf_event.h"
+#include "perf_protobuf_io.h"
+#include "scoped_temp_path.h"
+
+namespace quipper {
+
+namespace {
+
+using ::google::protobuf::io::StringOutputStream;
+
+PerfDataProto MakePerfDataProto(int num_events) {
+  PerfDataProto proto;
+  proto.add_file_attrs()->add_ids(1);
+  proto.add_event_types()->set_name("cycles");
+  proto.set_timestamp_sec(1234);
+  auto* build_id = proto.add_build_ids();
+  build_id->set_filename("/usr/lib/foo.so");
+  build_id->set_build_id_hash("\x01\x02\x03\x04");
+  proto.mutable_string_metadata()->mutable_perf_version()->set_value("6.1");
+  for (int i = 0; i < num_events; ++i) {
+    auto* event = proto.add_events();
+    event->mutable_header()->set_type(PERF_RECORD_SAMPLE);
+    event->set_timestamp(1000 + i);
+    event->mutable_sample_event()->set_ip(0x1000 + i);
+    event->mutable_sample_event()->add_callchain(0x2000 + i);
+  }
+  return proto;
+}
+
+std::string WriteStream(const PerfDataProto& proto, int events_per_batch) {
+  std::string stream;
+  StringOutputStream output(&stream);
+  PerfDataProtoStreamWriter writer(&output);
+  EXPECT_TRUE(writer.WritePerfDataProto(proto, events_per_batch));
+  return stream;
+}
+
+}  // namespace
+
+TEST(PerfDataProtoStreamTest, ReadsEventsInBatches) {
+  const PerfDataProto proto = MakePerfDataProto(5);
+  const std::string stream = WriteStream(proto, 2);
+
+  ArrayInputStream input(stream.data(), stream.size());
+  PerfDataProtoStreamReader reader(&input);
+  PerfDataProto header;
+  ASSERT_TRUE(reader.ReadHeader(&header));
+  EXPECT_EQ(0, header.events_size());
+  EXPECT_EQ(1234, header.timestamp_sec());
+  EXPECT_EQ("6.1", header.string_metadata().perf_version().value());
+
+  PerfDataProto batch;
+  std::vector<int> batch_sizes;
+  PerfDataProto merged = header;
+  while (reader.ReadEventBatch(&batch)) {
+    batch_sizes.push_back(batch.events_size());
+    merged.MergeFrom(batch);
+  }
+  EXPECT_TRUE(reader.at_end());
+  EXPECT_EQ((std::vector<int>{2, 2, 1}), batch_sizes);
+  EXPECT_TRUE(MessageDifferencer::Equals(proto, merged));
+}
+
+TEST(PerfDataProtoStreamTest, ReadsWholePerfDataProto) {
+  const PerfDataProto proto = MakePerfDataProto(3);
+  const std::string stream = WriteStream(proto, 1);
+
+  ArrayInputStream input(stream.data(), stream.size());
+  PerfDataProtoStreamReader reader(&input);
+  PerfDataProto read;
+  ASSERT_TRUE(reader.ReadPerfDataProto(&read));
+  EXPECT_TRUE(MessageDifferencer::Equals(proto, read));
+}
+
+TEST(PerfDataProtoStreamTest, ReadsWholePerfDataProtoOnArena) {
+  const PerfDataProto proto = MakePerfDataProto(3);
+  const std::string stream = WriteStream(proto, 2);
+
+  ArrayInputStream input(stream.data(), stream.size());
+  PerfDataProtoStreamReader reader(&input);
+  google::protobuf::Arena arena;
+  PerfDataProto* read =
+      google::protobuf::Arena::CreateMessage<PerfDataProto>(&arena);
+  ASSERT_TRUE(reader.ReadPerfDataProto(read));
+  EXPECT_TRUE(MessageDifferencer::Equals(proto, *read));
+}
+
+TEST(PerfDataProtoStreamTest, WritesEmptyEventList) {
+  const PerfDataProto proto = MakePerfDataProto(0);
+  const std::string stream = WriteStream(proto, 1);
+
+  ArrayInputStream input(stream.data(), stream.size());
+  PerfDataProtoStreamReader reader(&input);
+  PerfDataProto header;
+  ASSERT_TRUE(reader.ReadHeader(&header));
+  PerfDataProto batch;
+  EXPECT_FALSE(reader.ReadEventBatch(&batch));
+  EXPECT_TRUE(reader.at_end());
+}
+
+TEST(PerfDataProtoStreamTest, RejectsTruncatedStream) {
+  const std::string stream = WriteStream(MakePerfDataProto(2), 1);
+
+  // Without the end marker.
+  ArrayInputStream input(stream.data(), stream.size() - 1);
+  PerfDataProtoStreamReader reader(&input);
+  PerfDataProto read;
+  EXPECT_FALSE(reader.ReadPerfDataProto(&read));
+  EXPECT_FALSE(reader.at_end());
+  EXPECT_EQ(2, read.events_size());
+
+  // Not a stream at all.
+  const std::string serialized = MakePerfDataProto(2).SerializeAsString();
+  ArrayInputStream other_input(serialized.data(), serialized.size());
+  PerfDataProtoStreamReader other_reader(&other_input);
+  EXPECT_FALSE(other_reader.ReadHeader(&read));
+}
+
+TEST(PerfDataProtoStreamTest, WriterChecksOrder) {
+  const PerfDataProto proto = MakePerfDataProto(1);
+  std::string stream;
+  StringOutputStream output(&stream);
+  PerfDataProtoStreamWriter writer(&output);
+  EXPECT_FALSE(writer.WriteEvents(proto.events(), 0, 1));
+  EXPECT_FALSE(writer.Finish());
+  // The header must not have events.
+  EXPECT_FALSE(writer.WriteHeader(proto));
+  EXPECT_TRUE(writer.WriteHeader(PerfDataProto()));
+  EXPECT_FALSE(writer.WriteHeader(PerfDataProto()));
+  EXPECT_TRUE(writer.WriteEvents(proto.events(), 0, 1));
+  EXPECT_TRUE(writer.Finish());
+  EXPECT_FALSE(writer.WriteEvents(proto.events(), 0, 1));
+}
+
+TEST(PerfDataProtoStreamTest, WritesAndReadsFiles) {
+  ScopedTempFile file;
+  ASSERT_FALSE(file.path().empty());
+  const PerfDataProto proto = MakePerfDataProto(10);
+  ASSERT_TRUE(WriteProtobufToStreamFile(proto, file.path(), 3));
+
+  PerfDataProto read;
+  ASSERT_TRUE(ReadProtobufFromStreamFile(&read, file.path()));
+  EXPECT_TRUE(MessageDifferencer::Equals(proto, read));
+
+  // The events can also be read straight into a PerfReader.
+  PerfReader perf_reader;
+  ASSERT_TRUE(ReadProtobufFromStreamFile(&perf_reader, file.path()));
+  ASSERT_EQ(10, perf_reader.events().size());
+  for (int i = 0; i < 10; ++i) {
+    EXPECT_EQ(0x1000 + i, perf_reader.events().Get(i).sample_event().ip());
+  }
+}
+
+}  // namespace quipper
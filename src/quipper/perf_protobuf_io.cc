@@ -4,9 +4,13 @@
 
 #include "perf_protobuf_io.h"
 
+#include <fcntl.h>
+#include <unistd.h>
+
 #include <vector>
 
 #include "base/logging.h"
+#include "google/protobuf//io/zero_copy_stream_impl.h"
 
 #include "file_utils.h"
 
@@ -46,6 +50,7 @@ bool SerializeFromStringWithOptions(const std::string& contents,
   opts.read_missing_buildids = options.read_missing_buildids();
   opts.deduce_huge_page_mappings = options.deduce_huge_page_mappings();
   opts.combine_mappings = options.combine_mappings();
+  opts.symbol_cache_dir = options.symbol_cache_dir();
   return SerializeFromStringWithOptions(contents, opts, proto);
 }
 
@@ -97,4 +102,54 @@ bool ReadProtobufFromFile(PerfDataProto* perf_data_proto,
   return ret;
 }
 
+bool WriteProtobufToStreamFile(const PerfDataProto& perf_data_proto,
+                               const std::string& filename,
+                               int events_per_batch) {
+  int fd = TEMP_FAILURE_RETRY(
+      open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644));
+  if (fd == -1) {
+    LOG(ERROR) << "Could not open " << filename << " for writing.";
+    return false;
+  }
+  google::protobuf::io::FileOutputStream stream(fd);
+  PerfDataProtoStreamWriter writer(&stream);
+  bool ret = writer.WritePerfDataProto(perf_data_proto, events_per_batch);
+  // Close() also flushes what is left in the stream's buffer.
+  return stream.Close() && ret;
+}
+
+bool ReadProtobufFromStreamFile(PerfDataProto* perf_data_proto,
+                                const std::string& filename) {
+  int fd = TEMP_FAILURE_RETRY(open(filename.c_str(), O_RDONLY));
+  if (fd == -1) {
+    LOG(ERROR) << "Could not open " << filename << " for reading.";
+    return false;
+  }
+  google::protobuf::io::FileInputStream stream(fd);
+  stream.SetCloseOnDelete(true);
+  PerfDataProtoStreamReader reader(&stream);
+  bool ret = reader.ReadPerfDataProto(perf_data_proto);
+
+  LOG(INFO) << "#events" << perf_data_proto->events_size();
+
+  return ret;
+}
+
+bool ReadProtobufFromStreamFile(PerfReader* reader,
+                                const std::string& filename) {
+  int fd = TEMP_FAILURE_RETRY(open(filename.c_str(), O_RDONLY));
+  if (fd == -1) {
+    LOG(ERROR) << "Could not open " << filename << " for reading.";
+    return false;
+  }
+  google::protobuf::io::FileInputStream stream(fd);
+  stream.SetCloseOnDelete(true);
+  PerfDataProtoStreamReader stream_reader(&stream);
+  bool ret = reader->Deserialize(&stream_reader);
+
+  LOG(INFO) << "#events" << reader->events().size();
+
+  return ret;
+}
+
 }  // namespace quipper
@@ -7,6 +7,7 @@
 
 #include "compat/proto.h"
 #include "perf_parser.h"
+#include "perf_proto_stream.h"
 #include "perf_reader.h"
 
 namespace quipper {
@@ -49,6 +50,23 @@ bool WriteProtobufToFile(const quipper::PerfDataProto& perf_data_proto,
 bool ReadProtobufFromFile(quipper::PerfDataProto* perf_data_proto,
                           const std::string& filename);
 
+// Writes PerfDataProto object to a file as a PerfDataProto stream (see
+// perf_proto_stream.h), |events_per_batch| events at a time, so that the
+// serialized events are never all held in memory.
+bool WriteProtobufToStreamFile(const quipper::PerfDataProto& perf_data_proto,
+                               const std::string& filename,
+                               int events_per_batch = kDefaultEventsPerBatch);
+
+// Read from a file written by WriteProtobufToStreamFile() into a
+// PerfDataProto object.
+bool ReadProtobufFromStreamFile(quipper::PerfDataProto* perf_data_proto,
+                                const std::string& filename);
+
+// Like the above, but deserializes the PerfDataProto into |reader| as it is
+// read, so that the whole message is never held twice.
+bool ReadProtobufFromStreamFile(PerfReader* reader,
+                                const std::string& filename);
+
 }  // namespace quipper
 
 #endif  // CHROMIUMOS_WIDE_PROFILING_PERF_PROTOBUF_IO_H_
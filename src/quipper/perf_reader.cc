@@ -23,6 +23,7 @@
 #include "perf_buildid.h"
 #include "perf_data_structures.h"
 #include "perf_data_utils.h"
+#include "perf_proto_stream.h"
 #include "sample_info_reader.h"
 
 namespace quipper {
@@ -417,18 +418,81 @@ bool ByteSwapEventDataVariablePayloadFields(event_t* event) {
 
 }  // namespace
 
-PerfReader::PerfReader()
-    : proto_(Arena::CreateMessage<PerfDataProto>(&arena_)),
+PerfReader::PerfReader() : PerfReader(nullptr) {}
+
+PerfReader::PerfReader(ArenaBlockPool* arena_pool)
+    : arena_pool_(arena_pool),
+      arena_block_size_(0),
+      proto_(nullptr),
       is_cross_endian_(false) {
+  InitArena(/*input_size_hint=*/0);
+}
+
+PerfReader::~PerfReader() { ReleaseArena(); }
+
+void PerfReader::InitArena(size_t input_size_hint) {
+  if (arena_pool_ != nullptr && arena_block_ == nullptr) {
+    arena_block_ = arena_pool_->Acquire(input_size_hint, &arena_block_size_);
+  }
+  if (arena_block_ != nullptr) {
+    google::protobuf::ArenaOptions options;
+    options.initial_block = arena_block_.get();
+    options.initial_block_size = arena_block_size_;
+    arena_.reset(new Arena(options));
+  } else {
+    arena_.reset(new Arena());
+  }
+  proto_ = Arena::CreateMessage<PerfDataProto>(arena_.get());
   // The metadata mask is stored in |proto_|. It should be initialized to 0
   // since it is used heavily.
   proto_->add_metadata_mask(0);
 }
 
-PerfReader::~PerfReader() {}
+void PerfReader::ReleaseArena() {
+  proto_ = nullptr;
+  arena_.reset();
+  if (arena_pool_ != nullptr) {
+    arena_pool_->Release(std::move(arena_block_), arena_block_size_);
+  }
+  arena_block_.reset();
+  arena_block_size_ = 0;
+}
+
+void PerfReader::Reset(size_t input_size_hint) {
+  file_attrs_seen_.clear();
+  file_attr_configs_seen_.clear();
+  filenames_with_build_id_.clear();
+  is_cross_endian_ = false;
+  serializer_.Reset();
+  if (columnar_sample_store_ != nullptr) columnar_sample_store_->Clear();
+  memset(&header_, 0, sizeof(header_));
+  memset(&out_header_, 0, sizeof(out_header_));
+
+  // Keep the current block if it is neither too small for the new input nor
+  // more than twice the size the new input calls for.
+  const size_t wanted_block_size =
+      ArenaBlockPool::BlockSizeForInput(input_size_hint);
+  if (arena_block_ != nullptr && arena_block_size_ >= wanted_block_size &&
+      arena_block_size_ <= 2 * wanted_block_size) {
+    // Resetting the arena frees every block but the caller-supplied initial
+    // one, which is reused as-is.
+    arena_->Reset();
+    proto_ = Arena::CreateMessage<PerfDataProto>(arena_.get());
+    proto_->add_metadata_mask(0);
+    return;
+  }
+  ReleaseArena();
+  InitArena(input_size_hint);
+}
 
 bool PerfReader::Serialize(PerfDataProto* perf_data_proto) const {
   perf_data_proto->CopyFrom(*proto_);
+  if (columnar_sample_store_ != nullptr) {
+    columnar_sample_store_->MergeInto(perf_data_proto->mutable_events());
+  }
+  if (deduplicate_sample_stacks_when_serializing_) {
+    DeduplicateSampleStacks(perf_data_proto);
+  }
 
   // Add a timestamp_sec to the protobuf.
   struct timeval timestamp_sec;
@@ -439,6 +503,19 @@ bool PerfReader::Serialize(PerfDataProto* perf_data_proto) const {
 
 bool PerfReader::Deserialize(const PerfDataProto& perf_data_proto) {
   proto_->CopyFrom(perf_data_proto);
+  return FinishDeserialize();
+}
+
+bool PerfReader::Deserialize(PerfDataProtoStreamReader* stream) {
+  // The batches are parsed on the arena of |proto_| and their events are
+  // swapped into it, so no event is copied.
+  if (!stream->ReadPerfDataProto(proto_)) return false;
+  return FinishDeserialize();
+}
+
+bool PerfReader::FinishDeserialize() {
+  // The events are always kept with their stacks inline.
+  if (!InlineSampleStacks(proto_)) return false;
 
   // Iterate through all attrs and create a SampleInfoReader for each of them.
   // This is necessary for writing the proto representation of perf data to raw
@@ -526,6 +603,13 @@ bool PerfReader::WriteToPointer(char* buffer, size_t size) {
 }
 
 bool PerfReader::WriteToPointerWithoutCheckingSize(char* buffer, size_t size) {
+  // The store doesn't keep all the fields of the samples, so they can't be
+  // written back as raw events.
+  if (columnar_sample_store_ != nullptr && !columnar_sample_store_->empty()) {
+    LOG(ERROR) << "Can't write the samples of a columnar sample store";
+    return false;
+  }
+
   BufferWriter data(buffer, size);
   struct perf_file_header header;
   GenerateHeader(&header);
@@ -755,13 +839,31 @@ void PerfReader::GetFilenamesToBuildIDs(
   }
 }
 
+bool PerfReader::HasSampleTimeForAllAttrs() const {
+  for (const auto& attr : attrs()) {
+    if (!(attr.attr().sample_type() & PERF_SAMPLE_TIME)) {
+      return false;
+    }
+  }
+  return true;
+}
+
 void PerfReader::MaybeSortEventsByTime() {
   // Events can not be sorted by time if PERF_SAMPLE_TIME is not set in
   // attr.sample_type for all attrs.
-  for (const auto& attr : attrs()) {
-    if (!(attr.attr().sample_type() & PERF_SAMPLE_TIME)) {
-      return;
+  if (!HasSampleTimeForAllAttrs()) {
+    // This only happens if an attr without PERF_SAMPLE_TIME showed up after
+    // samples had been stored, e.g. in piped data.
+    if (columnar_sample_store_ != nullptr && !columnar_sample_store_->empty()) {
+      MoveColumnarSamplesToProto();
     }
+    return;
+  }
+
+  // The rows must be sorted while the events are still in stream order.
+  if (columnar_sample_store_ != nullptr &&
+      !columnar_sample_store_->sorted_by_time()) {
+    columnar_sample_store_->SortByTime(proto_->events());
   }
 
   // Sort the events based on timestamp.
@@ -772,6 +874,11 @@ void PerfReader::MaybeSortEventsByTime() {
                    proto_->mutable_events()->pointer_end(), CompareEventTimes);
 }
 
+void PerfReader::MoveColumnarSamplesToProto() {
+  columnar_sample_store_->MergeInto(proto_->mutable_events());
+  columnar_sample_store_->Clear();
+}
+
 bool PerfReader::ReadHeader(DataReader* data) {
   CheckNoEventHeaderPadding();
   // The header is the first thing to be read. Don't use SeekSet(0) because it
@@ -1189,6 +1296,29 @@ bool PerfReader::ReadNonHeaderEventDataWithoutHeader(
     }
   }
 
+  if (event->header.type == PERF_RECORD_SAMPLE &&
+      columnar_sample_store_ != nullptr && HasSampleTimeForAllAttrs() &&
+      event_types_to_skip_when_serializing_.find(PERF_RECORD_SAMPLE) ==
+          event_types_to_skip_when_serializing_.end()) {
+    // Decode the sample straight into the store's columns.
+    perf_sample sample_info;
+    uint64_t sample_type = 0;
+    if (!serializer_.ReadPerfSampleInfoAndType(*event, &sample_info,
+                                               &sample_type)) {
+      return false;
+    }
+    columnar_sample_store_->Append(event->header.misc, sample_info,
+                                   sample_type, proto_->events_size());
+    if (sample_event_callback_) {
+      columnar_sample_event_.Clear();
+      if (!serializer_.SerializeEvent(event, &columnar_sample_event_)) {
+        return false;
+      }
+      sample_event_callback_(columnar_sample_event_.sample_event());
+    }
+    return true;
+  }
+
   if (event_types_to_skip_when_serializing_.find(event->header.type) !=
       event_types_to_skip_when_serializing_.end()) {
     if (event->header.type == PERF_RECORD_SAMPLE && sample_event_callback_) {
@@ -16,6 +16,8 @@
 #include <unordered_set>
 #include <vector>
 
+#include "arena_block_pool.h"
+#include "columnar_sample_store.h"
 #include "compat/proto.h"
 #include "kernel/perf_event.h"
 #include "perf_serializer.h"
@@ -30,19 +32,39 @@ typedef u32 num_siblings_type;
 
 class DataReader;
 class DataWriter;
+class PerfDataProtoStreamReader;
 
 struct PerfFileAttr;
 
 class PerfReader {
  public:
   PerfReader();
+  // Takes the initial block of the internal protobuf arena from |arena_pool|,
+  // which must outlive this reader. Call Reset() with the size of each input
+  // before reading it, so that the block is sized for that input.
+  explicit PerfReader(ArenaBlockPool* arena_pool);
   ~PerfReader();
 
-  // Copy stored contents to |*perf_data_proto|. Appends a timestamp. Returns
-  // true on success.
+  // Discards everything read so far so that this reader can be reused for
+  // another input. The serialization options and the sample callback are kept.
+  // If this reader was created with an ArenaBlockPool, the initial arena block
+  // is kept when it suits an input of |input_size_hint| bytes, and is swapped
+  // for a suitably sized block from the pool otherwise.
+  //
+  // Invalidates all references into proto() and mutable_proto().
+  void Reset(size_t input_size_hint = 0);
+
+  // Copy stored contents to |*perf_data_proto|, including the samples of the
+  // columnar sample store, if any, merged back with the other events. Appends
+  // a timestamp. Returns true on success.
   bool Serialize(PerfDataProto* perf_data_proto) const;
-  // Read in contents from a protobuf. Returns true on success.
+  // Read in contents from a protobuf. Accepts sample callchains and branch
+  // stacks both inline and deduplicated into tables. Returns true on success.
   bool Deserialize(const PerfDataProto& perf_data_proto);
+  // Like the above, but reads the PerfDataProto from |stream| straight into
+  // this reader, one batch of events at a time, without first holding a copy
+  // of the whole message.
+  bool Deserialize(PerfDataProtoStreamReader* stream);
 
   bool ReadFile(const std::string& filename);
   bool ReadFromVector(const std::vector<char>& data);
@@ -95,9 +117,15 @@ class PerfReader {
       std::map<std::string, std::string>* filenames_to_build_ids) const;
 
   // Sort all events in |proto_| by timestamps if they are available. Otherwise
-  // event order is unchanged.
+  // event order is unchanged. The rows of the columnar sample store, if any,
+  // are sorted along with the events; if the events can't be sorted, the rows
+  // are moved back into |proto_| as sample events instead.
   void MaybeSortEventsByTime();
 
+  // Returns true if PERF_SAMPLE_TIME is set in attr.sample_type for all attrs,
+  // i.e. if the events can be sorted by time.
+  bool HasSampleTimeForAllAttrs() const;
+
   // Accessors and mutators.
 
   // This is a plain accessor for the internal protobuf storage. It is meant for
@@ -155,6 +183,14 @@ class PerfReader {
         std::move(event_types_to_skip_when_serializing);
   }
 
+  // Sets whether Serialize() stores each distinct sample callchain and branch
+  // stack only once, in PerfDataProto.callchains and .branch_stacks, with the
+  // samples referring to them by index. This makes the output much smaller
+  // when many samples share their stacks. Deserialize() accepts either form.
+  void SetDeduplicateSampleStacksWhenSerializing(bool deduplicate) {
+    deduplicate_sample_stacks_when_serializing_ = deduplicate;
+  }
+
   // Sets the callback to be called for each sample event in the perf data file.
   // It will be called even if PERF_RECORD_SAMPLE is in the set of event types
   // passed to |SetEventTypesToSkipWhenSerializing|. This is useful when SAMPLE
@@ -165,6 +201,23 @@ class PerfReader {
     sample_event_callback_ = callback;
   }
 
+  // Sets the store that sample events are read into instead of |proto_|, or
+  // nullptr to keep them in |proto_|. Samples are only diverted while the
+  // events can be sorted by time, so that they can later be merged back with
+  // the other events; see ColumnarSampleStore. |store| must outlive this reader
+  // or be unset before it is destroyed, and is cleared by Reset(). The sample
+  // callback and the event types to skip apply as before. PerfParser doesn't
+  // see the stored samples, so its sample statistics and
+  // PerfParserOptions::discard_unused_events don't account for them.
+  // Serialize() merges the stored samples back with the other events, while
+  // the Write*() functions fail as long as the store holds samples.
+  void SetColumnarSampleStore(ColumnarSampleStore* store) {
+    columnar_sample_store_ = store;
+  }
+  ColumnarSampleStore* columnar_sample_store() const {
+    return columnar_sample_store_;
+  }
+
  private:
   bool ReadHeader(DataReader* data);
   bool ReadAttrsSection(DataReader* data);
@@ -322,19 +375,40 @@ class PerfReader {
     proto_->set_metadata_mask(0, metadata_mask() | (1 << bit));
   }
 
+  // Prepares |proto_|, just read by Deserialize(), for use. Returns true on
+  // success.
+  bool FinishDeserialize();
+
   // Calculates and sets the correct event size in each event that has
   // event.header.size == 0. Returns true on success. Returns false when the
   // proto contains an unsupported perf event.
   bool PopulateMissingEventSize();
 
+  // Moves the rows of |columnar_sample_store_| back into |proto_| at their
+  // positions in the event stream.
+  void MoveColumnarSamplesToProto();
+
   // The file header is either a normal header or a piped header.
   union {
     struct perf_file_header header_;
     struct perf_pipe_file_header piped_header_;
   };
 
+  // Creates |arena_| and an empty |proto_| on it. With |arena_pool_| set, the
+  // arena starts out with a block from the pool suited to |input_size_hint|.
+  void InitArena(size_t input_size_hint);
+
+  // Releases |proto_| and |arena_|, and returns the arena's initial block to
+  // |arena_pool_|.
+  void ReleaseArena();
+
+  // Supplies the initial block of |arena_|, if set.
+  ArenaBlockPool* arena_pool_;
+  std::unique_ptr<char[]> arena_block_;
+  size_t arena_block_size_;
+
   // Store the perf data as a protobuf.
-  Arena arena_;
+  std::unique_ptr<Arena> arena_;
   PerfDataProto* proto_;
 
   // Attribute ids that have been added to |proto_|. PerfFileAttr is generated
@@ -368,10 +442,19 @@ class PerfReader {
   // e.g. PERF_RECORD_SAMPLE, PERF_RECORD_COMM, etc.
   std::unordered_set<u32> event_types_to_skip_when_serializing_;
 
+  // Whether Serialize() moves sample stacks into tables.
+  bool deduplicate_sample_stacks_when_serializing_ = false;
+
   // Callback to be called for each sample event in the perf data file if set,
   // even if PERF_RECORD_SAMPLE is in |event_types_to_skip_when_serializing|.
   std::function<void(const PerfDataProto_SampleEvent&)> sample_event_callback_;
 
+  // Receives the sample events, if set.
+  ColumnarSampleStore* columnar_sample_store_ = nullptr;
+  // Samples appended to |columnar_sample_store_| are only serialized, into
+  // this reused message, for |sample_event_callback_|.
+  PerfDataProto_PerfEvent columnar_sample_event_;
+
   PerfReader(const PerfReader&) = delete;
   PerfReader& operator=(const PerfReader&) = delete;
 };
@@ -195,6 +195,277 @@ TEST(PerfReaderTest, PerfFileAttr) {
   ASSERT_EQ(0, pr.event_types().size());
 }
 
+TEST(PerfReaderTest, ResetAllowsReuseWithPooledArena) {
+  std::stringstream first_input;
+  testing::ExamplePipedPerfDataFileHeader().WriteTo(&first_input);
+  testing::ExamplePerfEventAttrEvent_Hardware(PERF_SAMPLE_IP | PERF_SAMPLE_TID,
+                                              true /*sample_id_all*/)
+      .WithConfig(123)
+      .WithCgroup(true)
+      .WriteTo(&first_input);
+
+  std::stringstream second_input;
+  testing::ExamplePipedPerfDataFileHeader().WriteTo(&second_input);
+  testing::ExamplePerfEventAttrEvent_Hardware(PERF_SAMPLE_IP,
+                                              false /*sample_id_all*/)
+      .WithConfig(456)
+      .WriteTo(&second_input);
+
+  ArenaBlockPool pool;
+  {
+    PerfReader pr(&pool);
+    pr.Reset(first_input.str().size());
+    ASSERT_TRUE(pr.ReadFromString(first_input.str()));
+    ASSERT_EQ(1, pr.attrs().size());
+    EXPECT_EQ(123, pr.attrs().Get(0).attr().config());
+    EXPECT_TRUE(pr.attrs().Get(0).attr().cgroup());
+
+    // Nothing from the first input may survive the reset.
+    pr.Reset(second_input.str().size());
+    EXPECT_EQ(0, pr.attrs().size());
+    EXPECT_EQ(0, pr.events().size());
+    ASSERT_TRUE(pr.ReadFromString(second_input.str()));
+    ASSERT_EQ(1, pr.attrs().size());
+    EXPECT_EQ(456, pr.attrs().Get(0).attr().config());
+    EXPECT_FALSE(pr.attrs().Get(0).attr().cgroup());
+    EXPECT_EQ(0, pool.cached_bytes());
+  }
+  // The reader hands its block back when it is destroyed, and the next reader
+  // picks it up again.
+  const size_t cached_bytes = pool.cached_bytes();
+  EXPECT_EQ(ArenaBlockPool::kMinBlockSize, cached_bytes);
+  PerfReader pr(&pool);
+  EXPECT_EQ(0, pool.cached_bytes());
+  ASSERT_TRUE(pr.ReadFromString(first_input.str()));
+  ASSERT_EQ(1, pr.attrs().size());
+  EXPECT_EQ(123, pr.attrs().Get(0).attr().config());
+}
+
+TEST(PerfReaderTest, ReadsSamplesIntoColumnarStore) {
+  std::stringstream input;
+  testing::ExamplePipedPerfDataFileHeader().WriteTo(&input);
+  testing::ExamplePerfEventAttrEvent_Hardware(
+      PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_TIME,
+      true /*sample_id_all*/)
+      .WriteTo(&input);
+  testing::ExampleMmapEvent(1001, 0x1c1000, 0x1000, 0, "/usr/lib/foo.so",
+                            testing::SampleInfo().Tid(1001).Time(100))
+      .WriteTo(&input);
+  testing::ExamplePerfSampleEvent(
+      testing::SampleInfo().Ip(0x1c1100).Tid(1001).Time(300))
+      .WriteTo(&input);
+  testing::ExampleMmapEvent(1001, 0x1c3000, 0x1000, 0, "/usr/lib/bar.so",
+                            testing::SampleInfo().Tid(1001).Time(200))
+      .WriteTo(&input);
+  testing::ExamplePerfSampleEvent(
+      testing::SampleInfo().Ip(0x1c3100).Tid(1001).Time(200))
+      .WriteTo(&input);
+
+  ColumnarSampleStore store;
+  PerfReader pr;
+  pr.SetColumnarSampleStore(&store);
+  ASSERT_TRUE(pr.ReadFromString(input.str()));
+
+  // Only the mmaps end up in the proto.
+  ASSERT_EQ(2, pr.events().size());
+  ASSERT_EQ(2, store.size());
+  EXPECT_EQ(0x1c1100, store.ip(0));
+  EXPECT_EQ(1001, store.pid(0));
+  EXPECT_EQ(1, store.event_index(0));
+  EXPECT_EQ(0x1c3100, store.ip(1));
+  EXPECT_EQ(2, store.event_index(1));
+
+  pr.MaybeSortEventsByTime();
+  EXPECT_EQ(100, pr.events().Get(0).timestamp());
+  EXPECT_EQ(200, pr.events().Get(1).timestamp());
+  EXPECT_TRUE(store.sorted_by_time());
+  EXPECT_EQ(200, store.time_ns(0));
+  EXPECT_EQ(1, store.time_rank(0));
+  EXPECT_EQ(300, store.time_ns(1));
+
+  pr.Reset();
+  EXPECT_TRUE(store.empty());
+}
+
+TEST(PerfReaderTest, DecodesRawSamplesIntoColumnarStore) {
+  std::stringstream input;
+  testing::ExamplePipedPerfDataFileHeader().WriteTo(&input);
+  testing::ExamplePerfEventAttrEvent_Hardware(
+      PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_TIME | PERF_SAMPLE_ADDR |
+          PERF_SAMPLE_ID | PERF_SAMPLE_BRANCH_STACK,
+      true /*sample_id_all*/)
+      .WithId(7)
+      .WriteTo(&input);
+  testing::ExamplePerfSampleEvent(testing::SampleInfo()
+                                      .Ip(0x1c1100)
+                                      .Tid(1001, 1002)
+                                      .Time(300)
+                                      .Addr(0x2000)
+                                      .Id(7)
+                                      .BranchStack_nr(2)
+                                      .BranchStack_lbr(0x1c1200, 0x1c1300, 0x1)
+                                      .BranchStack_lbr(0x1c1400, 0x1c1500, 0x2))
+      .WriteTo(&input);
+
+  ColumnarSampleStore store;
+  PerfReader pr;
+  pr.SetColumnarSampleStore(&store);
+  ASSERT_TRUE(pr.ReadFromString(input.str()));
+  ASSERT_EQ(0, pr.events().size());
+  ASSERT_EQ(1, store.size());
+
+  EXPECT_EQ(ColumnarSampleStore::kMisc | ColumnarSampleStore::kIp |
+                ColumnarSampleStore::kPid | ColumnarSampleStore::kTid |
+                ColumnarSampleStore::kTime | ColumnarSampleStore::kAddr |
+                ColumnarSampleStore::kId,
+            store.presence(0));
+  EXPECT_EQ(0x1c1100, store.ip(0));
+  EXPECT_EQ(1001, store.pid(0));
+  EXPECT_EQ(1002, store.tid(0));
+  EXPECT_EQ(300, store.time_ns(0));
+  EXPECT_EQ(0x2000, store.addr(0));
+  EXPECT_EQ(7, store.id(0));
+  EXPECT_EQ(0, store.period(0));
+  EXPECT_EQ(0, store.callchain_size(0));
+  ASSERT_EQ(2, store.branch_stack_size(0));
+  const ColumnarSampleStore::BranchEntry* branch_stack = store.branch_stack(0);
+  EXPECT_EQ(0x1c1200, branch_stack[0].from_ip);
+  EXPECT_EQ(0x1c1300, branch_stack[0].to_ip);
+  EXPECT_EQ(ColumnarSampleStore::BranchEntry::kMispredicted,
+            branch_stack[0].flags);
+  EXPECT_EQ(0x1c1400, branch_stack[1].from_ip);
+  EXPECT_EQ(0x1c1500, branch_stack[1].to_ip);
+  EXPECT_EQ(ColumnarSampleStore::BranchEntry::kPredicted,
+            branch_stack[1].flags);
+}
+
+TEST(PerfReaderTest, SerializesColumnarSamples) {
+  std::stringstream input;
+  testing::ExamplePipedPerfDataFileHeader().WriteTo(&input);
+  testing::ExamplePerfEventAttrEvent_Hardware(
+      PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_TIME,
+      true /*sample_id_all*/)
+      .WriteTo(&input);
+  testing::ExampleMmapEvent(1001, 0x1c1000, 0x1000, 0, "/usr/lib/foo.so",
+                            testing::SampleInfo().Tid(1001).Time(100))
+      .WriteTo(&input);
+  testing::ExamplePerfSampleEvent(
+      testing::SampleInfo().Ip(0x1c1100).Tid(1001).Time(300))
+      .WriteTo(&input);
+  testing::ExampleMmapEvent(1001, 0x1c3000, 0x1000, 0, "/usr/lib/bar.so",
+                            testing::SampleInfo().Tid(1001).Time(200))
+      .WriteTo(&input);
+  testing::ExamplePerfSampleEvent(
+      testing::SampleInfo().Ip(0x1c3100).Tid(1001).Time(200))
+      .WriteTo(&input);
+
+  ColumnarSampleStore store;
+  PerfReader pr;
+  pr.SetColumnarSampleStore(&store);
+  ASSERT_TRUE(pr.ReadFromString(input.str()));
+  ASSERT_EQ(2, store.size());
+
+  // The samples are merged back in stream order.
+  PerfDataProto proto;
+  ASSERT_TRUE(pr.Serialize(&proto));
+  ASSERT_EQ(4, proto.events().size());
+  EXPECT_EQ(PERF_RECORD_MMAP, proto.events(0).header().type());
+  EXPECT_EQ(0x1c1100, proto.events(1).sample_event().ip());
+  EXPECT_EQ(1001, proto.events(1).sample_event().pid());
+  EXPECT_EQ(300, proto.events(1).sample_event().sample_time_ns());
+  EXPECT_EQ(PERF_RECORD_MMAP, proto.events(2).header().type());
+  EXPECT_EQ(0x1c3100, proto.events(3).sample_event().ip());
+
+  // And in time order once sorted, after the mmap with the same time.
+  pr.MaybeSortEventsByTime();
+  ASSERT_TRUE(pr.Serialize(&proto));
+  ASSERT_EQ(4, proto.events().size());
+  EXPECT_EQ(100, proto.events(0).timestamp());
+  EXPECT_EQ(PERF_RECORD_MMAP, proto.events(1).header().type());
+  EXPECT_EQ(0x1c3100, proto.events(2).sample_event().ip());
+  EXPECT_EQ(0x1c1100, proto.events(3).sample_event().ip());
+  EXPECT_EQ(2, store.size());
+
+  // The store doesn't keep every field of the samples to write them back.
+  std::string output;
+  EXPECT_FALSE(pr.WriteToString(&output));
+}
+
+TEST(PerfReaderTest, MovesColumnarSamplesBackIfUnsortable) {
+  std::stringstream input;
+  testing::ExamplePipedPerfDataFileHeader().WriteTo(&input);
+  testing::ExamplePerfEventAttrEvent_Hardware(
+      PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_TIME,
+      true /*sample_id_all*/)
+      .WithId(401)
+      .WriteTo(&input);
+  testing::ExamplePerfSampleEvent(
+      testing::SampleInfo().Ip(0x1c1100).Tid(1001).Time(300))
+      .WriteTo(&input);
+  testing::ExampleMmapEvent(1001, 0x1c1000, 0x1000, 0, "/usr/lib/foo.so",
+                            testing::SampleInfo().Tid(1001).Time(100))
+      .WriteTo(&input);
+  // An attr without PERF_SAMPLE_TIME after the first sample.
+  testing::ExamplePerfEventAttrEvent_Hardware(PERF_SAMPLE_IP | PERF_SAMPLE_TID,
+                                              false /*sample_id_all*/)
+      .WithId(402)
+      .WithConfig(456)
+      .WriteTo(&input);
+
+  ColumnarSampleStore store;
+  PerfReader pr;
+  pr.SetColumnarSampleStore(&store);
+  ASSERT_TRUE(pr.ReadFromString(input.str()));
+  ASSERT_EQ(1, pr.events().size());
+  ASSERT_EQ(1, store.size());
+
+  pr.MaybeSortEventsByTime();
+  EXPECT_TRUE(store.empty());
+  ASSERT_EQ(2, pr.events().size());
+  EXPECT_EQ(PERF_RECORD_SAMPLE, pr.events().Get(0).header().type());
+  EXPECT_EQ(0x1c1100, pr.events().Get(0).sample_event().ip());
+  EXPECT_EQ(PERF_RECORD_MMAP, pr.events().Get(1).header().type());
+}
+
+TEST(PerfReaderTest, SerializesDeduplicatedSampleStacks) {
+  std::stringstream input;
+  testing::ExamplePipedPerfDataFileHeader().WriteTo(&input);
+  testing::ExamplePerfEventAttrEvent_Hardware(PERF_SAMPLE_BRANCH_STACK,
+                                              false /*sample_id_all*/)
+      .WriteTo(&input);
+  for (int i = 0; i < 3; ++i) {
+    testing::ExamplePerfSampleEvent_BranchStack().WriteTo(&input);
+  }
+
+  PerfReader pr;
+  ASSERT_TRUE(pr.ReadFromString(input.str()));
+  ASSERT_EQ(3, pr.events().size());
+
+  pr.SetDeduplicateSampleStacksWhenSerializing(true);
+  PerfDataProto proto;
+  ASSERT_TRUE(pr.Serialize(&proto));
+  ASSERT_EQ(1, proto.branch_stacks_size());
+  EXPECT_EQ(16, proto.branch_stacks(0).entries_size());
+  for (const PerfEvent& event : proto.events()) {
+    EXPECT_EQ(0, event.sample_event().branch_stack_size());
+    EXPECT_EQ(0, event.sample_event().branch_stack_index());
+  }
+
+  // Deserializing puts the stacks back into the samples.
+  PerfReader pr2;
+  ASSERT_TRUE(pr2.Deserialize(proto));
+  EXPECT_EQ(0, pr2.proto().branch_stacks_size());
+  ASSERT_EQ(3, pr2.events().size());
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_EQ(pr.events().Get(i).SerializeAsString(),
+              pr2.events().Get(i).SerializeAsString());
+  }
+  std::string output, output2;
+  ASSERT_TRUE(pr.WriteToString(&output));
+  ASSERT_TRUE(pr2.WriteToString(&output2));
+  EXPECT_EQ(output, output2);
+}
+
 TEST(PerfReaderTest, CorruptedFiles) {
   for (const char* test_file :
        perf_test_files::GetCorruptedPerfPipedDataFiles()) {
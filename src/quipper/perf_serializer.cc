@@ -27,12 +27,44 @@ namespace {
 
 constexpr int kHexCharsPerByte = 2;
 
+// The most strings PerfSerializer::Intern() holds at once.
+constexpr size_t kMaxInternedStrings = 1 << 16;
+
 }  // namespace
 
 PerfSerializer::PerfSerializer() {}
 
 PerfSerializer::~PerfSerializer() {}
 
+void PerfSerializer::Reset() {
+  sample_info_reader_map_.clear();
+  sample_event_id_pos_ = EventIdPosition::Uninitialized;
+  other_event_id_pos_ = EventIdPosition::Uninitialized;
+  interned_strings_.clear();
+}
+
+const std::pair<const std::string, PerfSerializer::InternedString>&
+PerfSerializer::Intern(const char* str, bool is_filename) const {
+  intern_key_.assign(str);
+  auto it = interned_strings_.find(intern_key_);
+  if (it == interned_strings_.end()) {
+    // Bounds the memory held for files of ever changing names.
+    if (interned_strings_.size() >= kMaxInternedStrings) {
+      interned_strings_.clear();
+    }
+    InternedString interned;
+    interned.md5_prefix = Md5Prefix(intern_key_);
+    it = interned_strings_.emplace(intern_key_, std::move(interned)).first;
+  }
+  InternedString& interned = it->second;
+  if (is_filename && !interned.has_root_path) {
+    interned.root_path = RootPath(it->first);
+    interned.root_path_md5_prefix = Md5Prefix(interned.root_path);
+    interned.has_root_path = true;
+  }
+  return *it;
+}
+
 bool PerfSerializer::IsSupportedKernelEventType(uint32_t type) {
   switch (type) {
     case PERF_RECORD_MMAP:
@@ -639,6 +671,11 @@ bool PerfSerializer::SerializeSampleEvent(
 
 bool PerfSerializer::DeserializeSampleEvent(
     const PerfDataProto_SampleEvent& sample, event_t* event) const {
+  if (sample.has_callchain_index() || sample.has_branch_stack_index()) {
+    LOG(ERROR) << "Sample stacks must be inlined with InlineSampleStacks() "
+               << "before deserializing the sample.";
+    return false;
+  }
   perf_sample sample_info = {};
   GetPerfSampleInfo(sample, &sample_info);
 
@@ -657,13 +694,13 @@ bool PerfSerializer::SerializeMMapEvent(const event_t& event,
   sample->set_start(mmap.start);
   sample->set_len(mmap.len);
   sample->set_pgoff(mmap.pgoff);
-  sample->set_filename(mmap.filename);
-  sample->set_filename_md5_prefix(Md5Prefix(mmap.filename));
-  std::string root_path = RootPath(mmap.filename);
-  if (!root_path.empty()) {
-    sample->set_root_path(root_path);
+  const auto& filename = Intern(mmap.filename, true);
+  sample->set_filename(filename.first);
+  sample->set_filename_md5_prefix(filename.second.md5_prefix);
+  if (!filename.second.root_path.empty()) {
+    sample->set_root_path(filename.second.root_path);
   }
-  sample->set_root_path_md5_prefix(Md5Prefix(root_path));
+  sample->set_root_path_md5_prefix(filename.second.root_path_md5_prefix);
 
   return SerializeSampleInfo(event, sample->mutable_sample_info());
 }
@@ -705,13 +742,13 @@ bool PerfSerializer::SerializeMMap2Event(
   }
   sample->set_prot(mmap.prot);
   sample->set_flags(mmap.flags);
-  sample->set_filename(mmap.filename);
-  sample->set_filename_md5_prefix(Md5Prefix(mmap.filename));
-  std::string root_path = RootPath(mmap.filename);
-  if (!root_path.empty()) {
-    sample->set_root_path(root_path);
+  const auto& filename = Intern(mmap.filename, true);
+  sample->set_filename(filename.first);
+  sample->set_filename_md5_prefix(filename.second.md5_prefix);
+  if (!filename.second.root_path.empty()) {
+    sample->set_root_path(filename.second.root_path);
   }
-  sample->set_root_path_md5_prefix(Md5Prefix(root_path));
+  sample->set_root_path_md5_prefix(filename.second.root_path_md5_prefix);
 
   return SerializeSampleInfo(event, sample->mutable_sample_info());
 }
@@ -755,8 +792,9 @@ bool PerfSerializer::SerializeCommEvent(const event_t& event,
   const struct comm_event& comm = event.comm;
   sample->set_pid(comm.pid);
   sample->set_tid(comm.tid);
-  sample->set_comm(comm.comm);
-  sample->set_comm_md5_prefix(Md5Prefix(comm.comm));
+  const auto& interned = Intern(comm.comm, false);
+  sample->set_comm(interned.first);
+  sample->set_comm_md5_prefix(interned.second.md5_prefix);
 
   return SerializeSampleInfo(event, sample->mutable_sample_info());
 }
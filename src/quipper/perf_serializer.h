@@ -10,6 +10,9 @@
 
 #include <map>
 #include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include "compat/proto.h"
@@ -252,6 +255,14 @@ class PerfSerializer {
   static void DeserializeParserStats(const PerfDataProto& perf_data_proto,
                                      PerfEventStats* stats);
 
+  // Reads the sample info fields from |event| into |sample_info|. If more than
+  // one type of perf event attr is present, will pick the correct one. Also
+  // returns a bitfield of available sample info fields for the attr, in
+  // |sample_type|.
+  // Returns true if successfully read.
+  bool ReadPerfSampleInfoAndType(const event_t& event, perf_sample* sample_info,
+                                 uint64_t* sample_type) const;
+
   // Instantiate a new PerfSampleReader with the given attr type. If an old one
   // exists for that attr type, it is discarded.
   bool CreateSampleInfoReader(const PerfFileAttr& event_attr,
@@ -261,6 +272,10 @@ class PerfSerializer {
     return !sample_info_reader_map_.empty();
   }
 
+  // Discards all SampleInfoReaders and event ID positions, returning the
+  // serializer to its newly constructed state.
+  void Reset();
+
  private:
   // Special values for the event/other_event_id_pos_ fields.
   enum EventIdPosition {
@@ -286,14 +301,6 @@ class PerfSerializer {
   // first available SampleInfoReader is returned.
   const SampleInfoReader* GetSampleInfoReaderForId(uint64_t id) const;
 
-  // Reads the sample info fields from |event| into |sample_info|. If more than
-  // one type of perf event attr is present, will pick the correct one. Also
-  // returns a bitfield of available sample info fields for the attr, in
-  // |sample_type|.
-  // Returns true if successfully read.
-  bool ReadPerfSampleInfoAndType(const event_t& event, perf_sample* sample_info,
-                                 uint64_t* sample_type) const;
-
   bool SerializeKernelEvent(const event_t& event,
                             PerfDataProto_PerfEvent* event_proto) const;
   bool SerializeUserEvent(const event_t& event,
@@ -323,6 +330,27 @@ class PerfSerializer {
   // For each perf event attr ID, there is a SampleInfoReader to read events of
   // the associated perf attr type.
   std::map<uint64_t, std::unique_ptr<SampleInfoReader>> sample_info_reader_map_;
+  // The MD5 prefix of a string, and for filenames their root path and its MD5
+  // prefix.
+  struct InternedString {
+    uint64_t md5_prefix = 0;
+    bool has_root_path = false;
+    std::string root_path;
+    uint64_t root_path_md5_prefix = 0;
+  };
+
+  // Returns the interned |str| and its details, hashing it the first time it
+  // is seen, and computing its root path too if |is_filename|. The filenames
+  // and comms of MMAP and COMM events repeat across a file, so each is only
+  // hashed once. The result is valid until the next call.
+  const std::pair<const std::string, InternedString>& Intern(
+      const char* str, bool is_filename) const;
+
+  // The strings interned by Intern(). They are not shared between threads:
+  // a PerfSerializer serializes events on one thread at a time.
+  mutable std::unordered_map<std::string, InternedString> interned_strings_;
+  // Holds the string looked up in |interned_strings_|, reusing its buffer.
+  mutable std::string intern_key_;
 };
 
 }  // namespace quipper
@@ -11,6 +11,7 @@
 #include <string>
 
 #include "base/logging.h"
+#include "binary_data_utils.h"
 #include "compat/proto.h"
 #include "compat/test.h"
 #include "file_utils.h"
@@ -21,6 +22,7 @@
 #include "perf_reader.h"
 #include "perf_test_files.h"
 #include "scoped_temp_path.h"
+#include "string_utils.h"
 #include "test_perf_data.h"
 #include "test_utils.h"
 
@@ -747,6 +749,58 @@ TEST(PerfSerializerTest, SerializesAndDeserializesMmapEvents) {
   }
 }
 
+TEST(PerfSerializerTest, SerializesRepeatedMmapFilenames) {
+  std::stringstream input;
+
+  // header
+  testing::ExamplePipedPerfDataFileHeader().WriteTo(&input);
+
+  // data
+
+  // PERF_RECORD_HEADER_ATTR
+  testing::ExamplePerfEventAttrEvent_Hardware(PERF_SAMPLE_IP | PERF_SAMPLE_TID,
+                                              true /*sample_id_all*/)
+      .WriteTo(&input);
+
+  // PERF_RECORD_MMAP and PERF_RECORD_MMAP2 of files mapped more than once.
+  const std::vector<std::string> filenames = {
+      "/usr/lib/foo.so", "/tmp/bar.so", "/usr/lib/foo.so", "[anon:baz]",
+      "/tmp/bar.so",     "",            "/usr/lib/foo.so"};
+  for (size_t i = 0; i < filenames.size(); ++i) {
+    const u32 pid = 1001 + i;
+    if (i % 2 == 0) {
+      testing::ExampleMmapEvent(pid, 0x1c1000, 0x1000, 0, filenames[i],
+                                testing::SampleInfo().Tid(pid))
+          .WriteTo(&input);
+    } else {
+      testing::ExampleMmap2Event(pid, 0x2c1000, 0x2000, 0, filenames[i],
+                                 testing::SampleInfo().Tid(pid))
+          .WriteTo(&input);
+    }
+  }
+
+  // Parse and Serialize
+
+  PerfReader reader;
+  ASSERT_TRUE(reader.ReadFromString(input.str()));
+
+  PerfDataProto perf_data_proto;
+  ASSERT_TRUE(reader.Serialize(&perf_data_proto));
+
+  ASSERT_EQ(filenames.size(), perf_data_proto.events().size());
+  for (size_t i = 0; i < filenames.size(); ++i) {
+    const PerfDataProto::MMapEvent& mmap =
+        perf_data_proto.events(i).mmap_event();
+    const std::string root_path = RootPath(filenames[i]);
+    EXPECT_EQ(1001 + i, mmap.pid());
+    EXPECT_EQ(filenames[i], mmap.filename());
+    EXPECT_EQ(Md5Prefix(filenames[i]), mmap.filename_md5_prefix());
+    EXPECT_EQ(!root_path.empty(), mmap.has_root_path());
+    EXPECT_EQ(root_path, mmap.root_path());
+    EXPECT_EQ(Md5Prefix(root_path), mmap.root_path_md5_prefix());
+  }
+}
+
 TEST(PerfSerializerTest, SerializesAndDeserializesAuxtraceInfoEvents) {
   std::stringstream input;
 
@@ -0,0 +1,323 @@
+// Copyright 2016 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "symbol_cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <limits>
+#include <utility>
+
+#include "base/logging.h"
+#include "binary_data_utils.h"
+#include "file_utils.h"
+
+namespace quipper {
+
+struct SymbolIndex::Header {
+  char magic[8];
+  u32 version;
+  u32 num_segments;
+  u64 num_symbols;
+  u64 names_size;
+};
+
+struct SymbolIndex::Symbol {
+  u64 address;
+  u32 size;  // Sizes that do not fit are clamped.
+  u32 name;  // The offset of the name in names().
+};
+
+namespace {
+
+const char kSymbolIndexMagic[8] = {'Q', 'S', 'Y', 'M', 'I', 'D', 'X', '\0'};
+// Bump this whenever the layout of SymbolIndex changes.
+const u32 kSymbolIndexVersion = 1;
+
+const char kBuildIdsDir[] = "build_ids";
+const char kSymbolsDir[] = "symbols";
+
+bool IsLowerHexDigit(char c) {
+  return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f');
+}
+
+// Returns whether |key| can name a cache entry: a lowercase hex build ID, or
+// a FileKey() of lowercase hex numbers, '-' and '.'. Build IDs come from the
+// profiles being converted, so anything else, such as "../x", is refused
+// rather than used in a path.
+bool IsValidKey(const std::string& key) {
+  if (key.empty() || !IsLowerHexDigit(key[0])) return false;
+  for (char c : key) {
+    if (!IsLowerHexDigit(c) && c != '-' && c != '.') return false;
+  }
+  return true;
+}
+
+// Creates the directory |path| if it does not exist.
+bool MakeDirectory(const std::string& path) {
+  return mkdir(path.c_str(), 0755) == 0 || errno == EEXIST;
+}
+
+// Writes all of the |size| bytes of |data| to |fd|.
+bool WriteAll(int fd, const char* data, size_t size) {
+  while (size > 0) {
+    const ssize_t written = write(fd, data, size);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    data += written;
+    size -= written;
+  }
+  return true;
+}
+
+}  // namespace
+
+SymbolIndex::~SymbolIndex() {
+  if (mapped_) {
+    munmap(const_cast<char*>(data_), size_);
+  }
+}
+
+std::unique_ptr<SymbolIndex> SymbolIndex::Build(
+    std::vector<ElfSymbol> symbols,
+    const std::vector<ElfLoadSegment>& segments) {
+  std::sort(symbols.begin(), symbols.end(),
+            [](const ElfSymbol& a, const ElfSymbol& b) {
+              if (a.address != b.address) return a.address < b.address;
+              if (a.size != b.size) return a.size > b.size;
+              return a.name < b.name;
+            });
+  size_t num_symbols = 0;
+  u64 names_size = 0;
+  for (size_t i = 0; i < symbols.size(); ++i) {
+    if (num_symbols > 0 &&
+        symbols[num_symbols - 1].address == symbols[i].address) {
+      continue;
+    }
+    if (names_size + symbols[i].name.size() + 1 >
+        std::numeric_limits<u32>::max()) {
+      break;
+    }
+    names_size += symbols[i].name.size() + 1;
+    if (num_symbols != i) symbols[num_symbols] = std::move(symbols[i]);
+    ++num_symbols;
+  }
+  symbols.resize(num_symbols);
+
+  std::unique_ptr<SymbolIndex> index(new SymbolIndex);
+  std::string& data = index->owned_;
+  data.resize(sizeof(Header) + segments.size() * sizeof(ElfLoadSegment) +
+              num_symbols * sizeof(Symbol) + names_size);
+  Header header;
+  memcpy(header.magic, kSymbolIndexMagic, sizeof(header.magic));
+  header.version = kSymbolIndexVersion;
+  header.num_segments = segments.size();
+  header.num_symbols = num_symbols;
+  header.names_size = names_size;
+  char* out = &data[0];
+  memcpy(out, &header, sizeof(header));
+  out += sizeof(header);
+  for (const auto& segment : segments) {
+    memcpy(out, &segment, sizeof(segment));
+    out += sizeof(segment);
+  }
+  u32 name = 0;
+  for (const auto& symbol : symbols) {
+    Symbol compact;
+    compact.address = symbol.address;
+    compact.size = static_cast<u32>(
+        std::min<u64>(symbol.size, std::numeric_limits<u32>::max()));
+    compact.name = name;
+    memcpy(out, &compact, sizeof(compact));
+    out += sizeof(compact);
+    name += symbol.name.size() + 1;
+  }
+  for (const auto& symbol : symbols) {
+    // Copies the null terminator too.
+    memcpy(out, symbol.name.c_str(), symbol.name.size() + 1);
+    out += symbol.name.size() + 1;
+  }
+  CHECK(index->Init(data.data(), data.size()));
+  return index;
+}
+
+std::unique_ptr<SymbolIndex> SymbolIndex::Map(const std::string& filename) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) return nullptr;
+  struct stat s;
+  if (fstat(fd, &s) != 0 || s.st_size <= 0) {
+    close(fd);
+    return nullptr;
+  }
+  void* addr = mmap(nullptr, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) return nullptr;
+
+  std::unique_ptr<SymbolIndex> index(new SymbolIndex);
+  index->mapped_ = true;
+  if (!index->Init(static_cast<const char*>(addr), s.st_size)) {
+    LOG(WARNING) << "Invalid symbol index: " << filename;
+    return nullptr;
+  }
+  return index;
+}
+
+bool SymbolIndex::Init(const char* data, size_t size) {
+  data_ = data;
+  size_ = size;
+  if (size < sizeof(Header)) return false;
+  const Header* h = header();
+  if (memcmp(h->magic, kSymbolIndexMagic, sizeof(h->magic)) != 0 ||
+      h->version != kSymbolIndexVersion) {
+    return false;
+  }
+  // Checks each part against the size left, so that the sizes cannot
+  // overflow.
+  size_t left = size - sizeof(Header);
+  if (h->num_segments > left / sizeof(ElfLoadSegment)) return false;
+  left -= h->num_segments * sizeof(ElfLoadSegment);
+  if (h->num_symbols > left / sizeof(Symbol)) return false;
+  left -= h->num_symbols * sizeof(Symbol);
+  if (h->names_size != left) return false;
+  if (h->names_size > 0 && names()[h->names_size - 1] != '\0') return false;
+  const Symbol* s = symbols();
+  for (u64 i = 0; i < h->num_symbols; ++i) {
+    if (s[i].name >= h->names_size) return false;
+  }
+  return true;
+}
+
+const SymbolIndex::Header* SymbolIndex::header() const {
+  return reinterpret_cast<const Header*>(data_);
+}
+
+const ElfLoadSegment* SymbolIndex::segments() const {
+  return reinterpret_cast<const ElfLoadSegment*>(data_ + sizeof(Header));
+}
+
+const SymbolIndex::Symbol* SymbolIndex::symbols() const {
+  return reinterpret_cast<const Symbol*>(segments() + header()->num_segments);
+}
+
+const char* SymbolIndex::names() const {
+  return reinterpret_cast<const char*>(symbols() + header()->num_symbols);
+}
+
+size_t SymbolIndex::num_symbols() const { return header()->num_symbols; }
+
+bool SymbolIndex::OffsetToAddress(u64 offset, u64* address) const {
+  const ElfLoadSegment* begin = segments();
+  const ElfLoadSegment* end = begin + header()->num_segments;
+  for (const ElfLoadSegment* segment = begin; segment != end; ++segment) {
+    if (offset >= segment->offset && offset - segment->offset < segment->size) {
+      *address = offset - segment->offset + segment->vaddr;
+      return true;
+    }
+  }
+  return false;
+}
+
+const char* SymbolIndex::Lookup(u64 address) const {
+  const Symbol* begin = symbols();
+  const Symbol* end = begin + header()->num_symbols;
+  const Symbol* it = std::upper_bound(
+      begin, end, address,
+      [](u64 a, const Symbol& symbol) { return a < symbol.address; });
+  if (it == begin) return nullptr;
+  const Symbol& symbol = *--it;
+  // Symbols without a size extend to the next one.
+  if (symbol.size != 0 && address - symbol.address >= symbol.size) {
+    return nullptr;
+  }
+  return names() + symbol.name;
+}
+
+SymbolCache::SymbolCache(const std::string& dir) : dir_(dir) {}
+
+std::string SymbolCache::FileKey(const struct stat& s) {
+  char key[128];
+  snprintf(key, sizeof(key), "%llx-%llx-%lld.%09ld-%lld",
+           static_cast<unsigned long long>(s.st_dev),
+           static_cast<unsigned long long>(s.st_ino),
+           static_cast<long long>(s.st_mtim.tv_sec), s.st_mtim.tv_nsec,
+           static_cast<long long>(s.st_size));
+  return key;
+}
+
+bool SymbolCache::ReadElfBuildId(int fd, std::string* buildid) const {
+  struct stat s;
+  if (fstat(fd, &s) != 0) return false;
+  const std::string key = FileKey(s);
+  std::vector<char> contents;
+  if (FileToBuffer(dir_ + "/" + kBuildIdsDir + "/" + key, &contents) &&
+      !contents.empty() && contents.back() == '\n' &&
+      contents.size() % 2 == 1) {
+    const std::string hex(contents.begin(), contents.end() - 1);
+    std::string raw(hex.size() / 2, '\0');
+    if (HexStringToRawData(hex, reinterpret_cast<u8*>(&raw[0]), raw.size())) {
+      *buildid = raw;
+      return !raw.empty();
+    }
+  }
+
+  std::string raw;
+  // Caches files without a build ID too, as an empty one.
+  if (!quipper::ReadElfBuildId(fd, &raw)) raw.clear();
+  const std::string entry = RawDataToHexString(raw) + "\n";
+  WriteEntry(kBuildIdsDir, key, entry.data(), entry.size());
+  if (raw.empty()) return false;
+  *buildid = raw;
+  return true;
+}
+
+std::unique_ptr<SymbolIndex> SymbolCache::LookupSymbols(
+    const std::string& key) const {
+  if (!IsValidKey(key)) return nullptr;
+  return SymbolIndex::Map(dir_ + "/" + kSymbolsDir + "/" + key);
+}
+
+void SymbolCache::StoreSymbols(const std::string& key,
+                               const SymbolIndex& index) const {
+  // An entry that is corrupt, truncated or of another version is replaced.
+  if (LookupSymbols(key) != nullptr) return;
+  WriteEntry(kSymbolsDir, key, index.data(), index.size());
+}
+
+bool SymbolCache::WriteEntry(const std::string& subdir,
+                             const std::string& name, const char* data,
+                             size_t size) const {
+  if (!IsValidKey(name)) {
+    VLOG(1) << "Not caching the invalid key " << name;
+    return false;
+  }
+  const std::string dir = dir_ + "/" + subdir;
+  if (!MakeDirectory(dir_) || !MakeDirectory(dir)) {
+    LOG(WARNING) << "Could not create the symbol cache directory " << dir;
+    return false;
+  }
+  std::string temp_path = dir + "/." + name + ".XXXXXX";
+  int fd = mkstemp(&temp_path[0]);
+  if (fd < 0) {
+    LOG(WARNING) << "Could not create a file in " << dir;
+    return false;
+  }
+  const bool written = WriteAll(fd, data, size);
+  if (close(fd) != 0 || !written ||
+      rename(temp_path.c_str(), (dir + "/" + name).c_str()) != 0) {
+    LOG(WARNING) << "Could not write " << dir << "/" << name;
+    unlink(temp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+}  // namespace quipper
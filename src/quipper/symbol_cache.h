@@ -0,0 +1,115 @@
+// Copyright 2016 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMIUMOS_WIDE_PROFILING_SYMBOL_CACHE_H_
+#define CHROMIUMOS_WIDE_PROFILING_SYMBOL_CACHE_H_
+
+#include <sys/stat.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "dso.h"
+
+namespace quipper {
+
+// The function symbols of an ELF file, sorted by address, in a layout that is
+// the same in memory and on disk, so that an index read from a SymbolCache is
+// used straight from the mapped file:
+//   header, load segments, symbols, then their null-terminated names.
+class SymbolIndex {
+ public:
+  ~SymbolIndex();
+  SymbolIndex(const SymbolIndex&) = delete;
+  SymbolIndex& operator=(const SymbolIndex&) = delete;
+
+  // Builds the index of |symbols|. Of the symbols at the same address, keeps
+  // the largest one, and of those of the same size the first by name, so that
+  // the index does not depend on the order of the symbols in the file.
+  static std::unique_ptr<SymbolIndex> Build(
+      std::vector<ElfSymbol> symbols,
+      const std::vector<ElfLoadSegment>& segments);
+
+  // Maps the index written to |filename|. Returns null if the file could not
+  // be mapped or does not hold a valid index.
+  static std::unique_ptr<SymbolIndex> Map(const std::string& filename);
+
+  // Sets |address| to the virtual address the file offset |offset| is loaded
+  // at. Returns false if it is not in any loadable segment.
+  bool OffsetToAddress(u64 offset, u64* address) const;
+
+  // Returns the name of the symbol of the virtual address |address|, or null
+  // if there is none.
+  const char* Lookup(u64 address) const;
+
+  size_t num_symbols() const;
+
+  // The bytes of the index, as written to disk.
+  const char* data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  struct Header;
+  struct Symbol;
+
+  SymbolIndex() = default;
+
+  // Points |data_| at the |size| bytes of an index and checks that they hold
+  // a valid one.
+  bool Init(const char* data, size_t size);
+
+  const Header* header() const;
+  const ElfLoadSegment* segments() const;
+  const Symbol* symbols() const;
+  const char* names() const;
+
+  // The bytes of a built index. Unused for a mapped index.
+  std::string owned_;
+  // The bytes of the index, in |owned_| or in the mapped file.
+  const char* data_ = nullptr;
+  size_t size_ = 0;
+  bool mapped_ = false;
+};
+
+// A directory of build IDs and symbol indexes shared by conversions, so that
+// the same ELF files are not read again by each one:
+//   <dir>/build_ids/<dev>-<inode>-<mtime>-<size>
+//     The hex build ID of a file, or nothing if it has none, and a newline.
+//   <dir>/symbols/<hex build ID>, <dir>/symbols/<dev>-<inode>-<mtime>-<size>
+//     The SymbolIndex of a file, by build ID, or by file for files without
+//     one.
+// Entries are written to temporary files that are renamed into place, so that
+// workers sharing the directory never see a partial entry, and are never
+// changed once written unless they turn out to be invalid. Keys other than
+// lowercase hex build IDs and FileKey()s are refused. Failures to read or write
+// entries are not errors: the caller reads the ELF file instead.
+class SymbolCache {
+ public:
+  explicit SymbolCache(const std::string& dir);
+
+  // Returns the key of the file of |s| in the cache.
+  static std::string FileKey(const struct stat& s);
+
+  // Reads the build ID of the ELF file open as |fd| from the cache, or from
+  // the file, caching it. Returns false if the file has none.
+  bool ReadElfBuildId(int fd, std::string* buildid) const;
+
+  // Returns the cached index of |key|, or null if there is no valid one.
+  std::unique_ptr<SymbolIndex> LookupSymbols(const std::string& key) const;
+
+  // Adds |index| to the cache as |key|, unless a valid index is already there.
+  void StoreSymbols(const std::string& key, const SymbolIndex& index) const;
+
+ private:
+  // Writes |size| bytes of |data| to |subdir|/|name| in the cache, atomically.
+  bool WriteEntry(const std::string& subdir, const std::string& name,
+                  const char* data, size_t size) const;
+
+  const std::string dir_;
+};
+
+}  // namespace quipper
+
+#endif  // CHROMIUMOS_WIDE_PROFILING_SYMBOL_CACHE_H_
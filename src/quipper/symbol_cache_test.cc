@@ -0,0 +1,140 @@
+// Copyright 2016 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "symbol_cache.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "base/logging.h"
+#include "compat/test.h"
+#include "dso_test_utils.h"
+#include "file_utils.h"
+#include "scoped_temp_path.h"
+
+namespace quipper {
+
+namespace {
+
+ElfSymbol MakeSymbol(u64 address, u64 size, const std::string& name) {
+  ElfSymbol symbol;
+  symbol.address = address;
+  symbol.size = size;
+  symbol.name = name;
+  return symbol;
+}
+
+std::unique_ptr<SymbolIndex> MakeIndex() {
+  ElfLoadSegment segment;
+  segment.offset = 0x1000;
+  segment.vaddr = 0x401000;
+  segment.size = 0x1000;
+  return SymbolIndex::Build(
+      {MakeSymbol(0x401200, 0x10, "b"), MakeSymbol(0x401100, 0x20, "alias"),
+       MakeSymbol(0x401100, 0x20, "a"), MakeSymbol(0x401300, 0, "c")},
+      {segment});
+}
+
+void ExpectLookups(const SymbolIndex& index) {
+  EXPECT_EQ(3, index.num_symbols());
+  u64 address = 0;
+  EXPECT_TRUE(index.OffsetToAddress(0x1110, &address));
+  EXPECT_EQ(0x401110, address);
+  EXPECT_FALSE(index.OffsetToAddress(0x2000, &address));
+  EXPECT_EQ(nullptr, index.Lookup(0x401000));
+  EXPECT_STREQ("a", index.Lookup(0x401100));
+  EXPECT_STREQ("a", index.Lookup(0x40111f));
+  EXPECT_EQ(nullptr, index.Lookup(0x401120));
+  EXPECT_STREQ("b", index.Lookup(0x401205));
+  // Symbols without a size extend to the next one.
+  EXPECT_STREQ("c", index.Lookup(0x409000));
+}
+
+}  // namespace
+
+TEST(SymbolCacheTest, BuildsAndMapsSymbolIndexes) {
+  ScopedTempDir dir("/tmp/symbol_cache_test.");
+  SymbolCache cache(dir.path());
+  std::unique_ptr<SymbolIndex> index = MakeIndex();
+  ExpectLookups(*index);
+
+  EXPECT_EQ(nullptr, cache.LookupSymbols("0123abcd"));
+  cache.StoreSymbols("0123abcd", *index);
+  std::unique_ptr<SymbolIndex> mapped = cache.LookupSymbols("0123abcd");
+  ASSERT_NE(nullptr, mapped);
+  ExpectLookups(*mapped);
+  EXPECT_EQ(std::string(index->data(), index->size()),
+            std::string(mapped->data(), mapped->size()));
+
+  // Truncated and foreign entries are ignored, and replaced when stored.
+  std::vector<char> contents(index->data(), index->data() + index->size());
+  contents.pop_back();
+  ASSERT_TRUE(BufferToFile(dir.path() + "/symbols/0badf00d", contents));
+  EXPECT_EQ(nullptr, cache.LookupSymbols("0badf00d"));
+  cache.StoreSymbols("0badf00d", *index);
+  mapped = cache.LookupSymbols("0badf00d");
+  ASSERT_NE(nullptr, mapped);
+  ExpectLookups(*mapped);
+  ASSERT_TRUE(
+      BufferToFile(dir.path() + "/symbols/f0e1", std::string("not ELF")));
+  EXPECT_EQ(nullptr, cache.LookupSymbols("f0e1"));
+
+  // Keys that are not lowercase hex do not become paths.
+  for (const std::string key : {"../0123abcd", "/tmp/x", ".x", "ABCD", ""}) {
+    cache.StoreSymbols(key, *index);
+    EXPECT_EQ(nullptr, cache.LookupSymbols(key)) << key;
+  }
+  EXPECT_FALSE(FileExists(dir.path() + "/0123abcd"));
+}
+
+TEST(SymbolCacheTest, CachesBuildIds) {
+  InitializeLibelf();
+  ScopedTempDir dir("/tmp/symbol_cache_test.");
+  ScopedTempFile elf("/tmp/tempelf.");
+  SymbolCache cache(dir.path());
+  testing::WriteElfWithBuildid(elf.path(), ".note.gnu.build-id",
+                               "\xde\xad\xf0\x0d");
+
+  int fd = open(elf.path().c_str(), O_RDONLY);
+  ASSERT_GE(fd, 0);
+  struct stat s;
+  ASSERT_EQ(0, fstat(fd, &s));
+  std::string buildid;
+  EXPECT_TRUE(cache.ReadElfBuildId(fd, &buildid));
+  EXPECT_EQ("\xde\xad\xf0\x0d", buildid);
+  const std::string entry =
+      dir.path() + "/build_ids/" + SymbolCache::FileKey(s);
+  std::vector<char> contents;
+  ASSERT_TRUE(FileToBuffer(entry, &contents));
+  EXPECT_EQ("deadf00d\n", std::string(contents.begin(), contents.end()));
+
+  // The cached build ID is used rather than the file.
+  ASSERT_TRUE(BufferToFile(entry, std::string("c0def00d\n")));
+  EXPECT_TRUE(cache.ReadElfBuildId(fd, &buildid));
+  EXPECT_EQ("\xc0\xde\xf0\x0d", buildid);
+  // Unless the entry is not valid.
+  ASSERT_TRUE(BufferToFile(entry, std::string("c0def0")));
+  EXPECT_TRUE(cache.ReadElfBuildId(fd, &buildid));
+  EXPECT_EQ("\xde\xad\xf0\x0d", buildid);
+  close(fd);
+
+  // Files without a build ID are cached too.
+  testing::WriteElfWithMultipleBuildids(elf.path(), {/*empty*/});
+  fd = open(elf.path().c_str(), O_RDONLY);
+  ASSERT_GE(fd, 0);
+  ASSERT_EQ(0, fstat(fd, &s));
+  EXPECT_FALSE(cache.ReadElfBuildId(fd, &buildid));
+  ASSERT_TRUE(
+      FileToBuffer(dir.path() + "/build_ids/" + SymbolCache::FileKey(s),
+                   &contents));
+  EXPECT_EQ("\n", std::string(contents.begin(), contents.end()));
+  EXPECT_FALSE(cache.ReadElfBuildId(fd, &buildid));
+  close(fd);
+}
+
+}  // namespace quipper
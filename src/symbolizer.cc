@@ -0,0 +1,245 @@
+/*
+ * Copyright (c) 2016, Google Inc.
+ * All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include "src/symbolizer.h"
+
+#include <cxxabi.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <utility>
+
+#include "src/quipper/base/logging.h"
+#include "src/quipper/binary_data_utils.h"
+#include "src/quipper/dso.h"
+#include "src/quipper/parallel_for.h"
+
+namespace perftools {
+
+using profiles::Mapping;
+using profiles::Profile;
+
+namespace {
+
+// Returns whether the hex build IDs |a| and |b| are the same, but for the
+// zero bytes perf pads the shorter build IDs with.
+bool SameBuildId(const std::string& a, const std::string& b) {
+  const std::string& shorter = a.size() < b.size() ? a : b;
+  const std::string& longer = a.size() < b.size() ? b : a;
+  return longer.compare(0, shorter.size(), shorter) == 0 &&
+         longer.find_first_not_of('0', shorter.size()) == std::string::npos;
+}
+
+// Adds the function of the symbol |system_name| to the profile of |builder|,
+// with its demangled name if it is mangled, and returns its ID.
+uint64_t AddFunction(profiles::Builder* builder, const char* system_name) {
+  int status = 0;
+  char* demangled =
+      abi::__cxa_demangle(system_name, nullptr, nullptr, &status);
+  const uint64_t id = builder->FunctionId(
+      status == 0 && demangled != nullptr ? demangled : system_name,
+      system_name, "", 0);
+  free(demangled);
+  return id;
+}
+
+// The number of addresses looked up at a time by a thread.
+const size_t kLookupBatchSize = 1024;
+
+}  // namespace
+
+Symbolizer::Symbolizer(const Options& options) : options_(options) {
+  if (!options_.cache_dir.empty()) {
+    cache_.reset(new quipper::SymbolCache(options_.cache_dir));
+  }
+}
+
+Symbolizer::~Symbolizer() = default;
+
+int Symbolizer::Symbolize(profiles::Builder* builder) {
+  Profile* profile = builder->mutable_profile();
+  std::unordered_map<uint64_t, int> mapping_indices;
+  for (int i = 0; i < profile->mapping_size(); ++i) {
+    mapping_indices[profile->mapping(i).id()] = i;
+  }
+
+  // The locations to symbolize, and the indices of their mappings.
+  std::vector<int> locations;
+  std::vector<int> location_mappings;
+  std::vector<bool> mapping_used(profile->mapping_size());
+  for (int i = 0; i < profile->location_size(); ++i) {
+    const auto& location = profile->location(i);
+    if (location.address() == 0 || location.line_size() > 0) continue;
+    auto it = mapping_indices.find(location.mapping_id());
+    if (it == mapping_indices.end()) continue;
+    locations.push_back(i);
+    location_mappings.push_back(it->second);
+    mapping_used[it->second] = true;
+  }
+
+  // Reads the symbol tables not read for earlier profiles, in parallel.
+  std::vector<std::string> keys(profile->mapping_size());
+  std::vector<int> to_read;
+  for (int i = 0; i < profile->mapping_size(); ++i) {
+    if (!mapping_used[i]) continue;
+    keys[i] = TableKey(*profile, profile->mapping(i));
+    if (!keys[i].empty() && tables_.emplace(keys[i], nullptr).second) {
+      to_read.push_back(i);
+    }
+  }
+  std::vector<std::unique_ptr<quipper::SymbolIndex>> read(to_read.size());
+  quipper::ParallelFor(to_read.size(), options_.num_threads, [&](size_t i) {
+    read[i] = ReadSymbolIndex(*profile, profile->mapping(to_read[i]));
+  });
+  for (size_t i = 0; i < to_read.size(); ++i) {
+    tables_[keys[to_read[i]]] = std::move(read[i]);
+  }
+  std::vector<const quipper::SymbolIndex*> mapping_tables(
+      profile->mapping_size());
+  for (int i = 0; i < profile->mapping_size(); ++i) {
+    if (!keys[i].empty()) {
+      mapping_tables[i] = tables_[keys[i]].get();
+    }
+  }
+
+  // Looks up the addresses in parallel.
+  std::vector<const char*> names(locations.size());
+  const size_t num_batches =
+      (locations.size() + kLookupBatchSize - 1) / kLookupBatchSize;
+  quipper::ParallelFor(num_batches, options_.num_threads, [&](size_t batch) {
+    const size_t end =
+        std::min(locations.size(), (batch + 1) * kLookupBatchSize);
+    for (size_t i = batch * kLookupBatchSize; i < end; ++i) {
+      const auto* table = mapping_tables[location_mappings[i]];
+      if (table == nullptr) continue;
+      // Translates the address to the virtual address in the file, through
+      // the segment loaded at its file offset.
+      const Mapping& mapping = profile->mapping(location_mappings[i]);
+      const uint64_t address = profile->location(locations[i]).address();
+      uint64_t file_address = address;
+      table->OffsetToAddress(
+          address - mapping.memory_start() + mapping.file_offset(),
+          &file_address);
+      names[i] = table->Lookup(file_address);
+    }
+  });
+
+  // Adds the functions, which the builder does on one thread.
+  std::unordered_map<const char*, uint64_t> function_ids;
+  std::vector<bool> mapping_missed(profile->mapping_size());
+  int num_symbolized = 0;
+  for (size_t i = 0; i < locations.size(); ++i) {
+    if (names[i] == nullptr) {
+      mapping_missed[location_mappings[i]] = true;
+      continue;
+    }
+    auto inserted = function_ids.emplace(names[i], 0);
+    if (inserted.second) {
+      inserted.first->second = AddFunction(builder, names[i]);
+    }
+    profile->mutable_location(locations[i])
+        ->add_line()
+        ->set_function_id(inserted.first->second);
+    ++num_symbolized;
+  }
+  for (int i = 0; i < profile->mapping_size(); ++i) {
+    if (mapping_used[i] && !mapping_missed[i]) {
+      profile->mutable_mapping(i)->set_has_functions(true);
+    }
+  }
+  return num_symbolized;
+}
+
+std::string Symbolizer::TableKey(const Profile& profile,
+                                 const Mapping& mapping) {
+  const std::string& build_id = profile.string_table(mapping.build_id());
+  if (!build_id.empty()) {
+    return "build_id:" + build_id;
+  }
+  const std::string& filename = profile.string_table(mapping.filename());
+  if (!filename.empty()) {
+    return "file:" + filename;
+  }
+  return "";
+}
+
+std::unique_ptr<quipper::SymbolIndex> Symbolizer::ReadSymbolIndex(
+    const Profile& profile, const Mapping& mapping) const {
+  const std::string& build_id = profile.string_table(mapping.build_id());
+  const std::string& filename = profile.string_table(mapping.filename());
+  if (cache_ != nullptr && !build_id.empty()) {
+    auto index = cache_->LookupSymbols(build_id);
+    if (index != nullptr) return index;
+  }
+  if (build_id.size() > 2) {
+    // Also tries the build ID without the zero bytes that pad it, down to
+    // the size of an MD5 build ID.
+    std::vector<std::string> candidates = {build_id};
+    while (candidates.back().size() > 32 &&
+           candidates.back().compare(candidates.back().size() - 2, 2, "00") ==
+               0) {
+      candidates.push_back(
+          candidates.back().substr(0, candidates.back().size() - 2));
+    }
+    for (const auto& dir : options_.debug_dirs) {
+      for (const auto& candidate : candidates) {
+        const std::string path = dir + "/.build-id/" + candidate.substr(0, 2) +
+                                 "/" + candidate.substr(2) + ".debug";
+        if (access(path.c_str(), R_OK) == 0) {
+          return ReadElfFile(path, build_id);
+        }
+      }
+    }
+  }
+  if (!options_.use_mapping_files || filename.empty() || filename[0] != '/') {
+    return nullptr;
+  }
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) return nullptr;
+  struct stat s;
+  std::string file_build_id;
+  const bool has_build_id =
+      cache_ != nullptr ? cache_->ReadElfBuildId(fd, &file_build_id)
+                        : quipper::ReadElfBuildId(fd, &file_build_id);
+  const bool has_stat = fstat(fd, &s) == 0;
+  close(fd);
+  if (build_id.empty()) {
+    // Files without a build ID are cached by their inode and time instead.
+    return ReadElfFile(filename,
+                       has_stat ? quipper::SymbolCache::FileKey(s) : "");
+  }
+  if (!has_build_id ||
+      !SameBuildId(quipper::RawDataToHexString(file_build_id), build_id)) {
+    VLOG(1) << "The build ID of " << filename << " is not " << build_id;
+    return nullptr;
+  }
+  return ReadElfFile(filename, build_id);
+}
+
+std::unique_ptr<quipper::SymbolIndex> Symbolizer::ReadElfFile(
+    const std::string& filename, const std::string& cache_key) const {
+  const bool use_cache = cache_ != nullptr && !cache_key.empty();
+  if (use_cache) {
+    auto index = cache_->LookupSymbols(cache_key);
+    if (index != nullptr) return index;
+  }
+  std::vector<quipper::ElfSymbol> symbols;
+  std::vector<quipper::ElfLoadSegment> segments;
+  if (!quipper::ReadElfSymbols(filename, &symbols, &segments)) {
+    return nullptr;
+  }
+  auto index = quipper::SymbolIndex::Build(std::move(symbols), segments);
+  if (use_cache) {
+    cache_->StoreSymbols(cache_key, *index);
+  }
+  return index;
+}
+
+}  // namespace perftools
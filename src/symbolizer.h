@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2016, Google Inc.
+ * All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef PERFTOOLS_SYMBOLIZER_H_
+#define PERFTOOLS_SYMBOLIZER_H_
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "src/builder.h"
+#include "src/quipper/symbol_cache.h"
+
+namespace perftools {
+
+// Symbolizes the locations of profiles offline, from the ELF files of their
+// mappings found on the local file system. The symbols of each file are read
+// once, into a compact table sorted by address, and the table is reused for
+// every mapping of the same build ID, or of the same file name for mappings
+// without one, of all the profiles symbolized by the same Symbolizer, and, with
+// a cache directory, by every Symbolizer sharing it.
+//
+// A Symbolizer may be used by one thread at a time.
+class Symbolizer {
+ public:
+  struct Options {
+    // Directories searched for the files of the mappings by build ID, in the
+    // <dir>/.build-id/<first two hex digits>/<other hex digits>.debug layout,
+    // before the files named by the mappings.
+    std::vector<std::string> debug_dirs;
+    // Whether to read the files named by the mappings, if they have the build
+    // IDs of the mappings.
+    bool use_mapping_files = true;
+    // The number of threads reading the files and looking up the addresses.
+    int num_threads = 1;
+    // A quipper::SymbolCache directory, consulted for the build IDs and the
+    // symbol tables of the files before reading them, or empty for none.
+    std::string cache_dir;
+  };
+
+  explicit Symbolizer(const Options& options);
+  Symbolizer(const Symbolizer&) = delete;
+  Symbolizer& operator=(const Symbolizer&) = delete;
+  ~Symbolizer();
+
+  // Adds a line in the function of its address to each location of the
+  // profile of |builder| that has an address and a mapping and no lines yet,
+  // and marks the mappings whose locations all have one as having functions.
+  // Returns the number of locations symbolized.
+  int Symbolize(profiles::Builder* builder);
+
+ private:
+  // Returns the key of the symbol table of |mapping| in tables_, which is
+  // empty if the mapping has neither a build ID nor a file name.
+  static std::string TableKey(const profiles::Profile& profile,
+                              const profiles::Mapping& mapping);
+
+  // Returns the symbol table of the file of |mapping|, or null if none could
+  // be found or read.
+  std::unique_ptr<quipper::SymbolIndex> ReadSymbolIndex(
+      const profiles::Profile& profile, const profiles::Mapping& mapping) const;
+
+  // Returns the symbol table of the ELF file |filename|, from the cache as
+  // |cache_key| if it is not empty and the table is there, or null if the file
+  // could not be read.
+  std::unique_ptr<quipper::SymbolIndex> ReadElfFile(
+      const std::string& filename, const std::string& cache_key) const;
+
+  const Options options_;
+  std::unique_ptr<quipper::SymbolCache> cache_;
+  // The symbol tables by key, or null for the files that could not be read.
+  std::unordered_map<std::string, std::unique_ptr<quipper::SymbolIndex>>
+      tables_;
+};
+
+}  // namespace perftools
+
+#endif  // PERFTOOLS_SYMBOLIZER_H_
@@ -0,0 +1,218 @@
+/*
+ * Copyright (c) 2016, Google Inc.
+ * All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include "src/symbolizer.h"
+
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include <gtest/gtest.h>
+#include "src/quipper/binary_data_utils.h"
+#include "src/quipper/dso.h"
+#include "src/quipper/scoped_temp_path.h"
+
+extern "C" __attribute__((noinline)) int SymbolizerTestFunction(int x) {
+  asm volatile("");
+  return 3 * x + 1;
+}
+
+namespace perftools {
+namespace {
+
+using profiles::Builder;
+using profiles::Profile;
+
+__attribute__((noinline)) int MangledTestFunction(int x) {
+  asm volatile("");
+  return 5 * x + 2;
+}
+
+// The mapping of the test binary that holds an address.
+struct TextMapping {
+  uint64_t start = 0;
+  uint64_t limit = 0;
+  uint64_t offset = 0;
+  std::string path;
+  std::string build_id;
+};
+
+// Finds the mapping of |address| in /proc/self/maps.
+bool FindTextMapping(const void* address, TextMapping* mapping) {
+  const uint64_t addr = reinterpret_cast<uintptr_t>(address);
+  std::ifstream maps("/proc/self/maps");
+  std::string line;
+  while (std::getline(maps, line)) {
+    std::istringstream fields(line);
+    std::string range, perms, offset, dev, inode;
+    fields >> range >> perms >> offset >> dev >> inode >> mapping->path;
+    const size_t dash = range.find('-');
+    mapping->start = std::stoull(range.substr(0, dash), nullptr, 16);
+    mapping->limit = std::stoull(range.substr(dash + 1), nullptr, 16);
+    mapping->offset = std::stoull(offset, nullptr, 16);
+    if (mapping->start <= addr && addr < mapping->limit) {
+      std::string raw_build_id;
+      if (quipper::ReadElfBuildId(mapping->path, &raw_build_id)) {
+        mapping->build_id = quipper::RawDataToHexString(raw_build_id);
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+// Adds a mapping with |id| like |text| but for its file and build ID.
+void AddMapping(uint64_t id, const TextMapping& text,
+                const std::string& filename, const std::string& build_id,
+                Builder* builder) {
+  auto* mapping = builder->mutable_profile()->add_mapping();
+  mapping->set_id(id);
+  mapping->set_memory_start(text.start);
+  mapping->set_memory_limit(text.limit);
+  mapping->set_file_offset(text.offset);
+  mapping->set_filename(builder->StringId(filename.c_str()));
+  mapping->set_build_id(builder->StringId(build_id.c_str()));
+}
+
+void AddLocation(uint64_t mapping_id, const void* address, Builder* builder) {
+  Profile* profile = builder->mutable_profile();
+  auto* location = profile->add_location();
+  location->set_id(profile->location_size());
+  location->set_mapping_id(mapping_id);
+  // An address inside of the function rather than at its start.
+  location->set_address(reinterpret_cast<uintptr_t>(address) + 1);
+}
+
+// Returns the name of the function of the first line of |location_index|,
+// or an empty string if it has none.
+std::string FunctionName(const Profile& profile, int location_index) {
+  const auto& location = profile.location(location_index);
+  if (location.line_size() == 0) return "";
+  for (const auto& function : profile.function()) {
+    if (function.id() == location.line(0).function_id()) {
+      return profile.string_table(function.name());
+    }
+  }
+  return "";
+}
+
+TEST(SymbolizerTest, SymbolizesLocalBinaries) {
+  TextMapping text;
+  ASSERT_TRUE(FindTextMapping(
+      reinterpret_cast<const void*>(&SymbolizerTestFunction), &text));
+  Builder builder;
+  AddMapping(1, text, text.path, text.build_id, &builder);
+  AddMapping(2, text, "/nonexistent/libfoo.so", "", &builder);
+  AddMapping(3, text, text.path, "deadbeef", &builder);
+  AddLocation(1, reinterpret_cast<const void*>(&SymbolizerTestFunction),
+              &builder);
+  AddLocation(1, reinterpret_cast<const void*>(&MangledTestFunction),
+              &builder);
+  AddLocation(2, reinterpret_cast<const void*>(&SymbolizerTestFunction),
+              &builder);
+  AddLocation(3, reinterpret_cast<const void*>(&SymbolizerTestFunction),
+              &builder);
+
+  Symbolizer::Options options;
+  options.num_threads = 4;
+  Symbolizer symbolizer(options);
+  EXPECT_EQ(2, symbolizer.Symbolize(&builder));
+  const Profile& profile = *builder.mutable_profile();
+  EXPECT_EQ("SymbolizerTestFunction", FunctionName(profile, 0));
+  EXPECT_EQ("perftools::(anonymous namespace)::MangledTestFunction(int)",
+            FunctionName(profile, 1));
+  EXPECT_EQ("", FunctionName(profile, 2));
+  EXPECT_EQ("", FunctionName(profile, 3));
+  EXPECT_TRUE(profile.mapping(0).has_functions());
+  EXPECT_FALSE(profile.mapping(1).has_functions());
+  EXPECT_FALSE(profile.mapping(2).has_functions());
+
+  // Locations that already have lines are left alone.
+  EXPECT_EQ(0, symbolizer.Symbolize(&builder));
+  EXPECT_EQ(1, builder.mutable_profile()->location(0).line_size());
+  auto* sample_type = builder.mutable_profile()->add_sample_type();
+  sample_type->set_type(builder.StringId("samples"));
+  sample_type->set_unit(builder.StringId("count"));
+  EXPECT_TRUE(builder.Finalize());
+}
+
+TEST(SymbolizerTest, FindsDebugFilesByBuildId) {
+  TextMapping text;
+  ASSERT_TRUE(FindTextMapping(
+      reinterpret_cast<const void*>(&SymbolizerTestFunction), &text));
+  if (text.build_id.size() < 4) {
+    GTEST_SKIP() << "The test binary has no build ID";
+  }
+  char dir_template[] = "/tmp/symbolizer_test_XXXXXX";
+  const std::string dir = mkdtemp(dir_template);
+  const std::string build_id_dir =
+      dir + "/.build-id/" + text.build_id.substr(0, 2);
+  const std::string debug_file =
+      build_id_dir + "/" + text.build_id.substr(2) + ".debug";
+  ASSERT_EQ(0, mkdir((dir + "/.build-id").c_str(), 0755));
+  ASSERT_EQ(0, mkdir(build_id_dir.c_str(), 0755));
+  ASSERT_EQ(0, symlink(text.path.c_str(), debug_file.c_str()));
+
+  Symbolizer::Options options;
+  options.debug_dirs = {"/nonexistent", dir};
+  options.use_mapping_files = false;
+  Symbolizer symbolizer(options);
+  auto symbolize = [&]() {
+    Builder builder;
+    // Pads the build ID with zeros like perf does.
+    AddMapping(1, text, "/nonexistent/app", text.build_id + "00000000",
+               &builder);
+    AddLocation(1, reinterpret_cast<const void*>(&SymbolizerTestFunction),
+                &builder);
+    EXPECT_EQ(1, symbolizer.Symbolize(&builder));
+    return FunctionName(*builder.mutable_profile(), 0);
+  };
+  EXPECT_EQ("SymbolizerTestFunction", symbolize());
+
+  // The symbol table is reused without reading the file again.
+  unlink(debug_file.c_str());
+  rmdir(build_id_dir.c_str());
+  rmdir((dir + "/.build-id").c_str());
+  rmdir(dir.c_str());
+  EXPECT_EQ("SymbolizerTestFunction", symbolize());
+}
+
+TEST(SymbolizerTest, SharesSymbolTablesThroughTheCache) {
+  TextMapping text;
+  ASSERT_TRUE(FindTextMapping(
+      reinterpret_cast<const void*>(&SymbolizerTestFunction), &text));
+  if (text.build_id.empty()) {
+    GTEST_SKIP() << "The test binary has no build ID";
+  }
+  quipper::ScopedTempDir cache_dir("/tmp/symbolizer_test_cache.");
+  Symbolizer::Options options;
+  options.cache_dir = cache_dir.path();
+  auto symbolize = [&](const std::string& filename) {
+    Symbolizer symbolizer(options);
+    Builder builder;
+    AddMapping(1, text, filename, text.build_id, &builder);
+    AddLocation(1, reinterpret_cast<const void*>(&SymbolizerTestFunction),
+                &builder);
+    symbolizer.Symbolize(&builder);
+    return FunctionName(*builder.mutable_profile(), 0);
+  };
+  EXPECT_EQ("SymbolizerTestFunction", symbolize(text.path));
+  // Another symbolizer finds the table by build ID without the file.
+  EXPECT_EQ("SymbolizerTestFunction", symbolize("/nonexistent/app"));
+}
+
+}  // namespace
+}  // namespace perftools
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}